@@ -0,0 +1,70 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "linalg.h"
+
+// MatrixBackend
+// =============
+//
+// The functions that do the arithmetic behind the matrix operations. linalg.c checks sizes and precisions, keeps
+// device copies up to date, and then calls into the backend chosen by matrix_init() with the raw elements, so a
+// backend only has to compute. Every matrix is column major, and every function is given the precision of its
+// operands, which all share it. Functions a backend leaves NULL are taken from the "cpu" backend.
+typedef struct
+{
+	const char *name;
+
+	// Called from matrix_init() once the thread pool has started, and from matrix_shutdown() before it stops. Either
+	// may be NULL.
+	void (*start)(void);
+	void (*stop)(void);
+
+	// C = A * B, or C = ReLU(A * B + bias) if bias is not NULL, where A is (m,k), B is (k,n) and C is (m,n). Element
+	// (row,col) of A is at a[row * a_rs + col * a_cs], so a transpose is just a swap of strides, and the same goes
+	// for B. One of the two strides of each operand is always 1.
+	void (*gemm)(MatrixPrecision precision, unsigned int m, unsigned int n, unsigned int k, const void *a, size_t a_rs, size_t a_cs, const void *b, size_t b_rs, size_t b_cs, void *c, size_t ldc, const void *bias, bool relu);
+
+	// Element by element operations over size elements. out may be any of the inputs.
+	void (*elementwise_multiply)(MatrixPrecision precision, size_t size, void *out, const void *a, const void *b);
+	void (*relu)(MatrixPrecision precision, size_t size, void *out, const void *in);
+	void (*drelu)(MatrixPrecision precision, size_t size, void *out, const void *in);
+	void (*drelu_multiply)(MatrixPrecision precision, size_t size, void *out, const void *gradient, const void *in);
+	void (*subtract)(MatrixPrecision precision, size_t size, void *out, const void *a, const void *b, double scale);
+	void (*multiply_scalar)(MatrixPrecision precision, size_t size, void *out, const void *in, double value);
+
+	// out = inputs[0] + inputs[1] + ..., adding each element up in the order of the inputs. out may be the elements
+	// of inputs[0]. The inputs are given as matrices, so that the caller does not need an array of their elements.
+	void (*sum)(MatrixPrecision precision, size_t size, void *out, Matrix **inputs, unsigned int count);
+
+	// Operations on a (rows,cols) matrix. See the matrix operations of the same names.
+	void (*add_to_rows)(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in, const void *bias);
+	void (*sum_rows)(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in);
+	void (*transpose)(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in);
+	void (*softmax)(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in);
+	void (*gather_bytes)(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const unsigned char *bytes, const unsigned int *columns, double scale);
+
+	// Products with the columns of a sparse matrix listed in columns, or its first columns if columns is NULL.
+	// sparse_dense computes C = A * S + bias, or ReLU(A * S + bias) if relu, where A is (m,s->rows) and C is (m,n).
+	// sparse_multiply_t computes C = A * S^T, where A is (m,n) and C is (m,s->rows).
+	void (*sparse_dense)(MatrixPrecision precision, unsigned int m, unsigned int n, const void *a, const MatrixSparse *s, const unsigned int *columns, void *c, const void *bias, bool relu);
+	void (*sparse_multiply_t)(MatrixPrecision precision, unsigned int m, unsigned int n, const void *a, const MatrixSparse *s, const unsigned int *columns, void *c);
+
+	// C = W * B + bias, or ReLU(W * B + bias) if relu, where W is pruned, B is (w->cols,n) and C is (w->rows,n).
+	void (*pruned_dense)(MatrixPrecision precision, const MatrixPruned *w, unsigned int n, const void *b, void *c, const void *bias, bool relu);
+
+	// Returns the summed loss over the columns. See matrix_softmax_cross_entropy_into().
+	double (*softmax_cross_entropy)(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *probabilities, void *gradient, const void *in, const unsigned char *labels, unsigned int *correct);
+} MatrixBackend;
+
+// Plain loops that compute every element in double precision, to check the others against.
+extern const MatrixBackend backend_reference;
+
+// Cache blocked, vectorizable kernels spread over the thread pool.
+extern const MatrixBackend backend_cpu;
+
+#if USE_BLAS
+// Matrix multiplication from the system's CBLAS library.
+extern const MatrixBackend backend_blas;
+#endif
+
+#endif // BACKEND_H
@@ -0,0 +1,66 @@
+#include "backend.h"
+
+#if USE_BLAS
+#include <cblas.h>
+
+// blas_gemm
+// =========
+//
+// Multiplies with cblas_sgemm() or cblas_dgemm(), then adds the bias and applies the ReLU in a second pass over the
+// output. An operand whose row stride is 1 is passed as it is, and one whose column stride is 1 as a transpose.
+static void blas_gemm(MatrixPrecision precision, unsigned int m, unsigned int n, unsigned int k, const void *a, size_t a_rs, size_t a_cs, const void *b, size_t b_rs, size_t b_cs, void *c, size_t ldc, const void *bias, bool relu)
+{
+	enum CBLAS_TRANSPOSE a_op = (a_rs == 1) ? CblasNoTrans : CblasTrans;
+	enum CBLAS_TRANSPOSE b_op = (b_rs == 1) ? CblasNoTrans : CblasTrans;
+	size_t lda = (a_rs == 1) ? a_cs : a_rs;
+	size_t ldb = (b_rs == 1) ? b_cs : b_rs;
+
+	// BLAS insists on leading dimensions of at least 1, even for empty operands.
+	lda = (lda > 0) ? lda : 1;
+	ldb = (ldb > 0) ? ldb : 1;
+
+	if (precision == MATRIX_F32)
+	{
+		cblas_sgemm(CblasColMajor, a_op, b_op, m, n, k, 1, a, lda, b, ldb, 0, c, ldc);
+	}
+	else
+	{
+		cblas_dgemm(CblasColMajor, a_op, b_op, m, n, k, 1, a, lda, b, ldb, 0, c, ldc);
+	}
+
+	if (bias == NULL)
+	{
+		return;
+	}
+
+	for (unsigned int col = 0; col < n; col++)
+	{
+		for (unsigned int row = 0; row < m; row++)
+		{
+			size_t index = col * ldc + row;
+
+			if (precision == MATRIX_F32)
+			{
+				float value = ((float*)c)[index] + ((const float*)bias)[row];
+				((float*)c)[index] = (relu && value < 0) ? 0 : value;
+			}
+			else
+			{
+				double value = ((double*)c)[index] + ((const double*)bias)[row];
+				((double*)c)[index] = (relu && value < 0) ? 0 : value;
+			}
+		}
+	}
+}
+
+// Only the multiplication comes from BLAS. Everything else is left to the cpu
+// backend.
+const MatrixBackend backend_blas =
+{
+	.name = "blas",
+	.start = NULL,
+	.stop = NULL,
+	.gemm = blas_gemm
+};
+
+#endif
@@ -0,0 +1,362 @@
+#include "backend.h"
+
+// Blocking parameters for the CPU matrix multiplication. A block of MC rows by
+// KC columns of the first matrix is packed to stay in L2, a block of KC rows by
+// NC columns of the second matrix is packed to stay in L3, and the microkernel
+// keeps an MR by NR tile of the output in registers. MR is chosen per precision
+// so that a column of the tile fills whole vector registers.
+#define GEMM_MC 96
+#define GEMM_KC 256
+#define GEMM_NC 2048
+
+// Products with fewer multiply-adds than this are not worth waking the thread
+// pool for. Larger ones are split into about GEMM_TILES_PER_THREAD output tiles
+// per thread, each at least GEMM_MIN_TILE_COLS columns wide.
+#define GEMM_PARALLEL_MIN (1 << 18)
+#define GEMM_TILES_PER_THREAD 4
+#define GEMM_MIN_TILE_COLS 16
+
+// One pair of pack buffers per thread of the pool, indexed by worker.
+static void **gemm_packed_a;
+static void **gemm_packed_b;
+
+// GemmJob
+// =======
+//
+// The arguments of a multiplication shared by all of its tasks on the thread
+// pool, along with the size of the output tiles they are split into.
+typedef struct
+{
+	unsigned int m, n, k;
+	const void *a;
+	size_t a_rs, a_cs;
+	const void *b;
+	size_t b_rs, b_cs;
+	void *c;
+	size_t ldc;
+	const void *bias;
+	bool relu;
+	unsigned int tile_rows, tile_cols, row_tiles;
+} GemmJob;
+
+// Sums with fewer additions than this run on the calling thread. Larger ones
+// are split into chunks of at least SUM_MIN_CHUNK elements.
+#define SUM_PARALLEL_MIN (1 << 16)
+#define SUM_MIN_CHUNK 1024
+
+// SumJob
+// ======
+//
+// The arguments of matrix_sum_into() shared by all of its tasks on the thread
+// pool. inputs holds the matrices being added up.
+typedef struct
+{
+	size_t size, chunk;
+	void *output;
+	Matrix **inputs;
+	unsigned int count;
+} SumJob;
+
+// Sparse products with fewer columns than this run on the calling thread.
+// Larger ones are split into chunks of at least SPARSE_MIN_CHUNK columns. The
+// sparse dense layer keeps the sums of SPARSE_ROWS rows in registers at once.
+#define SPARSE_PARALLEL_MIN 256
+#define SPARSE_MIN_CHUNK 64
+#define SPARSE_ROWS 16
+
+// SparseJob
+// =========
+//
+// The arguments of a sparse dense layer shared by all of its tasks on the
+// thread pool.
+typedef struct
+{
+	unsigned int m, n, chunk;
+	const void *a;
+	const MatrixSparse *s;
+	const unsigned int *columns;
+	void *c;
+	const void *bias;
+	bool relu;
+} SparseJob;
+
+// The pruned dense layer computes PRUNED_LANES columns at once, one vector
+// register of single precision lanes. Like the sparse products, it is split
+// over the thread pool by columns.
+#define PRUNED_LANES 16
+
+// PrunedJob
+// =========
+//
+// The arguments of a pruned dense layer shared by all of its tasks on the
+// thread pool.
+typedef struct
+{
+	const MatrixPruned *w;
+	unsigned int n, chunk;
+	const void *b;
+	void *c;
+	const void *bias;
+	bool relu;
+} PrunedJob;
+
+#define SCALAR double
+#define KERNEL(name) name##_f64
+#define EXP exp
+#define GEMM_MR 12
+#define GEMM_NR 4
+#include "linalg_kernels.h"
+#undef SCALAR
+#undef KERNEL
+#undef EXP
+#undef GEMM_MR
+#undef GEMM_NR
+
+#define SCALAR float
+#define KERNEL(name) name##_f32
+#define EXP expf
+#define GEMM_MR 24
+#define GEMM_NR 4
+#include "linalg_kernels.h"
+#undef SCALAR
+#undef KERNEL
+#undef EXP
+#undef GEMM_MR
+#undef GEMM_NR
+
+// Calls the kernel of a precision, which take their pointer arguments as the
+// element type.
+#define DISPATCH(precision, name, ...) \
+	(((precision) == MATRIX_F32) ? name##_f32(__VA_ARGS__) : name##_f64(__VA_ARGS__))
+
+// cpu_start
+// =========
+//
+// Allocates a pair of pack buffers for each thread of the pool.
+static void cpu_start(void)
+{
+	unsigned int threads = threadpool_threads();
+
+	gemm_packed_a = malloc(sizeof(void*) * threads);
+	gemm_packed_b = malloc(sizeof(void*) * threads);
+
+	if (gemm_packed_a == NULL || gemm_packed_b == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	for (unsigned int worker = 0; worker < threads; worker++)
+	{
+		gemm_packed_a[worker] = aligned_alloc(64, sizeof(double) * GEMM_MC * GEMM_KC);
+		gemm_packed_b[worker] = aligned_alloc(64, sizeof(double) * GEMM_KC * GEMM_NC);
+
+		if (gemm_packed_a[worker] == NULL || gemm_packed_b[worker] == NULL)
+		{
+			printf("Your computer has run out of memory :(\n");
+			exit(3);
+		}
+	}
+}
+
+// cpu_stop
+// ========
+//
+// Releases the pack buffers.
+static void cpu_stop(void)
+{
+	for (unsigned int worker = 0; worker < threadpool_threads(); worker++)
+	{
+		free(gemm_packed_a[worker]);
+		free(gemm_packed_b[worker]);
+	}
+
+	free(gemm_packed_a);
+	free(gemm_packed_b);
+	gemm_packed_a = NULL;
+	gemm_packed_b = NULL;
+}
+
+// The rest of the backend picks the kernel of the precision it is given.
+
+static void cpu_gemm(MatrixPrecision precision, unsigned int m, unsigned int n, unsigned int k, const void *a, size_t a_rs, size_t a_cs, const void *b, size_t b_rs, size_t b_cs, void *c, size_t ldc, const void *bias, bool relu)
+{
+	DISPATCH(precision, gemm, m, n, k, a, a_rs, a_cs, b, b_rs, b_cs, c, ldc, bias, relu);
+}
+
+static void cpu_elementwise_multiply(MatrixPrecision precision, size_t size, void *out, const void *a, const void *b)
+{
+	DISPATCH(precision, elementwise_multiply, size, out, a, b);
+}
+
+static void cpu_relu(MatrixPrecision precision, size_t size, void *out, const void *in)
+{
+	DISPATCH(precision, relu, size, out, in);
+}
+
+static void cpu_drelu(MatrixPrecision precision, size_t size, void *out, const void *in)
+{
+	DISPATCH(precision, drelu, size, out, in);
+}
+
+static void cpu_drelu_multiply(MatrixPrecision precision, size_t size, void *out, const void *gradient, const void *in)
+{
+	DISPATCH(precision, drelu_multiply, size, out, gradient, in);
+}
+
+static void cpu_subtract(MatrixPrecision precision, size_t size, void *out, const void *a, const void *b, double scale)
+{
+	DISPATCH(precision, subtract, size, out, a, b, scale);
+}
+
+static void cpu_multiply_scalar(MatrixPrecision precision, size_t size, void *out, const void *in, double value)
+{
+	DISPATCH(precision, multiply_scalar, size, out, in, value);
+}
+
+// cpu_sum
+// =======
+//
+// Adds up the inputs in chunks spread over the thread pool. Each element is
+// still added up in the order of the inputs, so the result does not depend on
+// the number of threads.
+static void cpu_sum(MatrixPrecision precision, size_t size, void *out, Matrix **inputs, unsigned int count)
+{
+	SumJob job =
+	{
+		.size = size,
+		.output = out,
+		.inputs = inputs,
+		.count = count
+	};
+
+	unsigned int threads = threadpool_threads();
+	size_t chunks = (threads == 1 || job.size * count < SUM_PARALLEL_MIN) ? 1 : threads;
+	job.chunk = (job.size + chunks - 1) / chunks;
+	if ((chunks > 1 && job.chunk < SUM_MIN_CHUNK) || job.chunk == 0)
+	{
+		job.chunk = SUM_MIN_CHUNK;
+	}
+	chunks = (job.size + job.chunk - 1) / job.chunk;
+
+	threadpool_run(chunks, (precision == MATRIX_F32) ? sum_task_f32 : sum_task_f64, &job);
+}
+
+static void cpu_add_to_rows(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in, const void *bias)
+{
+	DISPATCH(precision, add_to_rows, rows, cols, out, in, bias);
+}
+
+static void cpu_sum_rows(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in)
+{
+	DISPATCH(precision, sum_rows, rows, cols, out, in);
+}
+
+static void cpu_transpose(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in)
+{
+	DISPATCH(precision, transpose, rows, cols, out, in);
+}
+
+static void cpu_softmax(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in)
+{
+	DISPATCH(precision, softmax, rows, cols, out, in);
+}
+
+static void cpu_gather_bytes(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const unsigned char *bytes, const unsigned int *columns, double scale)
+{
+	DISPATCH(precision, gather_bytes, rows, cols, out, bytes, columns, scale);
+}
+
+// cpu_sparse_dense
+// ================
+//
+// Splits the columns into chunks spread over the thread pool. Each column is
+// computed the same way whatever chunk it falls in.
+static void cpu_sparse_dense(MatrixPrecision precision, unsigned int m, unsigned int n, const void *a, const MatrixSparse *s, const unsigned int *columns, void *c, const void *bias, bool relu)
+{
+	SparseJob job =
+	{
+		.m = m,
+		.n = n,
+		.a = a,
+		.s = s,
+		.columns = columns,
+		.c = c,
+		.bias = bias,
+		.relu = relu
+	};
+
+	unsigned int threads = threadpool_threads();
+	unsigned int chunks = (threads == 1 || n < SPARSE_PARALLEL_MIN) ? 1 : threads;
+	job.chunk = (n + chunks - 1) / chunks;
+	if ((chunks > 1 && job.chunk < SPARSE_MIN_CHUNK) || job.chunk == 0)
+	{
+		job.chunk = SPARSE_MIN_CHUNK;
+	}
+	chunks = (n + job.chunk - 1) / job.chunk;
+
+	threadpool_run(chunks, (precision == MATRIX_F32) ? sparse_dense_task_f32 : sparse_dense_task_f64, &job);
+}
+
+static void cpu_sparse_multiply_t(MatrixPrecision precision, unsigned int m, unsigned int n, const void *a, const MatrixSparse *s, const unsigned int *columns, void *c)
+{
+	DISPATCH(precision, sparse_multiply_t, m, n, a, s, columns, c);
+}
+
+// cpu_pruned_dense
+// ================
+//
+// Splits the columns into chunks spread over the thread pool, as
+// cpu_sparse_dense() does.
+static void cpu_pruned_dense(MatrixPrecision precision, const MatrixPruned *w, unsigned int n, const void *b, void *c, const void *bias, bool relu)
+{
+	PrunedJob job =
+	{
+		.w = w,
+		.n = n,
+		.b = b,
+		.c = c,
+		.bias = bias,
+		.relu = relu
+	};
+
+	unsigned int threads = threadpool_threads();
+	unsigned int chunks = (threads == 1 || n < SPARSE_PARALLEL_MIN) ? 1 : threads;
+	job.chunk = (n + chunks - 1) / chunks;
+	if ((chunks > 1 && job.chunk < SPARSE_MIN_CHUNK) || job.chunk == 0)
+	{
+		job.chunk = SPARSE_MIN_CHUNK;
+	}
+	chunks = (n + job.chunk - 1) / job.chunk;
+
+	threadpool_run(chunks, (precision == MATRIX_F32) ? pruned_dense_task_f32 : pruned_dense_task_f64, &job);
+}
+
+static double cpu_softmax_cross_entropy(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *probabilities, void *gradient, const void *in, const unsigned char *labels, unsigned int *correct)
+{
+	return DISPATCH(precision, softmax_cross_entropy, rows, cols, probabilities, gradient, in, labels, correct);
+}
+
+const MatrixBackend backend_cpu =
+{
+	.name = "cpu",
+	.start = cpu_start,
+	.stop = cpu_stop,
+	.gemm = cpu_gemm,
+	.elementwise_multiply = cpu_elementwise_multiply,
+	.relu = cpu_relu,
+	.drelu = cpu_drelu,
+	.drelu_multiply = cpu_drelu_multiply,
+	.subtract = cpu_subtract,
+	.multiply_scalar = cpu_multiply_scalar,
+	.sum = cpu_sum,
+	.add_to_rows = cpu_add_to_rows,
+	.sum_rows = cpu_sum_rows,
+	.transpose = cpu_transpose,
+	.softmax = cpu_softmax,
+	.gather_bytes = cpu_gather_bytes,
+	.sparse_dense = cpu_sparse_dense,
+	.sparse_multiply_t = cpu_sparse_multiply_t,
+	.pruned_dense = cpu_pruned_dense,
+	.softmax_cross_entropy = cpu_softmax_cross_entropy
+};
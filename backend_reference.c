@@ -0,0 +1,379 @@
+#include "backend.h"
+
+// The reference backend is written for clarity rather than speed. Every
+// element is read into a double, computed on in double precision and rounded
+// to the matrix's precision when it is stored, so single precision results
+// are as accurate as they can be, which makes it a yardstick for the others.
+
+// load
+// ====
+//
+// Reads an element as a double.
+//
+// Parameters:
+//   precision - The precision of the elements.
+//        data - The elements.
+//       index - The index of the element.
+//
+// Return:
+//   The element.
+static double load(MatrixPrecision precision, const void *data, size_t index)
+{
+	return (precision == MATRIX_F32) ? ((const float*)data)[index] : ((const double*)data)[index];
+}
+
+// store
+// =====
+//
+// Writes an element, rounding it to the precision.
+//
+// Parameters:
+//   precision - The precision of the elements.
+//        data - The elements.
+//       index - The index of the element.
+//       value - The value to write.
+static void store(MatrixPrecision precision, void *data, size_t index, double value)
+{
+	if (precision == MATRIX_F32)
+	{
+		((float*)data)[index] = value;
+	}
+	else
+	{
+		((double*)data)[index] = value;
+	}
+}
+
+static void reference_gemm(MatrixPrecision precision, unsigned int m, unsigned int n, unsigned int k, const void *a, size_t a_rs, size_t a_cs, const void *b, size_t b_rs, size_t b_cs, void *c, size_t ldc, const void *bias, bool relu)
+{
+	for (unsigned int col = 0; col < n; col++)
+	{
+		for (unsigned int row = 0; row < m; row++)
+		{
+			double sum = 0;
+
+			for (unsigned int i = 0; i < k; i++)
+			{
+				sum += load(precision, a, row * a_rs + i * a_cs) * load(precision, b, i * b_rs + col * b_cs);
+			}
+
+			if (bias != NULL)
+			{
+				sum += load(precision, bias, row);
+
+				if (relu && sum < 0)
+				{
+					sum = 0;
+				}
+			}
+
+			store(precision, c, col * ldc + row, sum);
+		}
+	}
+}
+
+static void reference_elementwise_multiply(MatrixPrecision precision, size_t size, void *out, const void *a, const void *b)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		store(precision, out, i, load(precision, a, i) * load(precision, b, i));
+	}
+}
+
+static void reference_relu(MatrixPrecision precision, size_t size, void *out, const void *in)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		double value = load(precision, in, i);
+		store(precision, out, i, (value > 0) ? value : 0);
+	}
+}
+
+static void reference_drelu(MatrixPrecision precision, size_t size, void *out, const void *in)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		store(precision, out, i, load(precision, in, i) > 0);
+	}
+}
+
+static void reference_drelu_multiply(MatrixPrecision precision, size_t size, void *out, const void *gradient, const void *in)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		store(precision, out, i, (load(precision, in, i) > 0) ? load(precision, gradient, i) : 0);
+	}
+}
+
+static void reference_subtract(MatrixPrecision precision, size_t size, void *out, const void *a, const void *b, double scale)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		store(precision, out, i, load(precision, a, i) - load(precision, b, i) * scale);
+	}
+}
+
+static void reference_multiply_scalar(MatrixPrecision precision, size_t size, void *out, const void *in, double value)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		store(precision, out, i, load(precision, in, i) * value);
+	}
+}
+
+static void reference_sum(MatrixPrecision precision, size_t size, void *out, Matrix **inputs, unsigned int count)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		double sum = 0;
+
+		for (unsigned int input = 0; input < count; input++)
+		{
+			sum += load(precision, inputs[input]->data, i);
+		}
+
+		store(precision, out, i, sum);
+	}
+}
+
+static void reference_add_to_rows(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in, const void *bias)
+{
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			size_t index = (size_t)col * rows + row;
+			store(precision, out, index, load(precision, in, index) + load(precision, bias, row));
+		}
+	}
+}
+
+static void reference_sum_rows(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in)
+{
+	for (unsigned int row = 0; row < rows; row++)
+	{
+		double sum = 0;
+
+		for (unsigned int col = 0; col < cols; col++)
+		{
+			sum += load(precision, in, (size_t)col * rows + row);
+		}
+
+		store(precision, out, row, sum);
+	}
+}
+
+static void reference_transpose(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in)
+{
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			store(precision, out, (size_t)row * cols + col, load(precision, in, (size_t)col * rows + row));
+		}
+	}
+}
+
+static void reference_softmax(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const void *in)
+{
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		size_t first = (size_t)col * rows;
+
+		double max = load(precision, in, first);
+		for (unsigned int row = 1; row < rows; row++)
+		{
+			max = fmax(max, load(precision, in, first + row));
+		}
+
+		double sum = 0;
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			sum += exp(load(precision, in, first + row) - max);
+		}
+
+		// Every exponential is worked out again so that out may be in.
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			store(precision, out, first + row, exp(load(precision, in, first + row) - max) / sum);
+		}
+	}
+}
+
+static void reference_gather_bytes(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *out, const unsigned char *bytes, const unsigned int *columns, double scale)
+{
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		const unsigned char *in = bytes + (size_t)((columns != NULL) ? columns[col] : col) * rows;
+
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			store(precision, out, (size_t)col * rows + row, in[row] * scale);
+		}
+	}
+}
+
+static void reference_sparse_dense(MatrixPrecision precision, unsigned int m, unsigned int n, const void *a, const MatrixSparse *s, const unsigned int *columns, void *c, const void *bias, bool relu)
+{
+	for (unsigned int col = 0; col < n; col++)
+	{
+		unsigned int input = (columns != NULL) ? columns[col] : col;
+
+		for (unsigned int row = 0; row < m; row++)
+		{
+			double sum = 0;
+
+			for (size_t i = s->starts[input]; i < s->starts[input + 1]; i++)
+			{
+				sum += load(precision, a, (size_t)s->indices[i] * m + row) * (s->values[i] * s->scale);
+			}
+
+			sum += load(precision, bias, row);
+
+			if (relu && sum < 0)
+			{
+				sum = 0;
+			}
+
+			store(precision, c, (size_t)col * m + row, sum);
+		}
+	}
+}
+
+static void reference_sparse_multiply_t(MatrixPrecision precision, unsigned int m, unsigned int n, const void *a, const MatrixSparse *s, const unsigned int *columns, void *c)
+{
+	for (unsigned int k = 0; k < s->rows; k++)
+	{
+		for (unsigned int row = 0; row < m; row++)
+		{
+			double sum = 0;
+
+			for (unsigned int col = 0; col < n; col++)
+			{
+				unsigned int input = (columns != NULL) ? columns[col] : col;
+
+				// The rows of a column are in order, so the element at row k, if
+				// there is one, is found by a binary search.
+				size_t low = s->starts[input], high = s->starts[input + 1];
+				while (low < high)
+				{
+					size_t middle = low + (high - low) / 2;
+
+					if (s->indices[middle] < k)
+					{
+						low = middle + 1;
+					}
+					else
+					{
+						high = middle;
+					}
+				}
+
+				if (low < s->starts[input + 1] && s->indices[low] == k)
+				{
+					sum += load(precision, a, (size_t)col * m + row) * (s->values[low] * s->scale);
+				}
+			}
+
+			store(precision, c, (size_t)k * m + row, sum);
+		}
+	}
+}
+
+static void reference_pruned_dense(MatrixPrecision precision, const MatrixPruned *w, unsigned int n, const void *b, void *c, const void *bias, bool relu)
+{
+	for (unsigned int col = 0; col < n; col++)
+	{
+		for (unsigned int row = 0; row < w->rows; row++)
+		{
+			double sum = 0;
+
+			for (unsigned int i = w->starts[row]; i < w->starts[row + 1]; i++)
+			{
+				sum += load(precision, w->data, i) * load(precision, b, (size_t)col * w->cols + w->indices[i]);
+			}
+
+			sum += load(precision, bias, row);
+
+			if (relu && sum < 0)
+			{
+				sum = 0;
+			}
+
+			store(precision, c, (size_t)col * w->rows + row, sum);
+		}
+	}
+}
+
+static double reference_softmax_cross_entropy(MatrixPrecision precision, unsigned int rows, unsigned int cols, void *probabilities, void *gradient, const void *in, const unsigned char *labels, unsigned int *correct)
+{
+	double total_loss = 0.0;
+	*correct = 0;
+
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		size_t first = (size_t)col * rows;
+		unsigned int label = labels[col];
+
+		unsigned int response = 0;
+		for (unsigned int row = 1; row < rows; row++)
+		{
+			if (load(precision, in, first + row) > load(precision, in, first + response))
+			{
+				response = row;
+			}
+		}
+
+		double max = load(precision, in, first + response);
+		double shifted_label = load(precision, in, first + label) - max;
+
+		double sum = 0;
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			sum += exp(load(precision, in, first + row) - max);
+		}
+
+		// The outputs may be in, so each element is read before it is written.
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			double p = exp(load(precision, in, first + row) - max) / sum;
+
+			if (probabilities != NULL)
+			{
+				store(precision, probabilities, first + row, p);
+			}
+
+			if (gradient != NULL)
+			{
+				store(precision, gradient, first + row, p - (row == label));
+			}
+		}
+
+		total_loss += log(sum) - shifted_label;
+		*correct += response == label;
+	}
+
+	return total_loss;
+}
+
+const MatrixBackend backend_reference =
+{
+	.name = "reference",
+	.gemm = reference_gemm,
+	.elementwise_multiply = reference_elementwise_multiply,
+	.relu = reference_relu,
+	.drelu = reference_drelu,
+	.drelu_multiply = reference_drelu_multiply,
+	.subtract = reference_subtract,
+	.multiply_scalar = reference_multiply_scalar,
+	.sum = reference_sum,
+	.add_to_rows = reference_add_to_rows,
+	.sum_rows = reference_sum_rows,
+	.transpose = reference_transpose,
+	.softmax = reference_softmax,
+	.gather_bytes = reference_gather_bytes,
+	.sparse_dense = reference_sparse_dense,
+	.sparse_multiply_t = reference_sparse_multiply_t,
+	.pruned_dense = reference_pruned_dense,
+	.softmax_cross_entropy = reference_softmax_cross_entropy
+};
@@ -0,0 +1,998 @@
+#include "bench.h"
+
+// compare_doubles
+// ===============
+//
+// Orders doubles from smallest to largest, for qsort().
+//
+// Parameters:
+//   a - The first double.
+//   b - The second double.
+//
+// Return:
+//   Less than, equal to or greater than 0 as a is less than, equal to or greater than b.
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+// peak_f32
+// ========
+//
+// Runs BENCH_PEAK_ITERATIONS rounds of BENCH_PEAK_LANES independent single precision multiply-adds. Run on the
+// thread pool, once per thread.
+//
+// Parameters:
+//   context - An array of doubles, one per task, that the result is stored in so that it cannot be optimized away.
+//      task - The index of the task.
+//    worker - Unused.
+static void peak_f32(void *context, unsigned int task, unsigned int worker)
+{
+	float lanes[BENCH_PEAK_LANES];
+	for (unsigned int lane = 0; lane < BENCH_PEAK_LANES; lane++)
+	{
+		lanes[lane] = lane;
+	}
+
+	for (unsigned int i = 0; i < BENCH_PEAK_ITERATIONS; i++)
+	{
+		for (unsigned int lane = 0; lane < BENCH_PEAK_LANES; lane++)
+		{
+			lanes[lane] = lanes[lane] * 0.999999f + 0.000001f;
+		}
+	}
+
+	double sum = 0;
+	for (unsigned int lane = 0; lane < BENCH_PEAK_LANES; lane++)
+	{
+		sum += lanes[lane];
+	}
+
+	((double*)context)[task] = sum;
+}
+
+// peak_f64
+// ========
+//
+// Runs BENCH_PEAK_ITERATIONS rounds of BENCH_PEAK_LANES / 2 independent double precision multiply-adds, which take
+// the same registers as peak_f32(). Run on the thread pool, once per thread.
+//
+// Parameters:
+//   context - An array of doubles, one per task, that the result is stored in so that it cannot be optimized away.
+//      task - The index of the task.
+//    worker - Unused.
+static void peak_f64(void *context, unsigned int task, unsigned int worker)
+{
+	double lanes[BENCH_PEAK_LANES / 2];
+	for (unsigned int lane = 0; lane < BENCH_PEAK_LANES / 2; lane++)
+	{
+		lanes[lane] = lane;
+	}
+
+	for (unsigned int i = 0; i < BENCH_PEAK_ITERATIONS; i++)
+	{
+		for (unsigned int lane = 0; lane < BENCH_PEAK_LANES / 2; lane++)
+		{
+			lanes[lane] = lanes[lane] * 0.999999 + 0.000001;
+		}
+	}
+
+	double sum = 0;
+	for (unsigned int lane = 0; lane < BENCH_PEAK_LANES / 2; lane++)
+	{
+		sum += lanes[lane];
+	}
+
+	((double*)context)[task] = sum;
+}
+
+// StreamJob
+// =========
+//
+// The arrays stream_triad() works on.
+typedef struct
+{
+	double *a, *b, *c;
+	unsigned int tasks;
+} StreamJob;
+
+// stream_triad
+// ============
+//
+// Computes a = b + 3c over one slice of a StreamJob's arrays, as in the STREAM benchmark. Run on the thread pool.
+//
+// Parameters:
+//   context - The StreamJob.
+//      task - The index of the slice.
+//    worker - Unused.
+static void stream_triad(void *context, unsigned int task, unsigned int worker)
+{
+	StreamJob *job = context;
+	size_t first = (size_t)BENCH_STREAM_SIZE * task / job->tasks;
+	size_t last = (size_t)BENCH_STREAM_SIZE * (task + 1) / job->tasks;
+
+	for (size_t i = first; i < last; i++)
+	{
+		job->a[i] = job->b[i] + 3 * job->c[i];
+	}
+}
+
+// measure_peaks
+// =============
+//
+// Measures the machine's peak arithmetic rate in each precision and its memory bandwidth, on every thread of the
+// pool, taking the best of a few attempts. Peaks given as options are kept.
+//
+// Parameters:
+//   bench - The bench run.
+static void measure_peaks(Bench *bench)
+{
+	unsigned int threads = threadpool_threads();
+	double *results = malloc(sizeof(double) * threads);
+	StreamJob job = { malloc(sizeof(double) * BENCH_STREAM_SIZE), malloc(sizeof(double) * BENCH_STREAM_SIZE), malloc(sizeof(double) * BENCH_STREAM_SIZE), threads };
+
+	if (results == NULL || job.a == NULL || job.b == NULL || job.c == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	ThreadPoolFunction peaks[2] = { [MATRIX_F64] = peak_f64, [MATRIX_F32] = peak_f32 };
+	double lanes[2] = { [MATRIX_F64] = BENCH_PEAK_LANES / 2, [MATRIX_F32] = BENCH_PEAK_LANES };
+
+	for (unsigned int precision = 0; precision < 2; precision++)
+	{
+		if (bench->peak_gflops[precision] > 0)
+		{
+			continue;
+		}
+
+		for (unsigned int attempt = 0; attempt < 3; attempt++)
+		{
+			double start = threadpool_seconds();
+			threadpool_run(threads, peaks[precision], results);
+			double elapsed = threadpool_seconds() - start;
+
+			double gflops = 2.0 * lanes[precision] * BENCH_PEAK_ITERATIONS * threads / elapsed / 1e9;
+			bench->peak_gflops[precision] = fmax(bench->peak_gflops[precision], gflops);
+		}
+	}
+
+	if (bench->peak_gbs <= 0)
+	{
+		for (size_t i = 0; i < BENCH_STREAM_SIZE; i++)
+		{
+			job.a[i] = 0;
+			job.b[i] = 1;
+			job.c[i] = 2;
+		}
+
+		for (unsigned int attempt = 0; attempt < 5; attempt++)
+		{
+			double start = threadpool_seconds();
+			threadpool_run(threads, stream_triad, &job);
+			double elapsed = threadpool_seconds() - start;
+
+			bench->peak_gbs = fmax(bench->peak_gbs, 3.0 * sizeof(double) * BENCH_STREAM_SIZE / elapsed / 1e9);
+		}
+	}
+
+	free(results);
+	free(job.a);
+	free(job.b);
+	free(job.c);
+}
+
+// random_matrix
+// =============
+//
+// Creates a matrix of random values between -0.5 and 0.5, in the precision being measured.
+//
+// Parameters:
+//   rows - The number of rows.
+//   cols - The number of columns.
+//
+// Return:
+//   The matrix. Call matrix_free() when no longer needed.
+static Matrix *random_matrix(unsigned int rows, unsigned int cols)
+{
+	Matrix *matrix = matrix_new(rows, cols);
+	matrix_rand(matrix);
+
+	return matrix;
+}
+
+// random_bytes
+// ============
+//
+// Allocates random bytes below a limit, to stand in for pixels or labels.
+//
+// Parameters:
+//   count - The number of bytes.
+//   limit - One more than the largest byte.
+//
+// Return:
+//   The bytes. Call free() when no longer needed.
+static unsigned char *random_bytes(size_t count, unsigned int limit)
+{
+	unsigned char *bytes = malloc(count);
+	if (bytes == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		bytes[i] = rand() % limit;
+	}
+
+	return bytes;
+}
+
+// The run functions of the cases. Each performs its operation once.
+
+static void run_multiply(BenchCase *bench)
+{
+	matrix_multiply_into(bench->output, bench->a, bench->b, bench->a_operation, bench->b_operation);
+}
+
+static void run_dense_relu(BenchCase *bench)
+{
+	matrix_dense_into(bench->output, bench->a, bench->b, bench->c, MATRIX_ACTIVATION_RELU);
+}
+
+static void run_dense(BenchCase *bench)
+{
+	matrix_dense_into(bench->output, bench->a, bench->b, bench->c, MATRIX_ACTIVATION_NONE);
+}
+
+static void run_elementwise_multiply(BenchCase *bench)
+{
+	matrix_elementwise_multiply_into(bench->output, bench->a, bench->b);
+}
+
+static void run_add_to_rows(BenchCase *bench)
+{
+	matrix_add_to_rows_into(bench->output, bench->a, bench->c);
+}
+
+static void run_sum_rows(BenchCase *bench)
+{
+	matrix_sum_rows_into(bench->output, bench->a);
+}
+
+static void run_ReLU(BenchCase *bench)
+{
+	matrix_ReLU_into(bench->output, bench->a);
+}
+
+static void run_dReLU(BenchCase *bench)
+{
+	matrix_dReLU_into(bench->output, bench->a);
+}
+
+static void run_dReLU_multiply(BenchCase *bench)
+{
+	matrix_dReLU_multiply_into(bench->output, bench->b, bench->a);
+}
+
+static void run_transpose(BenchCase *bench)
+{
+	matrix_transpose_into(bench->output, bench->a);
+}
+
+static void run_subtract(BenchCase *bench)
+{
+	matrix_subtract_into(bench->output, bench->a, bench->b, 0.1);
+}
+
+static void run_sum(BenchCase *bench)
+{
+	matrix_sum_into(bench->output, bench->inputs, BENCH_SHARDS);
+}
+
+static void run_multiply_scalar(BenchCase *bench)
+{
+	matrix_multiply_scalar_into(bench->output, bench->a, 0.5);
+}
+
+static void run_softmax(BenchCase *bench)
+{
+	matrix_softmax_into(bench->output, bench->a);
+}
+
+static void run_softmax_cross_entropy(BenchCase *bench)
+{
+	double loss;
+	unsigned int correct;
+	matrix_softmax_cross_entropy_into(NULL, bench->output, bench->a, bench->bytes_in, &loss, &correct);
+}
+
+static void run_gather_bytes(BenchCase *bench)
+{
+	matrix_gather_bytes_into(bench->output, bench->bytes_in, NULL, 1 / 255.0);
+}
+
+static void run_sparse_dense(BenchCase *bench)
+{
+	matrix_sparse_dense_into(bench->output, bench->a, bench->sparse, bench->columns, bench->c, MATRIX_ACTIVATION_RELU);
+}
+
+static void run_sparse_multiply(BenchCase *bench)
+{
+	matrix_sparse_multiply_into(bench->output, bench->a, bench->sparse, bench->columns);
+}
+
+static void run_pruned_dense(BenchCase *bench)
+{
+	matrix_pruned_dense_into(bench->output, bench->pruned, bench->b, bench->c, MATRIX_ACTIVATION_RELU);
+}
+
+// wanted
+// ======
+//
+// Returns whether an operation is to be measured.
+//
+// Parameters:
+//   bench - The bench run.
+//      op - The name of the operation.
+//
+// Return:
+//   Whether it was asked for.
+static bool wanted(Bench *bench, const char *op)
+{
+	return bench->options.op == NULL || strstr(op, bench->options.op) != NULL;
+}
+
+// measure
+// =======
+//
+// Times a case, reports it in the table and the JSON, and frees its operands.
+//
+// Parameters:
+//   bench - The bench run.
+//    test - The case.
+static void measure(Bench *bench, BenchCase *test)
+{
+	for (unsigned int i = 0; i < BENCH_WARMUPS; i++)
+	{
+		test->run(test);
+	}
+
+	double *samples = malloc(sizeof(double) * BENCH_MAX_RUNS);
+	if (samples == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	double before = threadpool_seconds();
+	test->run(test);
+	double once = threadpool_seconds() - before;
+	unsigned int repeats = (once < BENCH_MIN_SAMPLE_SECONDS) ? ceil(BENCH_MIN_SAMPLE_SECONDS / fmax(once, 1e-8)) : 1;
+
+	unsigned int runs = 0;
+	double start = threadpool_seconds();
+
+	while (runs < BENCH_MAX_RUNS && (runs < bench->options.min_runs || threadpool_seconds() - start < BENCH_MIN_SECONDS))
+	{
+		before = threadpool_seconds();
+		for (unsigned int i = 0; i < repeats; i++)
+		{
+			test->run(test);
+		}
+		samples[runs++] = (threadpool_seconds() - before) / repeats;
+	}
+
+	qsort(samples, runs, sizeof(double), compare_doubles);
+	double median = (runs % 2 == 1) ? samples[runs / 2] : (samples[runs / 2 - 1] + samples[runs / 2]) / 2;
+	free(samples);
+
+	double gflops = test->flops / median / 1e9;
+	double gbs = test->bytes / median / 1e9;
+	double peak = (test->bound == BENCH_COMPUTE) ? gflops / bench->peak_gflops[bench->precision] : gbs / bench->peak_gbs;
+	const char *precision = (bench->precision == MATRIX_F32) ? "f32" : "f64";
+
+	printf("%-22s %-4s %-26s %10.2lf %9.2lf %9.2lf %6.1lf%% %s\n", test->op, precision, test->shape, median * 1e6, gflops,
+		gbs, 100 * peak, (test->bound == BENCH_COMPUTE) ? "flops" : "memory");
+	fflush(stdout);
+
+	if (bench->json != NULL)
+	{
+		fprintf(bench->json, "%s\n    {\"op\": \"%s\", \"precision\": \"%s\", \"shape\": \"%s\", \"bound\": \"%s\", "
+			"\"runs\": %u, \"median_seconds\": %.9lf, \"gflops\": %.4lf, \"gbs\": %.4lf, \"peak_fraction\": %.4lf}",
+			(bench->results > 0) ? "," : "", test->op, precision, test->shape, (test->bound == BENCH_COMPUTE) ? "flops" : "memory",
+			runs, median, gflops, gbs, peak);
+	}
+	bench->results++;
+
+	Matrix *operands[] = { test->output, test->a, test->b, test->c };
+	for (unsigned int i = 0; i < sizeof(operands) / sizeof(operands[0]); i++)
+	{
+		if (operands[i] != NULL)
+		{
+			matrix_free(operands[i]);
+		}
+	}
+
+	for (unsigned int i = 0; i < BENCH_SHARDS; i++)
+	{
+		if (test->inputs[i] != NULL)
+		{
+			matrix_free(test->inputs[i]);
+		}
+	}
+
+	free(test->bytes_in);
+	free(test->columns);
+
+	if (test->sparse != NULL)
+	{
+		matrix_sparse_free(test->sparse);
+	}
+
+	if (test->pruned != NULL)
+	{
+		matrix_pruned_free(test->pruned);
+	}
+}
+
+// bench_multiply
+// ==============
+//
+// Measures matrix_multiply_into() at one shape.
+//
+// Parameters:
+//         bench - The bench run.
+//          m, n - The size of the product.
+//             k - The length of the inner dimension.
+//   a_operation - Whether the first operand is transposed.
+//   b_operation - Whether the second operand is transposed.
+static void bench_multiply(Bench *bench, unsigned int m, unsigned int n, unsigned int k, MatrixOperation a_operation, MatrixOperation b_operation)
+{
+	if (!wanted(bench, "multiply"))
+	{
+		return;
+	}
+
+	BenchCase test = { .op = "multiply", .bound = BENCH_COMPUTE, .run = run_multiply };
+	test.a = (a_operation == MATRIX_OP_N) ? random_matrix(m, k) : random_matrix(k, m);
+	test.b = (b_operation == MATRIX_OP_N) ? random_matrix(k, n) : random_matrix(n, k);
+	test.output = matrix_new(m, n);
+	test.a_operation = a_operation;
+	test.b_operation = b_operation;
+	test.flops = 2.0 * m * n * k;
+	test.bytes = matrix_element_size(test.output) * ((double)m * k + (double)k * n + (double)m * n);
+
+	snprintf(test.shape, sizeof(test.shape), "%ux%u%s * %ux%u%s", test.a->rows, test.a->cols,
+		(a_operation == MATRIX_OP_T) ? "^T" : "", test.b->rows, test.b->cols, (b_operation == MATRIX_OP_T) ? "^T" : "");
+
+	measure(bench, &test);
+}
+
+// bench_dense
+// ===========
+//
+// Measures matrix_dense_into() at one shape.
+//
+// Parameters:
+//   bench - The bench run.
+//    m, n - The size of the output.
+//       k - The length of the inner dimension.
+//    relu - Whether the layer has a ReLU.
+static void bench_dense(Bench *bench, unsigned int m, unsigned int n, unsigned int k, bool relu)
+{
+	const char *op = relu ? "dense_relu" : "dense";
+	if (!wanted(bench, op))
+	{
+		return;
+	}
+
+	BenchCase test = { .op = op, .bound = BENCH_COMPUTE, .run = relu ? run_dense_relu : run_dense };
+	test.a = random_matrix(m, k);
+	test.b = random_matrix(k, n);
+	test.c = random_matrix(m, 1);
+	test.output = matrix_new(m, n);
+	test.flops = 2.0 * m * n * k + 2.0 * m * n;
+	test.bytes = matrix_element_size(test.output) * ((double)m * k + (double)k * n + (double)m * n + m);
+
+	snprintf(test.shape, sizeof(test.shape), "%ux%u * %ux%u + %ux1", m, k, k, n, m);
+
+	measure(bench, &test);
+}
+
+// bench_elementwise
+// =================
+//
+// Measures an operation that reads and writes whole (rows, cols) matrices.
+//
+// Parameters:
+//      bench - The bench run.
+//         op - The name of the operation.
+//        run - The run function.
+//       rows - The number of rows of the operands.
+//       cols - The number of columns of the operands.
+//     inputs - The number of (rows, cols) matrices read.
+//      flops - The floating point operations per element.
+static void bench_elementwise(Bench *bench, const char *op, void (*run)(BenchCase*), unsigned int rows, unsigned int cols, unsigned int inputs, double flops)
+{
+	if (!wanted(bench, op))
+	{
+		return;
+	}
+
+	BenchCase test = { .op = op, .bound = BENCH_MEMORY, .run = run };
+	double size = (double)rows * cols;
+
+	test.a = random_matrix(rows, cols);
+	test.b = (inputs > 1) ? random_matrix(rows, cols) : NULL;
+	test.output = matrix_new(rows, cols);
+	test.flops = flops * size;
+	test.bytes = matrix_element_size(test.output) * (inputs + 1) * size;
+
+	snprintf(test.shape, sizeof(test.shape), "%ux%u", rows, cols);
+
+	measure(bench, &test);
+}
+
+// bench_rows
+// ==========
+//
+// Measures the operations between a (rows, cols) matrix and a column of rows: matrix_add_to_rows_into() and
+// matrix_sum_rows_into().
+//
+// Parameters:
+//   bench - The bench run.
+//    rows - The number of rows.
+//    cols - The number of columns.
+static void bench_rows(Bench *bench, unsigned int rows, unsigned int cols)
+{
+	double size = (double)rows * cols;
+
+	if (wanted(bench, "add_to_rows"))
+	{
+		BenchCase test = { .op = "add_to_rows", .bound = BENCH_MEMORY, .run = run_add_to_rows };
+		test.a = random_matrix(rows, cols);
+		test.c = random_matrix(rows, 1);
+		test.output = matrix_new(rows, cols);
+		test.flops = size;
+		test.bytes = matrix_element_size(test.output) * (2 * size + rows);
+		snprintf(test.shape, sizeof(test.shape), "%ux%u + %ux1", rows, cols, rows);
+
+		measure(bench, &test);
+	}
+
+	if (wanted(bench, "sum_rows"))
+	{
+		BenchCase test = { .op = "sum_rows", .bound = BENCH_MEMORY, .run = run_sum_rows };
+		test.a = random_matrix(rows, cols);
+		test.output = matrix_new(rows, 1);
+		test.flops = size;
+		test.bytes = matrix_element_size(test.output) * (size + rows);
+		snprintf(test.shape, sizeof(test.shape), "%ux%u", rows, cols);
+
+		measure(bench, &test);
+	}
+}
+
+// bench_transpose
+// ===============
+//
+// Measures matrix_transpose_into() at one shape.
+//
+// Parameters:
+//   bench - The bench run.
+//    rows - The number of rows of the matrix transposed.
+//    cols - The number of columns of the matrix transposed.
+static void bench_transpose(Bench *bench, unsigned int rows, unsigned int cols)
+{
+	if (!wanted(bench, "transpose"))
+	{
+		return;
+	}
+
+	BenchCase test = { .op = "transpose", .bound = BENCH_MEMORY, .run = run_transpose };
+	test.a = random_matrix(rows, cols);
+	test.output = matrix_new(cols, rows);
+	test.bytes = matrix_element_size(test.output) * 2.0 * rows * cols;
+	snprintf(test.shape, sizeof(test.shape), "%ux%u", rows, cols);
+
+	measure(bench, &test);
+}
+
+// bench_sum
+// =========
+//
+// Measures matrix_sum_into() adding up BENCH_SHARDS matrices, as in train()'s all-reduce of the gradients.
+//
+// Parameters:
+//   bench - The bench run.
+//    rows - The number of rows of each matrix.
+//    cols - The number of columns of each matrix.
+static void bench_sum(Bench *bench, unsigned int rows, unsigned int cols)
+{
+	if (!wanted(bench, "sum"))
+	{
+		return;
+	}
+
+	BenchCase test = { .op = "sum", .bound = BENCH_MEMORY, .run = run_sum };
+	for (unsigned int i = 0; i < BENCH_SHARDS; i++)
+	{
+		test.inputs[i] = random_matrix(rows, cols);
+	}
+	test.output = matrix_new(rows, cols);
+	test.flops = (BENCH_SHARDS - 1.0) * rows * cols;
+	test.bytes = matrix_element_size(test.output) * (BENCH_SHARDS + 1.0) * rows * cols;
+	snprintf(test.shape, sizeof(test.shape), "%u x %ux%u", BENCH_SHARDS, rows, cols);
+
+	measure(bench, &test);
+}
+
+// bench_outputs
+// =============
+//
+// Measures the operations on the (10, cols) output layer: matrix_softmax_into() and
+// matrix_softmax_cross_entropy_into().
+//
+// Parameters:
+//   bench - The bench run.
+//    cols - The number of columns.
+static void bench_outputs(Bench *bench, unsigned int cols)
+{
+	double size = 10.0 * cols;
+
+	if (wanted(bench, "softmax"))
+	{
+		BenchCase test = { .op = "softmax", .bound = BENCH_MEMORY, .run = run_softmax };
+		test.a = random_matrix(10, cols);
+		test.output = matrix_new(10, cols);
+		test.flops = 4 * size;
+		test.bytes = matrix_element_size(test.output) * 2 * size;
+		snprintf(test.shape, sizeof(test.shape), "10x%u", cols);
+
+		measure(bench, &test);
+	}
+
+	if (wanted(bench, "softmax_cross_entropy"))
+	{
+		BenchCase test = { .op = "softmax_cross_entropy", .bound = BENCH_MEMORY, .run = run_softmax_cross_entropy };
+		test.a = random_matrix(10, cols);
+		test.output = matrix_new(10, cols);
+		test.bytes_in = random_bytes(cols, 10);
+		test.flops = 4 * size;
+		test.bytes = matrix_element_size(test.output) * 2 * size + cols;
+		snprintf(test.shape, sizeof(test.shape), "10x%u", cols);
+
+		measure(bench, &test);
+	}
+}
+
+// bench_gather_bytes
+// ==================
+//
+// Measures matrix_gather_bytes_into() turning (rows, cols) pixel bytes into a matrix.
+//
+// Parameters:
+//   bench - The bench run.
+//    rows - The number of bytes per column.
+//    cols - The number of columns.
+static void bench_gather_bytes(Bench *bench, unsigned int rows, unsigned int cols)
+{
+	if (!wanted(bench, "gather_bytes"))
+	{
+		return;
+	}
+
+	BenchCase test = { .op = "gather_bytes", .bound = BENCH_MEMORY, .run = run_gather_bytes };
+	test.output = matrix_new(rows, cols);
+	test.bytes_in = random_bytes((size_t)rows * cols, 256);
+	test.flops = (double)rows * cols;
+	test.bytes = (1.0 + matrix_element_size(test.output)) * rows * cols;
+	snprintf(test.shape, sizeof(test.shape), "%ux%u bytes", rows, cols);
+
+	measure(bench, &test);
+}
+
+// bench_sparse
+// ============
+//
+// Measures matrix_sparse_dense_into() and matrix_sparse_multiply_into() on a batch of (k, n) pixels, BENCH_DENSITY
+// of them set, picked from a set twice the size as train() picks a batch. The floating point operations counted are
+// those on the pixels that are set.
+//
+// Parameters:
+//   bench - The bench run.
+//    m, k - The size of the weights.
+//       n - The number of columns in the batch.
+static void bench_sparse(Bench *bench, unsigned int m, unsigned int n, unsigned int k)
+{
+	const char *ops[] = { "sparse_dense", "sparse_multiply" };
+
+	for (unsigned int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+	{
+		if (!wanted(bench, ops[i]))
+		{
+			continue;
+		}
+
+		unsigned int count = 2 * n;
+		unsigned char *pixels = random_bytes((size_t)k * count, 256);
+		for (size_t j = 0; j < (size_t)k * count; j++)
+		{
+			pixels[j] = (rand() < BENCH_DENSITY * RAND_MAX) ? pixels[j] | 1 : 0;
+		}
+
+		BenchCase test = { .op = ops[i], .bound = BENCH_COMPUTE };
+		test.sparse = matrix_sparse_from_bytes(k, count, pixels, 1 / 255.0);
+		free(pixels);
+
+		test.columns = malloc(sizeof(unsigned int) * n);
+		if (test.columns == NULL)
+		{
+			printf("Your computer has run out of memory :(\n");
+			exit(3);
+		}
+
+		for (unsigned int col = 0; col < n; col++)
+		{
+			test.columns[col] = rand() % count;
+		}
+
+		double set = (double)k * n * matrix_sparse_density(test.sparse);
+
+		if (i == 0)
+		{
+			test.run = run_sparse_dense;
+			test.a = random_matrix(m, k);
+			test.c = random_matrix(m, 1);
+			test.output = matrix_new(m, n);
+			test.flops = 2.0 * m * (set + n);
+			snprintf(test.shape, sizeof(test.shape), "%ux%u * %ux%u sparse", m, k, k, n);
+		}
+		else
+		{
+			test.run = run_sparse_multiply;
+			test.a = random_matrix(m, n);
+			test.output = matrix_new(m, k);
+			test.flops = 2.0 * m * set;
+			snprintf(test.shape, sizeof(test.shape), "%ux%u * %ux%u^T sparse", m, n, k, n);
+		}
+
+		test.bytes = 3.0 * set + (double)matrix_element_size(test.a) * (test.a->rows * test.a->cols + test.output->rows * test.output->cols);
+
+		measure(bench, &test);
+	}
+}
+
+// bench_pruned
+// ============
+//
+// Measures matrix_pruned_dense_into() with (m, k) weights, BENCH_SPARSITY of them pruned, on (k, n) inputs. The
+// floating point operations counted are those on the kept weights.
+//
+// Parameters:
+//   bench - The bench run.
+//    m, k - The size of the weights.
+//       n - The number of columns in the input.
+static void bench_pruned(Bench *bench, unsigned int m, unsigned int n, unsigned int k)
+{
+	if (!wanted(bench, "pruned_dense"))
+	{
+		return;
+	}
+
+	BenchCase test = { .op = "pruned_dense", .bound = BENCH_COMPUTE, .run = run_pruned_dense };
+	test.a = random_matrix(m, k);
+	test.pruned = matrix_prune(test.a, test.a, BENCH_SPARSITY);
+	test.b = random_matrix(k, n);
+	test.c = random_matrix(m, 1);
+	test.output = matrix_new(m, n);
+
+	double kept = test.pruned->starts[m];
+	test.flops = 2.0 * n * (kept + m);
+	test.bytes = (double)matrix_element_size(test.a) * (kept + test.b->rows * test.b->cols + test.output->rows * test.output->cols)
+		+ sizeof(unsigned short) * kept;
+	snprintf(test.shape, sizeof(test.shape), "%ux%u pruned * %ux%u", m, k, k, n);
+
+	measure(bench, &test);
+}
+
+// bench_precision
+// ===============
+//
+// Measures every operation across the sweep of shapes in one precision. The shapes are those of a step of train()
+// at a mini-batch and at the full batch, where X is the (784, batch) pixels, A1 and dZ1 the (10, batch) hidden layer
+// and dZ2 the (10, batch) output gradient, followed by square multiplications for comparison.
+//
+// Parameters:
+//   bench - The bench run.
+static void bench_precision(Bench *bench)
+{
+	matrix_use_precision(bench->precision);
+
+	unsigned int batches[] = { BENCH_MINIBATCH, BENCH_FULL_BATCH };
+
+	for (unsigned int i = 0; i < sizeof(batches) / sizeof(batches[0]); i++)
+	{
+		unsigned int n = batches[i];
+
+		// The forward pass, W1 * X and W2 * A1, as plain products and as fused layers.
+		bench_multiply(bench, 10, n, 784, MATRIX_OP_N, MATRIX_OP_N);
+		bench_multiply(bench, 10, n, 10, MATRIX_OP_N, MATRIX_OP_N);
+		bench_dense(bench, 10, n, 784, true);
+		bench_dense(bench, 10, n, 10, false);
+
+		// The backward pass: dZ2 * A1^T, W2^T * dZ2 and dZ1 * X^T.
+		bench_multiply(bench, 10, 10, n, MATRIX_OP_N, MATRIX_OP_T);
+		bench_multiply(bench, 10, n, 10, MATRIX_OP_T, MATRIX_OP_N);
+		bench_multiply(bench, 10, 784, n, MATRIX_OP_N, MATRIX_OP_T);
+
+		// The same first layer products reading the pixels sparse, and the
+		// forward one with most of the weights pruned.
+		bench_sparse(bench, 10, n, 784);
+		bench_pruned(bench, 10, n, 784);
+
+		bench_gather_bytes(bench, 784, n);
+		bench_outputs(bench, n);
+		bench_rows(bench, 10, n);
+		bench_transpose(bench, 10, n);
+		bench_transpose(bench, 784, n);
+
+		bench_elementwise(bench, "ReLU", run_ReLU, 10, n, 1, 1);
+		bench_elementwise(bench, "dReLU", run_dReLU, 10, n, 1, 1);
+		bench_elementwise(bench, "dReLU_multiply", run_dReLU_multiply, 10, n, 2, 1);
+		bench_elementwise(bench, "elementwise_multiply", run_elementwise_multiply, 10, n, 2, 1);
+		bench_elementwise(bench, "multiply_scalar", run_multiply_scalar, 10, n, 1, 1);
+	}
+
+	// The updates and the all-reduce of the gradients, whose shapes do not
+	// depend on the batch.
+	bench_elementwise(bench, "subtract", run_subtract, 10, 784, 2, 2);
+	bench_elementwise(bench, "subtract", run_subtract, 10, 10, 2, 2);
+	bench_sum(bench, 10, 784);
+
+	unsigned int squares[] = { 256, 1024 };
+	for (unsigned int i = 0; i < sizeof(squares) / sizeof(squares[0]); i++)
+	{
+		bench_multiply(bench, squares[i], squares[i], squares[i], MATRIX_OP_N, MATRIX_OP_N);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int threads = 0;
+	DeviceKind device = DEVICE_DEFAULT;
+	const char *backend = NULL;
+
+	BenchOptions options =
+	{
+		.f32 = true,
+		.f64 = true,
+		.op = NULL,
+		.min_runs = BENCH_MIN_RUNS,
+		.json = NULL,
+		.peak_gflops = { 0, 0 },
+		.peak_gbs = 0
+	};
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--threads=", 10) == 0)
+		{
+			threads = strtol(argv[i] + 10, NULL, 10);
+		}
+		else if (strequ(argv[i], "--device=none"))
+		{
+			device = DEVICE_NONE;
+		}
+		else if (strequ(argv[i], "--device=cuda"))
+		{
+			device = DEVICE_CUDA;
+		}
+		else if (strequ(argv[i], "--device=emulated"))
+		{
+			device = DEVICE_EMULATED;
+		}
+		else if (strncmp(argv[i], "--backend=", 10) == 0)
+		{
+			backend = argv[i] + 10;
+		}
+		else if (strequ(argv[i], "--precision=f32"))
+		{
+			options.f64 = false;
+		}
+		else if (strequ(argv[i], "--precision=f64"))
+		{
+			options.f32 = false;
+		}
+		else if (strncmp(argv[i], "--op=", 5) == 0)
+		{
+			options.op = argv[i] + 5;
+		}
+		else if (strncmp(argv[i], "--runs=", 7) == 0)
+		{
+			options.min_runs = strtol(argv[i] + 7, NULL, 10);
+		}
+		else if (strncmp(argv[i], "--json=", 7) == 0)
+		{
+			options.json = argv[i] + 7;
+		}
+		else if (strncmp(argv[i], "--peak-gflops-f32=", 18) == 0)
+		{
+			options.peak_gflops[MATRIX_F32] = strtod(argv[i] + 18, NULL);
+		}
+		else if (strncmp(argv[i], "--peak-gflops-f64=", 18) == 0)
+		{
+			options.peak_gflops[MATRIX_F64] = strtod(argv[i] + 18, NULL);
+		}
+		else if (strncmp(argv[i], "--peak-gbs=", 11) == 0)
+		{
+			options.peak_gbs = strtod(argv[i] + 11, NULL);
+		}
+		else
+		{
+			printf("Unknown option '%s'. bench accepts --threads=N, --device=none|cuda|emulated, --backend=NAME, "
+				"--precision=f32|f64, --op=NAME, --runs=N, --json=PATH, --peak-gflops-f32=X, --peak-gflops-f64=X "
+				"and --peak-gbs=X.\n", argv[i]);
+			return 0;
+		}
+	}
+
+	matrix_init(threads, device, backend);
+
+	Bench bench =
+	{
+		.options = options,
+		.peak_gflops = { options.peak_gflops[0], options.peak_gflops[1] },
+		.peak_gbs = options.peak_gbs,
+		.json = NULL,
+		.results = 0
+	};
+
+	measure_peaks(&bench);
+
+	printf("%s backend, %u threads. Peak: %.1lf GFLOP/s f32, %.1lf GFLOP/s f64, %.1lf GB/s.\n\n", matrix_backend(),
+		threadpool_threads(), bench.peak_gflops[MATRIX_F32], bench.peak_gflops[MATRIX_F64], bench.peak_gbs);
+	printf("%-22s %-4s %-26s %10s %9s %9s %7s %s\n", "op", "prec", "shape", "median us", "GFLOP/s", "GB/s", "peak", "of");
+
+	if (options.json != NULL)
+	{
+		bench.json = fopen(options.json, "w");
+		if (bench.json == NULL)
+		{
+			printf("Could not write '%s'.\n", options.json);
+			return 0;
+		}
+
+		fprintf(bench.json, "{\n  \"backend\": \"%s\",\n  \"threads\": %u,\n  \"peak_gflops_f32\": %.4lf,\n  \"peak_gflops_f64\": %.4lf,\n"
+			"  \"peak_gbs\": %.4lf,\n  \"results\": [", matrix_backend(), threadpool_threads(), bench.peak_gflops[MATRIX_F32],
+			bench.peak_gflops[MATRIX_F64], bench.peak_gbs);
+	}
+
+	if (options.f32)
+	{
+		bench.precision = MATRIX_F32;
+		bench_precision(&bench);
+	}
+
+	if (options.f64)
+	{
+		bench.precision = MATRIX_F64;
+		bench_precision(&bench);
+	}
+
+	if (bench.json != NULL)
+	{
+		fprintf(bench.json, "\n  ]\n}\n");
+		fclose(bench.json);
+	}
+
+	matrix_shutdown();
+
+	return 0;
+}
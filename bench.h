@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "linalg.h"
+
+// Each benchmark is run BENCH_WARMUPS times untimed, then timed at least
+// BENCH_MIN_RUNS times and until BENCH_MIN_SECONDS have passed, but no more
+// than BENCH_MAX_RUNS times. The median of the timed runs is reported. Each
+// timed run repeats operations faster than BENCH_MIN_SAMPLE_SECONDS enough
+// times to take that long, so that they are not lost in the clock's resolution.
+#define BENCH_WARMUPS 2
+#define BENCH_MIN_RUNS 5
+#define BENCH_MAX_RUNS 1000
+#define BENCH_MIN_SECONDS 0.2
+#define BENCH_MIN_SAMPLE_SECONDS 50e-6
+
+// The batch sizes train() uses: a mini-batch, and the original full batch of
+// 10,000 images.
+#define BENCH_MINIBATCH 64
+#define BENCH_FULL_BATCH 10000
+
+// The number of per-thread gradients train() adds up in an all-reduce, for the
+// sum benchmark.
+#define BENCH_SHARDS 4
+
+// The fraction of pixels set in the sparse inputs, about that of MNIST.
+#define BENCH_DENSITY 0.19
+
+// The fraction of the first layer's weights pruned for the pruned benchmark.
+#define BENCH_SPARSITY 0.9
+
+// The number of elements in each of the three arrays the memory bandwidth is
+// measured over, 96MB of doubles together, which is well out of cache.
+#define BENCH_STREAM_SIZE (4 << 20)
+
+// The peak arithmetic rate is measured with this many independent multiply-adds
+// per thread, enough to fill the vector registers and hide their latency,
+// repeated this many times.
+#define BENCH_PEAK_LANES 128
+#define BENCH_PEAK_ITERATIONS (1 << 20)
+
+#define strequ !strcmp
+
+// BenchBound
+// ==========
+//
+// What limits an operation, and so which peak it is compared against.
+typedef enum
+{
+	BENCH_COMPUTE, // Arithmetic, reported in GFLOP/s.
+	BENCH_MEMORY   // Memory traffic, reported in GB/s.
+} BenchBound;
+
+// BenchCase
+// =========
+//
+// One operation at one shape, with the operands it runs on.
+typedef struct BenchCase BenchCase;
+struct BenchCase
+{
+	const char *op;       // The name of the matrix operation.
+	char shape[64];       // The shape of the operands, for the report.
+	BenchBound bound;
+	double flops;         // The floating point operations in one run.
+	double bytes;         // The fewest bytes one run must read and write.
+	void (*run)(BenchCase *bench);
+
+	// Operands, which the run function picks from.
+	Matrix *output, *a, *b, *c;
+	MatrixOperation a_operation, b_operation;
+	Matrix *inputs[BENCH_SHARDS];
+	unsigned char *bytes_in; // Pixel bytes or labels.
+	MatrixSparse *sparse;
+	unsigned int *columns;
+	MatrixPruned *pruned;
+};
+
+// BenchOptions
+// ============
+//
+// What bench measures and where it reports.
+typedef struct
+{
+	bool f32, f64;            // The precisions to measure.
+	const char *op;           // Only operations whose name contains this, or NULL for all of them.
+	unsigned int min_runs;
+	const char *json;         // The path to write the results to as JSON, or NULL.
+	double peak_gflops[2];    // The machine's peak per precision, indexed by MatrixPrecision, or 0 to measure it.
+	double peak_gbs;          // The machine's peak memory bandwidth, or 0 to measure it.
+} BenchOptions;
+
+// Bench
+// =====
+//
+// The state of a bench run.
+typedef struct
+{
+	BenchOptions options;
+	MatrixPrecision precision; // The precision being measured.
+	double peak_gflops[2];     // Indexed by MatrixPrecision.
+	double peak_gbs;
+	FILE *json;                // Where the results are written as JSON, or NULL.
+	unsigned int results;      // The number of results written so far.
+} Bench;
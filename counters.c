@@ -0,0 +1,519 @@
+#include "counters.h"
+#include "threadpool.h"
+
+#if USE_COUNTERS
+
+// CounterGroup
+// ============
+//
+// The counters of one thread, opened as a group so that they are scheduled together and read with one system call.
+typedef struct
+{
+	pid_t tid;
+	int fds[COUNTER_EVENTS]; // -1 for events that could not be opened.
+	int leader;              // The first event that was opened, or -1 if none were.
+	int slots[COUNTER_EVENTS]; // The position of each event in a read of the group, or -1.
+} CounterGroup;
+
+// CounterTotals
+// =============
+//
+// What every call of one operation at one shape counted.
+typedef struct
+{
+	const char *op;
+	unsigned int rows, cols, depth;
+	double flops;
+	uint64_t calls;
+	uint64_t counts[COUNTER_EVENTS];
+} CounterTotals;
+
+static const char *event_names[COUNTER_EVENTS] = { "task-clock", "cycles", "instructions", "L1D-load-misses", "LLC-misses" };
+
+// Whether each event could be opened on the first thread. Later threads only
+// open these, so that every group reads back the same events.
+static bool enabled;
+static bool available[COUNTER_EVENTS];
+static int errors[COUNTER_EVENTS];
+
+// The groups of the threads that were running when counting started, the
+// first being the thread that started it, followed by those of threads that
+// first counted later, such as the loader.
+static CounterGroup groups[COUNTERS_MAX_THREADS];
+static unsigned int pool_count, group_count;
+static _Thread_local CounterGroup *local;
+
+// The group of threads that no counters could be opened for.
+static CounterGroup unopened = { .leader = -1 };
+
+static CounterTotals totals[COUNTERS_MAX_KEYS];
+static unsigned int total_count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// event_attributes
+// ================
+//
+// Describes an event to perf_event_open().
+//
+// Parameters:
+//   event - The event.
+//    attr - Set to the description.
+static void event_attributes(CounterEvent event, struct perf_event_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->size = sizeof(*attr);
+	attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	// Only user space is counted, which unprivileged processes are allowed at
+	// the default perf_event_paranoid level of 2.
+	attr->exclude_kernel = 1;
+	attr->exclude_hv = 1;
+
+	switch (event)
+	{
+		case COUNTER_TASK_CLOCK:
+			attr->type = PERF_TYPE_SOFTWARE;
+			attr->config = PERF_COUNT_SW_TASK_CLOCK;
+			break;
+
+		case COUNTER_CYCLES:
+			attr->type = PERF_TYPE_HARDWARE;
+			attr->config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+
+		case COUNTER_INSTRUCTIONS:
+			attr->type = PERF_TYPE_HARDWARE;
+			attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+
+		case COUNTER_L1D_MISSES:
+			attr->type = PERF_TYPE_HW_CACHE;
+			attr->config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+
+		default:
+			attr->type = PERF_TYPE_HARDWARE;
+			attr->config = PERF_COUNT_HW_CACHE_MISSES;
+			break;
+	}
+}
+
+// group_open
+// ==========
+//
+// Opens the counters of a thread. Events that fail to open are left out. The first thread opened decides which
+// events are available.
+//
+// Parameters:
+//   this - The group to fill in.
+//    tid - The thread, or 0 for the calling thread.
+//
+// Return:
+//   Whether any event was opened.
+static bool group_open(CounterGroup *this, pid_t tid)
+{
+	bool first = (group_count == 0);
+	int slot = 0;
+
+	this->tid = (tid == 0) ? (pid_t)syscall(SYS_gettid) : tid;
+	this->leader = -1;
+
+	for (unsigned int event = 0; event < COUNTER_EVENTS; event++)
+	{
+		this->fds[event] = -1;
+		this->slots[event] = -1;
+
+		if (!first && !available[event])
+		{
+			continue;
+		}
+
+		struct perf_event_attr attr;
+		event_attributes(event, &attr);
+
+		int fd = syscall(SYS_perf_event_open, &attr, tid, -1, (this->leader >= 0) ? this->fds[this->leader] : -1, 0);
+		if (fd < 0)
+		{
+			if (first)
+			{
+				errors[event] = errno;
+			}
+
+			continue;
+		}
+
+		if (first)
+		{
+			available[event] = true;
+		}
+
+		if (this->leader < 0)
+		{
+			this->leader = event;
+		}
+
+		this->fds[event] = fd;
+		this->slots[event] = slot++;
+	}
+
+	return this->leader >= 0;
+}
+
+// group_read
+// ==========
+//
+// Reads the counters of a thread, scaling them up for any time the group was not scheduled because other groups
+// were using the hardware counters.
+//
+// Parameters:
+//     this - The group.
+//   counts - Added to by the count of each event.
+static void group_read(CounterGroup *this, uint64_t *counts)
+{
+	if (this->leader < 0)
+	{
+		return;
+	}
+
+	uint64_t buffer[3 + COUNTER_EVENTS];
+	if (read(this->fds[this->leader], buffer, sizeof(buffer)) < (ssize_t)(3 * sizeof(uint64_t)))
+	{
+		return;
+	}
+
+	uint64_t time_enabled = buffer[1], time_running = buffer[2];
+
+	for (unsigned int event = 0; event < COUNTER_EVENTS; event++)
+	{
+		if (this->slots[event] < 0 || this->slots[event] >= buffer[0])
+		{
+			continue;
+		}
+
+		uint64_t count = buffer[3 + this->slots[event]];
+		if (time_running > 0 && time_running < time_enabled)
+		{
+			count = (uint64_t)((double)count * time_enabled / time_running);
+		}
+
+		counts[event] += count;
+	}
+}
+
+// group_close
+// ===========
+//
+// Closes the counters of a thread.
+//
+// Parameters:
+//   this - The group.
+static void group_close(CounterGroup *this)
+{
+	for (unsigned int event = 0; event < COUNTER_EVENTS; event++)
+	{
+		if (this->fds[event] >= 0)
+		{
+			close(this->fds[event]);
+		}
+	}
+}
+
+// counters_start
+// ==============
+//
+// Opens the counters on the calling thread and on every thread of the pool. Call once the pool has started. If
+// the kernel refuses every event, says why once and counts nothing, and any events it refuses are left out of the
+// report.
+void counters_start(void)
+{
+	if (!group_open(&groups[0], 0))
+	{
+		fprintf(stderr, "Performance counters are unavailable (%s), so matrix operations are not counted.\n", strerror(errors[COUNTER_TASK_CLOCK]));
+		return;
+	}
+
+	group_count = 1;
+	local = &groups[0];
+
+	// The pool's workers were started by this thread, so they are the other
+	// threads of the process at this point.
+	DIR *tasks = opendir("/proc/self/task");
+	struct dirent *entry;
+
+	while (tasks != NULL && (entry = readdir(tasks)) != NULL && group_count < COUNTERS_MAX_THREADS)
+	{
+		pid_t tid = strtol(entry->d_name, NULL, 10);
+
+		if (tid > 0 && tid != groups[0].tid && group_open(&groups[group_count], tid))
+		{
+			group_count++;
+		}
+	}
+
+	if (tasks != NULL)
+	{
+		closedir(tasks);
+	}
+
+	pool_count = group_count;
+	enabled = true;
+
+	for (unsigned int event = 0; event < COUNTER_EVENTS; event++)
+	{
+		if (!available[event])
+		{
+			fprintf(stderr, "The %s counter is unavailable (%s).\n", event_names[event], strerror(errors[event]));
+		}
+	}
+}
+
+// thread_group
+// ============
+//
+// Returns the counters of the calling thread, opening them the first time a thread outside the pool counts.
+//
+// Return:
+//   The group, or NULL if there are no more free groups or nothing could be opened.
+static CounterGroup *thread_group(void)
+{
+	if (local != NULL)
+	{
+		return (local->leader >= 0) ? local : NULL;
+	}
+
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+
+	pthread_mutex_lock(&lock);
+
+	for (unsigned int i = 0; i < group_count; i++)
+	{
+		if (groups[i].tid == tid)
+		{
+			local = &groups[i];
+		}
+	}
+
+	if (local == NULL)
+	{
+		if (group_count < COUNTERS_MAX_THREADS && group_open(&groups[group_count], 0))
+		{
+			local = &groups[group_count++];
+		}
+		else
+		{
+			local = &unopened;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return (local->leader >= 0) ? local : NULL;
+}
+
+// read_scope
+// ==========
+//
+// Reads the counters that cover a scope: those of every thread of the pool if the operation spreads over it, or
+// otherwise those of the calling thread alone, so that operations run at the same time on different threads do
+// not count each other.
+//
+// Parameters:
+//    scope - The scope.
+//   counts - Set to the counts.
+static void read_scope(CounterScope *scope, uint64_t *counts)
+{
+	memset(counts, 0, sizeof(uint64_t) * COUNTER_EVENTS);
+
+	if (scope->spread)
+	{
+		for (unsigned int i = 0; i < pool_count; i++)
+		{
+			group_read(&groups[i], counts);
+		}
+	}
+	else
+	{
+		group_read(local, counts);
+	}
+}
+
+// counters_begin
+// ==============
+//
+// Opens a counted scope. Use COUNTERS_SCOPE rather than calling this directly.
+//
+// Parameters:
+//     op - The name of the operation, which must outlive the program.
+//   rows - The number of rows of the result.
+//   cols - The number of columns of the result.
+//  depth - The inner dimension of a multiplication or the number of matrices added up, otherwise 0.
+//  flops - The floating point operations one call does at this shape.
+//
+// Return:
+//   The scope, to pass to counters_end().
+CounterScope counters_begin(const char *op, unsigned int rows, unsigned int cols, unsigned int depth, double flops)
+{
+	CounterScope scope = { .op = NULL };
+
+	if (!enabled || thread_group() == NULL)
+	{
+		return scope;
+	}
+
+	scope.op = op;
+	scope.rows = rows;
+	scope.cols = cols;
+	scope.depth = depth;
+	scope.flops = flops;
+	scope.spread = (local == &groups[0] && threadpool_threads() > 1);
+	read_scope(&scope, scope.start);
+
+	return scope;
+}
+
+// counters_end
+// ============
+//
+// Closes a counted scope, adding what was counted during it to the totals of its operation and shape.
+//
+// Parameters:
+//   this - The scope, as returned by counters_begin().
+void counters_end(CounterScope *this)
+{
+	if (this->op == NULL)
+	{
+		return;
+	}
+
+	uint64_t end[COUNTER_EVENTS];
+	read_scope(this, end);
+
+	pthread_mutex_lock(&lock);
+
+	CounterTotals *found = NULL;
+	for (unsigned int i = 0; i < total_count && found == NULL; i++)
+	{
+		CounterTotals *key = &totals[i];
+
+		if (key->op == this->op && key->rows == this->rows && key->cols == this->cols && key->depth == this->depth)
+		{
+			found = key;
+		}
+	}
+
+	if (found == NULL && total_count < COUNTERS_MAX_KEYS)
+	{
+		found = &totals[total_count++];
+		*found = (CounterTotals){ this->op, this->rows, this->cols, this->depth, this->flops, 0, { 0 } };
+	}
+
+	if (found != NULL)
+	{
+		found->calls++;
+
+		for (unsigned int event = 0; event < COUNTER_EVENTS; event++)
+		{
+			found->counts[event] += end[event] - this->start[event];
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+// compare_totals
+// ==============
+//
+// Orders totals by their cycles, or their CPU time without a cycle counter, most first, for qsort().
+//
+// Parameters:
+//   a - The first totals.
+//   b - The second totals.
+//
+// Return:
+//   Less than, equal to or greater than 0 as a comes before, with or after b.
+static int compare_totals(const void *a, const void *b)
+{
+	CounterEvent event = available[COUNTER_CYCLES] ? COUNTER_CYCLES : COUNTER_TASK_CLOCK;
+	uint64_t x = ((const CounterTotals*)a)->counts[event];
+	uint64_t y = ((const CounterTotals*)b)->counts[event];
+
+	return (x < y) - (x > y);
+}
+
+// print_ratio
+// ===========
+//
+// Prints one column of the report, or a dash if an event it needs is unavailable.
+//
+// Parameters:
+//   available - Whether the events the column needs were counted.
+//       value - The value.
+//      format - The printf() format of the value.
+static void print_ratio(bool available, double value, const char *format)
+{
+	if (available)
+	{
+		fprintf(stderr, format, value);
+	}
+	else
+	{
+		fprintf(stderr, " %10s", "-");
+	}
+}
+
+// counters_stop
+// =============
+//
+// Prints the counts of each operation and shape to stderr, then closes the counters. Call before the pool stops.
+void counters_stop(void)
+{
+	if (!enabled)
+	{
+		return;
+	}
+
+	enabled = false;
+	qsort(totals, total_count, sizeof(CounterTotals), compare_totals);
+
+	// The report goes to stderr so that it stays out of classify's CSV or JSON.
+	// The floating point operations are counted from the shapes, as there is no
+	// portable event for them.
+	fprintf(stderr, "\n%-28s %-20s %8s %10s %10s %10s %10s %10s %10s\n", "op", "shape", "calls", "us/call",
+		"MFLOP/call", "Mcyc/call", "IPC", "L1D/FLOP", "LLC/FLOP");
+
+	for (unsigned int i = 0; i < total_count; i++)
+	{
+		CounterTotals *key = &totals[i];
+		double calls = key->calls;
+		double flops = key->flops * calls;
+
+		char shape[32];
+		if (key->depth > 0)
+		{
+			snprintf(shape, sizeof(shape), "%ux%u k=%u", key->rows, key->cols, key->depth);
+		}
+		else
+		{
+			snprintf(shape, sizeof(shape), "%ux%u", key->rows, key->cols);
+		}
+
+		fprintf(stderr, "%-28s %-20s %8llu", key->op, shape, (unsigned long long)key->calls);
+		print_ratio(available[COUNTER_TASK_CLOCK], key->counts[COUNTER_TASK_CLOCK] / 1e3 / calls, " %10.2lf");
+		fprintf(stderr, " %10.3lf", key->flops / 1e6);
+		print_ratio(available[COUNTER_CYCLES], key->counts[COUNTER_CYCLES] / 1e6 / calls, " %10.3lf");
+		print_ratio(available[COUNTER_CYCLES] && available[COUNTER_INSTRUCTIONS] && key->counts[COUNTER_CYCLES] > 0,
+			(double)key->counts[COUNTER_INSTRUCTIONS] / key->counts[COUNTER_CYCLES], " %10.2lf");
+		print_ratio(available[COUNTER_L1D_MISSES] && flops > 0, key->counts[COUNTER_L1D_MISSES] / flops, " %10.5lf");
+		print_ratio(available[COUNTER_LLC_MISSES] && flops > 0, key->counts[COUNTER_LLC_MISSES] / flops, " %10.5lf");
+		fprintf(stderr, "\n");
+	}
+
+	for (unsigned int i = 0; i < group_count; i++)
+	{
+		group_close(&groups[i]);
+	}
+
+	group_count = pool_count = total_count = 0;
+}
+
+#endif // USE_COUNTERS
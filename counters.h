@@ -0,0 +1,109 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if USE_COUNTERS
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// The most distinct operation and shape pairs counted, and the most threads
+// whose counters are opened when the pool starts.
+#define COUNTERS_MAX_KEYS 256
+#define COUNTERS_MAX_THREADS 256
+
+// CounterEvent
+// ============
+//
+// The events counted for each operation. The task clock is a software event, which the kernel provides even where
+// the hardware counters are hidden, such as in most virtual machines and containers.
+typedef enum
+{
+	COUNTER_TASK_CLOCK,   // Nanoseconds of CPU time.
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_L1D_MISSES,   // Loads that missed the level 1 data cache.
+	COUNTER_LLC_MISSES,   // References that missed the last level cache.
+	COUNTER_EVENTS
+} CounterEvent;
+
+#if USE_COUNTERS
+
+// CounterScope
+// ============
+//
+// The counts at the start of an operation, opened by counters_begin() and closed by counters_end().
+typedef struct
+{
+	const char *op;          // The name of the operation, or NULL if nothing is being counted.
+	unsigned int rows, cols, depth;
+	double flops;
+	bool spread;             // Whether the operation spreads over the whole thread pool.
+	uint64_t start[COUNTER_EVENTS];
+} CounterScope;
+
+// COUNTERS_SCOPE
+// ==============
+//
+// Counts the rest of the enclosing block as one call of an operation at a shape. The scope is closed however the
+// block is left, including by return. Needs GCC or Clang.
+#define COUNTERS_JOIN(a, b) a##b
+#define COUNTERS_LOCAL(line) COUNTERS_JOIN(counter_scope_, line)
+#define COUNTERS_SCOPE(op, rows, cols, depth, flops) CounterScope COUNTERS_LOCAL(__LINE__) __attribute__((cleanup(counters_end))) = counters_begin(op, rows, cols, depth, flops)
+
+	// counters_start
+	// ==============
+	//
+	// Opens the counters on the calling thread and on every thread of the pool. Call once the pool has started. If
+	// the kernel refuses every event, says why once and counts nothing, and any events it refuses are left out of the
+	// report.
+	void counters_start(void);
+
+	// counters_stop
+	// =============
+	//
+	// Prints the counts of each operation and shape to stderr, then closes the counters. Call before the pool stops.
+	void counters_stop(void);
+
+	// counters_begin
+	// ==============
+	//
+	// Opens a counted scope. Use COUNTERS_SCOPE rather than calling this directly.
+	//
+	// Parameters:
+	//     op - The name of the operation, which must outlive the program.
+	//   rows - The number of rows of the result.
+	//   cols - The number of columns of the result.
+	//  depth - The inner dimension of a multiplication or the number of matrices added up, otherwise 0.
+	//  flops - The floating point operations one call does at this shape.
+	//
+	// Return:
+	//   The scope, to pass to counters_end().
+	CounterScope counters_begin(const char *op, unsigned int rows, unsigned int cols, unsigned int depth, double flops);
+
+	// counters_end
+	// ============
+	//
+	// Closes a counted scope, adding what was counted during it to the totals of its operation and shape.
+	//
+	// Parameters:
+	//   scope - The scope, as returned by counters_begin().
+	void counters_end(CounterScope *scope);
+
+#else
+
+// Without USE_COUNTERS nothing is counted, and the arguments are not evaluated.
+#define COUNTERS_SCOPE(op, rows, cols, depth, flops)
+
+#endif // USE_COUNTERS
+
+#endif // COUNTERS_H
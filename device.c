@@ -0,0 +1,309 @@
+#include "device.h"
+
+// Device memory is handed out in power of two sizes from DEVICE_MIN_BLOCK bytes
+// up, and each size has its own list of cached blocks. The lists are kept on
+// the host, since device memory cannot hold the links.
+#define DEVICE_MIN_BLOCK 256
+#define DEVICE_BUCKETS 48
+
+typedef struct CachedBlock
+{
+	struct CachedBlock *next;
+	void *memory;
+} CachedBlock;
+
+static DeviceKind kind = DEVICE_NONE;
+static CachedBlock *cache[DEVICE_BUCKETS];
+static DeviceStats stats;
+
+// Blocks are allocated and freed, and transfers counted, from several threads.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// bucket
+// ======
+//
+// Returns the cache list that a size of block belongs to.
+//
+// Parameters:
+//   size - The number of bytes asked for.
+//
+// Return:
+//   The index of the list. The blocks in list i are DEVICE_MIN_BLOCK << i bytes.
+static unsigned int bucket(size_t size)
+{
+	unsigned int index = 0;
+
+	while (((size_t)DEVICE_MIN_BLOCK << index) < size)
+	{
+		index++;
+	}
+
+	if (index >= DEVICE_BUCKETS)
+	{
+		printf("Cannot allocate %zu bytes of device memory.\n", size);
+		exit(3);
+	}
+
+	return index;
+}
+
+// raw_alloc
+// =========
+//
+// Allocates memory from the device itself, bypassing the cache.
+//
+// Parameters:
+//   size - The number of bytes.
+//
+// Return:
+//   The memory, or NULL if the device is out of memory.
+static void *raw_alloc(size_t size)
+{
+#if USE_CUDA
+	if (kind == DEVICE_CUDA)
+	{
+		void *memory;
+		return (cudaMalloc(&memory, size) == cudaSuccess) ? memory : NULL;
+	}
+#endif
+
+	return aligned_alloc(64, size);
+}
+
+// raw_free
+// ========
+//
+// Gives memory from raw_alloc() back to the device.
+//
+// Parameters:
+//   memory - The memory.
+static void raw_free(void *memory)
+{
+#if USE_CUDA
+	if (kind == DEVICE_CUDA)
+	{
+		cudaFree(memory);
+		return;
+	}
+#endif
+
+	free(memory);
+}
+
+// release_cache
+// =============
+//
+// Gives every cached block back to the device. Must be called with the lock held.
+static void release_cache(void)
+{
+	for (unsigned int index = 0; index < DEVICE_BUCKETS; index++)
+	{
+		while (cache[index] != NULL)
+		{
+			CachedBlock *block = cache[index];
+			cache[index] = block->next;
+
+			raw_free(block->memory);
+			stats.reserved -= (size_t)DEVICE_MIN_BLOCK << index;
+			free(block);
+		}
+	}
+}
+
+// device_start
+// ============
+//
+// Selects the device that device memory is allocated on. Exits if it is not available in this build.
+//
+// Parameters:
+//   device - The device.
+void device_start(DeviceKind device)
+{
+#if !USE_CUDA
+	if (device == DEVICE_CUDA)
+	{
+		printf("numeros was compiled without CUDA. Compile it with nvcc and -DUSE_CUDA=1 to use the GPU.\n");
+		exit(3);
+	}
+#endif
+
+	kind = device;
+	memset(&stats, 0, sizeof(stats));
+}
+
+// device_stop
+// ===========
+//
+// Gives every block in the allocator's cache back to the device. Blocks still in use are not released.
+void device_stop(void)
+{
+	pthread_mutex_lock(&lock);
+	release_cache();
+	pthread_mutex_unlock(&lock);
+
+	kind = DEVICE_NONE;
+}
+
+// device_kind
+// ===========
+//
+// Returns the device given to device_start().
+//
+// Return:
+//   The device, or DEVICE_NONE if there is none.
+DeviceKind device_kind(void)
+{
+	return kind;
+}
+
+// device_alloc
+// ============
+//
+// Allocates device memory. Sizes are rounded up to a power of two, and blocks given back by device_free() are
+// cached by rounded size and handed out again, so steady state allocations never reach the device.
+//
+// Parameters:
+//   size - The number of bytes needed.
+//
+// Return:
+//   The device memory. Call device_free() when no longer needed.
+void *device_alloc(size_t size)
+{
+	unsigned int index = bucket(size);
+	size_t rounded = (size_t)DEVICE_MIN_BLOCK << index;
+
+	pthread_mutex_lock(&lock);
+
+	CachedBlock *block = cache[index];
+	if (block != NULL)
+	{
+		cache[index] = block->next;
+		stats.reuses++;
+		pthread_mutex_unlock(&lock);
+
+		void *memory = block->memory;
+		free(block);
+
+		return memory;
+	}
+
+	// A device that is out of memory may still have room once the blocks
+	// cached for other sizes are given back.
+	void *memory = raw_alloc(rounded);
+	if (memory == NULL)
+	{
+		release_cache();
+		memory = raw_alloc(rounded);
+	}
+
+	if (memory == NULL)
+	{
+		printf("The device has run out of memory :(\n");
+		exit(3);
+	}
+
+	stats.allocations++;
+	stats.reserved += rounded;
+	pthread_mutex_unlock(&lock);
+
+	return memory;
+}
+
+// device_free
+// ===========
+//
+// Gives device memory back to the allocator's cache.
+//
+// Parameters:
+//   memory - The device memory, from device_alloc().
+//     size - The size it was allocated with.
+void device_free(void *memory, size_t size)
+{
+	unsigned int index = bucket(size);
+
+	CachedBlock *block = malloc(sizeof(CachedBlock));
+	if (block == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	block->memory = memory;
+
+	pthread_mutex_lock(&lock);
+	block->next = cache[index];
+	cache[index] = block;
+	pthread_mutex_unlock(&lock);
+}
+
+// device_upload
+// =============
+//
+// Copies memory from the host to the device.
+//
+// Parameters:
+//   device - The device memory to copy into.
+//     host - The host memory to copy from.
+//     size - The number of bytes.
+void device_upload(void *device, const void *host, size_t size)
+{
+#if USE_CUDA
+	if (kind == DEVICE_CUDA)
+	{
+		cudaMemcpy(device, host, size, cudaMemcpyHostToDevice);
+	}
+	else
+#endif
+	{
+		memcpy(device, host, size);
+	}
+
+	pthread_mutex_lock(&lock);
+	stats.uploads++;
+	stats.upload_bytes += size;
+	pthread_mutex_unlock(&lock);
+}
+
+// device_download
+// ===============
+//
+// Copies memory from the device to the host.
+//
+// Parameters:
+//     host - The host memory to copy into.
+//   device - The device memory to copy from.
+//     size - The number of bytes.
+void device_download(void *host, const void *device, size_t size)
+{
+#if USE_CUDA
+	if (kind == DEVICE_CUDA)
+	{
+		cudaMemcpy(host, device, size, cudaMemcpyDeviceToHost);
+	}
+	else
+#endif
+	{
+		memcpy(host, device, size);
+	}
+
+	pthread_mutex_lock(&lock);
+	stats.downloads++;
+	stats.download_bytes += size;
+	pthread_mutex_unlock(&lock);
+}
+
+// device_stats
+// ============
+//
+// Returns the transfer and allocation counters so far.
+//
+// Return:
+//   The counters.
+DeviceStats device_stats(void)
+{
+	pthread_mutex_lock(&lock);
+	DeviceStats copy = stats;
+	pthread_mutex_unlock(&lock);
+
+	return copy;
+}
@@ -0,0 +1,124 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if USE_CUDA
+#include <cuda_runtime.h>
+#endif
+
+// DeviceKind
+// ==========
+//
+// Where device memory lives. DEVICE_EMULATED keeps it in ordinary host memory, but otherwise behaves like a GPU: data
+// only gets there by an explicit upload, and every transfer is counted. It lets residency be checked without a GPU.
+typedef enum
+{
+	DEVICE_NONE,
+	DEVICE_CUDA,
+	DEVICE_EMULATED
+} DeviceKind;
+
+// The device used when none is asked for.
+#if USE_CUDA
+#define DEVICE_DEFAULT DEVICE_CUDA
+#else
+#define DEVICE_DEFAULT DEVICE_NONE
+#endif
+
+// DeviceStats
+// ===========
+//
+// What has moved between the host and the device, and how well the allocator's cache has done.
+typedef struct
+{
+	unsigned long long uploads, upload_bytes;
+	unsigned long long downloads, download_bytes;
+	unsigned long long allocations; // Blocks the allocator had to get from the device.
+	unsigned long long reuses;      // Blocks handed out again from the cache instead.
+	size_t reserved;                // Bytes of device memory held by the allocator, in use or cached.
+} DeviceStats;
+
+	// device_start
+	// ============
+	//
+	// Selects the device that device memory is allocated on. Exits if it is not available in this build.
+	//
+	// Parameters:
+	//   device - The device.
+	void device_start(DeviceKind device);
+
+	// device_stop
+	// ===========
+	//
+	// Gives every block in the allocator's cache back to the device. Blocks still in use are not released.
+	void device_stop(void);
+
+	// device_kind
+	// ===========
+	//
+	// Returns the device given to device_start().
+	//
+	// Return:
+	//   The device, or DEVICE_NONE if there is none.
+	DeviceKind device_kind(void);
+
+	// device_alloc
+	// ============
+	//
+	// Allocates device memory. Sizes are rounded up to a power of two, and blocks given back by device_free() are
+	// cached by rounded size and handed out again, so steady state allocations never reach the device.
+	//
+	// Parameters:
+	//   size - The number of bytes needed.
+	//
+	// Return:
+	//   The device memory. Call device_free() when no longer needed.
+	void *device_alloc(size_t size);
+
+	// device_free
+	// ===========
+	//
+	// Gives device memory back to the allocator's cache.
+	//
+	// Parameters:
+	//   memory - The device memory, from device_alloc().
+	//     size - The size it was allocated with.
+	void device_free(void *memory, size_t size);
+
+	// device_upload
+	// =============
+	//
+	// Copies memory from the host to the device.
+	//
+	// Parameters:
+	//   device - The device memory to copy into.
+	//     host - The host memory to copy from.
+	//     size - The number of bytes.
+	void device_upload(void *device, const void *host, size_t size);
+
+	// device_download
+	// ===============
+	//
+	// Copies memory from the device to the host.
+	//
+	// Parameters:
+	//     host - The host memory to copy into.
+	//   device - The device memory to copy from.
+	//     size - The number of bytes.
+	void device_download(void *host, const void *device, size_t size);
+
+	// device_stats
+	// ============
+	//
+	// Returns the transfer and allocation counters so far.
+	//
+	// Return:
+	//   The counters.
+	DeviceStats device_stats(void);
+
+#endif // DEVICE_H
@@ -0,0 +1,147 @@
+#include "idx.h"
+
+// The type code IDX uses for unsigned bytes.
+#define IDX_UNSIGNED_BYTE 0x08
+
+// read_big_endian
+// ===============
+//
+// Reads a 4 byte big endian integer.
+//
+// Parameters:
+//   data - The bytes.
+//
+// Return:
+//   The integer.
+static uint32_t read_big_endian(const unsigned char *data)
+{
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+// idx_open
+// ========
+//
+// Maps an IDX file of unsigned bytes into memory and checks its header against its size. Exits if the file is
+// not one.
+//
+// Parameters:
+//   path - The path to the file.
+//
+// Return:
+//   The mapped file, or NULL if it could not be opened. Call idx_close() when no longer needed.
+IdxFile *idx_open(const char *path)
+{
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor == -1)
+	{
+		return NULL;
+	}
+
+	struct stat metadata;
+	if (fstat(descriptor, &metadata) == -1)
+	{
+		close(descriptor);
+		return NULL;
+	}
+
+	size_t size = metadata.st_size;
+	if (size < 4)
+	{
+		printf("'%s' is too short to be an IDX file.\n", path);
+		exit(6);
+	}
+
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+
+	if (mapping == MAP_FAILED)
+	{
+		printf("Could not map '%s' into memory.\n", path);
+		exit(6);
+	}
+
+	const unsigned char *bytes = mapping;
+
+	// The magic number is two zero bytes, the type of the data, and the number of dimensions.
+	if (bytes[0] != 0 || bytes[1] != 0 || bytes[3] == 0)
+	{
+		printf("'%s' is not an IDX file.\n", path);
+		exit(6);
+	}
+
+	if (bytes[2] != IDX_UNSIGNED_BYTE)
+	{
+		printf("'%s' does not hold unsigned bytes. Only unsigned byte IDX files are supported.\n", path);
+		exit(6);
+	}
+
+	IdxFile *file = malloc(sizeof(IdxFile));
+	if (file == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	file->dimensions = bytes[3];
+	size_t header_size = 4 + 4 * (size_t)file->dimensions;
+
+	if (size < header_size)
+	{
+		printf("'%s' is too short for its IDX header.\n", path);
+		exit(6);
+	}
+
+	file->item_size = 1;
+	for (unsigned int dimension = 0; dimension < file->dimensions; dimension++)
+	{
+		file->sizes[dimension] = read_big_endian(bytes + 4 + 4 * dimension);
+
+		if (dimension > 0)
+		{
+			file->item_size *= file->sizes[dimension];
+		}
+	}
+
+	file->count = file->sizes[0];
+
+	if (file->item_size > 0 && (size - header_size) / file->item_size < file->count)
+	{
+		printf("'%s' holds fewer items than its header says (%u).\n", path, file->count);
+		exit(6);
+	}
+
+	file->data = bytes + header_size;
+	file->mapping = mapping;
+	file->mapping_size = size;
+
+	return file;
+}
+
+// idx_item
+// ========
+//
+// Returns the bytes of one item of an IDX file, such as the pixels of one image or one label.
+//
+// Parameters:
+//   file - The file.
+//   item - The index of the item.
+//
+// Return:
+//   The first of the item's file->item_size bytes. Valid until idx_close().
+const unsigned char *idx_item(IdxFile *file, unsigned int item)
+{
+	return file->data + (size_t)item * file->item_size;
+}
+
+// idx_close
+// =========
+//
+// Unmaps an IDX file.
+//
+// Parameters:
+//   file - The file.
+void idx_close(IdxFile *file)
+{
+	munmap(file->mapping, file->mapping_size);
+	free(file);
+}
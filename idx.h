@@ -0,0 +1,66 @@
+#ifndef IDX_H
+#define IDX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The most dimensions an IDX file can have, by the format's one byte count.
+#define IDX_MAX_DIMENSIONS 255
+
+// IdxFile
+// =======
+//
+// An IDX file of unsigned bytes, the format of the MNIST database, mapped into memory. The items are read straight
+// out of the mapping, so opening a file costs nothing however large it is.
+typedef struct
+{
+	unsigned int count;                     // The number of items, the first dimension of the file.
+	unsigned int dimensions;                // The number of dimensions, including the first.
+	unsigned int sizes[IDX_MAX_DIMENSIONS]; // The size of each dimension.
+	size_t item_size;                       // The bytes in one item, the product of every dimension after the first.
+	const unsigned char *data;              // The first byte of the first item.
+	void *mapping;
+	size_t mapping_size;
+} IdxFile;
+
+	// idx_open
+	// ========
+	//
+	// Maps an IDX file of unsigned bytes into memory and checks its header against its size. Exits if the file is
+	// not one.
+	//
+	// Parameters:
+	//   path - The path to the file.
+	//
+	// Return:
+	//   The mapped file, or NULL if it could not be opened. Call idx_close() when no longer needed.
+	IdxFile *idx_open(const char *path);
+
+	// idx_item
+	// ========
+	//
+	// Returns the bytes of one item of an IDX file, such as the pixels of one image or one label.
+	//
+	// Parameters:
+	//   file - The file.
+	//   item - The index of the item.
+	//
+	// Return:
+	//   The first of the item's file->item_size bytes. Valid until idx_close().
+	const unsigned char *idx_item(IdxFile *file, unsigned int item);
+
+	// idx_close
+	// =========
+	//
+	// Unmaps an IDX file.
+	//
+	// Parameters:
+	//   file - The file.
+	void idx_close(IdxFile *file);
+
+#endif // IDX_H
@@ -1,137 +1,406 @@
 #include "images.h"
 
-// readint
+// The widest or tallest bitmap read_image() reads, which bounds the memory it
+// needs to IMAGE_SIZE rows of this many pixels.
+#define IMAGE_MAX_DIMENSION 65536
+
+// Files up to this size are read into a buffer on the stack rather than mapped,
+// as setting up and tearing down a mapping costs more than copying a few pages.
+// A 28x28 bitmap is under 3KB.
+#define IMAGE_READ_LIMIT 16384
+
+// The compression methods of an uncompressed bitmap, with and without masks
+// giving where each colour is in a pixel.
+#define BITMAP_RGB 0
+#define BITMAP_BITFIELDS 3
+
+// read_u16
+// ========
+//
+// Reads a 2 byte integer out of little endian data.
+//
+// Parameters:
+//   data - The little endian data.
+//
+// Return:
+//   The integer.
+static uint16_t read_u16(const unsigned char *data)
+{
+	return data[0] | (data[1] << 8);
+}
+
+// read_u32
+// ========
+//
+// Reads a 4 byte integer out of little endian data.
+//
+// Parameters:
+//   data - The little endian data.
+//
+// Return:
+//   The integer.
+static uint32_t read_u32(const unsigned char *data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// grey_row
+// ========
+//
+// Converts a row of a bitmap to greyscale. Grey pixels keep their value exactly. The loops are kept simple so that
+// the compiler vectorizes them.
+//
+// Parameters:
+//              row - The row's pixels in the file.
+//            width - The number of pixels in the row.
+//   bits_per_pixel - 8, 24 or 32.
+//          palette - The grey value of each colour of an 8 bits-per-pixel bitmap.
+//             grey - Set to the row's grey values.
+static void grey_row(const unsigned char *restrict row, unsigned int width, unsigned int bits_per_pixel, const float *restrict palette, float *restrict grey)
+{
+	if (bits_per_pixel == 8)
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			grey[x] = palette[row[x]];
+		}
+	}
+	else if (bits_per_pixel == 24)
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			grey[x] = (29 * row[3 * x] + 150 * row[3 * x + 1] + 77 * row[3 * x + 2]) * (1.0f / 256);
+		}
+	}
+	else
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			grey[x] = (29 * row[4 * x] + 150 * row[4 * x + 1] + 77 * row[4 * x + 2]) * (1.0f / 256);
+		}
+	}
+}
+
+// overlap
 // =======
 //
-// Reads either a 2 or 4 byte integer value out of big endian data.
+// Returns how much two ranges overlap.
 //
 // Parameters:
-//   bytecount - Either 2 or 4, depending on the wanted output size.
-//        data - The big ending data.
+//   first, last - The first range.
+//    start, end - The second range.
 //
 // Return:
-//  A 32 bit integer of the numer contained in data.
-static uint32_t readint(int bytecount, unsigned char* data)
+//   The length of the overlap, or 0 if there is none.
+static double overlap(double first, double last, double start, double end)
+{
+	double length = fmin(last, end) - fmax(first, start);
+	return (length > 0) ? length : 0;
+}
+
+// resample
+// ========
+//
+// Converts a bitmap's pixels to greyscale and scales them to IMAGE_SIZE by IMAGE_SIZE, averaging each output pixel
+// over the area of the bitmap it covers. Each row of the bitmap is converted once and added into a running sum for
+// every output row it covers, and the sums are only narrowed to IMAGE_SIZE columns at the end, with weights worked
+// out once per image, so the work done per bitmap pixel is a few vectorized multiply-adds.
+//
+// Parameters:
+//           pixels - The first byte of the bitmap's pixel data.
+//           stride - The number of bytes in each row of the pixel data.
+//            width - The bitmap's width.
+//             rows - The bitmap's height.
+//         top_down - Whether the first row of the pixel data is the top of the image rather than the bottom.
+//   bits_per_pixel - 8, 24 or 32.
+//          palette - The grey value of each colour of an 8 bits-per-pixel bitmap.
+//           output - Set to the scaled image.
+static void resample(const unsigned char *pixels, size_t stride, unsigned int width, unsigned int rows, bool top_down, unsigned int bits_per_pixel, const float *palette, unsigned char *output)
 {
-	if (bytecount == 4)
+	float *grey = malloc(sizeof(float) * width);
+	if (grey == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	// Bitmaps of the right size only need converting.
+	if (width == IMAGE_SIZE && rows == IMAGE_SIZE)
+	{
+		for (unsigned int y = 0; y < rows; y++)
+		{
+			grey_row(pixels + stride * (top_down ? y : rows - 1 - y), width, bits_per_pixel, palette, grey);
+
+			for (unsigned int x = 0; x < width; x++)
+			{
+				output[y * IMAGE_SIZE + x] = grey[x] + 0.5f;
+			}
+		}
+
+		free(grey);
+		return;
+	}
+
+	float *sums = calloc((size_t)IMAGE_SIZE * width, sizeof(float));
+	float *weights = malloc(sizeof(float) * (width + IMAGE_SIZE));
+	if (sums == NULL || weights == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	// The number of bitmap pixels across and down each output pixel.
+	double scale_x = (double)width / IMAGE_SIZE;
+	double scale_y = (double)rows / IMAGE_SIZE;
+
+	// The columns each output column covers, starting from first_x, and how
+	// much of each, divided by the area of an output pixel so that the weights
+	// give the average. The weights of output column out_x start at
+	// weights[first_weight[out_x]].
+	unsigned int first_x[IMAGE_SIZE], first_weight[IMAGE_SIZE], column_count[IMAGE_SIZE];
+	unsigned int weight_count = 0;
+
+	for (unsigned int out_x = 0; out_x < IMAGE_SIZE; out_x++)
+	{
+		double start = out_x * scale_x;
+		double end = (out_x + 1) * scale_x;
+
+		first_weight[out_x] = weight_count;
+		first_x[out_x] = start;
+		column_count[out_x] = 0;
+
+		for (unsigned int x = start; x < width && x < end; x++)
+		{
+			weights[weight_count++] = overlap(x, x + 1, start, end) / (scale_x * scale_y);
+			column_count[out_x]++;
+		}
+	}
+
+	for (unsigned int y = 0; y < rows; y++)
 	{
-		uint32_t value;
-		unsigned char* ptr = (unsigned char*)&value;
-		ptr[0] = data[0];
-		ptr[1] = data[1];
-		ptr[2] = data[2];
-		ptr[3] = data[3];
+		grey_row(pixels + stride * (top_down ? y : rows - 1 - y), width, bits_per_pixel, palette, grey);
+
+		for (unsigned int out_y = y / scale_y; out_y < IMAGE_SIZE && out_y * scale_y < y + 1; out_y++)
+		{
+			float weight = overlap(y, y + 1, out_y * scale_y, (out_y + 1) * scale_y);
+			float *sum = sums + (size_t)out_y * width;
 
-		return value;
+			for (unsigned int x = 0; x < width; x++)
+			{
+				sum[x] += weight * grey[x];
+			}
+		}
 	}
-	else if (bytecount == 2)
+
+	for (unsigned int out_y = 0; out_y < IMAGE_SIZE; out_y++)
 	{
-		uint16_t value;
-		unsigned char* ptr = (unsigned char*)&value;
-		ptr[0] = data[0];
-		ptr[1] = data[1];
+		const float *sum = sums + (size_t)out_y * width;
+
+		for (unsigned int out_x = 0; out_x < IMAGE_SIZE; out_x++)
+		{
+			const float *weight = weights + first_weight[out_x];
+			const float *column = sum + first_x[out_x];
+			float total = 0.5f;
 
-		return value;
+			for (unsigned int i = 0; i < column_count[out_x]; i++)
+			{
+				total += column[i] * weight[i];
+			}
+
+			output[out_y * IMAGE_SIZE + out_x] = (total >= 255) ? 255 : (total <= 0) ? 0 : (unsigned char)total;
+		}
 	}
 
-	return 0;
+	free(grey);
+	free(sums);
+	free(weights);
 }
 
-// read_image
-// ==========
+// decode
+// ======
 //
-// Reads a 24 bits-per-pixel bitmap image and returns the red values.
+// Checks a mapped bitmap's headers and resamples its pixels. See read_image().
 //
 // Parameters:
-//   path - Path to the image.
+//    bytes - The file.
+//     size - The size of the file.
+//   pixels - Set to the scaled image.
 //
 // Return:
-//   Bytes corresponding to greyscale pixel values (1 byte per pixel),
-//   left to right, then down. Call free() when this is no longer needed.
-unsigned char* read_image(char* path)
+//   IMAGE_OK, or why the bitmap could not be read.
+static ImageError decode(const unsigned char *bytes, size_t size, unsigned char *pixels)
 {
-	FILE* file = fopen(path, "rb");
-	if (file == NULL)
+	if (size < 2 || !(bytes[0] == 'B' && bytes[1] == 'M'))
 	{
-		printf("No file '%s' found.\n", path);
-		exit(5);
+		return IMAGE_NOT_BITMAP;
 	}
 
-	struct _stat metadata;
-	if (_stat(path, &metadata) == -1)
+	// The file header and a BITMAPINFOHEADER, or one of its larger successors.
+	if (size < 54)
 	{
-		printf("Error getting file metadata.\n");
-		fclose(file);
-		exit(5);
+		return IMAGE_CORRUPT;
 	}
 
-	unsigned char* bytes = (unsigned char*)malloc(metadata.st_size);
-	if (bytes == NULL)
+	uint32_t offset = read_u32(bytes + 10);
+	uint32_t header_size = read_u32(bytes + 14);
+	int32_t width = read_u32(bytes + 18);
+	int32_t height = read_u32(bytes + 22);
+	uint16_t bits_per_pixel = read_u16(bytes + 28);
+	uint32_t compression_method = read_u32(bytes + 30);
+	uint32_t colours = read_u32(bytes + 46);
+
+	if (header_size < 40)
 	{
-		printf("Computer is out of memory.\n");
-		fclose(file);
-		exit(5);
+		return IMAGE_UNSUPPORTED;
 	}
 
-	fread(bytes, 1, metadata.st_size, file);
-	fclose(file);
-
-	if (!(bytes[0] == 'B' && bytes[1] == 'M'))
+	if (width <= 0 || height == 0 || height == INT32_MIN)
 	{
-		printf("The file '%s' is not a bitmap.\n", path);
-		free(bytes);
-		exit(5);
+		return IMAGE_CORRUPT;
 	}
 
-	uint32_t width = readint(4, bytes + 18);
-	uint32_t height = readint(4, bytes + 22);
-	uint16_t bits_per_pixel = readint(2, bytes + 28);
-	uint32_t compression_method = readint(4, bytes + 30);
-	uint32_t offset = readint(4, bytes + 10);
+	// A negative height means the rows are stored top down.
+	bool top_down = height < 0;
+	uint32_t rows = top_down ? -height : height;
 
-	if (bits_per_pixel != 24)
+	if (width > IMAGE_MAX_DIMENSION || rows > IMAGE_MAX_DIMENSION)
 	{
-		printf("Only 24 bits per pixel images are supported.\n");
-		free(bytes);
-		exit(5);
+		return IMAGE_UNSUPPORTED;
 	}
 
-	if (compression_method != 0)
+	if (bits_per_pixel != 8 && bits_per_pixel != 24 && bits_per_pixel != 32)
 	{
-		printf("Only uncompressed images are supported.\n");
-		free(bytes);
-		exit(5);
+		return IMAGE_UNSUPPORTED;
 	}
 
-	if (!(width == 28 && height == 28))
+	// 32 bits-per-pixel bitmaps often give masks for their colours, which are
+	// readable as long as they are the usual ones.
+	if (compression_method == BITMAP_BITFIELDS && bits_per_pixel == 32 && size >= 66)
 	{
-		printf("The image must be 28 by 28 pixels.\n");
-		free(bytes);
-		exit(5);
+		if (read_u32(bytes + 54) != 0x00FF0000 || read_u32(bytes + 58) != 0x0000FF00 || read_u32(bytes + 62) != 0x000000FF)
+		{
+			return IMAGE_UNSUPPORTED;
+		}
 	}
-
-	unsigned int rowstride = width * 3;
-	if (rowstride & 0b11)
+	else if (compression_method != BITMAP_RGB)
 	{
-		rowstride = (rowstride + 4) & 0xFFFFFFF0;
+		return IMAGE_UNSUPPORTED;
 	}
 
-	unsigned char* output = (unsigned char*)malloc(width * height);
-	if (output == NULL)
+	// Rows are padded to a multiple of 4 bytes.
+	uint64_t stride = ((uint64_t)width * bits_per_pixel + 31) / 32 * 4;
+	if (offset > size || stride * rows > size - offset)
 	{
-		printf("Your computer is out of memory.\n");
-		free(bytes);
-		exit(5);
+		return IMAGE_CORRUPT;
 	}
 
-	for (unsigned int row = 0; row < height; row++)
+	float palette[256] = { 0 };
+	if (bits_per_pixel == 8)
 	{
-		for (unsigned int col = 0; col < width; col++)
+		uint64_t count = (colours > 0) ? colours : 256;
+		uint64_t table = 14 + (uint64_t)header_size;
+
+		if (count > 256 || table + 4 * count > offset)
+		{
+			return IMAGE_CORRUPT;
+		}
+
+		for (unsigned int colour = 0; colour < count; colour++)
 		{
-			output[(height-row-1) * width + col] = bytes[offset + row * rowstride + (col * 3)];
+			const unsigned char *entry = bytes + table + 4 * colour;
+			palette[colour] = (29 * entry[0] + 150 * entry[1] + 77 * entry[2]) * (1.0f / 256);
 		}
 	}
 
-	free(bytes);
-	return output;
-}
\ No newline at end of file
+	resample(bytes + offset, stride, width, rows, top_down, bits_per_pixel, palette, pixels);
+
+	return IMAGE_OK;
+}
+
+// read_image
+// ==========
+//
+// Reads an uncompressed 8, 24 or 32 bits-per-pixel bitmap of any size, bottom up or top down, and scales it to
+// IMAGE_SIZE by IMAGE_SIZE greyscale pixels. Large files are mapped rather than read, and each pixel is converted
+// and averaged into the pixels it covers as it is visited.
+//
+// Parameters:
+//     path - Path to the image.
+//   pixels - Set to IMAGE_SIZE * IMAGE_SIZE greyscale pixel values, left to right, then down, with 0 as black.
+//
+// Return:
+//   IMAGE_OK, or why the image could not be read, in which case pixels is left alone.
+ImageError read_image(const char *path, unsigned char *pixels)
+{
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor == -1)
+	{
+		return IMAGE_NOT_FOUND;
+	}
+
+	struct stat metadata;
+	if (fstat(descriptor, &metadata) == -1 || !S_ISREG(metadata.st_mode))
+	{
+		close(descriptor);
+		return IMAGE_NOT_FOUND;
+	}
+
+	size_t size = metadata.st_size;
+	if (size < 2)
+	{
+		close(descriptor);
+		return IMAGE_NOT_BITMAP;
+	}
+
+	if (size <= IMAGE_READ_LIMIT)
+	{
+		unsigned char buffer[IMAGE_READ_LIMIT];
+		ImageError error = (read(descriptor, buffer, size) == (ssize_t)size) ? decode(buffer, size, pixels) : IMAGE_CORRUPT;
+
+		close(descriptor);
+		return error;
+	}
+
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+
+	if (mapping == MAP_FAILED)
+	{
+		return IMAGE_NOT_FOUND;
+	}
+
+	ImageError error = decode(mapping, size, pixels);
+
+	munmap(mapping, size);
+
+	return error;
+}
+
+// image_error
+// ===========
+//
+// Describes an ImageError.
+//
+// Parameters:
+//   error - The error.
+//
+// Return:
+//   The description, in lower case without a full stop.
+const char *image_error(ImageError error)
+{
+	switch (error)
+	{
+	case IMAGE_OK:
+		return "no error";
+	case IMAGE_NOT_FOUND:
+		return "the file could not be opened";
+	case IMAGE_NOT_BITMAP:
+		return "the file is not a bitmap";
+	case IMAGE_UNSUPPORTED:
+		return "only uncompressed 8, 24 and 32 bits-per-pixel bitmaps up to 65536 pixels across are supported";
+	case IMAGE_CORRUPT:
+		return "the bitmap is corrupt";
+	}
+
+	return "unknown error";
+}
@@ -3,20 +3,56 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/stat.h>
+#include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The width and height of the images the model classifies.
+#define IMAGE_SIZE 28
+
+// ImageError
+// ==========
+//
+// Why read_image() could not read an image.
+typedef enum
+{
+	IMAGE_OK = 0,
+	IMAGE_NOT_FOUND,   // The file could not be opened.
+	IMAGE_NOT_BITMAP,  // The file is not a bitmap.
+	IMAGE_UNSUPPORTED, // The bitmap is compressed, too large, or not 8, 24 or 32 bits per pixel.
+	IMAGE_CORRUPT      // The bitmap's headers do not fit the file.
+} ImageError;
 
 	// read_image
 	// ==========
 	//
-	// Reads a 24 bits-per-pixel bitmap image and returns the red values.
+	// Reads an uncompressed 8, 24 or 32 bits-per-pixel bitmap of any size, bottom up or top down, and scales it to
+	// IMAGE_SIZE by IMAGE_SIZE greyscale pixels. Large files are mapped rather than read, and each pixel is
+	// converted and averaged into the pixels it covers as it is visited.
+	//
+	// Parameters:
+	//     path - Path to the image.
+	//   pixels - Set to IMAGE_SIZE * IMAGE_SIZE greyscale pixel values, left to right, then down, with 0 as black.
+	//
+	// Return:
+	//   IMAGE_OK, or why the image could not be read, in which case pixels is left alone.
+	ImageError read_image(const char *path, unsigned char *pixels);
+
+	// image_error
+	// ===========
+	//
+	// Describes an ImageError.
 	//
 	// Parameters:
-	//   path - Path to the image.
+	//   error - The error.
 	//
 	// Return:
-	//   Bytes corresponding to greyscale pixel values (1 byte per pixel),
-	//   left to right, then down. Call free() when this is no longer needed.
-	unsigned char* read_image(char* path);
+	//   The description, in lower case without a full stop.
+	const char *image_error(ImageError error);
 
-#endif // IMAGES_H
\ No newline at end of file
+#endif // IMAGES_H
@@ -1,270 +1,1972 @@
-#include "linalg.h"
+#include "backend.h"
 
 #if USE_CUDA
-cublasHandle_t cublas;
+// A cuBLAS handle must not be used by two threads at once, and the shards of a
+// training batch multiply from every thread of the pool.
+static cublasHandle_t cublas;
+static pthread_mutex_t cublas_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-// matrix_move_to_gpu
-// ==================
+// idx
+// ===
+//
+// Returns the offset of the data at (row,col) in a matrix.
+//
+// Parameters:
+//   this - The matrix containing the data.
+//    row - The row.
+//    col - The column.
+//
+// Return:
+//   The offset (array index) of the position (row,col).
+static unsigned int idx(Matrix *this, double row, double col)
+{
+	return this->rows * col + row;
+}
+
+// Matrices allocated from an arena are carved out of a chain of blocks. Blocks past
+// the current one are kept after a reset and reused before new ones are allocated.
+#define ARENA_ALIGNMENT 64
+
+typedef struct ArenaBlock
+{
+	struct ArenaBlock *next;
+	size_t capacity, used;
+	_Alignas(ARENA_ALIGNMENT) unsigned char data[];
+} ArenaBlock;
+
+struct MatrixArena
+{
+	ArenaBlock *first, *current;
+	size_t capacity, used, peak;
+};
+
+// The arena and the precision matrix_new() uses are set per thread, so that
+// one thread's arena never hands out memory to another.
+static _Thread_local MatrixArena *current_arena;
+
+// arena_block_new
+// ===============
 //
-// Moves memory from a matrix's data into GPU dedicated memory.
+// Allocates an empty arena block.
 //
 // Parameters:
-//   matrix: The matrix whose data is to be moved.
+//   capacity - The number of usable bytes in the block.
 //
 // Return:
-//   The pointer to the GPU device's memory location.
-double *matrix_move_to_gpu(Matrix *matrix)
+//   The block.
+static ArenaBlock *arena_block_new(size_t capacity)
 {
-	double *gpu;
-	int size = sizeof(double) * matrix->rows * matrix->cols;
-	cublasStatus_t status = cudaMalloc(&gpu, size);
+	capacity = (capacity + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
 
-	if (status != CUBLAS_STATUS_SUCCESS)
+	ArenaBlock *block = aligned_alloc(ARENA_ALIGNMENT, sizeof(ArenaBlock) + capacity);
+	if (block == NULL)
 	{
-		printf("Cublas reported an error.\n");
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
 	}
 
-	cudaMemcpy(gpu, matrix->data, size, cudaMemcpyHostToDevice);
+	block->next = NULL;
+	block->capacity = capacity;
+	block->used = 0;
 
-	return gpu;
+	return block;
 }
-#endif
 
-// idx
-// ===
+// arena_alloc
+// ===========
 //
-// Returns the offset of the data at (row,col) in a matrix.
+// Takes a 64 byte aligned piece of memory from an arena, moving on to the next block when the current one is full.
 //
 // Parameters:
-//   this - The matrix containing the data.
-//    row - The row.
-//    col - The column.
+//   arena - The arena.
+//    size - The number of bytes needed.
 //
 // Return:
-//   The offset (array index) of the position (row,col).
-static unsigned int idx(Matrix *this, double row, double col)
+//   The memory, which stays valid until the arena is reset.
+static void *arena_alloc(MatrixArena *arena, size_t size)
 {
-	return this->rows * col + row;
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+	ArenaBlock *block = arena->current;
+	while (block->used + size > block->capacity)
+	{
+		if (block->next == NULL || block->next->capacity < size)
+		{
+			ArenaBlock *fresh = arena_block_new((size > arena->capacity) ? size : arena->capacity);
+			fresh->next = block->next;
+			block->next = fresh;
+		}
+
+		block = block->next;
+		block->used = 0;
+	}
+
+	arena->current = block;
+
+	void *memory = block->data + block->used;
+	block->used += size;
+
+	arena->used += size;
+	if (arena->used > arena->peak)
+	{
+		arena->peak = arena->used;
+	}
+
+	return memory;
+}
+
+static _Thread_local MatrixPrecision current_precision = MATRIX_F64;
+
+// element_size
+// ============
+//
+// Returns the size in bytes of one element of a given precision.
+//
+// Parameters:
+//   precision - The precision.
+//
+// Return:
+//   The size of an element.
+static size_t element_size(MatrixPrecision precision)
+{
+	return (precision == MATRIX_F32) ? sizeof(float) : sizeof(double);
+}
+
+// data_size
+// =========
+//
+// Returns the size in bytes of the elements of a matrix.
+//
+// Parameters:
+//   this - The matrix.
+//
+// Return:
+//   The size of the matrix's data.
+static size_t data_size(Matrix *this)
+{
+	return element_size(this->precision) * this->rows * this->cols;
+}
+
+// Every heap matrix is counted as it is made and freed, overall and by shape, so
+// that matrix_memory_report() can say where memory goes and matrix_shutdown()
+// can check that nothing leaked. Shapes past the first MEMORY_SHAPES are only
+// counted overall.
+#define MEMORY_SHAPES 64
+
+typedef struct
+{
+	unsigned int rows, cols;
+	MatrixPrecision precision;
+	bool borrowed;
+	unsigned long long allocations, live;
+} MemoryShape;
+
+static MatrixMemoryStats memory;
+static MemoryShape memory_shapes[MEMORY_SHAPES];
+static unsigned int memory_shape_count;
+static double memory_start;
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// memory_count
+// ============
+//
+// Counts a heap matrix being made or freed.
+//
+// Parameters:
+//        this - The matrix.
+//   allocated - Whether it was made rather than freed.
+static void memory_count(Matrix *this, bool allocated)
+{
+	size_t bytes = (this->borrowed) ? 0 : data_size(this);
+
+	pthread_mutex_lock(&memory_lock);
+
+	if (allocated)
+	{
+		memory.allocations++;
+		memory.live++;
+		memory.allocated_bytes += bytes;
+		memory.live_bytes += bytes;
+
+		if (memory.live_bytes > memory.peak_bytes)
+		{
+			memory.peak_bytes = memory.live_bytes;
+		}
+	}
+	else
+	{
+		memory.frees++;
+		memory.live--;
+		memory.live_bytes -= bytes;
+	}
+
+	MemoryShape *shape = NULL;
+	for (unsigned int i = 0; i < memory_shape_count && shape == NULL; i++)
+	{
+		MemoryShape *other = &memory_shapes[i];
+
+		if (other->rows == this->rows && other->cols == this->cols && other->precision == this->precision && other->borrowed == this->borrowed)
+		{
+			shape = other;
+		}
+	}
+
+	if (shape == NULL && allocated && memory_shape_count < MEMORY_SHAPES)
+	{
+		shape = &memory_shapes[memory_shape_count++];
+		*shape = (MemoryShape){ this->rows, this->cols, this->precision, this->borrowed, 0, 0 };
+	}
+
+	if (shape != NULL)
+	{
+		shape->allocations += allocated;
+		shape->live += (allocated) ? 1 : -1;
+	}
+
+	pthread_mutex_unlock(&memory_lock);
 }
 
-// mymax
-// =====
+// compare_shapes
+// ==============
 //
-// Returns the maximum of two numbers.
+// Orders shapes by the bytes their matrices have allocated, most first, for qsort().
 //
 // Parameters:
-//   a - The first number.
-//   b - The second number.
+//   a - The first shape.
+//   b - The second shape.
 //
 // Return:
-//   The larger of a or b.
-static double mymax(double a, double b)
+//   Less than, equal to or greater than 0 as a comes before, with or after b.
+static int compare_shapes(const void *a, const void *b)
+{
+	const MemoryShape *x = a, *y = b;
+	double x_bytes = (x->borrowed) ? 0 : (double)element_size(x->precision) * x->rows * x->cols * x->allocations;
+	double y_bytes = (y->borrowed) ? 0 : (double)element_size(y->precision) * y->rows * y->cols * y->allocations;
+
+	return (x_bytes < y_bytes) - (x_bytes > y_bytes);
+}
+
+// print_shapes
+// ============
+//
+// Prints a table of the shapes of matrices made, sorted by the bytes they allocated. Hold memory_lock.
+//
+// Parameters:
+//   live_only - Whether to only print shapes with matrices still live.
+static void print_shapes(bool live_only)
+{
+	qsort(memory_shapes, memory_shape_count, sizeof(MemoryShape), compare_shapes);
+
+	fprintf(stderr, "  %-12s %-12s %12s %8s %12s\n", "shape", "elements", "allocations", "live", "bytes each");
+
+	for (unsigned int i = 0; i < memory_shape_count; i++)
+	{
+		MemoryShape *shape = &memory_shapes[i];
+		if (live_only && shape->live == 0)
+		{
+			continue;
+		}
+
+		char size[32];
+		snprintf(size, sizeof(size), "%ux%u", shape->rows, shape->cols);
+
+		fprintf(stderr, "  %-12s %-12s %12llu %8llu %12zu\n", size,
+			(shape->borrowed) ? "wrapped" : (shape->precision == MATRIX_F32) ? "f32" : "f64",
+			shape->allocations, shape->live, (shape->borrowed) ? 0 : element_size(shape->precision) * shape->rows * shape->cols);
+	}
+
+	if (memory_shape_count == MEMORY_SHAPES)
+	{
+		fprintf(stderr, "  Shapes past the first %u are only counted in the totals.\n", MEMORY_SHAPES);
+	}
+}
+
+// check_leaks
+// ===========
+//
+// Reports heap matrices that were never freed, by shape, on stderr.
+static void check_leaks(void)
+{
+	pthread_mutex_lock(&memory_lock);
+
+	if (memory.live > 0)
+	{
+		fflush(stdout);
+		fprintf(stderr, "Leak check: %llu matrices holding %.2lfMB were never freed.\n", memory.live, memory.live_bytes / 1e6);
+		print_shapes(true);
+	}
+
+	pthread_mutex_unlock(&memory_lock);
+}
+
+// host_read
+// =========
+//
+// Brings the data of a matrix up to date with its device buffer before it is read on the CPU.
+//
+// Parameters:
+//   this - The matrix.
+static void host_read(Matrix *this)
+{
+	if (this->host_stale)
+	{
+		device_download(this->data, this->device, data_size(this));
+		this->host_stale = false;
+	}
+}
+
+// host_write
+// ==========
+//
+// Records that the data of a matrix has been overwritten on the CPU, so its device buffer is out of date.
+//
+// Parameters:
+//   this - The matrix.
+static void host_write(Matrix *this)
+{
+	this->host_stale = false;
+	this->device_stale = (this->device != NULL);
+}
+
+// The backends matrix_init() can choose from, the first being the default.
+static const MatrixBackend *backends[] =
+{
+	&backend_cpu,
+	&backend_reference,
+#if USE_BLAS
+	&backend_blas,
+#endif
+};
+
+// The chosen backend, with the functions it leaves out taken from backend_cpu.
+static MatrixBackend backend;
+
+// choose_backend
+// ==============
+//
+// Looks up a backend by name and makes it the one the matrix operations use. Exits if there is no such backend.
+//
+// Parameters:
+//   name - The name of the backend.
+static void choose_backend(const char *name)
 {
-	return (a>b) * a + (a<=b) * b;
+	const MatrixBackend *chosen = NULL;
+	unsigned int count = sizeof(backends) / sizeof(backends[0]);
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (strcmp(backends[i]->name, name) == 0)
+		{
+			chosen = backends[i];
+		}
+	}
+
+	if (chosen == NULL)
+	{
+		printf("Unknown backend '%s'. This build has:", name);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			printf(" %s", backends[i]->name);
+		}
+		printf(".\n");
+		exit(1);
+	}
+
+	backend = *chosen;
+
+	// Start and stop are particular to each backend, so they are not filled in.
+#define FILL(function) if (backend.function == NULL) backend.function = backend_cpu.function
+	FILL(gemm);
+	FILL(elementwise_multiply);
+	FILL(relu);
+	FILL(drelu);
+	FILL(drelu_multiply);
+	FILL(subtract);
+	FILL(multiply_scalar);
+	FILL(sum);
+	FILL(add_to_rows);
+	FILL(sum_rows);
+	FILL(transpose);
+	FILL(softmax);
+	FILL(gather_bytes);
+	FILL(sparse_dense);
+	FILL(sparse_multiply_t);
+	FILL(pruned_dense);
+	FILL(softmax_cross_entropy);
+#undef FILL
 }
 
 // matrix_init
 // ===========
 //
-// Must be called before using any of the matrix operations.
-void matrix_init(void)
+// Must be called before using any of the matrix operations. Starts the thread pool that matrix operations are spread
+// over, the backend that computes them, and the device that matrix multiplications run on, if any.
+//
+// Parameters:
+//   threads - The number of threads, or 0 to use the NUMEROS_THREADS environment variable, falling back to the
+//             number of online processors.
+//    device - The device to multiply on, or DEVICE_NONE to multiply on the CPU. On DEVICE_EMULATED the
+//             multiplications run with the backend, but their operands go through counted uploads and downloads
+//             as they would on a GPU.
+//      name - The name of the backend, or NULL to use the NUMEROS_BACKEND environment variable, falling back to
+//             "cpu". See matrix_backends().
+void matrix_init(unsigned int threads, DeviceKind device, const char *name)
 {
 	//srand(time(NULL));
 
+	if (name == NULL)
+	{
+		name = getenv("NUMEROS_BACKEND");
+	}
+
+	choose_backend((name != NULL && name[0] != '\0') ? name : backends[0]->name);
+
+	device_start(device);
+
 #if USE_CUDA
-	cublasCreate(&cublas);
+	if (device == DEVICE_CUDA)
+	{
+		cublasCreate(&cublas);
+	}
+#endif
+
+	threadpool_start(threads);
+	memory_start = threadpool_seconds();
+
+	if (backend.start != NULL)
+	{
+		backend.start();
+	}
+
+#if USE_COUNTERS
+	counters_start();
 #endif
 }
 
-// matrix_new
-// ==========
+// matrix_shutdown
+// ===============
+//
+// Stops the thread pool, the backend and the device, and releases what matrix_init() allocated. No matrix operations
+// may be used afterwards.
+void matrix_shutdown(void)
+{
+	check_leaks();
+
+#if USE_CUDA
+	if (device_kind() == DEVICE_CUDA)
+	{
+		cublasDestroy(cublas);
+	}
+#endif
+
+#if USE_COUNTERS
+	counters_stop();
+#endif
+
+	device_stop();
+
+	if (backend.stop != NULL)
+	{
+		backend.stop();
+	}
+
+	threadpool_stop();
+}
+
+// matrix_backend
+// ==============
+//
+// Returns the name of the backend given to matrix_init().
+//
+// Return:
+//   The name.
+const char *matrix_backend(void)
+{
+	return backend.name;
+}
+
+// matrix_backends
+// ===============
 //
-// Allocates space and initializes a new 2D matrix.
+// Returns the names of the backends in this build: "cpu", the cache blocked kernels spread over the thread pool,
+// "reference", plain loops that compute in double precision, and "blas", the system's CBLAS library, when compiled
+// with USE_BLAS. The first is the default.
 //
 // Parameters:
-//   rows - The number of rows the matrix has.
-//   cols - The number of columns the matrix has.
+//   count - Set to the number of backends.
 //
 // Return:
-//   The matrix. Call matrix_free() when no longer needed.
-Matrix *matrix_new(unsigned int rows, unsigned int cols)
+//   The names.
+const char *const *matrix_backends(unsigned int *count)
 {
-	Matrix *this = malloc(sizeof(Matrix));
-
-	this->rows = rows;
-	this->cols = cols;
-	this->data = malloc(sizeof(double) * rows * cols);
+	static const char *names[sizeof(backends) / sizeof(backends[0])];
 
-	if (this->data == NULL)
+	*count = sizeof(backends) / sizeof(backends[0]);
+	for (unsigned int i = 0; i < *count; i++)
 	{
-		printf("Your computer has run out of memory :(\n");
-		exit(3);
+		names[i] = backends[i]->name;
 	}
 
-	return this;
+	return names;
 }
 
-// matrix_new_from_data
+// matrix_use_precision
 // ====================
 //
-// Creates a 2D matrix from preexising data.
+// Sets the precision of the matrices created by matrix_new() on the calling thread. Matrices start out as
+// MATRIX_F64 on every thread.
 //
 // Parameters:
-//   rows - The number of rows the matrix has.
-//   cols - The number of columns the matrix has.
-//   data - The left to right then down data of the matrix. The matrix takes ownership of this data.
+//   precision - The precision.
 //
 // Return:
-//   The matrix. Call matrix_free() when no longer needed.
-Matrix *matrix_new_from_data(unsigned int rows, unsigned int cols, double *data)
+//   The precision that was in use before.
+MatrixPrecision matrix_use_precision(MatrixPrecision precision)
 {
-	Matrix *this = malloc(sizeof(Matrix));
-
-	this->rows = rows;
-	this->cols = cols;
-	this->data = data;
+	MatrixPrecision previous = current_precision;
+	current_precision = precision;
 
-	return this;
+	return previous;
 }
 
-// matrix_free
-// ===========
+// matrix_element_size
+// ===================
 //
-// Releases the resources used by a matrix.
+// Returns the size in bytes of one element of a matrix.
 //
 // Parameters:
 //   this - The matrix.
-void matrix_free(Matrix *this)
+//
+// Return:
+//   The size of an element.
+size_t matrix_element_size(Matrix *this)
 {
-	free(this->data);
-	free(this);
+	return element_size(this->precision);
 }
 
-// matrix_set
+// matrix_new
 // ==========
 //
-// Sets a value in a matrix.
+// Allocates space and initializes a new 2D matrix, from the arena given to matrix_arena_use() if there is one.
+// The matrix has the precision given to matrix_use_precision().
 //
 // Parameters:
-//    this - The matrix.
-//     row - The row.
-//     col - The column.
-//   value - The value to set the element to.
-void matrix_set(Matrix *this, unsigned int row, unsigned int col, double value)
+//   rows - The number of rows the matrix has.
+//   cols - The number of columns the matrix has.
+//
+// Return:
+//   The matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_new(unsigned int rows, unsigned int cols)
 {
-	this->data[idx(this, row, col)] = value;
+	PROFILE_SCOPE("matrix_new");
+
+	size_t size = element_size(current_precision) * rows * cols;
+
+	if (current_arena != NULL)
+	{
+		Matrix *this = arena_alloc(current_arena, sizeof(Matrix));
+
+		this->rows = rows;
+		this->cols = cols;
+		this->precision = current_precision;
+		this->data = arena_alloc(current_arena, size);
+		this->arena = current_arena;
+		this->borrowed = false;
+		this->device = NULL;
+		this->host_stale = false;
+		this->device_stale = false;
+
+		return this;
+	}
+
+	Matrix *this = malloc(sizeof(Matrix));
+
+	this->rows = rows;
+	this->cols = cols;
+	this->precision = current_precision;
+	this->data = malloc(size);
+	this->arena = NULL;
+	this->borrowed = false;
+	this->device = NULL;
+	this->host_stale = false;
+	this->device_stale = false;
+
+	if (this->data == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	memory_count(this, true);
+
+	return this;
+}
+
+// matrix_arena_new
+// ================
+//
+// Creates an arena that matrix_new() can allocate from while it is in use.
+//
+// Parameters:
+//   capacity - The size in bytes of each block.
+//
+// Return:
+//   The arena. Call matrix_arena_free() when no longer needed.
+MatrixArena *matrix_arena_new(size_t capacity)
+{
+	MatrixArena *arena = malloc(sizeof(MatrixArena));
+	if (arena == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	arena->capacity = capacity;
+	arena->first = arena_block_new(capacity);
+	arena->current = arena->first;
+	arena->used = 0;
+	arena->peak = 0;
+
+	return arena;
+}
+
+// matrix_arena_free
+// =================
+//
+// Releases an arena and every matrix allocated from it.
+//
+// Parameters:
+//   arena - The arena.
+void matrix_arena_free(MatrixArena *arena)
+{
+	if (current_arena == arena)
+	{
+		current_arena = NULL;
+	}
+
+	size_t peak = matrix_arena_peak(arena);
+
+	pthread_mutex_lock(&memory_lock);
+	memory.arenas++;
+	if (peak > memory.arena_peak_bytes)
+	{
+		memory.arena_peak_bytes = peak;
+	}
+	pthread_mutex_unlock(&memory_lock);
+
+	ArenaBlock *block = arena->first;
+	while (block != NULL)
+	{
+		ArenaBlock *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	free(arena);
+}
+
+// matrix_arena_use
+// ================
+//
+// Makes matrix_new() on the calling thread allocate from an arena, or from the heap again when given NULL. Other
+// threads keep their own arena, so an arena must only be used, reset and freed by one thread at a time.
+//
+// Parameters:
+//   arena - The arena, or NULL.
+//
+// Return:
+//   The arena that was in use before, or NULL.
+MatrixArena *matrix_arena_use(MatrixArena *arena)
+{
+	MatrixArena *previous = current_arena;
+	current_arena = arena;
+
+	return previous;
+}
+
+// matrix_arena_reset
+// ==================
+//
+// Releases every matrix allocated from an arena at once. The arena keeps its blocks for reuse.
+//
+// Parameters:
+//   arena - The arena.
+void matrix_arena_reset(MatrixArena *arena)
+{
+	arena->current = arena->first;
+	arena->current->used = 0;
+	arena->used = 0;
+}
+
+// matrix_arena_peak
+// =================
+//
+// Returns the most bytes that have been in use at once in an arena.
+//
+// Parameters:
+//   arena - The arena.
+//
+// Return:
+//   The peak usage in bytes.
+size_t matrix_arena_peak(MatrixArena *arena)
+{
+	return arena->peak;
+}
+
+// matrix_memory_stats
+// ===================
+//
+// Returns how many matrices have been made and freed, and how much memory they hold.
+//
+// Return:
+//   The counters.
+MatrixMemoryStats matrix_memory_stats(void)
+{
+	double now = threadpool_seconds();
+
+	pthread_mutex_lock(&memory_lock);
+	MatrixMemoryStats stats = memory;
+	pthread_mutex_unlock(&memory_lock);
+
+	stats.seconds = now - memory_start;
+
+	return stats;
+}
+
+// matrix_memory_report
+// ====================
+//
+// Prints the counters of matrix_memory_stats() to stderr, with the allocation rate, the peak of the fullest arena,
+// and a table of how many matrices of each shape have been made and are still live, most bytes first.
+void matrix_memory_report(void)
+{
+	MatrixMemoryStats stats = matrix_memory_stats();
+	fflush(stdout);
+
+	fprintf(stderr, "Matrices: %llu made (%.2lfMB) and %llu freed in %.2lfs, %.1lf per second. Peak %.2lfMB, "
+		"%llu still live (%.2lfMB).\n", stats.allocations, stats.allocated_bytes / 1e6, stats.frees, stats.seconds,
+		(stats.seconds > 0) ? stats.allocations / stats.seconds : 0.0, stats.peak_bytes / 1e6, stats.live,
+		stats.live_bytes / 1e6);
+
+	if (stats.arenas > 0)
+	{
+		fprintf(stderr, "Arenas: %llu freed, the fullest holding %zu bytes at its peak.\n", stats.arenas, stats.arena_peak_bytes);
+	}
+
+	pthread_mutex_lock(&memory_lock);
+	print_shapes(false);
+	pthread_mutex_unlock(&memory_lock);
+}
+
+// matrix_new_from_data
+// ====================
+//
+// Creates a 2D MATRIX_F64 matrix from preexising data.
+//
+// Parameters:
+//   rows - The number of rows the matrix has.
+//   cols - The number of columns the matrix has.
+//   data - The left to right then down data of the matrix. The matrix takes ownership of this data.
+//
+// Return:
+//   The matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_new_from_data(unsigned int rows, unsigned int cols, double *data)
+{
+	Matrix *this = malloc(sizeof(Matrix));
+
+	this->rows = rows;
+	this->cols = cols;
+	this->precision = MATRIX_F64;
+	this->data = data;
+	this->arena = NULL;
+	this->borrowed = false;
+	this->device = NULL;
+	this->host_stale = false;
+	this->device_stale = false;
+
+	memory_count(this, true);
+
+	return this;
+}
+
+// matrix_wrap
+// ===========
+//
+// Creates a matrix over memory it does not own, such as a tensor mapped from a model file, without copying it.
+// matrix_free() releases the matrix but leaves the memory alone. Read only memory must only be read from.
+//
+// Parameters:
+//        rows - The number of rows the matrix has.
+//        cols - The number of columns the matrix has.
+//   precision - The precision of the elements.
+//        data - The column major elements, which must outlive the matrix.
+//
+// Return:
+//   The matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_wrap(unsigned int rows, unsigned int cols, MatrixPrecision precision, const void *data)
+{
+	Matrix *this = malloc(sizeof(Matrix));
+	if (this == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	this->rows = rows;
+	this->cols = cols;
+	this->precision = precision;
+	this->data = (double*)data;
+	this->arena = NULL;
+	this->borrowed = true;
+	this->device = NULL;
+	this->host_stale = false;
+	this->device_stale = false;
+
+	memory_count(this, true);
+
+	return this;
+}
+
+// matrix_free
+// ===========
+//
+// Releases the resources used by a matrix. Matrices allocated from an arena are released by matrix_arena_reset()
+// instead, so this does nothing for them.
+//
+// Parameters:
+//   this - The matrix.
+void matrix_free(Matrix *this)
+{
+	PROFILE_SCOPE("matrix_free");
+
+	if (this->arena != NULL)
+	{
+		return;
+	}
+
+	memory_count(this, false);
+
+	if (this->device != NULL)
+	{
+		device_free(this->device, data_size(this));
+	}
+
+	if (!this->borrowed)
+	{
+		free(this->data);
+	}
+
+	free(this);
+}
+
+// matrix_keep_on_device
+// =====================
+//
+// Gives a matrix its own buffer on the device, which stays there until matrix_free(). The matrix then keeps track of
+// whether its data or its device buffer is newer, and is only copied across when the other side is out of date. A
+// matrix used on the device without one is uploaded to a temporary buffer every time. Does nothing without a device.
+//
+// Parameters:
+//   this - The matrix. Must not be from an arena.
+void matrix_keep_on_device(Matrix *this)
+{
+	if (device_kind() == DEVICE_NONE || this->device != NULL)
+	{
+		return;
+	}
+
+	if (this->arena != NULL)
+	{
+		printf("Matrices allocated from an arena cannot be kept on the device.\n");
+		exit(1);
+	}
+
+	this->device = device_alloc(data_size(this));
+	this->host_stale = false;
+	this->device_stale = true;
+}
+
+// matrix_upload
+// =============
+//
+// Brings the device buffer of a matrix given to matrix_keep_on_device() up to date now, rather than when it is next
+// used on the device. This moves the upload to a convenient thread, such as before the matrix is shared by several.
+//
+// Parameters:
+//   this - The matrix.
+void matrix_upload(Matrix *this)
+{
+	PROFILE_SCOPE("matrix_upload");
+
+	if (this->device_stale)
+	{
+		device_upload(this->device, this->data, data_size(this));
+		this->device_stale = false;
+	}
+}
+
+// matrix_set
+// ==========
+//
+// Sets a value in a matrix.
+//
+// Parameters:
+//    this - The matrix.
+//     row - The row.
+//     col - The column.
+//   value - The value to set the element to.
+void matrix_set(Matrix *this, unsigned int row, unsigned int col, double value)
+{
+	host_read(this);
+	host_write(this);
+
+	if (this->precision == MATRIX_F32)
+	{
+		this->fdata[idx(this, row, col)] = value;
+	}
+	else
+	{
+		this->data[idx(this, row, col)] = value;
+	}
+}
+
+// matrix_get
+// ==========
+//
+// Gets a value from a matrix.
+//
+// Parameters:
+//   this - The matrix.
+//    row - The row.
+//    col - The column.
+//
+// Return:
+//   The value in the matrix.
+double matrix_get(Matrix *this, unsigned int row, unsigned int col)
+{
+	host_read(this);
+
+	if (this->precision == MATRIX_F32)
+	{
+		return this->fdata[idx(this, row, col)];
+	}
+
+	return this->data[idx(this, row, col)];
+}
+
+// check_output
+// ============
+//
+// Exits if a preallocated output matrix does not have the expected size and precision.
+//
+// Parameters:
+//      output - The output matrix.
+//        rows - The expected number of rows.
+//        cols - The expected number of columns.
+//   precision - The expected precision.
+static void check_output(Matrix *output, unsigned int rows, unsigned int cols, MatrixPrecision precision)
+{
+	if (output->rows != rows || output->cols != cols)
+	{
+		printf("Output matrix has the wrong size: expected (%u,%u), got (%u,%u).\n", rows, cols, output->rows, output->cols);
+		exit(1);
+	}
+
+	if (output->precision != precision)
+	{
+		printf("Output matrix has the wrong precision.\n");
+		exit(1);
+	}
+}
+
+// check_precision
+// ===============
+//
+// Exits if two matrices do not have the same precision.
+//
+// Parameters:
+//    this - The first matrix.
+//   other - The second matrix.
+static void check_precision(Matrix *this, Matrix *other)
+{
+	if (this->precision != other->precision)
+	{
+		printf("Cannot combine matrices of different precisions.\n");
+		exit(1);
+	}
+}
+
+// matrix_columns
+// ==============
+//
+// Returns a view of some of the columns of a matrix, sharing its data. Writing to the view writes to the matrix.
+// The view lives on the stack and must not be passed to matrix_free(). The view of a matrix kept on the device
+// shares its device buffer as well, but only the matrix itself knows which copy is newer, so such a view should only
+// be read from.
+//
+// Parameters:
+//    this - The matrix.
+//   first - The first column of the view.
+//   count - The number of columns in the view.
+//
+// Return:
+//   The view.
+Matrix matrix_columns(Matrix *this, unsigned int first, unsigned int count)
+{
+	if (first > this->cols || count > this->cols - first)
+	{
+		printf("Cannot view columns %u to %u of a matrix with %u columns.\n", first, first + count, this->cols);
+		exit(1);
+	}
+
+	Matrix view = *this;
+	view.cols = count;
+
+	if (this->precision == MATRIX_F32)
+	{
+		view.fdata = this->fdata + (size_t)first * this->rows;
+	}
+	else
+	{
+		view.data = this->data + (size_t)first * this->rows;
+	}
+
+	if (this->device != NULL)
+	{
+		view.device = (char*)this->device + element_size(this->precision) * first * this->rows;
+	}
+
+	return view;
+}
+
+// matrix_gather_bytes_into
+// ========================
+//
+// Fills each column of a preallocated matrix from a run of bytes, such as the pixels of one image, multiplied by a
+// scale. This is how raw data is turned into a batch without going element by element through matrix_set().
+//
+// Parameters:
+//    output - The matrix to fill. Each of its columns takes output->rows bytes.
+//     bytes - The runs of bytes, one after the other.
+//   columns - The index of the run to copy into each column, or NULL to copy the first output->cols runs in order.
+//     scale - The value each byte is multiplied by.
+void matrix_gather_bytes_into(Matrix *output, const unsigned char *bytes, const unsigned int *columns, double scale)
+{
+	PROFILE_SCOPE("matrix_gather_bytes");
+	COUNTERS_SCOPE("matrix_gather_bytes", output->rows, output->cols, 0, (double)output->rows * output->cols);
+
+	host_write(output);
+
+	backend.gather_bytes(output->precision, output->rows, output->cols, output->data, bytes, columns, scale);
+}
+
+// host_multiply
+// =============
+//
+// Multiplies two matrices with the backend, reading them from and writing the result to the given memory, which may
+// be the memory of the emulated device rather than the matrices' own data.
+//
+// Parameters:
+//             output - The memory to write the result into, with output_rows rows.
+//               this - The first matrix.
+//          this_data - The elements of the first matrix.
+//              other - The second matrix.
+//         other_data - The elements of the second matrix.
+//        output_rows - The number of rows of the result.
+//   transpose_matrix - Whether to multiply by the transpose of the first matrix.
+//    transpose_other - Whether to multiply by the transpose of the second matrix.
+static void host_multiply(void *output, Matrix *this, const void *this_data, Matrix *other, const void *other_data, unsigned int output_rows, bool transpose_matrix, bool transpose_other)
+{
+	unsigned int output_cols = (transpose_other) ? other->rows : other->cols;
+	unsigned int inner = (transpose_matrix) ? this->rows : this->cols;
+
+	// A transpose swaps the row and column strides instead of moving any data.
+	size_t this_rs = (transpose_matrix) ? this->rows : 1, this_cs = (transpose_matrix) ? 1 : this->rows;
+	size_t other_rs = (transpose_other) ? other->rows : 1, other_cs = (transpose_other) ? 1 : other->rows;
+
+	backend.gemm(this->precision, output_rows, output_cols, inner,
+		this_data, this_rs, this_cs,
+		other_data, other_rs, other_cs,
+		output, output_rows,
+		NULL, false);
+}
+
+// device_read
+// ===========
+//
+// Returns an up to date copy of a matrix on the device, uploading its data if the device does not have it yet.
+//
+// Parameters:
+//        this - The matrix.
+//   temporary - Set to whether the copy is a temporary buffer, because the matrix has none of its own. The caller
+//               must give a temporary buffer to device_free().
+//
+// Return:
+//   The device memory.
+static void *device_read(Matrix *this, bool *temporary)
+{
+	*temporary = (this->device == NULL);
+
+	if (*temporary)
+	{
+		void *memory = device_alloc(data_size(this));
+		device_upload(memory, this->data, data_size(this));
+
+		return memory;
+	}
+
+	matrix_upload(this);
+
+	return this->device;
+}
+
+// device_multiply
+// ===============
+//
+// Multiplies two matrices on the device. Operands the device already has up to date are not uploaded again, and an
+// output kept on the device is left there until it is read on the CPU.
+//
+// Parameters:
+//             output - The matrix to write into.
+//               this - The first matrix.
+//              other - The second matrix.
+//   transpose_matrix - Whether to multiply by the transpose of the first matrix.
+//    transpose_other - Whether to multiply by the transpose of the second matrix.
+static void device_multiply(Matrix *output, Matrix *this, Matrix *other, bool transpose_matrix, bool transpose_other)
+{
+	bool this_temporary, other_temporary;
+	void *this_device = device_read(this, &this_temporary);
+	void *other_device = device_read(other, &other_temporary);
+	void *output_device = (output->device != NULL) ? output->device : device_alloc(data_size(output));
+
+#if USE_CUDA
+	if (device_kind() == DEVICE_CUDA)
+	{
+		int m = output->rows;
+		int n = output->cols;
+		int k = (transpose_matrix) ? this->rows : this->cols;
+
+		cublasStatus_t status;
+		pthread_mutex_lock(&cublas_lock);
+
+		if (this->precision == MATRIX_F32)
+		{
+			float alpha = 1, beta = 0;
+
+			status = cublasSgemm(
+				cublas,
+				(transpose_matrix) ? CUBLAS_OP_T : CUBLAS_OP_N,
+				(transpose_other) ? CUBLAS_OP_T : CUBLAS_OP_N,
+				m, n, k,
+				&alpha,
+				this_device, this->rows,
+				other_device, other->rows,
+				&beta,
+				output_device, output->rows
+			);
+		}
+		else
+		{
+			double alpha = 1, beta = 0;
+
+			status = cublasDgemm(
+				cublas,
+				(transpose_matrix) ? CUBLAS_OP_T : CUBLAS_OP_N,
+				(transpose_other) ? CUBLAS_OP_T : CUBLAS_OP_N,
+				m, n, k,
+				&alpha,
+				this_device, this->rows,
+				other_device, other->rows,
+				&beta,
+				output_device, output->rows
+			);
+		}
+
+		pthread_mutex_unlock(&cublas_lock);
+
+		if (status != CUBLAS_STATUS_SUCCESS)
+		{
+			printf("Cublas reported an error.\n");
+			exit(5);
+		}
+	}
+	else
+#endif
+	{
+		// The emulated device's memory is host memory, so the backend multiplies it directly.
+		host_multiply(output_device, this, this_device, other, other_device, output->rows, transpose_matrix, transpose_other);
+	}
+
+	if (this_temporary)
+	{
+		device_free(this_device, data_size(this));
+	}
+
+	if (other_temporary)
+	{
+		device_free(other_device, data_size(other));
+	}
+
+	if (output->device != NULL)
+	{
+		output->host_stale = true;
+		output->device_stale = false;
+	}
+	else
+	{
+		device_download(output->data, output_device, data_size(output));
+		device_free(output_device, data_size(output));
+	}
+}
+
+// matrix_multiply
+// ===============
+//
+// Multiplies this matrix with another matrix. Transposed operands are read in place, without copying.
+//
+// Parameters:
+//              this - The first matrix.
+//             other - The second matrix.
+//    this_operation - MATRIX_OP_T to multiply by the transpose of this matrix, otherwise MATRIX_OP_N.
+//   other_operation - MATRIX_OP_T to multiply by the transpose of the other matrix, otherwise MATRIX_OP_N.
+//
+// Return:
+//   A newly allocated matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_multiply(Matrix *this, Matrix *other, MatrixOperation this_operation, MatrixOperation other_operation)
+{
+	MatrixPrecision previous = matrix_use_precision(this->precision);
+	Matrix *output = matrix_new(
+		(this_operation == MATRIX_OP_T) ? this->cols : this->rows,
+		(other_operation == MATRIX_OP_T) ? other->rows : other->cols);
+	matrix_use_precision(previous);
+
+	matrix_multiply_into(output, this, other, this_operation, other_operation);
+
+	return output;
+}
+
+// matrix_multiply_into
+// ====================
+//
+// Multiplies this matrix with another matrix into a preallocated matrix.
+//
+// Parameters:
+//            output - The matrix to write into. Must not be this or other.
+//              this - The first matrix.
+//             other - The second matrix.
+//    this_operation - MATRIX_OP_T to multiply by the transpose of this matrix, otherwise MATRIX_OP_N.
+//   other_operation - MATRIX_OP_T to multiply by the transpose of the other matrix, otherwise MATRIX_OP_N.
+void matrix_multiply_into(Matrix *output, Matrix *this, Matrix *other, MatrixOperation this_operation, MatrixOperation other_operation)
+{
+	PROFILE_SCOPE("matrix_multiply");
+
+	bool transpose_matrix = this_operation == MATRIX_OP_T;
+	bool transpose_other = other_operation == MATRIX_OP_T;
+
+	unsigned int matcols = (transpose_matrix) ? this->rows : this->cols;
+	unsigned int othrows = (transpose_other) ? other->cols : other->rows;
+
+	if (matcols != othrows)
+	{
+		printf("Cannot multiply matrices due to incompatible sizes: (%u,%u) and (%u,%u).\n", this->rows, this->cols, other->rows, other->cols);
+		exit(1);
+	}
+
+	check_precision(this, other);
+	check_output(output, (transpose_matrix) ? this->cols : this->rows, (transpose_other) ? other->rows : other->cols, this->precision);
+	COUNTERS_SCOPE("matrix_multiply", output->rows, output->cols, matcols, 2.0 * output->rows * output->cols * matcols);
+
+	if (device_kind() != DEVICE_NONE)
+	{
+		device_multiply(output, this, other, transpose_matrix, transpose_other);
+		return;
+	}
+
+	host_multiply(output->data, this, this->data, other, other->data, output->rows, transpose_matrix, transpose_other);
+}
+
+// matrix_dense
+// ============
+//
+// Computes a dense layer, activation(weights * input + bias), in a single pass over the output.
+//
+// Parameters:
+//      weights - The (M,K) weight matrix.
+//        input - The (K,N) input matrix, one sample per column.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
+//
+// Return:
+//   A newly allocated matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_dense(Matrix *weights, Matrix *input, Matrix *bias, MatrixActivation activation)
+{
+	MatrixPrecision previous = matrix_use_precision(weights->precision);
+	Matrix *output = matrix_new(weights->rows, input->cols);
+	matrix_use_precision(previous);
+
+	matrix_dense_into(output, weights, input, bias, activation);
+
+	return output;
+}
+
+// matrix_dense_into
+// =================
+//
+// Computes a dense layer, activation(weights * input + bias), into a preallocated matrix.
+//
+// Parameters:
+//       output - The matrix to write into. Must not be weights, input or bias.
+//      weights - The (M,K) weight matrix.
+//        input - The (K,N) input matrix, one sample per column.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
+void matrix_dense_into(Matrix *output, Matrix *weights, Matrix *input, Matrix *bias, MatrixActivation activation)
+{
+	PROFILE_SCOPE("matrix_dense");
+
+	if (weights->cols != input->rows || bias->rows != weights->rows)
+	{
+		printf("Cannot apply dense layer due to incompatible sizes: (%u,%u), (%u,%u) and (%u,%u).\n", weights->rows, weights->cols, input->rows, input->cols, bias->rows, bias->cols);
+		exit(1);
+	}
+
+	check_precision(weights, input);
+	check_precision(weights, bias);
+	check_output(output, weights->rows, input->cols, weights->precision);
+	COUNTERS_SCOPE("matrix_dense", output->rows, output->cols, weights->cols, 2.0 * output->rows * output->cols * (weights->cols + 1));
+
+	// Only the multiplication runs on a device. The bias and activation are
+	// applied on the CPU.
+	if (device_kind() != DEVICE_NONE)
+	{
+		matrix_multiply_into(output, weights, input, MATRIX_OP_N, MATRIX_OP_N);
+		matrix_add_to_rows_into(output, output, bias);
+
+		if (activation == MATRIX_ACTIVATION_RELU)
+		{
+			matrix_ReLU_into(output, output);
+		}
+
+		return;
+	}
+
+	backend.gemm(weights->precision, output->rows, output->cols, weights->cols,
+		weights->data, 1, weights->rows,
+		input->data, 1, input->rows,
+		output->data, output->rows,
+		bias->data, activation == MATRIX_ACTIVATION_RELU);
+}
+
+// SparseBuild
+// ===========
+//
+// The arguments of matrix_sparse_from_bytes() shared by all of its tasks on
+// the thread pool. The first pass counts the nonzero bytes of each column into
+// starts[col + 1], and the second copies them out once the counts have been
+// turned into offsets.
+typedef struct
+{
+	MatrixSparse *sparse;
+	const unsigned char *bytes;
+	unsigned int chunk;
+	bool copy;
+} SparseBuild;
+
+// sparse_build_task
+// =================
+//
+// Counts or copies the nonzero bytes of one chunk of columns of a SparseBuild.
+//
+// Parameters:
+//   context - The SparseBuild.
+//      task - The chunk.
+//    worker - Unused.
+static void sparse_build_task(void *context, unsigned int task, unsigned int worker)
+{
+	SparseBuild *build = context;
+	MatrixSparse *sparse = build->sparse;
+
+	unsigned int first = task * build->chunk;
+	unsigned int last = (sparse->cols - first < build->chunk) ? sparse->cols : first + build->chunk;
+
+	for (unsigned int col = first; col < last; col++)
+	{
+		const unsigned char *in = build->bytes + (size_t)col * sparse->rows;
+
+		if (!build->copy)
+		{
+			size_t count = 0;
+			for (unsigned int row = 0; row < sparse->rows; row++)
+			{
+				count += in[row] != 0;
+			}
+
+			sparse->starts[col + 1] = count;
+			continue;
+		}
+
+		size_t position = sparse->starts[col];
+		for (unsigned int row = 0; row < sparse->rows; row++)
+		{
+			if (in[row] != 0)
+			{
+				sparse->indices[position] = row;
+				sparse->values[position] = in[row];
+				position++;
+			}
+		}
+	}
+}
+
+// matrix_sparse_from_bytes
+// ========================
+//
+// Builds a sparse matrix from runs of bytes, one run per column, such as the pixels of a set of images. The columns
+// are converted in parallel on the thread pool.
+//
+// Parameters:
+//    rows - The number of bytes in each run. At most 65535.
+//    cols - The number of runs.
+//   bytes - The runs of bytes, one after the other.
+//   scale - The value each byte is multiplied by when used.
+//
+// Return:
+//   The sparse matrix. Call matrix_sparse_free() when no longer needed.
+MatrixSparse *matrix_sparse_from_bytes(unsigned int rows, unsigned int cols, const unsigned char *bytes, double scale)
+{
+	PROFILE_SCOPE("matrix_sparse_from_bytes");
+
+	if (rows > USHRT_MAX)
+	{
+		printf("Cannot make a sparse matrix with %u rows, as rows are indexed in 16 bits.\n", rows);
+		exit(1);
+	}
+
+	MatrixSparse *sparse = malloc(sizeof(MatrixSparse));
+	if (sparse == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	sparse->rows = rows;
+	sparse->cols = cols;
+	sparse->scale = scale;
+	sparse->starts = malloc(sizeof(size_t) * ((size_t)cols + 1));
+
+	if (sparse->starts == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	// Every thread takes a few chunks, so that the pool stays busy when some
+	// columns are denser than others.
+	SparseBuild build =
+	{
+		.sparse = sparse,
+		.bytes = bytes,
+		.chunk = cols / (threadpool_threads() * 4) + 1,
+		.copy = false
+	};
+	unsigned int chunks = (cols + build.chunk - 1) / build.chunk;
+
+	threadpool_run(chunks, sparse_build_task, &build);
+
+	sparse->starts[0] = 0;
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		sparse->starts[col + 1] += sparse->starts[col];
+	}
+
+	size_t count = sparse->starts[cols];
+	sparse->indices = malloc(sizeof(unsigned short) * count + 1);
+	sparse->values = malloc(count + 1);
+
+	if (sparse->indices == NULL || sparse->values == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	build.copy = true;
+	threadpool_run(chunks, sparse_build_task, &build);
+
+	return sparse;
+}
+
+// matrix_sparse_free
+// ==================
+//
+// Releases a sparse matrix.
+//
+// Parameters:
+//   this - The sparse matrix.
+void matrix_sparse_free(MatrixSparse *this)
+{
+	free(this->starts);
+	free(this->indices);
+	free(this->values);
+	free(this);
+}
+
+// matrix_sparse_density
+// =====================
+//
+// Returns the fraction of the elements of a sparse matrix that are nonzero.
+//
+// Parameters:
+//   this - The sparse matrix.
+//
+// Return:
+//   The density, between 0 and 1.
+double matrix_sparse_density(MatrixSparse *this)
+{
+	double size = (double)this->rows * this->cols;
+
+	return (size > 0) ? this->starts[this->cols] / size : 0.0;
+}
+
+// matrix_sparse_dense_into
+// ========================
+//
+// Computes a dense layer over some of the columns of a sparse matrix, activation(weights * input + bias), into a
+// preallocated matrix. Only the nonzero elements of the input are visited. Runs on the CPU whatever the device.
+//
+// Parameters:
+//       output - The matrix to write into, one column per column of the input used.
+//      weights - The (M,K) weight matrix.
+//        input - The (K,N) sparse input, one sample per column.
+//      columns - The column of the input to use for each column of the output, or NULL to use all N in order.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
+void matrix_sparse_dense_into(Matrix *output, Matrix *weights, MatrixSparse *input, const unsigned int *columns, Matrix *bias, MatrixActivation activation)
+{
+	PROFILE_SCOPE("matrix_sparse_dense");
+
+	if (weights->cols != input->rows || bias->rows != weights->rows)
+	{
+		printf("Cannot apply dense layer due to incompatible sizes: (%u,%u), sparse (%u,%u) and (%u,%u).\n", weights->rows, weights->cols, input->rows, input->cols, bias->rows, bias->cols);
+		exit(1);
+	}
+
+	check_precision(weights, bias);
+	check_output(output, weights->rows, (columns != NULL) ? output->cols : input->cols, weights->precision);
+	COUNTERS_SCOPE("matrix_sparse_dense", output->rows, output->cols, weights->cols, 2.0 * output->rows * output->cols * (weights->cols * matrix_sparse_density(input) + 1));
+
+	host_read(weights);
+	host_read(bias);
+	host_write(output);
+
+	backend.sparse_dense(weights->precision, output->rows, output->cols, weights->data, input, columns, output->data, bias->data, activation == MATRIX_ACTIVATION_RELU);
+}
+
+// matrix_sparse_multiply_into
+// ===========================
+//
+// Multiplies a matrix with the transpose of some of the columns of a sparse matrix, this * input^T, into a
+// preallocated matrix. This is the weight gradient of matrix_sparse_dense_into(), given the gradient of its output.
+// Only the nonzero elements of the input are visited. Runs on the calling thread, on the CPU whatever the device.
+//
+// Parameters:
+//    output - The (M,K) matrix to write into.
+//      this - The (M,C) matrix, one column per column of the input used.
+//     input - The (K,N) sparse input.
+//   columns - The column of the input matching each column of this, or NULL to use all N in order.
+void matrix_sparse_multiply_into(Matrix *output, Matrix *this, MatrixSparse *input, const unsigned int *columns)
+{
+	PROFILE_SCOPE("matrix_sparse_multiply");
+
+	if (columns == NULL && this->cols != input->cols)
+	{
+		printf("Cannot multiply matrices due to incompatible sizes: (%u,%u) and sparse (%u,%u) transposed.\n", this->rows, this->cols, input->rows, input->cols);
+		exit(1);
+	}
+
+	check_output(output, this->rows, input->rows, this->precision);
+	COUNTERS_SCOPE("matrix_sparse_multiply", output->rows, output->cols, this->cols, 2.0 * this->rows * this->cols * input->rows * matrix_sparse_density(input));
+
+	host_read(this);
+	host_write(output);
+
+	backend.sparse_multiply_t(this->precision, this->rows, this->cols, this->data, input, columns, output->data);
+}
+
+// PruneRank
+// =========
+//
+// The magnitude of one weight and where it is, for ranking the weights to prune.
+typedef struct
+{
+	double magnitude;
+	size_t index;
+} PruneRank;
+
+// compare_ranks
+// =============
+//
+// Orders weights by magnitude, smallest first, and weights of equal magnitude by position, for qsort().
+//
+// Parameters:
+//   a - The first weight.
+//   b - The second weight.
+//
+// Return:
+//   Less than, equal to or greater than 0 as a comes before, with or after b.
+static int compare_ranks(const void *a, const void *b)
+{
+	const PruneRank *x = a, *y = b;
+
+	if (x->magnitude != y->magnitude)
+	{
+		return (x->magnitude > y->magnitude) - (x->magnitude < y->magnitude);
+	}
+
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+// pruned_alloc
+// ============
+//
+// Allocates a pruned matrix and its arrays.
+//
+// Parameters:
+//        rows - The number of rows.
+//        cols - The number of columns.
+//   precision - The precision of the values.
+//       count - The number of elements kept.
+//
+// Return:
+//   The pruned matrix, with its arrays unset.
+static MatrixPruned *pruned_alloc(unsigned int rows, unsigned int cols, MatrixPrecision precision, size_t count)
+{
+	MatrixPruned *pruned = malloc(sizeof(MatrixPruned));
+	if (pruned == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	pruned->rows = rows;
+	pruned->cols = cols;
+	pruned->precision = precision;
+	pruned->borrowed = false;
+	pruned->starts = malloc(sizeof(unsigned int) * ((size_t)rows + 1));
+	pruned->indices = malloc(sizeof(unsigned short) * count + 1);
+	pruned->data = malloc(element_size(precision) * count + 1);
+
+	if (pruned->starts == NULL || pruned->indices == NULL || pruned->data == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	return pruned;
+}
+
+// matrix_prune
+// ============
+//
+// Prunes the smallest weights of a matrix by magnitude, setting them to zero, and keeps the rest as a pruned matrix.
+// Weights that are already zero are never kept, so pruning a pruned matrix again cannot restore what was pruned.
+//
+// Parameters:
+//     output - The matrix to write the weights into with the pruned ones set to zero. May be this.
+//       this - The weights.
+//   sparsity - The fraction of the weights to prune, from 0 to 1.
+//
+// Return:
+//   The weights that were kept. Call matrix_pruned_free() when no longer needed.
+MatrixPruned *matrix_prune(Matrix *output, Matrix *this, double sparsity)
+{
+	PROFILE_SCOPE("matrix_prune");
+
+	if (this->cols > USHRT_MAX)
+	{
+		printf("Cannot prune a matrix with %u columns, as columns are indexed in 16 bits.\n", this->cols);
+		exit(1);
+	}
+
+	if (!(sparsity >= 0 && sparsity <= 1))
+	{
+		printf("Cannot prune a fraction of %lf of the weights.\n", sparsity);
+		exit(1);
+	}
+
+	check_output(output, this->rows, this->cols, this->precision);
+
+	host_read(this);
+	host_write(output);
+
+	size_t size = (size_t)this->rows * this->cols;
+	PruneRank *ranks = malloc(sizeof(PruneRank) * size + 1);
+	if (ranks == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	for (size_t i = 0; i < size; i++)
+	{
+		double value = (this->precision == MATRIX_F32) ? this->fdata[i] : this->data[i];
+		ranks[i] = (PruneRank){ fabs(value), i };
+
+		if (output != this)
+		{
+			if (output->precision == MATRIX_F32)
+			{
+				output->fdata[i] = this->fdata[i];
+			}
+			else
+			{
+				output->data[i] = this->data[i];
+			}
+		}
+	}
+
+	qsort(ranks, size, sizeof(PruneRank), compare_ranks);
+
+	size_t pruned_count = (size_t)(sparsity * size + 0.5);
+	for (size_t i = 0; i < pruned_count; i++)
+	{
+		if (output->precision == MATRIX_F32)
+		{
+			output->fdata[ranks[i].index] = 0;
+		}
+		else
+		{
+			output->data[ranks[i].index] = 0;
+		}
+	}
+
+	free(ranks);
+
+	// The matrix is stored by column, but each output of a dense layer is the
+	// dot product of a row, so the kept weights are gathered by row.
+	size_t count = 0;
+	for (size_t i = 0; i < size; i++)
+	{
+		count += matrix_get(output, i % output->rows, i / output->rows) != 0;
+	}
+
+	if (count > UINT_MAX)
+	{
+		printf("Cannot prune a matrix keeping %zu weights, as they are counted in 32 bits.\n", count);
+		exit(1);
+	}
+
+	MatrixPruned *pruned = pruned_alloc(this->rows, this->cols, this->precision, count);
+
+	size_t position = 0;
+	for (unsigned int row = 0; row < output->rows; row++)
+	{
+		pruned->starts[row] = position;
+
+		for (unsigned int col = 0; col < output->cols; col++)
+		{
+			double value = matrix_get(output, row, col);
+			if (value == 0)
+			{
+				continue;
+			}
+
+			pruned->indices[position] = col;
+			if (pruned->precision == MATRIX_F32)
+			{
+				pruned->fdata[position] = value;
+			}
+			else
+			{
+				pruned->data[position] = value;
+			}
+			position++;
+		}
+	}
+	pruned->starts[output->rows] = position;
+
+	return pruned;
+}
+
+// matrix_pruned_wrap
+// ==================
+//
+// Makes a pruned matrix around arrays that belong to someone else, such as tensors mapped from a model file, without
+// copying them. The arrays must outlive the matrix and are never written to.
+//
+// Parameters:
+//        rows - The number of rows.
+//        cols - The number of columns. At most 65535.
+//   precision - The precision of the values.
+//      starts - rows + 1 offsets, as in MatrixPruned.
+//     indices - The column of each kept element.
+//        data - The value of each kept element.
+//
+// Return:
+//   The pruned matrix. Call matrix_pruned_free() when no longer needed.
+MatrixPruned *matrix_pruned_wrap(unsigned int rows, unsigned int cols, MatrixPrecision precision, const unsigned int *starts, const unsigned short *indices, const void *data)
+{
+	if (cols > USHRT_MAX)
+	{
+		printf("Cannot make a pruned matrix with %u columns, as columns are indexed in 16 bits.\n", cols);
+		exit(1);
+	}
+
+	MatrixPruned *pruned = malloc(sizeof(MatrixPruned));
+	if (pruned == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	// The arrays are only ever read through a borrowed matrix.
+	pruned->rows = rows;
+	pruned->cols = cols;
+	pruned->precision = precision;
+	pruned->starts = (unsigned int*)starts;
+	pruned->indices = (unsigned short*)indices;
+	pruned->data = (double*)data;
+	pruned->borrowed = true;
+
+	return pruned;
+}
+
+// matrix_pruned_free
+// ==================
+//
+// Releases a pruned matrix, and its arrays unless they are borrowed.
+//
+// Parameters:
+//   this - The pruned matrix.
+void matrix_pruned_free(MatrixPruned *this)
+{
+	if (!this->borrowed)
+	{
+		free(this->starts);
+		free(this->indices);
+		free(this->data);
+	}
+
+	free(this);
+}
+
+// matrix_pruned_density
+// =====================
+//
+// Returns the fraction of the elements of a pruned matrix that were kept.
+//
+// Parameters:
+//   this - The pruned matrix.
+//
+// Return:
+//   The density, between 0 and 1.
+double matrix_pruned_density(MatrixPruned *this)
+{
+	double size = (double)this->rows * this->cols;
+
+	return (size > 0) ? this->starts[this->rows] / size : 0.0;
+}
+
+// matrix_pruned_expand
+// ====================
+//
+// Writes a pruned matrix out in full, with zeros for the pruned elements, as matrix_prune() left it.
+//
+// Parameters:
+//   this - The pruned matrix.
+//
+// Return:
+//   A newly allocated matrix in the precision of the pruned one. Call matrix_free() when no longer needed.
+Matrix *matrix_pruned_expand(MatrixPruned *this)
+{
+	MatrixPrecision previous = matrix_use_precision(this->precision);
+	Matrix *output = matrix_new(this->rows, this->cols);
+	matrix_use_precision(previous);
+
+	host_write(output);
+	memset(output->data, 0, element_size(output->precision) * output->rows * output->cols);
+
+	for (unsigned int row = 0; row < this->rows; row++)
+	{
+		for (unsigned int i = this->starts[row]; i < this->starts[row + 1]; i++)
+		{
+			size_t index = (size_t)this->indices[i] * this->rows + row;
+
+			if (this->precision == MATRIX_F32)
+			{
+				output->fdata[index] = this->fdata[i];
+			}
+			else
+			{
+				output->data[index] = this->data[i];
+			}
+		}
+	}
+
+	return output;
 }
 
-// matrix_get
-// ==========
+// matrix_pruned_dense
+// ===================
 //
-// Gets a value from a matrix.
+// Computes a dense layer with pruned weights, activation(weights * input + bias), visiting only the kept weights.
 //
 // Parameters:
-//   this - The matrix.
-//    row - The row.
-//    col - The column.
+//      weights - The (M,K) pruned weights.
+//        input - The (K,N) input matrix, one sample per column.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
 //
 // Return:
-//   The value in the matrix.
-double matrix_get(Matrix *this, unsigned int row, unsigned int col)
+//   A newly allocated matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_pruned_dense(MatrixPruned *weights, Matrix *input, Matrix *bias, MatrixActivation activation)
 {
-	return this->data[idx(this, row, col)];
+	MatrixPrecision previous = matrix_use_precision(weights->precision);
+	Matrix *output = matrix_new(weights->rows, input->cols);
+	matrix_use_precision(previous);
+
+	matrix_pruned_dense_into(output, weights, input, bias, activation);
+
+	return output;
 }
 
-// matrix_multiply
-// ===============
+// matrix_pruned_dense_into
+// ========================
 //
-// Multiplies this matrix with another matrix.
+// Computes a dense layer with pruned weights, activation(weights * input + bias), into a preallocated matrix. Runs
+// on the CPU whatever the device.
 //
 // Parameters:
-//    this - The first matrix.
-//   other - The second matrix.
-//
-// Return:
-//   A newly allocated matrix. Call matrix_free() when no longer needed.
-#if USE_CUDA
-Matrix *matrix_multiply(Matrix *this, Matrix *other, cublasOperation_t matrix_operation, cublasOperation_t other_operation)
-#else
-Matrix *matrix_multiply(Matrix *this, Matrix *other)
-#endif
+//       output - The matrix to write into. Must not be input or bias.
+//      weights - The (M,K) pruned weights.
+//        input - The (K,N) input matrix, one sample per column.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
+void matrix_pruned_dense_into(Matrix *output, MatrixPruned *weights, Matrix *input, Matrix *bias, MatrixActivation activation)
 {
-	bool transpose_matrix = false, transpose_other = false;
-#if USE_CUDA
-	transpose_matrix = matrix_operation == CUBLAS_OP_T;
-	transpose_other = other_operation == CUBLAS_OP_T;
-#endif
-
-	unsigned int matcols = (transpose_matrix) ? this->rows : this->cols;
-	unsigned int othrows = (transpose_other) ? other->cols : other->rows;
+	PROFILE_SCOPE("matrix_pruned_dense");
 
-	if (matcols != othrows)
+	if (weights->cols != input->rows || bias->rows != weights->rows)
 	{
-		printf("Cannot multiply matrices due to incompatible sizes: (%u,%u) and (%u,%u).\n", this->rows, this->cols, other->rows, other->cols);
+		printf("Cannot apply dense layer due to incompatible sizes: pruned (%u,%u), (%u,%u) and (%u,%u).\n", weights->rows, weights->cols, input->rows, input->cols, bias->rows, bias->cols);
 		exit(1);
 	}
 
-	Matrix *output = matrix_new((transpose_matrix) ? this->cols : this->rows, (transpose_other) ? other->rows : other->cols);
-
-#if USE_CUDA
-	double alpha = 1, beta = 0;
-
-	double *matrix_gpu = matrix_move_to_gpu(this);
-	double *other_gpu = matrix_move_to_gpu(other);
-
-	int m = (transpose_matrix) ? this->cols : this->rows;
-	int n = (transpose_other) ? other->rows : other->cols;
-	int k = (transpose_matrix) ? this->rows : this->cols;
-
-	double *output_gpu;
-	int output_gpu_size = sizeof(double) * m * n;
-	cudaMalloc(&output_gpu, output_gpu_size);
-
-	cublasStatus_t status = cublasDgemm(
-		cublas,
-		matrix_operation, other_operation,
-		m, n, k,
-		&alpha,
-		matrix_gpu, this->rows,
-		other_gpu, other->rows,
-		&beta,
-		output_gpu, output->rows
-	);
-
-	if (status != CUBLAS_STATUS_SUCCESS)
+	if (input->precision != weights->precision)
 	{
-		printf("Cublas reported an error.\n");
-		exit(5);
+		printf("Cannot combine matrices of different precisions.\n");
+		exit(1);
 	}
 
-	cudaMemcpy(output->data, output_gpu, output_gpu_size, cudaMemcpyDeviceToHost);
-
-	cudaFree(matrix_gpu);
-	cudaFree(other_gpu);
-	cudaFree(output_gpu);
-
-#else
-
-	double sum;
-
-	for (unsigned int thisRow = 0; thisRow < this->rows; thisRow++)
-	{
-		for (unsigned int otherCol = 0; otherCol < other->cols; otherCol++)
-		{
-			sum = 0.0;
-
-			for (unsigned int i = 0; i < this->cols; i++)
-			{
-				sum += matrix_get(this, thisRow, i) * matrix_get(other, i, otherCol);
-			}
+	check_precision(input, bias);
+	check_output(output, weights->rows, input->cols, weights->precision);
+	COUNTERS_SCOPE("matrix_pruned_dense", output->rows, output->cols, weights->cols, 2.0 * output->rows * output->cols * (weights->cols * matrix_pruned_density(weights) + 1));
 
-			matrix_set(output, thisRow, otherCol, sum);
-		}
-	}
-	
-#endif
+	host_read(input);
+	host_read(bias);
+	host_write(output);
 
-	return output;
+	backend.pruned_dense(weights->precision, weights, output->cols, input->data, output->data, bias->data, activation == MATRIX_ACTIVATION_RELU);
 }
 
 // matrix_elementwise_multiply
@@ -280,23 +1982,45 @@ Matrix *matrix_multiply(Matrix *this, Matrix *other)
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_elementwise_multiply(Matrix *this, Matrix *other)
 {
+	MatrixPrecision previous = matrix_use_precision(this->precision);
+	Matrix *output = matrix_new(this->rows, this->cols);
+	matrix_use_precision(previous);
+
+	matrix_elementwise_multiply_into(output, this, other);
+
+	return output;
+}
+
+// matrix_elementwise_multiply_into
+// ================================
+//
+// Multiplies each element of a matrix with the corresponding element of another matrix into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be this or other.
+//     this - The first matrix.
+//    other - The second matrix.
+void matrix_elementwise_multiply_into(Matrix *output, Matrix *this, Matrix *other)
+{
+	PROFILE_SCOPE("matrix_elementwise_multiply");
+
 	if (this->rows != other->rows || this->cols != other->cols)
 	{
 		printf("Cannot multiply matrices due to incompatible sizes.\n");
 		exit(1);
 	}
 
-	Matrix *output = matrix_new(this->rows, this->cols);
+	check_precision(this, other);
+	check_output(output, this->rows, this->cols, this->precision);
+	COUNTERS_SCOPE("matrix_elementwise_multiply", output->rows, output->cols, 0, (double)output->rows * output->cols);
 
-	for (unsigned int row = 0; row < this->rows; row++)
-	{
-		for (unsigned int col = 0; col < this->cols; col++)
-		{
-			matrix_set(output, row, col, matrix_get(this, row, col) * matrix_get(other, row, col));
-		}
-	}
+	host_read(this);
+	host_read(other);
+	host_write(output);
 
-	return output;
+	size_t size = (size_t)this->rows * this->cols;
+
+	backend.elementwise_multiply(this->precision, size, output->data, this->data, other->data);
 }
 
 // matrix_add_to_rows
@@ -312,23 +2036,44 @@ Matrix *matrix_elementwise_multiply(Matrix *this, Matrix *other)
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_add_to_rows(Matrix *this, Matrix *other)
 {
+	MatrixPrecision previous = matrix_use_precision(this->precision);
+	Matrix *output = matrix_new(this->rows, this->cols);
+	matrix_use_precision(previous);
+
+	matrix_add_to_rows_into(output, this, other);
+
+	return output;
+}
+
+// matrix_add_to_rows_into
+// =======================
+//
+// Adds the value in the first column of the other matrix to each element in the corresponding row of the first matrix,
+// writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be this.
+//     this - The first matrix.
+//    other - The second matrix.
+void matrix_add_to_rows_into(Matrix *output, Matrix *this, Matrix *other)
+{
+	PROFILE_SCOPE("matrix_add_to_rows");
+
 	if (this->rows != other->rows)
 	{
 		printf("Cannot add matrices due to incompatible sizes.\n");
 		exit(1);
 	}
 
-	Matrix *output = matrix_new(this->rows, this->cols);
+	check_precision(this, other);
+	check_output(output, this->rows, this->cols, this->precision);
+	COUNTERS_SCOPE("matrix_add_to_rows", output->rows, output->cols, 0, (double)output->rows * output->cols);
 
-	for (int col = 0; col < this->cols; col++)
-	{
-		for (int row = 0; row < this->rows; row++)
-		{
-			matrix_set(output, row, col, matrix_get(this, row, col) + matrix_get(other, row, 0));
-		}
-	}
+	host_read(this);
+	host_read(other);
+	host_write(output);
 
-	return output;
+	backend.add_to_rows(this->precision, this->rows, this->cols, output->data, this->data, other->data);
 }
 
 // matrix_sum_rows
@@ -343,22 +2088,33 @@ Matrix *matrix_add_to_rows(Matrix *this, Matrix *other)
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_sum_rows(Matrix *this)
 {
+	MatrixPrecision previous = matrix_use_precision(this->precision);
 	Matrix *output = matrix_new(this->rows, 1);
-	double sum;
+	matrix_use_precision(previous);
 
-	for (unsigned int row = 0; row < this->rows; row++)
-	{
-		sum = 0.0;
+	matrix_sum_rows_into(output, this);
 
-		for (unsigned int col = 0; col < this->cols; col++)
-		{
-			sum += matrix_get(this, row, col);
-		}
+	return output;
+}
 
-		matrix_set(output, row, 0, sum);
-	}
+// matrix_sum_rows_into
+// ====================
+//
+// Writes the sum of each row of the input matrix into a preallocated (N,1) matrix.
+//
+// Parameters:
+//   output - The matrix to write into. Must not be this.
+//     this - The matrix.
+void matrix_sum_rows_into(Matrix *output, Matrix *this)
+{
+	PROFILE_SCOPE("matrix_sum_rows");
 
-	return output;
+	check_output(output, this->rows, 1, this->precision);
+	COUNTERS_SCOPE("matrix_sum_rows", this->rows, this->cols, 0, (double)this->rows * this->cols);
+	host_read(this);
+	host_write(output);
+
+	backend.sum_rows(this->precision, this->rows, this->cols, output->data, this->data);
 }
 
 // matrix_ReLU
@@ -373,19 +2129,37 @@ Matrix *matrix_sum_rows(Matrix *this)
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_ReLU(Matrix *this)
 {
+	MatrixPrecision previous = matrix_use_precision(this->precision);
 	Matrix *output = matrix_new(this->rows, this->cols);
+	matrix_use_precision(previous);
 
-	for (unsigned int row = 0; row < this->rows; row++)
-	{
-		for (unsigned int col = 0; col < this->cols; col++)
-		{
-			matrix_set(output, row, col, mymax(matrix_get(this, row, col), 0));
-		}
-	}
+	matrix_ReLU_into(output, this);
 
 	return output;
 }
 
+// matrix_ReLU_into
+// ================
+//
+// Performs a ReLU on each element of the matrix, writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be this.
+//     this - The matrix.
+void matrix_ReLU_into(Matrix *output, Matrix *this)
+{
+	PROFILE_SCOPE("matrix_ReLU");
+
+	check_output(output, this->rows, this->cols, this->precision);
+	COUNTERS_SCOPE("matrix_ReLU", output->rows, output->cols, 0, (double)output->rows * output->cols);
+	host_read(this);
+	host_write(output);
+
+	size_t size = (size_t)this->rows * this->cols;
+
+	backend.relu(this->precision, size, output->data, this->data);
+}
+
 // matrix_dReLU
 // ============
 //
@@ -398,17 +2172,90 @@ Matrix *matrix_ReLU(Matrix *this)
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_dReLU(Matrix *this)
 {
+	MatrixPrecision previous = matrix_use_precision(this->precision);
 	Matrix *output = matrix_new(this->rows, this->cols);
+	matrix_use_precision(previous);
 
-	for (unsigned int row = 0; row < this->rows; row++)
+	matrix_dReLU_into(output, this);
+
+	return output;
+}
+
+// matrix_dReLU_into
+// =================
+//
+// Performs the derivative of a ReLU on each element of the matrix, writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be this.
+//     this - The matrix.
+void matrix_dReLU_into(Matrix *output, Matrix *this)
+{
+	PROFILE_SCOPE("matrix_dReLU");
+
+	check_output(output, this->rows, this->cols, this->precision);
+	COUNTERS_SCOPE("matrix_dReLU", output->rows, output->cols, 0, (double)output->rows * output->cols);
+	host_read(this);
+	host_write(output);
+
+	size_t size = (size_t)this->rows * this->cols;
+
+	backend.drelu(this->precision, size, output->data, this->data);
+}
+
+// matrix_dReLU_multiply
+// =====================
+//
+// Multiplies each element of a gradient by the derivative of a ReLU at the corresponding element of another matrix.
+//
+// Parameters:
+//   gradient - The gradient.
+//     matrix - The input or the output of the ReLU.
+//
+// Return:
+//   A newly allocated matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_dReLU_multiply(Matrix *gradient, Matrix *matrix)
+{
+	MatrixPrecision previous = matrix_use_precision(gradient->precision);
+	Matrix *output = matrix_new(gradient->rows, gradient->cols);
+	matrix_use_precision(previous);
+
+	matrix_dReLU_multiply_into(output, gradient, matrix);
+
+	return output;
+}
+
+// matrix_dReLU_multiply_into
+// ==========================
+//
+// Multiplies each element of a gradient by the derivative of a ReLU at the corresponding element of another matrix,
+// writing the result into a preallocated matrix.
+//
+// Parameters:
+//     output - The matrix to write into. May be gradient or matrix.
+//   gradient - The gradient.
+//     matrix - The input or the output of the ReLU.
+void matrix_dReLU_multiply_into(Matrix *output, Matrix *gradient, Matrix *matrix)
+{
+	PROFILE_SCOPE("matrix_dReLU_multiply");
+
+	if (gradient->rows != matrix->rows || gradient->cols != matrix->cols)
 	{
-		for (unsigned int col = 0; col < this->cols; col++)
-		{
-			matrix_set(output, row, col, matrix_get(this, row, col) > 0);
-		}
+		printf("Cannot multiply matrices due to incompatible sizes.\n");
+		exit(1);
 	}
 
-	return output;
+	check_precision(gradient, matrix);
+	check_output(output, gradient->rows, gradient->cols, gradient->precision);
+	COUNTERS_SCOPE("matrix_dReLU_multiply", output->rows, output->cols, 0, (double)output->rows * output->cols);
+
+	host_read(gradient);
+	host_read(matrix);
+	host_write(output);
+
+	size_t size = (size_t)gradient->rows * gradient->cols;
+
+	backend.drelu_multiply(gradient->precision, size, output->data, gradient->data, matrix->data);
 }
 
 // matrix_transpose
@@ -423,19 +2270,35 @@ Matrix *matrix_dReLU(Matrix *this)
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_transpose(Matrix *this)
 {
+	MatrixPrecision previous = matrix_use_precision(this->precision);
 	Matrix *output = matrix_new(this->cols, this->rows);
+	matrix_use_precision(previous);
 
-	for (unsigned int row = 0; row < this->rows; row++)
-	{
-		for (unsigned int col = 0; col < this->cols; col++)
-		{
-			matrix_set(output, col, row, matrix_get(this, row, col));
-		}
-	}
+	matrix_transpose_into(output, this);
 
 	return output;
 }
 
+// matrix_transpose_into
+// =====================
+//
+// Transposes a matrix into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. Must not be this.
+//     this - The matrix.
+void matrix_transpose_into(Matrix *output, Matrix *this)
+{
+	PROFILE_SCOPE("matrix_transpose");
+
+	check_output(output, this->cols, this->rows, this->precision);
+	COUNTERS_SCOPE("matrix_transpose", output->rows, output->cols, 0, 0);
+	host_read(this);
+	host_write(output);
+
+	backend.transpose(this->precision, this->rows, this->cols, output->data, this->data);
+}
+
 // matrix_subtract
 // ===============
 //
@@ -450,23 +2313,82 @@ Matrix *matrix_transpose(Matrix *this)
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_subtract(Matrix *this, Matrix *other, double scale)
 {
+	MatrixPrecision previous = matrix_use_precision(this->precision);
+	Matrix *output = matrix_new(this->rows, this->cols);
+	matrix_use_precision(previous);
+
+	matrix_subtract_into(output, this, other, scale);
+
+	return output;
+}
+
+// matrix_subtract_into
+// ====================
+//
+// Subtracts each element of the other matrix from this matrix, writing the result into a preallocated matrix.
+// Passing this as the output updates it in place, e.g. for a parameter update.
+//
+// Parameters:
+//   output - The matrix to write into. May be this or other.
+//     this - The matrix.
+//    other - The other matrix.
+//    scale - The amount by which to scale the other matrix.
+void matrix_subtract_into(Matrix *output, Matrix *this, Matrix *other, double scale)
+{
+	PROFILE_SCOPE("matrix_subtract");
+
 	if (this->cols != other->cols || this->rows != other->rows)
 	{
 		printf("Cannot subtract matrices due to incompatible sizes.\n");
 		exit(1);
 	}
 
-	Matrix *output = matrix_new(this->rows, this->cols);
+	check_precision(this, other);
+	check_output(output, this->rows, this->cols, this->precision);
+	COUNTERS_SCOPE("matrix_subtract", output->rows, output->cols, 0, 2.0 * output->rows * output->cols);
 
-	for (unsigned int row = 0; row < this->rows; row++)
+	host_read(this);
+	host_read(other);
+	host_write(output);
+
+	size_t size = (size_t)this->rows * this->cols;
+
+	backend.subtract(this->precision, size, output->data, this->data, other->data, scale);
+}
+
+// matrix_sum_into
+// ===============
+//
+// Adds up a number of matrices, element by element, into a preallocated matrix. Every element is added up in the
+// order the matrices are given, so the result is the same however many threads share the work.
+//
+// Parameters:
+//     output - The matrix to write into. May be the first of the matrices.
+//   matrices - The matrices, all the same size and precision.
+//      count - The number of matrices. Must be at least 1.
+void matrix_sum_into(Matrix *output, Matrix **matrices, unsigned int count)
+{
+	PROFILE_SCOPE("matrix_sum");
+
+	Matrix *first = matrices[0];
+
+	for (unsigned int i = 0; i < count; i++)
 	{
-		for (unsigned int col = 0; col < this->cols; col++)
+		if (matrices[i]->rows != first->rows || matrices[i]->cols != first->cols)
 		{
-			matrix_set(output, row, col, matrix_get(this, row, col) - matrix_get(other, row, col) * scale);
+			printf("Cannot add matrices due to incompatible sizes.\n");
+			exit(1);
 		}
+
+		check_precision(first, matrices[i]);
+		host_read(matrices[i]);
 	}
 
-	return output;
+	check_output(output, first->rows, first->cols, first->precision);
+	COUNTERS_SCOPE("matrix_sum", output->rows, output->cols, count, (count - 1.0) * output->rows * output->cols);
+	host_write(output);
+
+	backend.sum(first->precision, (size_t)first->rows * first->cols, output->data, matrices, count);
 }
 
 // matrix_multiply_scalar
@@ -482,23 +2404,43 @@ Matrix *matrix_subtract(Matrix *this, Matrix *other, double scale)
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_multiply_scalar(Matrix *this, double value)
 {
+	MatrixPrecision previous = matrix_use_precision(this->precision);
 	Matrix *output = matrix_new(this->rows, this->cols);
+	matrix_use_precision(previous);
 
-	for (unsigned int row = 0; row < this->rows; row++)
-	{
-		for (unsigned int col = 0; col < this->cols; col++)
-		{
-			matrix_set(output, row, col, matrix_get(this, row, col) * value);
-		}
-	}
+	matrix_multiply_scalar_into(output, this, value);
 
 	return output;
 }
 
+// matrix_multiply_scalar_into
+// ===========================
+//
+// Multiplies each element in a matrix by a scalar value, writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be this.
+//     this - The matrix.
+//    value - The scalar to multiply by.
+void matrix_multiply_scalar_into(Matrix *output, Matrix *this, double value)
+{
+	PROFILE_SCOPE("matrix_multiply_scalar");
+
+	check_output(output, this->rows, this->cols, this->precision);
+	COUNTERS_SCOPE("matrix_multiply_scalar", output->rows, output->cols, 0, (double)output->rows * output->cols);
+	host_read(this);
+	host_write(output);
+
+	size_t size = (size_t)this->rows * this->cols;
+
+	backend.multiply_scalar(this->precision, size, output->data, this->data, value);
+}
+
 // matrix_softmax
 // ==============
 //
-// Performs a softmax operation on each column of the matrix.
+// Performs a softmax operation on each column of the matrix. The largest value of each column is subtracted first,
+// so large inputs do not overflow.
 //
 // Parameters:
 //   this - The matrix.
@@ -507,23 +2449,99 @@ Matrix *matrix_multiply_scalar(Matrix *this, double value)
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_softmax(Matrix *this)
 {
+	MatrixPrecision previous = matrix_use_precision(this->precision);
 	Matrix *output = matrix_new(this->rows, this->cols);
+	matrix_use_precision(previous);
+
+	matrix_softmax_into(output, this);
+
+	return output;
+}
+
+// matrix_softmax_into
+// ===================
+//
+// Performs a softmax operation on each column of the matrix, writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be this.
+//     this - The matrix.
+void matrix_softmax_into(Matrix *output, Matrix *this)
+{
+	PROFILE_SCOPE("matrix_softmax");
+
+	check_output(output, this->rows, this->cols, this->precision);
+	COUNTERS_SCOPE("matrix_softmax", output->rows, output->cols, 0, 4.0 * output->rows * output->cols);
+	host_read(this);
+	host_write(output);
+
+	backend.softmax(this->precision, this->rows, this->cols, output->data, this->data);
+}
+
+// matrix_softmax_cross_entropy_into
+// =================================
+//
+// Performs a softmax on each column of the matrix and computes the gradient of the cross entropy loss against the
+// labels, softmax(this) - one_hot(labels), in a single sweep over each column. The one hot matrix is never built.
+//
+// Parameters:
+//   probabilities - The matrix to write the softmax into, or NULL. May be this.
+//        gradient - The matrix to write the gradient into, or NULL. May be this.
+//            this - The matrix, one sample per column.
+//          labels - The correct row of each column.
+//            loss - Set to the mean cross entropy loss over the columns, or NULL.
+//         correct - Set to the number of columns whose largest value is at the labelled row, or NULL.
+void matrix_softmax_cross_entropy_into(Matrix *probabilities, Matrix *gradient, Matrix *this, const unsigned char *labels, double *loss, unsigned int *correct)
+{
+	PROFILE_SCOPE("matrix_softmax_cross_entropy");
+	COUNTERS_SCOPE("matrix_softmax_cross_entropy", this->rows, this->cols, 0, 4.0 * this->rows * this->cols);
+
+	if (probabilities != NULL)
+	{
+		check_output(probabilities, this->rows, this->cols, this->precision);
+	}
+
+	if (gradient != NULL)
+	{
+		check_output(gradient, this->rows, this->cols, this->precision);
+	}
 
 	for (unsigned int col = 0; col < this->cols; col++)
 	{
-		double sum = 0.0;
-		for (unsigned int row = 0; row < this->rows; row++)
+		if (labels[col] >= this->rows)
 		{
-			sum += exp(matrix_get(this, row, col));
+			printf("Label %u is out of range for a matrix with %u rows.\n", labels[col], this->rows);
+			exit(1);
 		}
+	}
 
-		for (unsigned int row = 0; row < this->rows; row++)
-		{
-			matrix_set(output, row, col, exp(matrix_get(this, row, col)) / sum);
-		}
+	host_read(this);
+
+	if (probabilities != NULL)
+	{
+		host_write(probabilities);
 	}
 
-	return output;
+	if (gradient != NULL)
+	{
+		host_write(gradient);
+	}
+
+	unsigned int total_correct;
+	double total_loss = backend.softmax_cross_entropy(this->precision, this->rows, this->cols,
+		(probabilities != NULL) ? probabilities->data : NULL,
+		(gradient != NULL) ? gradient->data : NULL,
+		this->data, labels, &total_correct);
+
+	if (loss != NULL)
+	{
+		*loss = (this->cols > 0) ? total_loss / this->cols : 0.0;
+	}
+
+	if (correct != NULL)
+	{
+		*correct = total_correct;
+	}
 }
 
 // matrix_rand
@@ -553,13 +2571,8 @@ void matrix_rand(Matrix *this)
 //   this - The matrix.
 void matrix_clear(Matrix *this)
 {
-	for (int row = 0; row < this->rows; row++)
-	{
-		for (int col = 0; col < this->cols; col++)
-		{
-			matrix_set(this, row, col, 0);
-		}
-	}
+	host_write(this);
+	memset(this->data, 0, element_size(this->precision) * this->rows * this->cols);
 }
 
 // matrix_print
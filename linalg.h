@@ -7,42 +7,201 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdbool.h>
+#include <limits.h>
+#include "threadpool.h"
+#include "device.h"
+#include "profile.h"
+#include "counters.h"
 
 #if USE_CUDA
 #include <cublas_v2.h>
 #endif
 
 
+// MatrixArena
+// ===========
+//
+// A bump allocator for short lived matrices. See matrix_arena_new().
+typedef struct MatrixArena MatrixArena;
+
+// MatrixPrecision
+// ===============
+//
+// The element type of a matrix. MATRIX_F64 matrices store their elements in data, MATRIX_F32 matrices in fdata.
+typedef enum
+{
+	MATRIX_F64,
+	MATRIX_F32
+} MatrixPrecision;
+
 typedef struct
 {
 	unsigned int rows, cols;
-	double *data;
+	MatrixPrecision precision;
+	union
+	{
+		double *data;
+		float *fdata;
+	};
+	MatrixArena *arena; // The arena the matrix was allocated from, or NULL if it is on the heap.
+	bool borrowed;      // Whether data belongs to someone else. See matrix_wrap().
+	void *device;       // The matrix's own buffer on the device, or NULL. See matrix_keep_on_device().
+	bool host_stale;    // Whether data is older than the device buffer.
+	bool device_stale;  // Whether the device buffer is older than data.
 } Matrix;
 
-#if USE_CUDA
-// matrix_move_to_gpu
-// ==================
+// MatrixOperation
+// ===============
 //
-// Moves memory from a matrix's data into GPU dedicated memory.
+// Selects whether matrix_multiply() reads an operand as it is or as its transpose.
+typedef enum
+{
+	MATRIX_OP_N,
+	MATRIX_OP_T
+} MatrixOperation;
+
+// MatrixActivation
+// ================
 //
-// Parameters:
-//   matrix: The matrix whose data is to be moved.
+// Selects the activation function matrix_dense() applies to its output.
+typedef enum
+{
+	MATRIX_ACTIVATION_NONE,
+	MATRIX_ACTIVATION_RELU
+} MatrixActivation;
+
+// MatrixMemoryStats
+// =================
 //
-// Return:
-//   The pointer to the GPU device's memory location.
-double *matrix_move_to_gpu(Matrix *matrix);
-#endif
+// The heap matrices made since matrix_init(), counted by matrix_new(), matrix_new_from_data(), matrix_wrap() and
+// matrix_free(). Matrices from arenas are not counted one by one; instead each arena's matrix_arena_peak() is
+// gathered when it is freed.
+typedef struct
+{
+	unsigned long long allocations;     // Matrices made.
+	unsigned long long frees;           // Matrices freed.
+	unsigned long long allocated_bytes; // Bytes of elements allocated in total. Wrapped elements are not counted.
+	unsigned long long live;            // Matrices not yet freed.
+	size_t live_bytes;                  // Bytes of elements held by matrices not yet freed.
+	size_t peak_bytes;                  // The most bytes of elements held at once.
+	unsigned long long arenas;          // Arenas freed.
+	size_t arena_peak_bytes;            // The most bytes in use at once in any one of them.
+	double seconds;                     // The time since matrix_init().
+} MatrixMemoryStats;
+
+// MatrixSparse
+// ============
+//
+// A (rows,cols) matrix of bytes, such as a set of images with one image per column, that keeps only its nonzero
+// elements, in compressed sparse column form. Each column's elements are contiguous and in order of row, so the
+// same arrays read as compressed sparse rows of the transpose, one image per row. Every element is multiplied by
+// scale when used. Built by matrix_sparse_from_bytes() and read only afterwards.
+typedef struct
+{
+	unsigned int rows, cols;
+	size_t *starts;          // Column col holds elements starts[col] up to starts[col + 1], cols + 1 offsets in all.
+	unsigned short *indices; // The row of each element.
+	unsigned char *values;   // The value of each element, before scaling.
+	double scale;
+} MatrixSparse;
+
+// MatrixPruned
+// ============
+//
+// A (rows,cols) weight matrix with most of its elements pruned to zero, keeping only the rest in compressed sparse
+// row form, so that products with it skip the pruned weights entirely. Each row's elements are in order of column.
+// Made by matrix_prune() or matrix_pruned_wrap().
+typedef struct
+{
+	unsigned int rows, cols;
+	MatrixPrecision precision;
+	unsigned int *starts;    // Row row holds elements starts[row] up to starts[row + 1], rows + 1 offsets in all.
+	unsigned short *indices; // The column of each element.
+	union
+	{
+		double *data;        // The value of each element, in data or fdata by precision as in a Matrix.
+		float *fdata;
+	};
+	bool borrowed;           // Whether the arrays belong to someone else. See matrix_pruned_wrap().
+} MatrixPruned;
 
 // matrix_init
 // ===========
 //
-// Must be called before using any of the matrix operations.
-void matrix_init(void);
+// Must be called before using any of the matrix operations. Starts the thread pool that matrix operations are spread
+// over, the backend that computes them, and the device that matrix multiplications run on, if any.
+//
+// Parameters:
+//   threads - The number of threads, or 0 to use the NUMEROS_THREADS environment variable, falling back to the
+//             number of online processors.
+//    device - The device to multiply on, or DEVICE_NONE to multiply on the CPU. On DEVICE_EMULATED the
+//             multiplications run with the backend, but their operands go through counted uploads and downloads
+//             as they would on a GPU.
+//      name - The name of the backend, or NULL to use the NUMEROS_BACKEND environment variable, falling back to
+//             "cpu". See matrix_backends().
+void matrix_init(unsigned int threads, DeviceKind device, const char *name);
+
+// matrix_shutdown
+// ===============
+//
+// Stops the thread pool, the backend and the device, and releases what matrix_init() allocated. No matrix operations
+// may be used afterwards.
+void matrix_shutdown(void);
+
+// matrix_backend
+// ==============
+//
+// Returns the name of the backend given to matrix_init().
+//
+// Return:
+//   The name.
+const char *matrix_backend(void);
+
+// matrix_backends
+// ===============
+//
+// Returns the names of the backends in this build: "cpu", the cache blocked kernels spread over the thread pool,
+// "reference", plain loops that compute in double precision, and "blas", the system's CBLAS library, when compiled
+// with USE_BLAS. The first is the default.
+//
+// Parameters:
+//   count - Set to the number of backends.
+//
+// Return:
+//   The names.
+const char *const *matrix_backends(unsigned int *count);
+
+// matrix_use_precision
+// ====================
+//
+// Sets the precision of the matrices created by matrix_new() on the calling thread. Matrices start out as
+// MATRIX_F64 on every thread. Operations on existing matrices always produce results in the precision of their
+// inputs, and refuse to mix precisions.
+//
+// Parameters:
+//   precision - The precision.
+//
+// Return:
+//   The precision that was in use before.
+MatrixPrecision matrix_use_precision(MatrixPrecision precision);
+
+// matrix_element_size
+// ===================
+//
+// Returns the size in bytes of one element of a matrix.
+//
+// Parameters:
+//   matrix - The matrix.
+//
+// Return:
+//   The size of an element.
+size_t matrix_element_size(Matrix *matrix);
 
 // matrix_new
 // ==========
 //
-// Allocates space and initializes a new 2D matrix.
+// Allocates space and initializes a new 2D matrix, from the arena given to matrix_arena_use() if there is one.
+// The matrix has the precision given to matrix_use_precision().
 //
 // Parameters:
 //   rows - The number of rows the matrix has.
@@ -52,10 +211,83 @@ void matrix_init(void);
 //   The matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_new(unsigned int rows, unsigned int cols);
 
+// matrix_arena_new
+// ================
+//
+// Creates an arena that matrix_new() can allocate from while it is in use. Memory is handed out in 64 byte aligned
+// pieces from large blocks, and is only given back all at once by matrix_arena_reset(). The arena grows by another
+// block when it runs out of space.
+//
+// Parameters:
+//   capacity - The size in bytes of each block.
+//
+// Return:
+//   The arena. Call matrix_arena_free() when no longer needed.
+MatrixArena *matrix_arena_new(size_t capacity);
+
+// matrix_arena_free
+// =================
+//
+// Releases an arena and every matrix allocated from it.
+//
+// Parameters:
+//   arena - The arena.
+void matrix_arena_free(MatrixArena *arena);
+
+// matrix_arena_use
+// ================
+//
+// Makes matrix_new() on the calling thread allocate from an arena, or from the heap again when given NULL. Other
+// threads keep their own arena, so an arena must only be used, reset and freed by one thread at a time.
+//
+// Parameters:
+//   arena - The arena, or NULL.
+//
+// Return:
+//   The arena that was in use before, or NULL.
+MatrixArena *matrix_arena_use(MatrixArena *arena);
+
+// matrix_arena_reset
+// ==================
+//
+// Releases every matrix allocated from an arena at once. The arena keeps its blocks for reuse.
+//
+// Parameters:
+//   arena - The arena.
+void matrix_arena_reset(MatrixArena *arena);
+
+// matrix_arena_peak
+// =================
+//
+// Returns the most bytes that have been in use at once in an arena.
+//
+// Parameters:
+//   arena - The arena.
+//
+// Return:
+//   The peak usage in bytes.
+size_t matrix_arena_peak(MatrixArena *arena);
+
+// matrix_memory_stats
+// ===================
+//
+// Returns how many matrices have been made and freed, and how much memory they hold.
+//
+// Return:
+//   The counters.
+MatrixMemoryStats matrix_memory_stats(void);
+
+// matrix_memory_report
+// ====================
+//
+// Prints the counters of matrix_memory_stats() to stderr, with the allocation rate, the peak of the fullest arena,
+// and a table of how many matrices of each shape have been made and are still live, most bytes first.
+void matrix_memory_report(void);
+
 // matrix_new_from_data
 // ====================
 //
-// Creates a 2D matrix from preexising data.
+// Creates a 2D MATRIX_F64 matrix from preexising data.
 //
 // Parameters:
 //   rows - The number of rows the matrix has.
@@ -66,15 +298,53 @@ Matrix *matrix_new(unsigned int rows, unsigned int cols);
 //   The matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_new_from_data(unsigned int rows, unsigned int cols, double *data);
 
+// matrix_wrap
+// ===========
+//
+// Creates a matrix over memory it does not own, such as a tensor mapped from a model file, without copying it.
+// matrix_free() releases the matrix but leaves the memory alone. Read only memory must only be read from.
+//
+// Parameters:
+//        rows - The number of rows the matrix has.
+//        cols - The number of columns the matrix has.
+//   precision - The precision of the elements.
+//        data - The column major elements, which must outlive the matrix.
+//
+// Return:
+//   The matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_wrap(unsigned int rows, unsigned int cols, MatrixPrecision precision, const void *data);
+
 // matrix_free
 // ===========
 //
-// Releases the resources used by a matrix.
+// Releases the resources used by a matrix. Matrices allocated from an arena are released by matrix_arena_reset()
+// instead, so this does nothing for them.
 //
 // Parameters:
 //   matrix - The matrix.
 void matrix_free(Matrix *matrix);
 
+// matrix_keep_on_device
+// =====================
+//
+// Gives a matrix its own buffer on the device, which stays there until matrix_free(). The matrix then keeps track of
+// whether its data or its device buffer is newer, and is only copied across when the other side is out of date. A
+// matrix used on the device without one is uploaded to a temporary buffer every time. Does nothing without a device.
+//
+// Parameters:
+//   matrix - The matrix. Must not be from an arena.
+void matrix_keep_on_device(Matrix *matrix);
+
+// matrix_upload
+// =============
+//
+// Brings the device buffer of a matrix given to matrix_keep_on_device() up to date now, rather than when it is next
+// used on the device. This moves the upload to a convenient thread, such as before the matrix is shared by several.
+//
+// Parameters:
+//   matrix - The matrix.
+void matrix_upload(Matrix *matrix);
+
 // matrix_set
 // ==========
 //
@@ -101,22 +371,252 @@ void matrix_set(Matrix *matrix, unsigned int row, unsigned int col, double value
 //   The value in the matrix.
 double matrix_get(Matrix *matrix, unsigned int row, unsigned int col);
 
+// matrix_columns
+// ==============
+//
+// Returns a view of some of the columns of a matrix, sharing its data. Writing to the view writes to the matrix.
+// The view lives on the stack and must not be passed to matrix_free(). The view of a matrix kept on the device
+// shares its device buffer as well, but only the matrix itself knows which copy is newer, so such a view should only
+// be read from.
+//
+// Parameters:
+//   matrix - The matrix.
+//    first - The first column of the view.
+//    count - The number of columns in the view.
+//
+// Return:
+//   The view.
+Matrix matrix_columns(Matrix *matrix, unsigned int first, unsigned int count);
+
+// matrix_gather_bytes_into
+// ========================
+//
+// Fills each column of a preallocated matrix from a run of bytes, such as the pixels of one image, multiplied by a
+// scale. This is how raw data is turned into a batch without going element by element through matrix_set().
+//
+// Parameters:
+//    output - The matrix to fill. Each of its columns takes output->rows bytes.
+//     bytes - The runs of bytes, one after the other.
+//   columns - The index of the run to copy into each column, or NULL to copy the first output->cols runs in order.
+//     scale - The value each byte is multiplied by.
+void matrix_gather_bytes_into(Matrix *output, const unsigned char *bytes, const unsigned int *columns, double scale);
+
 // matrix_multiply
 // ===============
 //
-// Multiplies matrix matrix with another matrix.
+// Multiplies matrix matrix with another matrix. Transposed operands are read in place, without copying.
 //
 // Parameters:
-//    matrix - The first matrix.
-//   other - The second matrix.
+//             matrix - The first matrix.
+//              other - The second matrix.
+//   matrix_operation - MATRIX_OP_T to multiply by the transpose of the first matrix, otherwise MATRIX_OP_N.
+//    other_operation - MATRIX_OP_T to multiply by the transpose of the second matrix, otherwise MATRIX_OP_N.
 //
 // Return:
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
-#if USE_CUDA
-Matrix *matrix_multiply(Matrix *matrix, Matrix *other, cublasOperation_t matop, cublasOperation_t othop);
-#else
-Matrix *matrix_multiply(Matrix *matrix, Matrix *other);
-#endif
+Matrix *matrix_multiply(Matrix *matrix, Matrix *other, MatrixOperation matrix_operation, MatrixOperation other_operation);
+
+// matrix_multiply_into
+// ====================
+//
+// Multiplies matrix matrix with another matrix into a preallocated matrix.
+//
+// Parameters:
+//             output - The matrix to write into. Must not be matrix or other.
+//             matrix - The first matrix.
+//              other - The second matrix.
+//   matrix_operation - MATRIX_OP_T to multiply by the transpose of the first matrix, otherwise MATRIX_OP_N.
+//    other_operation - MATRIX_OP_T to multiply by the transpose of the second matrix, otherwise MATRIX_OP_N.
+void matrix_multiply_into(Matrix *output, Matrix *matrix, Matrix *other, MatrixOperation matrix_operation, MatrixOperation other_operation);
+
+// matrix_dense
+// ============
+//
+// Computes a dense layer, activation(weights * input + bias), in a single pass over the output.
+//
+// Parameters:
+//      weights - The (M,K) weight matrix.
+//        input - The (K,N) input matrix, one sample per column.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
+//
+// Return:
+//   A newly allocated matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_dense(Matrix *weights, Matrix *input, Matrix *bias, MatrixActivation activation);
+
+// matrix_dense_into
+// =================
+//
+// Computes a dense layer, activation(weights * input + bias), into a preallocated matrix.
+//
+// Parameters:
+//       output - The matrix to write into. Must not be weights, input or bias.
+//      weights - The (M,K) weight matrix.
+//        input - The (K,N) input matrix, one sample per column.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
+void matrix_dense_into(Matrix *output, Matrix *weights, Matrix *input, Matrix *bias, MatrixActivation activation);
+
+// matrix_sparse_from_bytes
+// ========================
+//
+// Builds a sparse matrix from runs of bytes, one run per column, such as the pixels of a set of images. The columns
+// are converted in parallel on the thread pool.
+//
+// Parameters:
+//    rows - The number of bytes in each run. At most 65535.
+//    cols - The number of runs.
+//   bytes - The runs of bytes, one after the other.
+//   scale - The value each byte is multiplied by when used.
+//
+// Return:
+//   The sparse matrix. Call matrix_sparse_free() when no longer needed.
+MatrixSparse *matrix_sparse_from_bytes(unsigned int rows, unsigned int cols, const unsigned char *bytes, double scale);
+
+// matrix_sparse_free
+// ==================
+//
+// Releases a sparse matrix.
+//
+// Parameters:
+//   matrix - The sparse matrix.
+void matrix_sparse_free(MatrixSparse *matrix);
+
+// matrix_sparse_density
+// =====================
+//
+// Returns the fraction of the elements of a sparse matrix that are nonzero.
+//
+// Parameters:
+//   matrix - The sparse matrix.
+//
+// Return:
+//   The density, between 0 and 1.
+double matrix_sparse_density(MatrixSparse *matrix);
+
+// matrix_sparse_dense_into
+// ========================
+//
+// Computes a dense layer over some of the columns of a sparse matrix, activation(weights * input + bias), into a
+// preallocated matrix. Only the nonzero elements of the input are visited. Runs on the CPU whatever the device.
+//
+// Parameters:
+//       output - The matrix to write into, one column per column of the input used.
+//      weights - The (M,K) weight matrix.
+//        input - The (K,N) sparse input, one sample per column.
+//      columns - The column of the input to use for each column of the output, or NULL to use all N in order.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
+void matrix_sparse_dense_into(Matrix *output, Matrix *weights, MatrixSparse *input, const unsigned int *columns, Matrix *bias, MatrixActivation activation);
+
+// matrix_sparse_multiply_into
+// ===========================
+//
+// Multiplies a matrix with the transpose of some of the columns of a sparse matrix, matrix * input^T, into a
+// preallocated matrix. This is the weight gradient of matrix_sparse_dense_into(), given the gradient of its output.
+// Only the nonzero elements of the input are visited. Runs on the calling thread, on the CPU whatever the device.
+//
+// Parameters:
+//    output - The (M,K) matrix to write into.
+//    matrix - The (M,C) matrix, one column per column of the input used.
+//     input - The (K,N) sparse input.
+//   columns - The column of the input matching each column of matrix, or NULL to use all N in order.
+void matrix_sparse_multiply_into(Matrix *output, Matrix *matrix, MatrixSparse *input, const unsigned int *columns);
+
+// matrix_prune
+// ============
+//
+// Prunes the smallest weights of a matrix by magnitude, setting them to zero, and keeps the rest as a pruned matrix.
+// Weights that are already zero are never kept, so pruning a pruned matrix again cannot restore what was pruned.
+//
+// Parameters:
+//     output - The matrix to write the weights into with the pruned ones set to zero. May be matrix.
+//     matrix - The weights.
+//   sparsity - The fraction of the weights to prune, from 0 to 1.
+//
+// Return:
+//   The weights that were kept. Call matrix_pruned_free() when no longer needed.
+MatrixPruned *matrix_prune(Matrix *output, Matrix *matrix, double sparsity);
+
+// matrix_pruned_wrap
+// ==================
+//
+// Makes a pruned matrix around arrays that belong to someone else, such as tensors mapped from a model file, without
+// copying them. The arrays must outlive the matrix and are never written to.
+//
+// Parameters:
+//        rows - The number of rows.
+//        cols - The number of columns. At most 65535.
+//   precision - The precision of the values.
+//      starts - rows + 1 offsets, as in MatrixPruned.
+//     indices - The column of each kept element.
+//        data - The value of each kept element.
+//
+// Return:
+//   The pruned matrix. Call matrix_pruned_free() when no longer needed.
+MatrixPruned *matrix_pruned_wrap(unsigned int rows, unsigned int cols, MatrixPrecision precision, const unsigned int *starts, const unsigned short *indices, const void *data);
+
+// matrix_pruned_free
+// ==================
+//
+// Releases a pruned matrix, and its arrays unless they are borrowed.
+//
+// Parameters:
+//   matrix - The pruned matrix.
+void matrix_pruned_free(MatrixPruned *matrix);
+
+// matrix_pruned_density
+// =====================
+//
+// Returns the fraction of the elements of a pruned matrix that were kept.
+//
+// Parameters:
+//   matrix - The pruned matrix.
+//
+// Return:
+//   The density, between 0 and 1.
+double matrix_pruned_density(MatrixPruned *matrix);
+
+// matrix_pruned_expand
+// ====================
+//
+// Writes a pruned matrix out in full, with zeros for the pruned elements, as matrix_prune() left it.
+//
+// Parameters:
+//   matrix - The pruned matrix.
+//
+// Return:
+//   A newly allocated matrix in the precision of the pruned one. Call matrix_free() when no longer needed.
+Matrix *matrix_pruned_expand(MatrixPruned *matrix);
+
+// matrix_pruned_dense
+// ===================
+//
+// Computes a dense layer with pruned weights, activation(weights * input + bias), visiting only the kept weights.
+//
+// Parameters:
+//      weights - The (M,K) pruned weights.
+//        input - The (K,N) input matrix, one sample per column.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
+//
+// Return:
+//   A newly allocated matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_pruned_dense(MatrixPruned *weights, Matrix *input, Matrix *bias, MatrixActivation activation);
+
+// matrix_pruned_dense_into
+// ========================
+//
+// Computes a dense layer with pruned weights, activation(weights * input + bias), into a preallocated matrix. Runs
+// on the CPU whatever the device.
+//
+// Parameters:
+//       output - The matrix to write into. Must not be input or bias.
+//      weights - The (M,K) pruned weights.
+//        input - The (K,N) input matrix, one sample per column.
+//         bias - The (M,1) bias, added to each column.
+//   activation - The activation function to apply.
+void matrix_pruned_dense_into(Matrix *output, MatrixPruned *weights, Matrix *input, Matrix *bias, MatrixActivation activation);
 
 // matrix_elementwise_multiply
 // ===========================
@@ -131,6 +631,17 @@ Matrix *matrix_multiply(Matrix *matrix, Matrix *other);
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_elementwise_multiply(Matrix *matrix, Matrix *other);
 
+// matrix_elementwise_multiply_into
+// ================================
+//
+// Multiplies each element of a matrix with the corresponding element of another matrix into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be matrix or other.
+//   matrix - The first matrix.
+//    other - The second matrix.
+void matrix_elementwise_multiply_into(Matrix *output, Matrix *matrix, Matrix *other);
+
 // matrix_add_to_rows
 // ==================
 //
@@ -144,6 +655,18 @@ Matrix *matrix_elementwise_multiply(Matrix *matrix, Matrix *other);
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_add_to_rows(Matrix *matrix, Matrix *other);
 
+// matrix_add_to_rows_into
+// =======================
+//
+// Adds the value in the first column of the other matrix to each element in the corresponding row of the first matrix,
+// writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be matrix.
+//   matrix - The first matrix.
+//    other - The second matrix.
+void matrix_add_to_rows_into(Matrix *output, Matrix *matrix, Matrix *other);
+
 // matrix_sum_rows
 // ===============
 //
@@ -156,6 +679,16 @@ Matrix *matrix_add_to_rows(Matrix *matrix, Matrix *other);
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_sum_rows(Matrix *matrix);
 
+// matrix_sum_rows_into
+// ====================
+//
+// Writes the sum of each row of the input matrix into a preallocated (N,1) matrix.
+//
+// Parameters:
+//   output - The matrix to write into. Must not be matrix.
+//   matrix - The matrix.
+void matrix_sum_rows_into(Matrix *output, Matrix *matrix);
+
 // matrix_ReLU
 // ===========
 //
@@ -168,6 +701,16 @@ Matrix *matrix_sum_rows(Matrix *matrix);
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_ReLU(Matrix *matrix);
 
+// matrix_ReLU_into
+// ================
+//
+// Performs a ReLU on each element of the matrix, writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be matrix.
+//   matrix - The matrix.
+void matrix_ReLU_into(Matrix *output, Matrix *matrix);
+
 // matrix_dReLU
 // ============
 //
@@ -180,6 +723,42 @@ Matrix *matrix_ReLU(Matrix *matrix);
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_dReLU(Matrix *matrix);
 
+// matrix_dReLU_into
+// =================
+//
+// Performs the derivative of a ReLU on each element of the matrix, writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be matrix.
+//   matrix - The matrix.
+void matrix_dReLU_into(Matrix *output, Matrix *matrix);
+
+// matrix_dReLU_multiply
+// =====================
+//
+// Multiplies each element of a gradient by the derivative of a ReLU at the corresponding element of another matrix.
+// Equivalent to matrix_elementwise_multiply(gradient, matrix_dReLU(matrix)) without the intermediate matrix.
+//
+// Parameters:
+//   gradient - The gradient.
+//     matrix - The input or the output of the ReLU.
+//
+// Return:
+//   A newly allocated matrix. Call matrix_free() when no longer needed.
+Matrix *matrix_dReLU_multiply(Matrix *gradient, Matrix *matrix);
+
+// matrix_dReLU_multiply_into
+// ==========================
+//
+// Multiplies each element of a gradient by the derivative of a ReLU at the corresponding element of another matrix,
+// writing the result into a preallocated matrix.
+//
+// Parameters:
+//     output - The matrix to write into. May be gradient or matrix.
+//   gradient - The gradient.
+//     matrix - The input or the output of the ReLU.
+void matrix_dReLU_multiply_into(Matrix *output, Matrix *gradient, Matrix *matrix);
+
 // matrix_transpose
 // ================
 //
@@ -192,6 +771,16 @@ Matrix *matrix_dReLU(Matrix *matrix);
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_transpose(Matrix *matrix);
 
+// matrix_transpose_into
+// =====================
+//
+// Transposes a matrix into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. Must not be matrix.
+//   matrix - The matrix.
+void matrix_transpose_into(Matrix *output, Matrix *matrix);
+
 // matrix_subtract
 // ===============
 //
@@ -206,6 +795,31 @@ Matrix *matrix_transpose(Matrix *matrix);
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_subtract(Matrix *matrix, Matrix *other, double scale);
 
+// matrix_subtract_into
+// ====================
+//
+// Subtracts each element of the other matrix from matrix matrix, writing the result into a preallocated matrix.
+// Passing matrix as the output updates it in place, e.g. for a parameter update.
+//
+// Parameters:
+//   output - The matrix to write into. May be matrix or other.
+//   matrix - The matrix.
+//    other - The other matrix.
+//    scale - The amount by which to scale the other matrix.
+void matrix_subtract_into(Matrix *output, Matrix *matrix, Matrix *other, double scale);
+
+// matrix_sum_into
+// ===============
+//
+// Adds up a number of matrices, element by element, into a preallocated matrix. Every element is added up in the
+// order the matrices are given, so the result is the same however many threads share the work.
+//
+// Parameters:
+//     output - The matrix to write into. May be the first of the matrices.
+//   matrices - The matrices, all the same size and precision.
+//      count - The number of matrices. Must be at least 1.
+void matrix_sum_into(Matrix *output, Matrix **matrices, unsigned int count);
+
 // matrix_multiply_scalar
 // ======================
 //
@@ -219,10 +833,22 @@ Matrix *matrix_subtract(Matrix *matrix, Matrix *other, double scale);
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_multiply_scalar(Matrix *matrix, double value);
 
+// matrix_multiply_scalar_into
+// ===========================
+//
+// Multiplies each element in a matrix by a scalar value, writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be matrix.
+//   matrix - The matrix.
+//    value - The scalar to multiply by.
+void matrix_multiply_scalar_into(Matrix *output, Matrix *matrix, double value);
+
 // matrix_softmax
 // ==============
 //
-// Performs a softmax operation on each column of the matrix.
+// Performs a softmax operation on each column of the matrix. The largest value of each column is subtracted first,
+// so large inputs do not overflow.
 //
 // Parameters:
 //   matrix - The matrix.
@@ -231,6 +857,31 @@ Matrix *matrix_multiply_scalar(Matrix *matrix, double value);
 //   A newly allocated matrix. Call matrix_free() when no longer needed.
 Matrix *matrix_softmax(Matrix *matrix);
 
+// matrix_softmax_into
+// ===================
+//
+// Performs a softmax operation on each column of the matrix, writing the result into a preallocated matrix.
+//
+// Parameters:
+//   output - The matrix to write into. May be matrix.
+//   matrix - The matrix.
+void matrix_softmax_into(Matrix *output, Matrix *matrix);
+
+// matrix_softmax_cross_entropy_into
+// =================================
+//
+// Performs a softmax on each column of the matrix and computes the gradient of the cross entropy loss against the
+// labels, softmax(matrix) - one_hot(labels), in a single sweep over each column. The one hot matrix is never built.
+//
+// Parameters:
+//   probabilities - The matrix to write the softmax into, or NULL. May be matrix.
+//        gradient - The matrix to write the gradient into, or NULL. May be matrix.
+//          matrix - The matrix, one sample per column.
+//          labels - The correct row of each column.
+//            loss - Set to the mean cross entropy loss over the columns, or NULL.
+//         correct - Set to the number of columns whose largest value is at the labelled row, or NULL.
+void matrix_softmax_cross_entropy_into(Matrix *probabilities, Matrix *gradient, Matrix *matrix, const unsigned char *labels, double *loss, unsigned int *correct);
+
 // matrix_rand
 // ===========
 //
@@ -0,0 +1,840 @@
+// linalg_kernels.h
+// ================
+//
+// The numeric kernels behind the cpu backend, written once for any element
+// type. This file has no include guard: backend_cpu.c includes it once per
+// precision, after defining
+//
+//    SCALAR - The element type.
+//    KERNEL - A macro that gives each kernel a name unique to the precision.
+//       EXP - The exponential function for SCALAR.
+//   GEMM_MR - The number of rows in a microkernel tile.
+//   GEMM_NR - The number of columns in a microkernel tile.
+//
+// Every matrix is column major, and the kernels trust that the public
+// functions in linalg.c have already checked their sizes.
+
+// gemm_pack_a
+// ===========
+//
+// Copies an (mc,kc) block of a matrix into panels of GEMM_MR rows, with each
+// panel stored column by column. Rows past mc are filled with zeros.
+//
+// Parameters:
+//       mc - The number of rows in the block.
+//       kc - The number of columns in the block.
+//        a - The first element of the block.
+//     a_rs - The distance between consecutive rows of a.
+//     a_cs - The distance between consecutive columns of a.
+//   packed - The destination buffer.
+static void KERNEL(gemm_pack_a)(unsigned int mc, unsigned int kc, const SCALAR *a, size_t a_rs, size_t a_cs, SCALAR *restrict packed)
+{
+	for (unsigned int panel = 0; panel < mc; panel += GEMM_MR)
+	{
+		unsigned int height = (mc - panel < GEMM_MR) ? mc - panel : GEMM_MR;
+
+		for (unsigned int k = 0; k < kc; k++)
+		{
+			unsigned int i = 0;
+
+			for (; i < height; i++)
+			{
+				*packed++ = a[(panel + i) * a_rs + k * a_cs];
+			}
+
+			for (; i < GEMM_MR; i++)
+			{
+				*packed++ = 0;
+			}
+		}
+	}
+}
+
+// gemm_pack_b
+// ===========
+//
+// Copies a (kc,nc) block of a matrix into panels of GEMM_NR columns, with each
+// panel stored row by row. Columns past nc are filled with zeros.
+//
+// Parameters:
+//       kc - The number of rows in the block.
+//       nc - The number of columns in the block.
+//        b - The first element of the block.
+//     b_rs - The distance between consecutive rows of b.
+//     b_cs - The distance between consecutive columns of b.
+//   packed - The destination buffer.
+static void KERNEL(gemm_pack_b)(unsigned int kc, unsigned int nc, const SCALAR *b, size_t b_rs, size_t b_cs, SCALAR *restrict packed)
+{
+	for (unsigned int panel = 0; panel < nc; panel += GEMM_NR)
+	{
+		unsigned int width = (nc - panel < GEMM_NR) ? nc - panel : GEMM_NR;
+
+		for (unsigned int k = 0; k < kc; k++)
+		{
+			unsigned int j = 0;
+
+			for (; j < width; j++)
+			{
+				*packed++ = b[k * b_rs + (panel + j) * b_cs];
+			}
+
+			for (; j < GEMM_NR; j++)
+			{
+				*packed++ = 0;
+			}
+		}
+	}
+}
+
+// gemm_microkernel
+// ================
+//
+// Multiplies a packed (GEMM_MR,kc) panel with a packed (kc,GEMM_NR) panel,
+// keeping the whole output tile in registers until it is stored. The bias and
+// ReLU of a dense layer are applied to the tile on its way out.
+//
+// Parameters:
+//           kc - The shared dimension of the panels.
+//            a - The packed panel of the first matrix.
+//            b - The packed panel of the second matrix.
+//            c - The top left element of the output tile.
+//          ldc - The distance between consecutive columns of c.
+//           mr - The number of valid rows in the tile.
+//           nr - The number of valid columns in the tile.
+//   accumulate - Adds to the output tile instead of overwriting it.
+//         bias - The value to add to each row of the tile, or NULL.
+//         relu - Clamps the stored tile at zero.
+static void KERNEL(gemm_microkernel)(unsigned int kc, const SCALAR *restrict a, const SCALAR *restrict b, SCALAR *restrict c, size_t ldc, unsigned int mr, unsigned int nr, bool accumulate, const SCALAR *restrict bias, bool relu)
+{
+	SCALAR tile[GEMM_NR][GEMM_MR] = { { 0 } };
+
+	for (unsigned int k = 0; k < kc; k++)
+	{
+		for (unsigned int j = 0; j < GEMM_NR; j++)
+		{
+			for (unsigned int i = 0; i < GEMM_MR; i++)
+			{
+				tile[j][i] += a[i] * b[j];
+			}
+		}
+
+		a += GEMM_MR;
+		b += GEMM_NR;
+	}
+
+	if (bias != NULL)
+	{
+		for (unsigned int j = 0; j < GEMM_NR; j++)
+		{
+			for (unsigned int i = 0; i < mr; i++)
+			{
+				tile[j][i] += bias[i];
+			}
+		}
+	}
+
+	if (mr == GEMM_MR && nr == GEMM_NR)
+	{
+		for (unsigned int j = 0; j < GEMM_NR; j++)
+		{
+			for (unsigned int i = 0; i < GEMM_MR; i++)
+			{
+				SCALAR value = (accumulate) ? c[j * ldc + i] + tile[j][i] : tile[j][i];
+				c[j * ldc + i] = (relu && value < 0) ? 0 : value;
+			}
+		}
+	}
+	else
+	{
+		for (unsigned int j = 0; j < nr; j++)
+		{
+			for (unsigned int i = 0; i < mr; i++)
+			{
+				SCALAR value = (accumulate) ? c[j * ldc + i] + tile[j][i] : tile[j][i];
+				c[j * ldc + i] = (relu && value < 0) ? 0 : value;
+			}
+		}
+	}
+}
+
+// gemm_block
+// ==========
+//
+// Computes C = A * B on the calling thread using packed, cache sized blocks. A
+// and B are described by strides so either one can be read in place as a
+// transpose. Optionally computes C = ReLU(A * B + bias) instead, finishing each
+// output tile while it is still in registers.
+//
+// Parameters:
+//          m - The number of rows of A and C.
+//          n - The number of columns of B and C.
+//          k - The number of columns of A and rows of B.
+//          a - The data of A.
+//       a_rs - The distance between consecutive rows of A.
+//       a_cs - The distance between consecutive columns of A.
+//          b - The data of B.
+//       b_rs - The distance between consecutive rows of B.
+//       b_cs - The distance between consecutive columns of B.
+//          c - The column major data of C.
+//        ldc - The distance between consecutive columns of C.
+//       bias - The m values to add to the rows of C, or NULL.
+//       relu - Clamps C at zero.
+//   packed_a - Scratch space for GEMM_MC by GEMM_KC elements of A.
+//   packed_b - Scratch space for GEMM_KC by GEMM_NC elements of B.
+static void KERNEL(gemm_block)(unsigned int m, unsigned int n, unsigned int k, const SCALAR *a, size_t a_rs, size_t a_cs, const SCALAR *b, size_t b_rs, size_t b_cs, SCALAR *c, size_t ldc, const SCALAR *bias, bool relu, SCALAR *packed_a, SCALAR *packed_b)
+{
+	if (k == 0)
+	{
+		for (unsigned int col = 0; col < n; col++)
+		{
+			for (unsigned int row = 0; row < m; row++)
+			{
+				SCALAR value = (bias != NULL) ? bias[row] : 0;
+				c[col * ldc + row] = (relu && value < 0) ? 0 : value;
+			}
+		}
+
+		return;
+	}
+
+	for (unsigned int jc = 0; jc < n; jc += GEMM_NC)
+	{
+		unsigned int nc = (n - jc < GEMM_NC) ? n - jc : GEMM_NC;
+
+		for (unsigned int pc = 0; pc < k; pc += GEMM_KC)
+		{
+			unsigned int kc = (k - pc < GEMM_KC) ? k - pc : GEMM_KC;
+			bool last = pc + kc == k;
+
+			KERNEL(gemm_pack_b)(kc, nc, b + pc * b_rs + jc * b_cs, b_rs, b_cs, packed_b);
+
+			for (unsigned int ic = 0; ic < m; ic += GEMM_MC)
+			{
+				unsigned int mc = (m - ic < GEMM_MC) ? m - ic : GEMM_MC;
+
+				KERNEL(gemm_pack_a)(mc, kc, a + ic * a_rs + pc * a_cs, a_rs, a_cs, packed_a);
+
+				for (unsigned int jr = 0; jr < nc; jr += GEMM_NR)
+				{
+					unsigned int nr = (nc - jr < GEMM_NR) ? nc - jr : GEMM_NR;
+
+					for (unsigned int ir = 0; ir < mc; ir += GEMM_MR)
+					{
+						unsigned int mr = (mc - ir < GEMM_MR) ? mc - ir : GEMM_MR;
+
+						KERNEL(gemm_microkernel)(kc,
+							packed_a + ir * kc,
+							packed_b + jr * kc,
+							c + (jc + jr) * ldc + ic + ir, ldc,
+							mr, nr, pc > 0,
+							(last && bias != NULL) ? bias + ic + ir : NULL,
+							last && relu);
+					}
+				}
+			}
+		}
+	}
+}
+
+// gemm_task
+// =========
+//
+// Computes one tile of the output of a GemmJob. Tiles are numbered down the
+// rows first, so neighbouring tasks share the same columns of B.
+//
+// Parameters:
+//   context - The GemmJob.
+//      task - The tile.
+//    worker - The thread, which selects the pack buffers.
+static void KERNEL(gemm_task)(void *context, unsigned int task, unsigned int worker)
+{
+	GemmJob *job = context;
+
+	unsigned int row = (task % job->row_tiles) * job->tile_rows;
+	unsigned int col = (task / job->row_tiles) * job->tile_cols;
+	unsigned int m = (job->m - row < job->tile_rows) ? job->m - row : job->tile_rows;
+	unsigned int n = (job->n - col < job->tile_cols) ? job->n - col : job->tile_cols;
+
+	const SCALAR *bias = job->bias;
+
+	KERNEL(gemm_block)(m, n, job->k,
+		(const SCALAR*)job->a + row * job->a_rs, job->a_rs, job->a_cs,
+		(const SCALAR*)job->b + col * job->b_cs, job->b_rs, job->b_cs,
+		(SCALAR*)job->c + col * job->ldc + row, job->ldc,
+		(bias != NULL) ? bias + row : NULL, job->relu,
+		gemm_packed_a[worker], gemm_packed_b[worker]);
+}
+
+// gemm
+// ====
+//
+// Computes C = A * B, or C = ReLU(A * B + bias), on the thread pool. The output
+// is cut into tiles of whole GEMM_MC row blocks and a multiple of GEMM_NR
+// columns, which each thread computes with gemm_block() into its own pack
+// buffers. Small products, and products inside a task of the thread pool, run
+// directly on the calling thread.
+//
+// Parameters:
+//   See gemm_block().
+static void KERNEL(gemm)(unsigned int m, unsigned int n, unsigned int k, const SCALAR *a, size_t a_rs, size_t a_cs, const SCALAR *b, size_t b_rs, size_t b_cs, SCALAR *c, size_t ldc, const SCALAR *bias, bool relu)
+{
+	unsigned int threads = threadpool_threads();
+
+	if (threads == 1 || (double)m * n * k < GEMM_PARALLEL_MIN)
+	{
+		unsigned int worker = threadpool_worker();
+		KERNEL(gemm_block)(m, n, k, a, a_rs, a_cs, b, b_rs, b_cs, c, ldc, bias, relu, gemm_packed_a[worker], gemm_packed_b[worker]);
+		return;
+	}
+
+	GemmJob job =
+	{
+		.m = m, .n = n, .k = k,
+		.a = a, .a_rs = a_rs, .a_cs = a_cs,
+		.b = b, .b_rs = b_rs, .b_cs = b_cs,
+		.c = c, .ldc = ldc,
+		.bias = bias, .relu = relu,
+		.tile_rows = GEMM_MC,
+		.row_tiles = (m + GEMM_MC - 1) / GEMM_MC,
+	};
+
+	// Aim for a few tiles per thread so that stealing can even out the load,
+	// without making tiles so narrow that repacking A dominates.
+	unsigned int col_tiles = (threads * GEMM_TILES_PER_THREAD + job.row_tiles - 1) / job.row_tiles;
+	unsigned int tile_cols = (n + col_tiles - 1) / col_tiles;
+	tile_cols = (tile_cols + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+	job.tile_cols = (tile_cols < GEMM_MIN_TILE_COLS) ? GEMM_MIN_TILE_COLS : tile_cols;
+	col_tiles = (n + job.tile_cols - 1) / job.tile_cols;
+
+	threadpool_run(job.row_tiles * col_tiles, KERNEL(gemm_task), &job);
+}
+
+// elementwise_multiply
+// ====================
+//
+// out = a * b, element by element.
+static void KERNEL(elementwise_multiply)(size_t size, SCALAR *out, const SCALAR *a, const SCALAR *b)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		out[i] = a[i] * b[i];
+	}
+}
+
+// add_to_rows
+// ===========
+//
+// Adds bias[row] to every element of each row.
+static void KERNEL(add_to_rows)(unsigned int rows, unsigned int cols, SCALAR *out, const SCALAR *in, const SCALAR *bias)
+{
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			out[(size_t)col * rows + row] = in[(size_t)col * rows + row] + bias[row];
+		}
+	}
+}
+
+// sum_rows
+// ========
+//
+// Writes the sum of each row into out[row].
+static void KERNEL(sum_rows)(unsigned int rows, unsigned int cols, SCALAR *out, const SCALAR *in)
+{
+	for (unsigned int row = 0; row < rows; row++)
+	{
+		out[row] = 0;
+	}
+
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			out[row] += in[(size_t)col * rows + row];
+		}
+	}
+}
+
+// relu
+// ====
+//
+// out = max(in, 0), element by element.
+static void KERNEL(relu)(size_t size, SCALAR *out, const SCALAR *in)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		out[i] = (in[i] > 0) ? in[i] : 0;
+	}
+}
+
+// drelu
+// =====
+//
+// out = (in > 0), element by element.
+static void KERNEL(drelu)(size_t size, SCALAR *out, const SCALAR *in)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		out[i] = in[i] > 0;
+	}
+}
+
+// drelu_multiply
+// ==============
+//
+// out = gradient * (in > 0), element by element.
+static void KERNEL(drelu_multiply)(size_t size, SCALAR *out, const SCALAR *gradient, const SCALAR *in)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		out[i] = (in[i] > 0) ? gradient[i] : 0;
+	}
+}
+
+// transpose
+// =========
+//
+// Writes the (cols,rows) transpose of a (rows,cols) matrix.
+static void KERNEL(transpose)(unsigned int rows, unsigned int cols, SCALAR *out, const SCALAR *in)
+{
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			out[(size_t)row * cols + col] = in[(size_t)col * rows + row];
+		}
+	}
+}
+
+// subtract
+// ========
+//
+// out = a - b * scale, element by element.
+static void KERNEL(subtract)(size_t size, SCALAR *out, const SCALAR *a, const SCALAR *b, SCALAR scale)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		out[i] = a[i] - b[i] * scale;
+	}
+}
+
+// sum_task
+// ========
+//
+// Adds up one chunk of a SumJob, taking the matrices in order.
+//
+// Parameters:
+//   context - The SumJob.
+//      task - The chunk.
+//    worker - Unused.
+static void KERNEL(sum_task)(void *context, unsigned int task, unsigned int worker)
+{
+	SumJob *job = context;
+
+	size_t begin = (size_t)task * job->chunk;
+	size_t end = (job->size - begin < job->chunk) ? job->size : begin + job->chunk;
+
+	SCALAR *out = job->output;
+
+	for (size_t i = begin; i < end; i++)
+	{
+		SCALAR sum = ((const SCALAR*)job->inputs[0]->data)[i];
+
+		for (unsigned int input = 1; input < job->count; input++)
+		{
+			sum += ((const SCALAR*)job->inputs[input]->data)[i];
+		}
+
+		out[i] = sum;
+	}
+}
+
+// multiply_scalar
+// ===============
+//
+// out = in * value, element by element.
+static void KERNEL(multiply_scalar)(size_t size, SCALAR *out, const SCALAR *in, SCALAR value)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		out[i] = in[i] * value;
+	}
+}
+
+// softmax
+// =======
+//
+// Performs a softmax on each column, subtracting the column's largest value first.
+static void KERNEL(softmax)(unsigned int rows, unsigned int cols, SCALAR *out, const SCALAR *in)
+{
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		const SCALAR *column = in + (size_t)col * rows;
+		SCALAR *result = out + (size_t)col * rows;
+
+		SCALAR max = column[0];
+		for (unsigned int row = 1; row < rows; row++)
+		{
+			max = (column[row] > max) ? column[row] : max;
+		}
+
+		SCALAR sum = 0;
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			result[row] = EXP(column[row] - max);
+			sum += result[row];
+		}
+
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			result[row] /= sum;
+		}
+	}
+}
+
+// softmax_cross_entropy
+// =====================
+//
+// Performs a softmax on each column and writes softmax - one_hot(labels), see
+// matrix_softmax_cross_entropy_into(). Everything read from a column of the
+// input happens before anything is written to it, so the outputs may alias it.
+//
+// Return:
+//   The summed cross entropy loss over all columns.
+static double KERNEL(softmax_cross_entropy)(unsigned int rows, unsigned int cols, SCALAR *probabilities, SCALAR *gradient, const SCALAR *in, const unsigned char *labels, unsigned int *correct)
+{
+	double total_loss = 0.0;
+	unsigned int total_correct = 0;
+
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		const SCALAR *column = in + (size_t)col * rows;
+		unsigned int label = labels[col];
+
+		unsigned int response = 0;
+		for (unsigned int row = 1; row < rows; row++)
+		{
+			if (column[row] > column[response])
+			{
+				response = row;
+			}
+		}
+
+		SCALAR max = column[response];
+		SCALAR shifted_label = column[label] - max;
+
+		SCALAR *exps = NULL;
+		if (gradient != NULL)
+		{
+			exps = gradient + (size_t)col * rows;
+		}
+		else if (probabilities != NULL)
+		{
+			exps = probabilities + (size_t)col * rows;
+		}
+
+		SCALAR sum = 0;
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			SCALAR e = EXP(column[row] - max);
+
+			if (exps != NULL)
+			{
+				exps[row] = e;
+			}
+
+			sum += e;
+		}
+
+		if (exps != NULL)
+		{
+			for (unsigned int row = 0; row < rows; row++)
+			{
+				SCALAR p = exps[row] / sum;
+
+				if (probabilities != NULL)
+				{
+					probabilities[(size_t)col * rows + row] = p;
+				}
+
+				if (gradient != NULL)
+				{
+					gradient[(size_t)col * rows + row] = p - (row == label);
+				}
+			}
+		}
+
+		total_loss += log(sum) - shifted_label;
+		total_correct += response == label;
+	}
+
+	*correct = total_correct;
+
+	return total_loss;
+}
+
+// gather_bytes
+// ============
+//
+// Fills each column of out with a run of rows bytes, scaled.
+static void KERNEL(gather_bytes)(unsigned int rows, unsigned int cols, SCALAR *out, const unsigned char *bytes, const unsigned int *columns, SCALAR scale)
+{
+	for (unsigned int col = 0; col < cols; col++)
+	{
+		const unsigned char *in = bytes + (size_t)((columns != NULL) ? columns[col] : col) * rows;
+
+		for (unsigned int row = 0; row < rows; row++)
+		{
+			out[(size_t)col * rows + row] = in[row] * scale;
+		}
+	}
+}
+
+// sparse_dense
+// ============
+//
+// Computes columns first to last of c = ReLU(a * s + bias), or of a * s + bias
+// without relu, where s is sparse. Each output column adds up the columns of a
+// picked out by the nonzero elements of its column of s, so the zeros cost
+// nothing. The rows are taken SPARSE_ROWS at a time, so that the sums stay in
+// registers, and alternate elements go to two sets of sums so that one addition
+// does not wait on the last. The bytes are added up unscaled and the scale is
+// applied once per output element.
+static void KERNEL(sparse_dense)(unsigned int m, unsigned int first, unsigned int last, const SCALAR *restrict a, const MatrixSparse *s, const unsigned int *columns, SCALAR *restrict c, const SCALAR *restrict bias, bool relu)
+{
+	SCALAR scale = s->scale;
+
+	for (unsigned int col = first; col < last; col++)
+	{
+		unsigned int input = (columns != NULL) ? columns[col] : col;
+		size_t begin = s->starts[input], end = s->starts[input + 1];
+
+		for (unsigned int block = 0; block < m; block += SPARSE_ROWS)
+		{
+			unsigned int rows = (m - block < SPARSE_ROWS) ? m - block : SPARSE_ROWS;
+			const SCALAR *restrict weights = a + block;
+
+			SCALAR even[SPARSE_ROWS] = { 0 }, odd[SPARSE_ROWS] = { 0 };
+
+			size_t i = begin;
+			for (; i + 1 < end; i += 2)
+			{
+				const SCALAR *restrict w0 = weights + (size_t)s->indices[i] * m;
+				const SCALAR *restrict w1 = weights + (size_t)s->indices[i + 1] * m;
+				SCALAR v0 = s->values[i], v1 = s->values[i + 1];
+
+				for (unsigned int row = 0; row < SPARSE_ROWS; row++)
+				{
+					even[row] += ((row < rows) ? w0[row] : 0) * v0;
+					odd[row] += ((row < rows) ? w1[row] : 0) * v1;
+				}
+			}
+
+			if (i < end)
+			{
+				const SCALAR *restrict w0 = weights + (size_t)s->indices[i] * m;
+				SCALAR v0 = s->values[i];
+
+				for (unsigned int row = 0; row < SPARSE_ROWS; row++)
+				{
+					even[row] += ((row < rows) ? w0[row] : 0) * v0;
+				}
+			}
+
+			SCALAR *restrict out = c + (size_t)col * m + block;
+			for (unsigned int row = 0; row < rows; row++)
+			{
+				SCALAR value = (even[row] + odd[row]) * scale + bias[block + row];
+				out[row] = (relu && value < 0) ? 0 : value;
+			}
+		}
+	}
+}
+
+// sparse_dense_task
+// =================
+//
+// Computes one chunk of the columns of a SparseJob.
+//
+// Parameters:
+//   context - The SparseJob.
+//      task - The chunk.
+//    worker - Unused.
+static void KERNEL(sparse_dense_task)(void *context, unsigned int task, unsigned int worker)
+{
+	SparseJob *job = context;
+
+	unsigned int first = task * job->chunk;
+	unsigned int last = (job->n - first < job->chunk) ? job->n : first + job->chunk;
+
+	KERNEL(sparse_dense)(job->m, first, last, job->a, job->s, job->columns, job->c, job->bias, job->relu);
+}
+
+// sparse_multiply_t
+// =================
+//
+// c = a * s^T, where s is sparse. Each column of a is added into the columns
+// of c picked out by the nonzero elements of the matching column of s, and c
+// is scaled once at the end.
+static void KERNEL(sparse_multiply_t)(unsigned int m, unsigned int n, const SCALAR *restrict a, const MatrixSparse *s, const unsigned int *columns, SCALAR *restrict c)
+{
+	size_t size = (size_t)m * s->rows;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		c[i] = 0;
+	}
+
+	for (unsigned int col = 0; col < n; col++)
+	{
+		unsigned int input = (columns != NULL) ? columns[col] : col;
+		const SCALAR *restrict gradient = a + (size_t)col * m;
+
+		for (size_t i = s->starts[input]; i < s->starts[input + 1]; i++)
+		{
+			SCALAR *restrict out = c + (size_t)s->indices[i] * m;
+			SCALAR value = s->values[i];
+
+			for (unsigned int row = 0; row < m; row++)
+			{
+				out[row] += gradient[row] * value;
+			}
+		}
+	}
+
+	SCALAR scale = s->scale;
+	for (size_t i = 0; i < size; i++)
+	{
+		c[i] *= scale;
+	}
+}
+
+// pruned_dense
+// ============
+//
+// Computes columns first to last of c = ReLU(w * b + bias), or of w * b + bias
+// without relu, where w is pruned. The columns are taken PRUNED_LANES at a time
+// and the inputs any kept weight uses are packed side by side into tile, so
+// that each kept weight multiplies the same input of every column with one
+// vector of lanes, and pruned weights cost nothing. Alternate weights go to two
+// sets of sums so that one addition does not wait on the last.
+//
+// Parameters:
+//   tile - Room for w->cols * PRUNED_LANES elements.
+//   slot - Room for w->cols slots.
+//   used - Room for w->cols inputs.
+static void KERNEL(pruned_dense)(const MatrixPruned *w, unsigned int first, unsigned int last, const SCALAR *restrict b, SCALAR *restrict c, const SCALAR *restrict bias, bool relu, SCALAR *restrict tile, unsigned short *restrict slot, unsigned short *restrict used)
+{
+	const SCALAR *restrict values = (const SCALAR*)w->data;
+	const unsigned short *restrict indices = w->indices;
+	unsigned int k = w->cols, m = w->rows;
+
+	// Inputs no row keeps a weight for are never packed. slot gives where each
+	// used input is in the tile.
+	memset(slot, 0, sizeof(unsigned short) * k);
+	for (unsigned int i = 0; i < w->starts[m]; i++)
+	{
+		slot[indices[i]] = 1;
+	}
+
+	unsigned int count = 0;
+	for (unsigned int input = 0; input < k; input++)
+	{
+		if (slot[input] != 0)
+		{
+			slot[input] = count;
+			used[count++] = input;
+		}
+	}
+
+	for (unsigned int col = first; col < last; col += PRUNED_LANES)
+	{
+		unsigned int lanes = (last - col < PRUNED_LANES) ? last - col : PRUNED_LANES;
+		const SCALAR *restrict in = b + (size_t)col * k;
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			for (unsigned int lane = 0; lane < PRUNED_LANES; lane++)
+			{
+				tile[(size_t)i * PRUNED_LANES + lane] = (lane < lanes) ? in[(size_t)lane * k + used[i]] : 0;
+			}
+		}
+
+		for (unsigned int row = 0; row < m; row++)
+		{
+			unsigned int i = w->starts[row], end = w->starts[row + 1];
+			SCALAR even[PRUNED_LANES] = { 0 }, odd[PRUNED_LANES] = { 0 };
+
+			for (; i + 1 < end; i += 2)
+			{
+				const SCALAR *restrict in0 = tile + (size_t)slot[indices[i]] * PRUNED_LANES;
+				const SCALAR *restrict in1 = tile + (size_t)slot[indices[i + 1]] * PRUNED_LANES;
+				SCALAR w0 = values[i], w1 = values[i + 1];
+
+				for (unsigned int lane = 0; lane < PRUNED_LANES; lane++)
+				{
+					even[lane] += w0 * in0[lane];
+					odd[lane] += w1 * in1[lane];
+				}
+			}
+
+			if (i < end)
+			{
+				const SCALAR *restrict in0 = tile + (size_t)slot[indices[i]] * PRUNED_LANES;
+				SCALAR w0 = values[i];
+
+				for (unsigned int lane = 0; lane < PRUNED_LANES; lane++)
+				{
+					even[lane] += w0 * in0[lane];
+				}
+			}
+
+			for (unsigned int lane = 0; lane < lanes; lane++)
+			{
+				SCALAR value = even[lane] + odd[lane] + bias[row];
+				c[(size_t)(col + lane) * m + row] = (relu && value < 0) ? 0 : value;
+			}
+		}
+	}
+}
+
+// pruned_dense_task
+// =================
+//
+// Computes one chunk of the columns of a PrunedJob, packing them into the
+// worker's gemm pack buffer, or into a buffer of its own if they do not fit or
+// the pack buffers were never allocated, as when another backend borrows this
+// kernel.
+//
+// Parameters:
+//   context - The PrunedJob.
+//      task - The chunk.
+//    worker - The worker running the task.
+static void KERNEL(pruned_dense_task)(void *context, unsigned int task, unsigned int worker)
+{
+	PrunedJob *job = context;
+
+	unsigned int first = task * job->chunk;
+	unsigned int last = (job->n - first < job->chunk) ? job->n : first + job->chunk;
+
+	size_t tile_size = sizeof(SCALAR) * job->w->cols * PRUNED_LANES;
+	size_t size = tile_size + sizeof(unsigned short) * 2 * job->w->cols;
+	bool own = (gemm_packed_b == NULL || size > sizeof(double) * GEMM_KC * GEMM_NC);
+	SCALAR *tile = own ? malloc(size) : gemm_packed_b[worker];
+	if (tile == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	unsigned short *slot = (unsigned short*)((unsigned char*)tile + tile_size);
+	unsigned short *used = slot + job->w->cols;
+
+	KERNEL(pruned_dense)(job->w, first, last, job->b, job->c, job->bias, job->relu, tile, slot, used);
+
+	if (own)
+	{
+		free(tile);
+	}
+}
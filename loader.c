@@ -0,0 +1,488 @@
+#include "loader.h"
+
+// BatchLoader
+// ===========
+//
+// A ring of depth batch buffers. The loading thread fills slots in order at
+// filled, and batch_loader_next() hands them out in the same order at handed.
+struct BatchLoader
+{
+	IdxFile *images, *labels;
+	unsigned int count, batch_size, epochs, chunk, depth;
+	unsigned int batches;         // The number of batches in each epoch.
+	bool shuffle;
+	bool pixels;                  // Whether batches are converted into pixels.
+
+	unsigned int *order;          // The images of the current epoch, in the order they are visited.
+	unsigned int *chunks;         // The chunks of the current epoch, in the order they are visited.
+	unsigned int chunk_count;
+
+	LoaderBatch *slots;
+	unsigned long long total;     // The number of batches in every epoch together.
+	unsigned long long filled;    // The number of batches the loading thread has prepared.
+	unsigned long long handed;    // The number of batches handed out by batch_loader_next().
+	unsigned long long released;  // The number of batches handed back by batch_loader_release().
+
+	pthread_t thread;
+	bool threaded;
+	bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;         // Signalled when a slot is filled.
+	pthread_cond_t emptied;       // Signalled when a slot is released.
+
+	double consumer_wait, producer_wait;
+};
+
+// shuffle
+// =======
+//
+// Puts an array of indices into a random order.
+//
+// Parameters:
+//   order - The indices.
+//   count - The number of indices.
+static void shuffle(unsigned int *order, unsigned int count)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	for (unsigned int i = count - 1; i > 0; i--)
+	{
+		unsigned int j = rand() % (i + 1);
+		unsigned int swap = order[i];
+		order[i] = order[j];
+		order[j] = swap;
+	}
+}
+
+// chunk_size
+// ==========
+//
+// Returns the number of images in a chunk. Only the last chunk can be short.
+//
+// Parameters:
+//   loader - The loader.
+//    chunk - The chunk.
+//
+// Return:
+//   The number of images.
+static unsigned int chunk_size(BatchLoader *loader, unsigned int chunk)
+{
+	unsigned int first = chunk * loader->chunk;
+
+	return (loader->count - first < loader->chunk) ? loader->count - first : loader->chunk;
+}
+
+// advise
+// ======
+//
+// Tells the kernel whether a chunk of the image file is about to be read, or
+// is finished with and can be dropped from memory.
+//
+// Parameters:
+//   loader - The loader.
+//    chunk - The chunk.
+//   advice - MADV_WILLNEED or MADV_DONTNEED.
+static void advise(BatchLoader *loader, unsigned int chunk, int advice)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t first = (size_t)chunk * loader->chunk;
+	size_t last = first + chunk_size(loader, chunk);
+
+	uintptr_t begin = (uintptr_t)idx_item(loader->images, first);
+	uintptr_t end = (uintptr_t)idx_item(loader->images, last);
+
+	// Only whole pages can be advised on. Dropping a page shared with a
+	// neighbouring chunk costs nothing more than reading it again.
+	begin -= begin % page;
+	madvise((void*)begin, end - begin, advice);
+}
+
+// plan_epoch
+// ==========
+//
+// Chooses the order the images of the next epoch are visited in.
+//
+// Parameters:
+//   loader - The loader.
+static void plan_epoch(BatchLoader *loader)
+{
+	if (!loader->shuffle)
+	{
+		return;
+	}
+
+	if (loader->chunk_count == 1)
+	{
+		shuffle(loader->order, loader->count);
+		return;
+	}
+
+	shuffle(loader->chunks, loader->chunk_count);
+
+	unsigned int position = 0;
+	for (unsigned int i = 0; i < loader->chunk_count; i++)
+	{
+		unsigned int first = loader->chunks[i] * loader->chunk;
+		unsigned int size = chunk_size(loader, loader->chunks[i]);
+
+		for (unsigned int image = 0; image < size; image++)
+		{
+			loader->order[position + image] = first + image;
+		}
+
+		shuffle(loader->order + position, size);
+		position += size;
+	}
+}
+
+// fill
+// ====
+//
+// Converts one batch of images into a slot, and uploads it if it is kept on a device, so that the transfer overlaps
+// training too.
+//
+// Parameters:
+//   loader - The loader.
+//     slot - The slot.
+//    batch - The index of the batch within its epoch.
+static void fill(BatchLoader *loader, LoaderBatch *slot, unsigned int batch)
+{
+	const unsigned int *columns = loader->order + (size_t)batch * loader->batch_size;
+
+	// The order is shuffled again for the next epoch while the last batches of
+	// this one may still be training, so each batch keeps its own copy.
+	memcpy(slot->columns, columns, sizeof(unsigned int) * loader->batch_size);
+	for (unsigned int image = 0; image < loader->batch_size; image++)
+	{
+		slot->labels[image] = loader->labels->data[columns[image]];
+	}
+
+	if (slot->pixels != NULL)
+	{
+		matrix_gather_bytes_into(slot->pixels, loader->images->data, columns, 1 / 255.0);
+		matrix_upload(slot->pixels);
+	}
+}
+
+// produce
+// =======
+//
+// The body of the loading thread.
+//
+// Parameters:
+//   argument - The loader.
+//
+// Return:
+//   NULL.
+static void *produce(void *argument)
+{
+	BatchLoader *loader = argument;
+	bool streaming = loader->chunk_count > 1;
+
+	for (unsigned int epoch = 0; epoch < loader->epochs; epoch++)
+	{
+		plan_epoch(loader);
+
+		// The chunk being read, by its place in this epoch's order, and the
+		// position in the order where it ends.
+		unsigned int current = 0;
+		size_t current_end = chunk_size(loader, loader->chunks[0]);
+
+		if (streaming)
+		{
+			advise(loader, loader->chunks[0], MADV_WILLNEED);
+			advise(loader, loader->chunks[1], MADV_WILLNEED);
+		}
+
+		for (unsigned int batch = 0; batch < loader->batches; batch++)
+		{
+			// Once a batch reaches into the next chunk, read the one after it
+			// ahead and drop the one before.
+			size_t batch_end = (size_t)(batch + 1) * loader->batch_size;
+
+			while (streaming && batch_end > current_end && current + 1 < loader->chunk_count)
+			{
+				if (current > 0)
+				{
+					advise(loader, loader->chunks[current - 1], MADV_DONTNEED);
+				}
+
+				current++;
+				current_end += chunk_size(loader, loader->chunks[current]);
+
+				if (current + 1 < loader->chunk_count)
+				{
+					advise(loader, loader->chunks[current + 1], MADV_WILLNEED);
+				}
+			}
+
+			pthread_mutex_lock(&loader->lock);
+
+			double start = threadpool_seconds();
+			while (loader->filled - loader->released == loader->depth && !loader->stopping)
+			{
+				pthread_cond_wait(&loader->emptied, &loader->lock);
+			}
+			loader->producer_wait += threadpool_seconds() - start;
+
+			if (loader->stopping)
+			{
+				pthread_mutex_unlock(&loader->lock);
+				return NULL;
+			}
+
+			LoaderBatch *slot = &loader->slots[loader->filled % loader->depth];
+			pthread_mutex_unlock(&loader->lock);
+
+			fill(loader, slot, batch);
+
+			pthread_mutex_lock(&loader->lock);
+			loader->filled++;
+			pthread_cond_signal(&loader->ready);
+			pthread_mutex_unlock(&loader->lock);
+		}
+	}
+
+	return NULL;
+}
+
+// batch_loader_new
+// ================
+//
+// Starts a thread that converts training images into a ring of preallocated batch buffers ahead of training, so
+// that batch k + 1 is prepared while batch k trains. Each epoch the images are visited in a new random order, in
+// whole batches. The images are read from the mapped files in chunks, only a few of which are kept resident, so
+// a data set larger than memory streams from disk. The buffers take the precision of matrix_new(), and are kept on
+// the device if there is one, with each batch uploaded by the loading thread. Each batch also lists the images it
+// holds, for training from a MatrixSparse of the whole set, in which case converting the pixels can be skipped.
+//
+// Parameters:
+//       images - The images, 784 bytes each.
+//       labels - The labels.
+//        count - The number of images to use, from the start of the files.
+//   batch_size - The number of images in each batch. Images left over after the last whole batch of an epoch
+//                are skipped that epoch.
+//       epochs - The number of passes over the images.
+//      shuffle - Whether to visit the images in a new random order each epoch. Without it, a single batch is
+//                prepared once and handed out every time.
+//        chunk - The number of images in each chunk. Chunks are visited in a random order, then the images of
+//                a chunk in a random order. A chunk as large as count shuffles every image together.
+//        depth - The number of batch buffers in the ring.
+//       pixels - Whether to convert the images into pixels. Without it, batches have no pixels matrix.
+//
+// Return:
+//   The loader. Call batch_loader_free() when no longer needed.
+BatchLoader *batch_loader_new(IdxFile *images, IdxFile *labels, unsigned int count, unsigned int batch_size, unsigned int epochs, bool shuffle, unsigned int chunk, unsigned int depth, bool pixels)
+{
+	BatchLoader *loader = calloc(1, sizeof(BatchLoader));
+	if (loader == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	loader->images = images;
+	loader->labels = labels;
+	loader->count = count;
+	loader->batch_size = batch_size;
+	loader->epochs = epochs;
+	loader->shuffle = shuffle;
+	loader->pixels = pixels;
+	loader->chunk = (chunk == 0 || chunk > count) ? count : chunk;
+	loader->chunk_count = (count + loader->chunk - 1) / loader->chunk;
+	loader->batches = count / batch_size;
+	loader->total = (unsigned long long)loader->batches * epochs;
+
+	// Without shuffling every epoch repeats the same batches, and a single one
+	// never has to be prepared again.
+	bool fixed = !shuffle && loader->batches == 1;
+	loader->depth = (fixed || depth == 0) ? 1 : depth;
+
+	loader->order = malloc(sizeof(unsigned int) * count);
+	loader->chunks = malloc(sizeof(unsigned int) * loader->chunk_count);
+	loader->slots = malloc(sizeof(LoaderBatch) * loader->depth);
+
+	if (loader->order == NULL || loader->chunks == NULL || loader->slots == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	for (unsigned int image = 0; image < count; image++)
+	{
+		loader->order[image] = image;
+	}
+
+	for (unsigned int i = 0; i < loader->chunk_count; i++)
+	{
+		loader->chunks[i] = i;
+	}
+
+	for (unsigned int slot = 0; slot < loader->depth; slot++)
+	{
+		loader->slots[slot].pixels = NULL;
+		if (pixels)
+		{
+			loader->slots[slot].pixels = matrix_new(784, batch_size);
+			matrix_keep_on_device(loader->slots[slot].pixels);
+		}
+
+		loader->slots[slot].labels = malloc(batch_size);
+		loader->slots[slot].columns = malloc(sizeof(unsigned int) * batch_size);
+
+		if (loader->slots[slot].labels == NULL || loader->slots[slot].columns == NULL)
+		{
+			printf("Your computer has run out of memory :(\n");
+			exit(3);
+		}
+	}
+
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->ready, NULL);
+	pthread_cond_init(&loader->emptied, NULL);
+
+	if (fixed)
+	{
+		fill(loader, &loader->slots[0], 0);
+		return loader;
+	}
+
+	if (pthread_create(&loader->thread, NULL, produce, loader) != 0)
+	{
+		printf("Could not start the batch loading thread.\n");
+		exit(3);
+	}
+	loader->threaded = true;
+
+	return loader;
+}
+
+// batch_loader_next
+// =================
+//
+// Waits for the next batch to be ready.
+//
+// Parameters:
+//   loader - The loader.
+//
+// Return:
+//   The batch, which stays valid until it is passed to batch_loader_release(), or NULL after the last batch of
+//   the last epoch.
+LoaderBatch *batch_loader_next(BatchLoader *loader)
+{
+	if (loader->handed == loader->total)
+	{
+		return NULL;
+	}
+
+	if (!loader->threaded)
+	{
+		loader->handed++;
+		return &loader->slots[0];
+	}
+
+	pthread_mutex_lock(&loader->lock);
+
+	double start = threadpool_seconds();
+	while (loader->filled == loader->handed)
+	{
+		pthread_cond_wait(&loader->ready, &loader->lock);
+	}
+	loader->consumer_wait += threadpool_seconds() - start;
+
+	LoaderBatch *batch = &loader->slots[loader->handed % loader->depth];
+	loader->handed++;
+
+	pthread_mutex_unlock(&loader->lock);
+
+	return batch;
+}
+
+// batch_loader_release
+// ====================
+//
+// Hands a batch's buffer back to the loader to be refilled.
+//
+// Parameters:
+//   loader - The loader.
+//    batch - The batch, from batch_loader_next().
+void batch_loader_release(BatchLoader *loader, LoaderBatch *batch)
+{
+	if (!loader->threaded)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&loader->lock);
+	loader->released++;
+	pthread_cond_signal(&loader->emptied);
+	pthread_mutex_unlock(&loader->lock);
+}
+
+// batch_loader_stats
+// ==================
+//
+// Returns how long each side of the loader has spent waiting so far.
+//
+// Parameters:
+//   loader - The loader.
+//
+// Return:
+//   The counters.
+LoaderStats batch_loader_stats(BatchLoader *loader)
+{
+	pthread_mutex_lock(&loader->lock);
+
+	LoaderStats stats =
+	{
+		.batches = loader->handed,
+		.consumer_wait = loader->consumer_wait,
+		.producer_wait = loader->producer_wait
+	};
+
+	pthread_mutex_unlock(&loader->lock);
+
+	return stats;
+}
+
+// batch_loader_free
+// =================
+//
+// Stops the loading thread and releases the batch buffers.
+//
+// Parameters:
+//   loader - The loader.
+void batch_loader_free(BatchLoader *loader)
+{
+	if (loader->threaded)
+	{
+		pthread_mutex_lock(&loader->lock);
+		loader->stopping = true;
+		pthread_cond_signal(&loader->emptied);
+		pthread_mutex_unlock(&loader->lock);
+
+		pthread_join(loader->thread, NULL);
+	}
+
+	for (unsigned int slot = 0; slot < loader->depth; slot++)
+	{
+		if (loader->slots[slot].pixels != NULL)
+		{
+			matrix_free(loader->slots[slot].pixels);
+		}
+		free(loader->slots[slot].labels);
+		free(loader->slots[slot].columns);
+	}
+
+	pthread_mutex_destroy(&loader->lock);
+	pthread_cond_destroy(&loader->ready);
+	pthread_cond_destroy(&loader->emptied);
+
+	free(loader->slots);
+	free(loader->chunks);
+	free(loader->order);
+	free(loader);
+}
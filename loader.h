@@ -0,0 +1,114 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "linalg.h"
+#include "idx.h"
+
+// LoaderBatch
+// ===========
+//
+// One batch made ready by a BatchLoader.
+typedef struct
+{
+	Matrix *pixels;        // (784, batch size), each pixel scaled to between 0 and 1, or NULL if not converted.
+	unsigned char *labels; // One label per column of pixels.
+	unsigned int *columns; // The index of the image in each column of pixels.
+} LoaderBatch;
+
+// LoaderStats
+// ===========
+//
+// How long each side of a BatchLoader spent waiting on the other. A consumer that waits means loading is the
+// bottleneck, and a producer that waits means training is.
+typedef struct
+{
+	unsigned long long batches; // The number of batches handed out so far.
+	double consumer_wait;       // Seconds batch_loader_next() spent waiting for a batch to be ready.
+	double producer_wait;       // Seconds the loading thread spent waiting for a free buffer.
+} LoaderStats;
+
+// BatchLoader
+// ===========
+//
+// Prepares training batches on a background thread. See batch_loader_new().
+typedef struct BatchLoader BatchLoader;
+
+	// batch_loader_new
+	// ================
+	//
+	// Starts a thread that converts training images into a ring of preallocated batch buffers ahead of training, so
+	// that batch k + 1 is prepared while batch k trains. Each epoch the images are visited in a new random order, in
+	// whole batches. The images are read from the mapped files in chunks, only a few of which are kept resident, so
+	// a data set larger than memory streams from disk. The buffers take the precision of matrix_new(), and are kept on
+	// the device if there is one, with each batch uploaded by the loading thread. Each batch also lists the images it
+	// holds, for training from a MatrixSparse of the whole set, in which case converting the pixels can be skipped.
+	//
+	// Parameters:
+	//       images - The images, 784 bytes each.
+	//       labels - The labels.
+	//        count - The number of images to use, from the start of the files.
+	//   batch_size - The number of images in each batch. Images left over after the last whole batch of an epoch
+	//                are skipped that epoch.
+	//       epochs - The number of passes over the images.
+	//      shuffle - Whether to visit the images in a new random order each epoch. Without it, a single batch is
+	//                prepared once and handed out every time.
+	//        chunk - The number of images in each chunk. Chunks are visited in a random order, then the images of
+	//                a chunk in a random order. A chunk as large as count shuffles every image together.
+	//        depth - The number of batch buffers in the ring.
+	//       pixels - Whether to convert the images into pixels. Without it, batches have no pixels matrix.
+	//
+	// Return:
+	//   The loader. Call batch_loader_free() when no longer needed.
+	BatchLoader *batch_loader_new(IdxFile *images, IdxFile *labels, unsigned int count, unsigned int batch_size, unsigned int epochs, bool shuffle, unsigned int chunk, unsigned int depth, bool pixels);
+
+	// batch_loader_next
+	// =================
+	//
+	// Waits for the next batch to be ready.
+	//
+	// Parameters:
+	//   loader - The loader.
+	//
+	// Return:
+	//   The batch, which stays valid until it is passed to batch_loader_release(), or NULL after the last batch of
+	//   the last epoch.
+	LoaderBatch *batch_loader_next(BatchLoader *loader);
+
+	// batch_loader_release
+	// ====================
+	//
+	// Hands a batch's buffer back to the loader to be refilled.
+	//
+	// Parameters:
+	//   loader - The loader.
+	//    batch - The batch, from batch_loader_next().
+	void batch_loader_release(BatchLoader *loader, LoaderBatch *batch);
+
+	// batch_loader_stats
+	// ==================
+	//
+	// Returns how long each side of the loader has spent waiting so far.
+	//
+	// Parameters:
+	//   loader - The loader.
+	//
+	// Return:
+	//   The counters.
+	LoaderStats batch_loader_stats(BatchLoader *loader);
+
+	// batch_loader_free
+	// =================
+	//
+	// Stops the loading thread and releases the batch buffers.
+	//
+	// Parameters:
+	//   loader - The loader.
+	void batch_loader_free(BatchLoader *loader);
+
+#endif // LOADER_H
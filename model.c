@@ -0,0 +1,327 @@
+#include "model.h"
+
+// The magic number as read on a machine of the other byte order.
+#define MODEL_MAGIC_SWAPPED 0x4E4D444C
+
+// crc32
+// =====
+//
+// Computes the CRC-32 (as used by zip and PNG) of some bytes.
+//
+// Parameters:
+//   data - The bytes.
+//   size - The number of bytes.
+//
+// Return:
+//   The checksum.
+static uint32_t crc32(const unsigned char *data, size_t size)
+{
+	uint32_t crc = 0xFFFFFFFF;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		crc ^= data[i];
+
+		for (unsigned int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+// align
+// =====
+//
+// Rounds an offset up to a multiple of MODEL_ALIGNMENT.
+//
+// Parameters:
+//   offset - The offset.
+//
+// Return:
+//   The rounded offset.
+static uint64_t align(uint64_t offset)
+{
+	return (offset + MODEL_ALIGNMENT - 1) & ~(uint64_t)(MODEL_ALIGNMENT - 1);
+}
+
+// model_type_size
+// ===============
+//
+// Returns the size in bytes of one element of a type.
+//
+// Parameters:
+//   type - The type.
+//
+// Return:
+//   The size of an element, or 0 if the type is unknown.
+size_t model_type_size(ModelType type)
+{
+	switch (type)
+	{
+	case MODEL_F64:
+		return sizeof(double);
+	case MODEL_F32:
+		return sizeof(float);
+	case MODEL_INT8:
+		return sizeof(int8_t);
+	case MODEL_U16:
+		return sizeof(uint16_t);
+	case MODEL_U32:
+		return sizeof(uint32_t);
+	}
+
+	return 0;
+}
+
+// model_save
+// ==========
+//
+// Writes a model file. The file is written under a temporary name and then renamed over path, so a reader never sees
+// half of it, and a reader that already has the old file mapped keeps it.
+//
+// Parameters:
+//      path - The path to write to.
+//   tensors - The tensors.
+//     count - The number of tensors.
+//
+// Return:
+//   false if the file could not be written.
+bool model_save(const char *path, const ModelTensorData *tensors, unsigned int count)
+{
+	// The whole file is laid out in memory first, so that it can be checksummed
+	// and written in one go. Models are small.
+	uint64_t size = align(sizeof(ModelHeader) + sizeof(ModelTensor) * count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		size = align(size + model_type_size(tensors[i].type) * tensors[i].rows * tensors[i].cols);
+	}
+
+	unsigned char *bytes = calloc(size, 1);
+	if (bytes == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	ModelHeader *header = (ModelHeader*)bytes;
+	ModelTensor *table = (ModelTensor*)(bytes + sizeof(ModelHeader));
+
+	header->magic = MODEL_MAGIC;
+	header->version = MODEL_VERSION;
+	header->tensor_count = count;
+	header->alignment = MODEL_ALIGNMENT;
+	header->size = size;
+
+	uint64_t offset = align(sizeof(ModelHeader) + sizeof(ModelTensor) * count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (strlen(tensors[i].name) >= MODEL_NAME_SIZE)
+		{
+			printf("The tensor name '%s' is too long for a model file.\n", tensors[i].name);
+			exit(7);
+		}
+
+		strcpy(table[i].name, tensors[i].name);
+		table[i].type = tensors[i].type;
+		table[i].rows = tensors[i].rows;
+		table[i].cols = tensors[i].cols;
+		table[i].offset = offset;
+		table[i].size = model_type_size(tensors[i].type) * tensors[i].rows * tensors[i].cols;
+
+		memcpy(bytes + offset, tensors[i].data, table[i].size);
+		offset = align(offset + table[i].size);
+	}
+
+	header->checksum = crc32(bytes + sizeof(ModelHeader), size - sizeof(ModelHeader));
+
+	char *temporary = malloc(strlen(path) + 5);
+	if (temporary == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+	sprintf(temporary, "%s.tmp", path);
+
+	FILE *file = fopen(temporary, "wb");
+	bool written = file != NULL && fwrite(bytes, 1, size, file) == size;
+
+	if (file != NULL && fclose(file) != 0)
+	{
+		written = false;
+	}
+
+	if (written && rename(temporary, path) != 0)
+	{
+		written = false;
+	}
+
+	if (!written)
+	{
+		remove(temporary);
+	}
+
+	free(temporary);
+	free(bytes);
+
+	return written;
+}
+
+// model_open
+// ==========
+//
+// Maps a model file into memory and checks its header, tensor table and checksum. Exits if the file is not a model
+// file of a version this build reads.
+//
+// Parameters:
+//   path - The path to the file.
+//
+// Return:
+//   The mapped file, or NULL if it could not be opened. Call model_close() when no longer needed.
+ModelFile *model_open(const char *path)
+{
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor == -1)
+	{
+		return NULL;
+	}
+
+	struct stat metadata;
+	if (fstat(descriptor, &metadata) == -1)
+	{
+		close(descriptor);
+		return NULL;
+	}
+
+	size_t size = metadata.st_size;
+	if (size < sizeof(ModelHeader))
+	{
+		printf("'%s' is too short to be a model file. Run train again.\n", path);
+		exit(7);
+	}
+
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+
+	if (mapping == MAP_FAILED)
+	{
+		printf("Could not map '%s' into memory.\n", path);
+		exit(7);
+	}
+
+	const ModelHeader *header = mapping;
+
+	if (header->magic == MODEL_MAGIC_SWAPPED)
+	{
+		printf("'%s' was written on a machine of the other byte order. Run train again.\n", path);
+		exit(7);
+	}
+
+	if (header->magic != MODEL_MAGIC)
+	{
+		printf("'%s' is not a model file, or is from an older version of numeros. Run train again.\n", path);
+		exit(7);
+	}
+
+	if (header->version < MODEL_MIN_VERSION || header->version > MODEL_VERSION)
+	{
+		printf("'%s' is a version %u model file, but this numeros reads versions %u to %u.\n", path, header->version, MODEL_MIN_VERSION, MODEL_VERSION);
+		exit(7);
+	}
+
+	if (header->size != size || (size - sizeof(ModelHeader)) / sizeof(ModelTensor) < header->tensor_count)
+	{
+		printf("'%s' is not the size its header says. Run train again.\n", path);
+		exit(7);
+	}
+
+	if (header->checksum != crc32((const unsigned char*)mapping + sizeof(ModelHeader), size - sizeof(ModelHeader)))
+	{
+		printf("'%s' is corrupt: its checksum does not match. Run train again.\n", path);
+		exit(7);
+	}
+
+	const ModelTensor *tensors = (const ModelTensor*)(header + 1);
+
+	for (unsigned int i = 0; i < header->tensor_count; i++)
+	{
+		const ModelTensor *tensor = &tensors[i];
+		size_t element_size = model_type_size(tensor->type);
+
+		if (memchr(tensor->name, 0, MODEL_NAME_SIZE) == NULL || element_size == 0
+			|| tensor->size != (uint64_t)element_size * tensor->rows * tensor->cols
+			|| tensor->offset % MODEL_ALIGNMENT != 0 || tensor->offset > size || tensor->size > size - tensor->offset)
+		{
+			printf("Tensor %u of '%s' is malformed. Run train again.\n", i, path);
+			exit(7);
+		}
+	}
+
+	ModelFile *file = malloc(sizeof(ModelFile));
+	if (file == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	file->header = header;
+	file->tensors = tensors;
+	file->mapping = mapping;
+	file->mapping_size = size;
+
+	return file;
+}
+
+// model_find
+// ==========
+//
+// Looks up a tensor of a model file by name.
+//
+// Parameters:
+//   file - The file.
+//   name - The name of the tensor.
+//
+// Return:
+//   The tensor, or NULL if the file has none of that name.
+const ModelTensor *model_find(ModelFile *file, const char *name)
+{
+	for (unsigned int i = 0; i < file->header->tensor_count; i++)
+	{
+		if (strcmp(file->tensors[i].name, name) == 0)
+		{
+			return &file->tensors[i];
+		}
+	}
+
+	return NULL;
+}
+
+// model_tensor_data
+// =================
+//
+// Returns the elements of a tensor of a model file.
+//
+// Parameters:
+//     file - The file.
+//   tensor - The tensor, from model_find().
+//
+// Return:
+//   The first element, aligned to MODEL_ALIGNMENT bytes. Read only, and valid until model_close().
+const void *model_tensor_data(ModelFile *file, const ModelTensor *tensor)
+{
+	return (const unsigned char*)file->mapping + tensor->offset;
+}
+
+// model_close
+// ===========
+//
+// Unmaps a model file.
+//
+// Parameters:
+//   file - The file.
+void model_close(ModelFile *file)
+{
+	munmap(file->mapping, file->mapping_size);
+	free(file);
+}
@@ -0,0 +1,170 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The first four bytes of a model file, "NMDL" in the byte order of the machine that wrote it, the version of the
+// layout described below, and the oldest version still read. Version 2 added the integer tensor types. Readers
+// refuse versions they do not know.
+#define MODEL_MAGIC 0x4C444D4E
+#define MODEL_VERSION 2
+#define MODEL_MIN_VERSION 1
+
+// Every tensor starts at a multiple of this many bytes from the start of the file, so mapped tensors are aligned for
+// vector loads.
+#define MODEL_ALIGNMENT 64
+
+// The longest tensor name, including its terminating zero.
+#define MODEL_NAME_SIZE 16
+
+// ModelType
+// =========
+//
+// The element type of a tensor.
+typedef enum
+{
+	MODEL_F64 = 1,
+	MODEL_F32 = 2,
+	MODEL_INT8 = 3,
+	MODEL_U16 = 4,
+	MODEL_U32 = 5
+} ModelType;
+
+// ModelHeader
+// ===========
+//
+// The start of a model file. It is followed by tensor_count ModelTensors, then by the tensors' elements.
+typedef struct
+{
+	uint32_t magic;        // MODEL_MAGIC.
+	uint32_t version;      // MODEL_VERSION.
+	uint32_t tensor_count;
+	uint32_t alignment;    // MODEL_ALIGNMENT when written.
+	uint64_t size;         // The size of the whole file.
+	uint32_t checksum;     // The CRC-32 of everything after the header.
+	uint32_t reserved;
+} ModelHeader;
+
+// ModelTensor
+// ===========
+//
+// Where one tensor of a model file is, and its shape. Elements are stored column major, as in a Matrix.
+typedef struct
+{
+	char name[MODEL_NAME_SIZE]; // Zero terminated.
+	uint32_t type;              // A ModelType.
+	uint32_t rows, cols;
+	uint32_t reserved;
+	uint64_t offset;            // From the start of the file.
+	uint64_t size;              // In bytes.
+} ModelTensor;
+
+// ModelTensorData
+// ===============
+//
+// A tensor to be written by model_save().
+typedef struct
+{
+	const char *name;
+	ModelType type;
+	unsigned int rows, cols;
+	const void *data;
+} ModelTensorData;
+
+// ModelFile
+// =========
+//
+// A model file mapped into memory. Its tensors are used straight out of the mapping, without being copied or
+// converted.
+typedef struct
+{
+	const ModelHeader *header;
+	const ModelTensor *tensors; // header->tensor_count of them.
+	void *mapping;
+	size_t mapping_size;
+} ModelFile;
+
+	// model_type_size
+	// ===============
+	//
+	// Returns the size in bytes of one element of a type.
+	//
+	// Parameters:
+	//   type - The type.
+	//
+	// Return:
+	//   The size of an element, or 0 if the type is unknown.
+	size_t model_type_size(ModelType type);
+
+	// model_save
+	// ==========
+	//
+	// Writes a model file. The file is written under a temporary name and then renamed over path, so a reader never
+	// sees half of it, and a reader that already has the old file mapped keeps it.
+	//
+	// Parameters:
+	//      path - The path to write to.
+	//   tensors - The tensors.
+	//     count - The number of tensors.
+	//
+	// Return:
+	//   false if the file could not be written.
+	bool model_save(const char *path, const ModelTensorData *tensors, unsigned int count);
+
+	// model_open
+	// ==========
+	//
+	// Maps a model file into memory and checks its header, tensor table and checksum. Exits if the file is not a
+	// model file of a version this build reads.
+	//
+	// Parameters:
+	//   path - The path to the file.
+	//
+	// Return:
+	//   The mapped file, or NULL if it could not be opened. Call model_close() when no longer needed.
+	ModelFile *model_open(const char *path);
+
+	// model_find
+	// ==========
+	//
+	// Looks up a tensor of a model file by name.
+	//
+	// Parameters:
+	//   file - The file.
+	//   name - The name of the tensor.
+	//
+	// Return:
+	//   The tensor, or NULL if the file has none of that name.
+	const ModelTensor *model_find(ModelFile *file, const char *name);
+
+	// model_tensor_data
+	// =================
+	//
+	// Returns the elements of a tensor of a model file.
+	//
+	// Parameters:
+	//     file - The file.
+	//   tensor - The tensor, from model_find().
+	//
+	// Return:
+	//   The first element, aligned to MODEL_ALIGNMENT bytes. Read only, and valid until model_close().
+	const void *model_tensor_data(ModelFile *file, const ModelTensor *tensor);
+
+	// model_close
+	// ===========
+	//
+	// Unmaps a model file.
+	//
+	// Parameters:
+	//   file - The file.
+	void model_close(ModelFile *file);
+
+#endif // MODEL_H
@@ -1,394 +1,2219 @@
 ﻿#include "numeros.h"
 
+// parse_count
+// ===========
+//
+// Reads the whole number given to an option, which must be positive and fill the rest of the argument.
+//
+// Parameters:
+//    text - The text after the '=' of the option.
+//   count - Set to the number when it is valid.
+//
+// Return:
+//   Whether the text was a positive whole number that fits an unsigned int.
+static bool parse_count(const char *text, unsigned int *count)
+{
+	char *end;
+	long long value = strtoll(text, &end, 10);
+
+	if (end == text || *end != '\0' || value < 1 || value > UINT_MAX)
+	{
+		return false;
+	}
+
+	*count = value;
+	return true;
+}
+
+// parse_number
+// ============
+//
+// Reads the number given to an option, which must fill the rest of the argument.
+//
+// Parameters:
+//    text - The text after the '=' of the option.
+//   value - Set to the number when it is valid.
+//
+// Return:
+//   Whether the text was a number.
+static bool parse_number(const char *text, double *value)
+{
+	char *end;
+	double parsed = strtod(text, &end);
+
+	if (end == text || *end != '\0' || isnan(parsed))
+	{
+		return false;
+	}
+
+	*value = parsed;
+	return true;
+}
+
 int main(int argc, char **argv)
 {
-	if (argc <= 1)
+	// --threads=N, --device=NAME, --backend=NAME and --memory may appear anywhere, and are removed before the command
+	// is read.
+	unsigned int threads = 0;
+	DeviceKind device = DEVICE_DEFAULT;
+	const char *backend = NULL;
+	bool memory = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--threads=", 10) == 0)
+		{
+			long requested = strtol(argv[i] + 10, NULL, 10);
+			if (requested <= 0)
+			{
+				printf("--threads needs a positive number of threads.\n");
+				return 0;
+			}
+
+			threads = requested;
+		}
+		else if (strncmp(argv[i], "--device=", 9) == 0)
+		{
+			if (strequ(argv[i] + 9, "none"))
+			{
+				device = DEVICE_NONE;
+			}
+			else if (strequ(argv[i] + 9, "cuda"))
+			{
+				device = DEVICE_CUDA;
+			}
+			else if (strequ(argv[i] + 9, "emulated"))
+			{
+				device = DEVICE_EMULATED;
+			}
+			else
+			{
+				printf("--device must be none, cuda or emulated.\n");
+				return 0;
+			}
+		}
+		else if (strncmp(argv[i], "--backend=", 10) == 0)
+		{
+			backend = argv[i] + 10;
+		}
+		else if (strequ(argv[i], "--memory"))
+		{
+			memory = true;
+		}
+		else
+		{
+			continue;
+		}
+
+		memmove(&argv[i], &argv[i + 1], sizeof(char*) * (argc - i));
+		argc--;
+		i--;
+	}
+
+	if (argc <= 1)
+	{
+		printf("numeros requires on of the following:\n  - \"test\"\n  - \"train\"\n  - \"prune\"\n  - \"serve\"\n  - \"classify\"\n  - a filename.\n");
+		return 0;
+	}
+
+	matrix_init(threads, device, backend);
+
+	if (strequ(argv[1], "train"))
+	{
+		TrainOptions options =
+		{
+			.precision = MATRIX_F64,
+			.images = 0,
+			.batch_size = MINIBATCH_SIZE,
+			.epochs = EPOCHS,
+			.learning_rate = LEARNING_RATE,
+			.shuffle = true,
+			.target = 0.0,
+			.trace = NULL,
+			.input = INPUT_AUTO
+		};
+
+		for (int i = 2; i < argc; i++)
+		{
+			if (strequ(argv[i], "--precision=f64"))
+			{
+				options.precision = MATRIX_F64;
+			}
+			else if (strequ(argv[i], "--precision=f32"))
+			{
+				options.precision = MATRIX_F32;
+			}
+			else if (strncmp(argv[i], "--batch-size=", 13) == 0)
+			{
+				if (!parse_count(argv[i] + 13, &options.batch_size))
+				{
+					printf("--batch-size needs a positive whole number of images.\n");
+					return 0;
+				}
+			}
+			else if (strncmp(argv[i], "--epochs=", 9) == 0)
+			{
+				if (!parse_count(argv[i] + 9, &options.epochs))
+				{
+					printf("--epochs needs a positive whole number of passes.\n");
+					return 0;
+				}
+			}
+			else if (strncmp(argv[i], "--learning-rate=", 16) == 0)
+			{
+				if (!parse_number(argv[i] + 16, &options.learning_rate) || options.learning_rate <= 0)
+				{
+					printf("--learning-rate needs a positive number.\n");
+					return 0;
+				}
+			}
+			else if (strncmp(argv[i], "--target=", 9) == 0)
+			{
+				double percent;
+				if (!parse_number(argv[i] + 9, &percent) || percent < 0 || percent > 100)
+				{
+					printf("--target needs a percentage from 0 to 100.\n");
+					return 0;
+				}
+
+				options.target = percent / 100.0;
+			}
+			else if (strncmp(argv[i], "--trace=", 8) == 0)
+			{
+#if USE_PROFILE
+				options.trace = argv[i] + 8;
+#else
+				printf("numeros was built without -DUSE_PROFILE=1, so --trace is ignored.\n");
+#endif
+			}
+			else if (strequ(argv[i], "--input=auto"))
+			{
+				options.input = INPUT_AUTO;
+			}
+			else if (strequ(argv[i], "--input=dense"))
+			{
+				options.input = INPUT_DENSE;
+			}
+			else if (strequ(argv[i], "--input=sparse"))
+			{
+				options.input = INPUT_SPARSE;
+			}
+			else if (strequ(argv[i], "--full-batch"))
+			{
+				// The original scheme: every step uses the same first BATCH_SIZE images.
+				options.images = BATCH_SIZE;
+				options.batch_size = BATCH_SIZE;
+				options.epochs = ITERATIONS;
+				options.learning_rate = 0.1;
+				options.shuffle = false;
+			}
+			else
+			{
+				printf("Unknown option '%s'. train accepts --precision=f64|f32, --batch-size=N, --epochs=N, "
+					"--learning-rate=X, --target=PERCENT, --trace=PATH, --input=auto|dense|sparse and --full-batch.\n", argv[i]);
+				return 0;
+			}
+		}
+
+		train(options);
+	}
+	else if (strequ(argv[1], "test"))
+	{
+		bool int8 = false;
+		InputMode input = INPUT_AUTO;
+
+		for (int i = 2; i < argc; i++)
+		{
+			if (strequ(argv[i], "--int8"))
+			{
+				int8 = true;
+			}
+			else if (strequ(argv[i], "--input=auto"))
+			{
+				input = INPUT_AUTO;
+			}
+			else if (strequ(argv[i], "--input=dense"))
+			{
+				input = INPUT_DENSE;
+			}
+			else if (strequ(argv[i], "--input=sparse"))
+			{
+				input = INPUT_SPARSE;
+			}
+			else
+			{
+				printf("Unknown option '%s'. test accepts --int8 and --input=auto|dense|sparse.\n", argv[i]);
+				return 0;
+			}
+		}
+
+		test(int8, input);
+	}
+	else if (strequ(argv[1], "classify"))
+	{
+		bool json = false;
+		bool int8 = false;
+		unsigned int count = 0;
+
+		// Options are taken out, leaving the images at the start of argv + 2.
+		for (int i = 2; i < argc; i++)
+		{
+			if (strequ(argv[i], "--format=csv"))
+			{
+				json = false;
+			}
+			else if (strequ(argv[i], "--format=json"))
+			{
+				json = true;
+			}
+			else if (strequ(argv[i], "--int8"))
+			{
+				int8 = true;
+			}
+			else if (strncmp(argv[i], "--", 2) == 0)
+			{
+				printf("Unknown option '%s'. classify accepts --format=csv|json and --int8.\n", argv[i]);
+				return 0;
+			}
+			else
+			{
+				argv[2 + count++] = argv[i];
+			}
+		}
+
+		classify(argv + 2, count, json, int8);
+	}
+	else if (strequ(argv[1], "serve"))
+	{
+		ServerOptions options =
+		{
+			.path = SERVE_SOCKET,
+			.max_batch = SERVE_MAX_BATCH,
+			.window = SERVE_WINDOW,
+			.report_interval = SERVE_REPORT_INTERVAL
+		};
+		bool int8 = false;
+
+		for (int i = 2; i < argc; i++)
+		{
+			if (strncmp(argv[i], "--socket=", 9) == 0)
+			{
+				options.path = argv[i] + 9;
+			}
+			else if (strncmp(argv[i], "--max-batch=", 12) == 0)
+			{
+				options.max_batch = strtol(argv[i] + 12, NULL, 10);
+			}
+			else if (strncmp(argv[i], "--window=", 9) == 0)
+			{
+				options.window = strtod(argv[i] + 9, NULL) / 1e3;
+			}
+			else if (strncmp(argv[i], "--report=", 9) == 0)
+			{
+				options.report_interval = strtod(argv[i] + 9, NULL);
+			}
+			else if (strequ(argv[i], "--int8"))
+			{
+				int8 = true;
+			}
+			else
+			{
+				printf("Unknown option '%s'. serve accepts --socket=PATH, --max-batch=N, --window=MILLISECONDS, "
+					"--report=SECONDS and --int8.\n", argv[i]);
+				return 0;
+			}
+		}
+
+		if (options.max_batch == 0 || options.window < 0 || options.report_interval <= 0)
+		{
+			printf("serve needs a positive --max-batch and --report, and a --window of at least 0.\n");
+			return 0;
+		}
+
+		serve(options, int8);
+	}
+	else if (strequ(argv[1], "prune"))
+	{
+		double sparsity = -1;
+
+		for (int i = 2; i < argc; i++)
+		{
+			if (strncmp(argv[i], "--sparsity=", 11) == 0)
+			{
+				if (!parse_number(argv[i] + 11, &sparsity))
+				{
+					printf("--sparsity needs a number, the fraction of the weights to prune.\n");
+					return 0;
+				}
+			}
+			else
+			{
+				printf("Unknown option '%s'. prune accepts --sparsity=X.\n", argv[i]);
+				return 0;
+			}
+		}
+
+		if (!(sparsity >= 0 && sparsity < 1))
+		{
+			printf("prune needs a --sparsity of at least 0 and less than 1, the fraction of the weights to prune.\n");
+			return 0;
+		}
+
+		prune(sparsity);
+	}
+	else
+	{
+		bool int8 = (argc > 2 && strequ(argv[2], "--int8"));
+		image(argv[1], int8);
+	}
+
+	if (memory)
+	{
+		matrix_memory_report();
+	}
+
+	matrix_shutdown();
+
+	return 0;
+}
+
+// print_device_stats
+// ==================
+//
+// Prints what has moved between the host and the device, if there is one.
+static void print_device_stats(void)
+{
+	if (device_kind() == DEVICE_NONE)
+	{
+		return;
+	}
+
+	DeviceStats stats = device_stats();
+	printf("Device: %llu uploads (%.1lfMB), %llu downloads (%.1lfMB), %llu blocks allocated and %llu reused.\n",
+		stats.uploads, stats.upload_bytes / 1e6, stats.downloads, stats.download_bytes / 1e6, stats.allocations, stats.reuses);
+}
+
+// predict
+// =======
+//
+// Picks the digit an image is classified as, the row of its column of the output with the largest value. The softmax
+// does not change which value is largest, so the logits before it can be given instead, and the softmax skipped.
+//
+// Parameters:
+//   output - The output of the model, or its logits, one column per image.
+//    image - The column of the image.
+//
+// Return:
+//   The digit.
+static unsigned char predict(Matrix *output, unsigned int image)
+{
+	unsigned char digit = 0;
+
+	for (unsigned int row = 1; row < output->rows; row++)
+	{
+		if (matrix_get(output, row, image) > matrix_get(output, digit, image))
+		{
+			digit = row;
+		}
+	}
+
+	return digit;
+}
+
+// brainsave_tensor
+// ================
+//
+// Wraps a tensor of the brainsave file in a matrix, in place.
+//
+// Parameters:
+//   brainsave - The mapped brainsave file.
+//        name - The name of the tensor.
+//        rows - The number of rows it must have.
+//        cols - The number of columns it must have.
+//        type - The element type it must have.
+//
+// Return:
+//   The matrix, which reads from the mapping and must be freed before the file is closed.
+static Matrix *brainsave_tensor(ModelFile *brainsave, const char *name, unsigned int rows, unsigned int cols, ModelType type)
+{
+	const ModelTensor *tensor = model_find(brainsave, name);
+
+	if (tensor == NULL || tensor->rows != rows || tensor->cols != cols || tensor->type != type)
+	{
+		printf("The brainsave file is corrupt. Run train again.\n");
+		exit(4);
+	}
+
+	return matrix_wrap(rows, cols, (type == MODEL_F32) ? MATRIX_F32 : MATRIX_F64, model_tensor_data(brainsave, tensor));
+}
+
+// read_pruned
+// ===========
+//
+// Wraps the kept weights of the first layer saved by prune(), in place, after checking that every offset and column
+// is in range so that the pruned kernel cannot read outside the file.
+//
+// Parameters:
+//   brainsave - The mapped brainsave file.
+//        rows - The number of rows of the first layer's weights.
+//        cols - The number of columns of the first layer's weights.
+//        type - The element type the kept weights must have.
+//
+// Return:
+//   The pruned weights, which must be freed before the file is closed, or NULL if the file has none.
+static MatrixPruned *read_pruned(ModelFile *brainsave, unsigned int rows, unsigned int cols, ModelType type)
+{
+	const ModelTensor *starts = model_find(brainsave, "W1.starts");
+	const ModelTensor *indices = model_find(brainsave, "W1.indices");
+	const ModelTensor *values = model_find(brainsave, "W1.values");
+
+	if (starts == NULL && indices == NULL && values == NULL)
+	{
+		return NULL;
+	}
+
+	bool valid = starts != NULL && indices != NULL && values != NULL
+		&& starts->type == MODEL_U32 && starts->rows == rows + 1 && starts->cols == 1
+		&& indices->type == MODEL_U16 && indices->cols == 1
+		&& values->type == type && values->rows == indices->rows && values->cols == 1;
+
+	const uint32_t *offsets = valid ? model_tensor_data(brainsave, starts) : NULL;
+	const uint16_t *columns = valid ? model_tensor_data(brainsave, indices) : NULL;
+
+	valid = valid && offsets[0] == 0 && offsets[rows] == indices->rows;
+	for (unsigned int row = 0; valid && row < rows; row++)
+	{
+		valid = offsets[row] <= offsets[row + 1];
+	}
+	for (unsigned int i = 0; valid && i < indices->rows; i++)
+	{
+		valid = columns[i] < cols;
+	}
+
+	if (!valid)
+	{
+		printf("The brainsave file is corrupt. Run train again.\n");
+		exit(4);
+	}
+
+	return matrix_pruned_wrap(rows, cols, (type == MODEL_F32) ? MATRIX_F32 : MATRIX_F64, offsets, columns, model_tensor_data(brainsave, values));
+}
+
+// read_brainsave
+// ==============
+//
+// Maps the weights saved by train(). The weights are used straight out of the file rather than read into new
+// matrices, and their precision becomes the precision of matrix_new() so that inputs match them. A model pruned by
+// prune() keeps only the kept weights of its first layer, which are written out in full into a new W1 for callers
+// that cannot use them as they are.
+//
+// Parameters:
+//       W1 - Set to the first layer's weights, or to NULL if the model is pruned and pruned is not NULL.
+//       W2 - Set to the second layer's weights.
+//       b1 - Set to the first layer's biases.
+//       b2 - Set to the second layer's biases.
+//   pruned - Set to the kept weights of the first layer if prune() saved them, otherwise NULL. May be NULL.
+//
+// Return:
+//   The mapped file, or NULL if there is no brainsave file. Free the matrices before calling model_close().
+static ModelFile *read_brainsave(Matrix **W1, Matrix **W2, Matrix **b1, Matrix **b2, MatrixPruned **pruned)
+{
+	ModelFile *brainsave = model_open("brainsave");
+	if (brainsave == NULL)
+	{
+		return NULL;
+	}
+
+	const ModelTensor *second = model_find(brainsave, "W2");
+	ModelType type = (second != NULL && second->type == MODEL_F32) ? MODEL_F32 : MODEL_F64;
+
+	*W2 = brainsave_tensor(brainsave, "W2", 10, 10, type);
+	*b1 = brainsave_tensor(brainsave, "b1", 10, 1, type);
+	*b2 = brainsave_tensor(brainsave, "b2", 10, 1, type);
+
+	matrix_use_precision((*W2)->precision);
+
+	MatrixPruned *kept = read_pruned(brainsave, 10, 784, type);
+	if (kept == NULL)
+	{
+		*W1 = brainsave_tensor(brainsave, "W1", 10, 784, type);
+	}
+	else if (pruned == NULL)
+	{
+		*W1 = matrix_pruned_expand(kept);
+		matrix_pruned_free(kept);
+		kept = NULL;
+	}
+	else
+	{
+		*W1 = NULL;
+	}
+
+	if (pruned != NULL)
+	{
+		*pruned = kept;
+	}
+
+	return brainsave;
+}
+
+// read_quantized
+// ==============
+//
+// Gets the int8 model for the weights of the brainsave file. train() saves a quantized first layer alongside the
+// floating point one, which is used in place; a file without one, such as a pruned model, is quantized here instead.
+//
+// Parameters:
+//   brainsave - The mapped brainsave file.
+//          W1 - The first layer's weights, from read_brainsave() given no pruned weights to set.
+//          W2 - The second layer's weights.
+//          b1 - The first layer's biases.
+//          b2 - The second layer's biases.
+//
+// Return:
+//   The quantized model, which must be freed before the file is closed.
+static QuantizedModel *read_quantized(ModelFile *brainsave, Matrix *W1, Matrix *W2, Matrix *b1, Matrix *b2)
+{
+	const ModelTensor *weights = model_find(brainsave, "W1.int8");
+	const ModelTensor *scales = model_find(brainsave, "W1.scale");
+
+	if (weights == NULL || scales == NULL)
+	{
+		return quantized_new(W1, W2, b1, b2);
+	}
+
+	if (weights->type != MODEL_INT8 || weights->cols != W1->rows || weights->rows < W1->cols || weights->rows % 32 != 0
+		|| scales->type != MODEL_F32 || scales->rows != W1->rows || scales->cols != 1)
+	{
+		printf("The brainsave file is corrupt. Run train again.\n");
+		exit(4);
+	}
+
+	return quantized_wrap(W1->cols, weights->rows, model_tensor_data(brainsave, weights), model_tensor_data(brainsave, scales), W2, b1, b2);
+}
+
+// write_brainsave
+// ===============
+//
+// Saves the weights for test() and image(), along with an int8 copy of the first layer for their --int8 paths. A
+// pruned first layer is saved as its kept weights alone, in place of both.
+//
+// Parameters:
+//       W1 - The first layer's weights. Not saved if pruned is not NULL.
+//       W2 - The second layer's weights.
+//       b1 - The first layer's biases.
+//       b2 - The second layer's biases.
+//   pruned - The kept weights of W1, from matrix_prune(), or NULL if it is not pruned.
+static void write_brainsave(Matrix *W1, Matrix *W2, Matrix *b1, Matrix *b2, MatrixPruned *pruned)
+{
+	ModelType type = (W2->precision == MATRIX_F32) ? MODEL_F32 : MODEL_F64;
+	QuantizedModel *quantized = (pruned == NULL) ? quantized_new(W1, W2, b1, b2) : NULL;
+
+	ModelTensorData tensors[6] =
+	{
+		{ "W2", type, W2->rows, W2->cols, W2->data },
+		{ "b1", type, b1->rows, b1->cols, b1->data },
+		{ "b2", type, b2->rows, b2->cols, b2->data }
+	};
+	unsigned int count = 3;
+
+	if (pruned == NULL)
+	{
+		// The quantized rows are stored as the columns of a (stride, hidden)
+		// tensor, which is the same layout.
+		tensors[count++] = (ModelTensorData){ "W1", type, W1->rows, W1->cols, W1->data };
+		tensors[count++] = (ModelTensorData){ "W1.int8", MODEL_INT8, quantized->stride, quantized->hidden, quantized->W1 };
+		tensors[count++] = (ModelTensorData){ "W1.scale", MODEL_F32, quantized->hidden, 1, quantized->W1_scales };
+	}
+	else
+	{
+		unsigned int kept = pruned->starts[pruned->rows];
+
+		tensors[count++] = (ModelTensorData){ "W1.starts", MODEL_U32, pruned->rows + 1, 1, pruned->starts };
+		tensors[count++] = (ModelTensorData){ "W1.indices", MODEL_U16, kept, 1, pruned->indices };
+		tensors[count++] = (ModelTensorData){ "W1.values", type, kept, 1, pruned->data };
+	}
+
+	if (!model_save("brainsave", tensors, count))
+	{
+		printf("Could not write the brainsave file.\n");
+	}
+
+	if (quantized != NULL)
+	{
+		quantized_free(quantized);
+	}
+}
+
+// open_dataset
+// ============
+//
+// Maps a set of images and their labels, and checks that they fit the model.
+//
+// Parameters:
+//          name - What the set is called in messages, such as "training".
+//   images_path - The path to the IDX file of images.
+//   labels_path - The path to the IDX file of labels.
+//        images - Set to the images. Call idx_close() when no longer needed.
+//        labels - Set to the labels. Call idx_close() when no longer needed.
+//     exit_code - The code to exit with if the set is missing, or 0 to return false instead.
+//
+// Return:
+//   Whether the set was opened.
+static bool open_dataset(const char *name, const char *images_path, const char *labels_path, IdxFile **images, IdxFile **labels, int exit_code)
+{
+	*images = idx_open(images_path);
+	if (*images == NULL)
+	{
+		if (exit_code == 0)
+		{
+			return false;
+		}
+
+		printf("Could not find %s images at '%s'.\n", name, images_path);
+		exit(exit_code);
+	}
+
+	*labels = idx_open(labels_path);
+	if (*labels == NULL)
+	{
+		idx_close(*images);
+
+		if (exit_code == 0)
+		{
+			return false;
+		}
+
+		printf("Could not find %s labels at '%s'.\n", name, labels_path);
+		exit(exit_code);
+	}
+
+	if ((*images)->dimensions != 3 || (*images)->item_size != 784)
+	{
+		printf("The %s images in '%s' must be 28 by 28 pixels.\n", name, images_path);
+		exit(6);
+	}
+
+	if ((*labels)->dimensions != 1 || (*labels)->count != (*images)->count)
+	{
+		printf("'%s' must hold one label for each of the %u %s images.\n", labels_path, (*images)->count, name);
+		exit(6);
+	}
+
+	return true;
+}
+
+// choose_input
+// ============
+//
+// Decides how the first layer reads a set of images, measuring the fraction of pixels set by building the sparse
+// form of the set once, and says what was chosen. The sparse products run on the CPU, so a set is only read sparse
+// with a device when asked to, and never when it is too large to hold in memory and is streamed instead.
+//
+// Parameters:
+//       mode - How to read the images.
+//       name - What the set is called in messages, such as "training".
+//     images - The images.
+//      count - The number of images to use, from the start of the set.
+//   streamed - Whether the set is streamed from disk.
+//
+// Return:
+//   The images in sparse form, to be released with matrix_sparse_free(), or NULL to read them dense.
+static MatrixSparse *choose_input(InputMode mode, const char *name, IdxFile *images, unsigned int count, bool streamed)
+{
+	if (mode == INPUT_DENSE || (mode == INPUT_AUTO && device_kind() != DEVICE_NONE))
+	{
+		return NULL;
+	}
+
+	if (streamed)
+	{
+		if (mode == INPUT_SPARSE)
+		{
+			printf("The %s images are streamed from disk, so they are read dense.\n", name);
+		}
+
+		return NULL;
+	}
+
+	MatrixSparse *sparse = matrix_sparse_from_bytes(784, count, images->data, 1 / 255.0);
+	double density = matrix_sparse_density(sparse);
+
+	if (mode == INPUT_AUTO && density > SPARSE_MAX_DENSITY)
+	{
+		printf("%.1lf%% of the %s pixels are set, so they are read dense.\n", 100.0 * density, name);
+		matrix_sparse_free(sparse);
+		return NULL;
+	}
+
+	printf("%.1lf%% of the %s pixels are set, so they are read sparse.\n", 100.0 * density, name);
+	return sparse;
+}
+
+// Shard
+// =====
+//
+// The columns of each batch that one thread trains on, along with the thread's
+// own activations and gradients.
+typedef struct
+{
+	unsigned int first, count;
+	Matrix *A1, *Z2, *dZ1, *dZ2;
+	Matrix *dW1, *dW2, *db1, *db2;
+	double loss;          // The total loss over the shard's images.
+	unsigned int correct;
+} Shard;
+
+// Batch
+// =====
+//
+// What the shards of one batch share.
+typedef struct
+{
+	Shard *shards;
+	Matrix *W1, *W2, *b1, *b2;
+	LoaderBatch *input;
+	MatrixSparse *sparse; // The training images in sparse form, or NULL to use the batch's pixels.
+} Batch;
+
+// shard_new
+// =========
+//
+// Allocates the buffers of a shard.
+//
+// Parameters:
+//   shard - The shard.
+//   first - The first column of each batch that belongs to the shard.
+//   count - The number of columns that belong to the shard.
+static void shard_new(Shard *shard, unsigned int first, unsigned int count)
+{
+	shard->first = first;
+	shard->count = count;
+
+	shard->A1 = matrix_new(10, count);
+	shard->Z2 = matrix_new(10, count);
+	shard->dZ1 = matrix_new(10, count);
+	shard->dZ2 = matrix_new(10, count);
+
+	// The activations are each used by more than one multiplication.
+	matrix_keep_on_device(shard->A1);
+	matrix_keep_on_device(shard->dZ1);
+	matrix_keep_on_device(shard->dZ2);
+
+	shard->dW1 = matrix_new(10, 784);
+	shard->dW2 = matrix_new(10, 10);
+	shard->db1 = matrix_new(10, 1);
+	shard->db2 = matrix_new(10, 1);
+}
+
+// shard_free
+// ==========
+//
+// Releases the buffers of a shard.
+//
+// Parameters:
+//   shard - The shard.
+static void shard_free(Shard *shard)
+{
+	matrix_free(shard->A1);
+	matrix_free(shard->Z2);
+	matrix_free(shard->dZ1);
+	matrix_free(shard->dZ2);
+	matrix_free(shard->dW1);
+	matrix_free(shard->dW2);
+	matrix_free(shard->db1);
+	matrix_free(shard->db2);
+}
+
+// train_shard
+// ===========
+//
+// Runs the forward and backward passes over one shard of a batch, leaving the
+// gradients summed over the shard's images in the shard. Run on the thread pool.
+//
+// Parameters:
+//   context - The Batch.
+//      task - The shard.
+//    worker - Unused.
+static void train_shard(void *context, unsigned int task, unsigned int worker)
+{
+	Batch *batch = context;
+	Shard *shard = &batch->shards[task];
+
+	PROFILE_SCOPE("shard");
+
+	const unsigned char *labels = batch->input->labels + shard->first;
+	const unsigned int *columns = batch->input->columns + shard->first;
+
+	Matrix pixels;
+	if (batch->sparse == NULL)
+	{
+		pixels = matrix_columns(batch->input->pixels, shard->first, shard->count);
+	}
+
+	{
+		PROFILE_SCOPE("forward");
+
+		if (batch->sparse != NULL)
+		{
+			matrix_sparse_dense_into(shard->A1, batch->W1, batch->sparse, columns, batch->b1, MATRIX_ACTIVATION_RELU);
+		}
+		else
+		{
+			matrix_dense_into(shard->A1, batch->W1, &pixels, batch->b1, MATRIX_ACTIVATION_RELU);
+		}
+
+		matrix_dense_into(shard->Z2, batch->W2, shard->A1, batch->b2, MATRIX_ACTIVATION_NONE);
+	}
+
+	{
+		PROFILE_SCOPE("loss");
+		double loss;
+		matrix_softmax_cross_entropy_into(NULL, shard->dZ2, shard->Z2, labels, &loss, &shard->correct);
+		shard->loss = loss * shard->count;
+	}
+
+	{
+		PROFILE_SCOPE("backward");
+		matrix_multiply_into(shard->dW2, shard->dZ2, shard->A1, MATRIX_OP_N, MATRIX_OP_T);
+		matrix_sum_rows_into(shard->db2, shard->dZ2);
+		matrix_multiply_into(shard->dZ1, batch->W2, shard->dZ2, MATRIX_OP_T, MATRIX_OP_N);
+		matrix_dReLU_multiply_into(shard->dZ1, shard->dZ1, shard->A1);
+
+		if (batch->sparse != NULL)
+		{
+			matrix_sparse_multiply_into(shard->dW1, shard->dZ1, batch->sparse, columns);
+		}
+		else
+		{
+			matrix_multiply_into(shard->dW1, shard->dZ1, &pixels, MATRIX_OP_N, MATRIX_OP_T);
+		}
+
+		matrix_sum_rows_into(shard->db1, shard->dZ1);
+	}
+}
+
+// InputComparison
+// ===============
+//
+// The first layer of one shard, timed reading the first images of the set dense and sparse by compare_inputs().
+typedef struct
+{
+	Batch *batch;
+	IdxFile *images;
+	double dense, sparse; // Seconds per forward and weight gradient product.
+} InputComparison;
+
+// compare_inputs
+// ==============
+//
+// Times the products of the first layer that the sparse input replaces, the forward pass and the weight gradient,
+// on the first shard's worth of images, dense and sparse. Run as a single task on the thread pool, so that each
+// product runs on one thread as in a shard. The shard's output buffers are overwritten, and the gradient of the
+// forward pass is stood in for by its output, which costs the same.
+//
+// Parameters:
+//   context - The InputComparison.
+//      task - Unused.
+//    worker - Unused.
+static void compare_inputs(void *context, unsigned int task, unsigned int worker)
+{
+	InputComparison *comparison = context;
+	Batch *batch = comparison->batch;
+	Shard *shard = &batch->shards[0];
+
+	Matrix *pixels = matrix_new(784, shard->count);
+	unsigned int *columns = malloc(sizeof(unsigned int) * shard->count);
+
+	if (columns == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	for (unsigned int image = 0; image < shard->count; image++)
+	{
+		columns[image] = image;
+	}
+
+	matrix_gather_bytes_into(pixels, comparison->images->data, columns, 1 / 255.0);
+
+	// Each way is repeated for a while, after a first untimed round.
+	for (unsigned int way = 0; way < 2; way++)
+	{
+		bool sparse = way == 1;
+		unsigned long long runs = 0;
+		double start = 0.0, elapsed = 0.0;
+
+		while (elapsed < INPUT_COMPARE_SECONDS)
+		{
+			if (sparse)
+			{
+				matrix_sparse_dense_into(shard->A1, batch->W1, batch->sparse, columns, batch->b1, MATRIX_ACTIVATION_RELU);
+				matrix_sparse_multiply_into(shard->dW1, shard->A1, batch->sparse, columns);
+			}
+			else
+			{
+				matrix_dense_into(shard->A1, batch->W1, pixels, batch->b1, MATRIX_ACTIVATION_RELU);
+				matrix_multiply_into(shard->dW1, shard->A1, pixels, MATRIX_OP_N, MATRIX_OP_T);
+			}
+
+			if (runs++ == 0)
+			{
+				start = threadpool_seconds();
+				continue;
+			}
+
+			elapsed = threadpool_seconds() - start;
+		}
+
+		*(sparse ? &comparison->sparse : &comparison->dense) = elapsed / (runs - 1);
+	}
+
+	free(columns);
+	matrix_free(pixels);
+}
+
+// train
+// =====
+//
+// Trains the model using the MNIST database.
+//
+// Parameters:
+//   options - How to train. See TrainOptions.
+void train(TrainOptions options)
+{
+	PROFILE_TRACE(options.trace);
+
+	IdxFile *images, *labels;
+	open_dataset("training", "data/train-images.idx3-ubyte", "data/train-labels.idx1-ubyte", &images, &labels, 2);
+
+	if (options.images == 0 || options.images > images->count)
+	{
+		options.images = images->count;
+	}
+
+	if (options.batch_size == 0 || options.batch_size > options.images)
+	{
+		printf("The batch size must be between 1 and the number of images (%u).\n", options.images);
+		exit(2);
+	}
+
+	matrix_use_precision(options.precision);
+
+	// Sets that do not fit in one chunk are streamed from disk by the loader.
+	unsigned int chunk = STREAM_CHUNK_BYTES / images->item_size;
+	MatrixSparse *sparse = choose_input(options.input, "training", images, options.images, options.images > chunk);
+
+	// The test set, if there is one, is used to follow the accuracy as training
+	// goes. It is read the same way as the training set.
+	IdxFile *test_images, *test_labels;
+	Matrix *test_pixels = NULL, *test_A1 = NULL, *test_Z2 = NULL;
+	MatrixSparse *test_sparse = NULL;
+
+	if (open_dataset("test", "data/t10k-images.idx3-ubyte", "data/t10k-labels.idx1-ubyte", &test_images, &test_labels, 0))
+	{
+		test_A1 = matrix_new(10, test_images->count);
+		test_Z2 = matrix_new(10, test_images->count);
+		matrix_keep_on_device(test_A1);
+
+		if (sparse != NULL)
+		{
+			test_sparse = matrix_sparse_from_bytes(784, test_images->count, test_images->data, 1 / 255.0);
+		}
+		else
+		{
+			test_pixels = matrix_new(784, test_images->count);
+			matrix_gather_bytes_into(test_pixels, test_images->data, NULL, 1 / 255.0);
+			matrix_keep_on_device(test_pixels);
+		}
+	}
+
+	Matrix *W1 = matrix_new(10, 784);
+	Matrix *b1 = matrix_new(10, 1);
+	Matrix *W2 = matrix_new(10, 10);
+	Matrix *b2 = matrix_new(10, 1);
+
+	// The weights stay on the device, and are uploaded once per batch after
+	// they have been updated.
+	matrix_keep_on_device(W1);
+	matrix_keep_on_device(W2);
+
+	// Each batch is split into one shard per thread. Every shard trains on its
+	// own columns into its own buffers, which are allocated once up front and
+	// overwritten each batch.
+	unsigned int shard_count = threadpool_threads();
+	if (shard_count > options.batch_size)
+	{
+		shard_count = options.batch_size;
+	}
+
+	Shard *shards = (Shard*)malloc(sizeof(Shard) * shard_count);
+	Matrix **dW1s = (Matrix**)malloc(sizeof(Matrix*) * shard_count);
+	Matrix **dW2s = (Matrix**)malloc(sizeof(Matrix*) * shard_count);
+	Matrix **db1s = (Matrix**)malloc(sizeof(Matrix*) * shard_count);
+	Matrix **db2s = (Matrix**)malloc(sizeof(Matrix*) * shard_count);
+
+	for (unsigned int shard = 0; shard < shard_count; shard++)
+	{
+		unsigned int first = (unsigned long long)options.batch_size * shard / shard_count;
+		unsigned int last = (unsigned long long)options.batch_size * (shard + 1) / shard_count;
+		shard_new(&shards[shard], first, last - first);
+
+		dW1s[shard] = shards[shard].dW1;
+		dW2s[shard] = shards[shard].dW2;
+		db1s[shard] = shards[shard].db1;
+		db2s[shard] = shards[shard].db2;
+	}
+
+	// The gradients summed over every shard.
+	Matrix *dW1 = matrix_new(10, 784);
+	Matrix *dW2 = matrix_new(10, 10);
+	Matrix *db1 = matrix_new(10, 1);
+	Matrix *db2 = matrix_new(10, 1);
+
+	matrix_rand(W1);
+	matrix_rand(b1);
+	matrix_rand(W2);
+	matrix_rand(b2);
+
+	Batch step =
+	{
+		.shards = shards,
+		.W1 = W1, .W2 = W2, .b1 = b1, .b2 = b2,
+		.sparse = sparse
+	};
+
+	if (sparse != NULL)
+	{
+		InputComparison comparison = { .batch = &step, .images = images };
+		threadpool_run(1, compare_inputs, &comparison);
+
+		printf("The first layer of a %u image shard takes %.1lfus sparse against %.1lfus dense (%.2lfx).\n",
+			shards[0].count, 1e6 * comparison.sparse, 1e6 * comparison.dense, comparison.dense / comparison.sparse);
+	}
+
+	// Batches are prepared on another thread while the previous one trains.
+	// The loader shuffles with rand(), so it is only started once the weights
+	// have been initialised. Images left over after the last whole batch of an
+	// epoch are skipped. When shuffling they land in a batch of some later
+	// epoch instead. Sparse training reads the images from the sparse set, so
+	// the loader only has to pick them.
+	BatchLoader *loader = batch_loader_new(images, labels, options.images, options.batch_size, options.epochs, options.shuffle, chunk, PREFETCH_DEPTH, sparse == NULL);
+	unsigned int batches = options.images / options.batch_size;
+	double scale = options.learning_rate / options.batch_size;
+
+	// Training time excludes measuring the test accuracy. The test accuracy is
+	// measured every as many whole epochs as the training set holds images,
+	// whatever the batch size, and so after every epoch that trains on the whole
+	// set but for the images left over.
+	unsigned int epoch_images = batches * options.batch_size;
+	unsigned int test_epochs = (images->count / epoch_images > 1) ? images->count / epoch_images : 1;
+	double elapsed = 0.0;
+	unsigned long long seen = 0;
+	double test_accuracy = -1.0, target_time = 0.0;
+	unsigned long long target_seen = 0;
+
+	for (unsigned int epoch = 1; epoch <= options.epochs; epoch++)
+	{
+		double start = threadpool_seconds();
+
+		double epoch_loss = 0.0;
+		unsigned int epoch_correct = 0;
+
+		for (unsigned int batch = 0; batch < batches; batch++)
+		{
+			PROFILE_SCOPE("batch");
+
+			{
+				PROFILE_SCOPE("wait for batch");
+				step.input = batch_loader_next(loader);
+			}
+
+			// Every shard reads the weights, so they are uploaded before the
+			// shards start rather than by whichever shard gets there first.
+			matrix_upload(W1);
+			matrix_upload(W2);
+
+			{
+				PROFILE_SCOPE("shards");
+				threadpool_run(shard_count, train_shard, &step);
+			}
+
+			batch_loader_release(loader, step.input);
+
+			// The shards' gradients are added up in shard order, so the result
+			// only depends on the number of threads, not on their timing.
+			{
+				PROFILE_SCOPE("all-reduce");
+				matrix_sum_into(dW1, dW1s, shard_count);
+				matrix_sum_into(db1, db1s, shard_count);
+				matrix_sum_into(dW2, dW2s, shard_count);
+				matrix_sum_into(db2, db2s, shard_count);
+			}
+
+			{
+				PROFILE_SCOPE("update");
+				matrix_subtract_into(W1, W1, dW1, scale);
+				matrix_subtract_into(b1, b1, db1, scale);
+				matrix_subtract_into(W2, W2, dW2, scale);
+				matrix_subtract_into(b2, b2, db2, scale);
+			}
+
+			for (unsigned int shard = 0; shard < shard_count; shard++)
+			{
+				epoch_loss += shards[shard].loss;
+				epoch_correct += shards[shard].correct;
+			}
+		}
+
+		elapsed += threadpool_seconds() - start;
+		seen += epoch_images;
+
+		if (test_A1 != NULL && epoch % test_epochs == 0)
+		{
+			PROFILE_SCOPE("test accuracy");
+
+			if (test_sparse != NULL)
+			{
+				matrix_sparse_dense_into(test_A1, W1, test_sparse, NULL, b1, MATRIX_ACTIVATION_RELU);
+			}
+			else
+			{
+				matrix_dense_into(test_A1, W1, test_pixels, b1, MATRIX_ACTIVATION_RELU);
+			}
+
+			matrix_dense_into(test_Z2, W2, test_A1, b2, MATRIX_ACTIVATION_NONE);
+			test_accuracy = mark(test_Z2, test_labels->data, test_labels->count);
+
+			if (options.target > 0 && target_seen == 0 && test_accuracy >= options.target)
+			{
+				target_time = elapsed;
+				target_seen = seen;
+			}
+		}
+
+		printf("Training...%.2lf%% Accuracy=%.1lf%% Loss=%.4lf", 100.0 * epoch / options.epochs, 100.0 * epoch_correct / epoch_images, epoch_loss / epoch_images);
+		if (test_accuracy >= 0)
+		{
+			printf(" Test=%.2lf%%", 100.0 * test_accuracy);
+		}
+		printf("\r");
+		fflush(stdout);
+
+		PROFILE_REPORT("Epoch %u", epoch);
+	}
+	printf("\n");
+
+	printf("Trained in %.2lfs (%.0lf images/s) with the %s backend.\n", elapsed, seen / elapsed, matrix_backend());
+
+	// Time training spent waiting means loading is the bottleneck, and time the
+	// loader spent waiting means training is.
+	LoaderStats stats = batch_loader_stats(loader);
+	printf("Waited %.2lfs for batches to load, and the loader waited %.2lfs for training.\n", stats.consumer_wait, stats.producer_wait);
+	batch_loader_free(loader);
+	print_device_stats();
+
+	if (options.target > 0)
+	{
+		if (target_seen > 0)
+		{
+			printf("Reached %.2lf%% test accuracy in %.2lfs (%llu images).\n", 100.0 * options.target, target_time, target_seen);
+		}
+		else
+		{
+			printf("Did not reach %.2lf%% test accuracy.\n", 100.0 * options.target);
+		}
+	}
+
+	write_brainsave(W1, W2, b1, b2, NULL);
+
+	for (unsigned int shard = 0; shard < shard_count; shard++)
+	{
+		shard_free(&shards[shard]);
+	}
+	free(shards);
+	free(dW1s);
+	free(dW2s);
+	free(db1s);
+	free(db2s);
+
+	idx_close(images);
+	idx_close(labels);
+	if (test_A1 != NULL)
+	{
+		idx_close(test_images);
+		idx_close(test_labels);
+		matrix_free(test_A1);
+		matrix_free(test_Z2);
+	}
+	if (test_pixels != NULL)
+	{
+		matrix_free(test_pixels);
+	}
+	if (test_sparse != NULL)
+	{
+		matrix_sparse_free(test_sparse);
+	}
+	if (sparse != NULL)
+	{
+		matrix_sparse_free(sparse);
+	}
+	matrix_free(dW1);
+	matrix_free(dW2);
+	matrix_free(db1);
+	matrix_free(db2);
+	matrix_free(W1);
+	matrix_free(W2);
+	matrix_free(b1);
+	matrix_free(b2);
+
+	PROFILE_FINISH();
+}
+
+// test
+// ====
+//
+// Uses the 'brainsave' file created by train() to test the model's accuracy.
+//
+// Parameters:
+//    int8 - Whether to also quantize the model and compare the int8 path against the floating point path.
+//   input - How the first layer reads the images.
+void test(bool int8, InputMode input)
+{
+	Matrix *W1, *W2, *b1, *b2;
+	MatrixPruned *pruned;
+	ModelFile *brainsave = read_brainsave(&W1, &W2, &b1, &b2, &pruned);
+	if (brainsave == NULL)
+	{
+		printf("Could not find a brainsave file. Run train first.\n");
+		exit(4);
+	}
+
+	// A pruned model is timed against its first layer written out in full, which --int8 quantizes too.
+	if (pruned != NULL)
+	{
+		W1 = matrix_pruned_expand(pruned);
+	}
+
+	IdxFile *images, *labels;
+	open_dataset("test", "data/t10k-images.idx3-ubyte", "data/t10k-labels.idx1-ubyte", &images, &labels, 4);
+	unsigned int count = images->count;
+
+	// Loaded before the clock starts, so that any quantization cost is not counted against the int8 path.
+	QuantizedModel *quantized = int8 ? read_quantized(brainsave, W1, W2, b1, b2) : NULL;
+
+	// Sparse images are still converted into pixels too, to time the dense
+	// forward pass against. A pruned model skips the pruned weights instead of
+	// the background pixels, so it always reads the images dense.
+	MatrixSparse *sparse = (pruned == NULL) ? choose_input(input, "test", images, count, false) : NULL;
+
+	Matrix *pixels = matrix_new(784, count);
+	matrix_gather_bytes_into(pixels, images->data, NULL, 1 / 255.0);
+
+	matrix_keep_on_device(W1);
+	matrix_keep_on_device(W2);
+	matrix_keep_on_device(pixels);
+
+	// The intermediates of the forward pass come from an arena and are released together.
+	MatrixArena *arena = matrix_arena_new(sizeof(double) * ((sparse != NULL || pruned != NULL) ? 6 : 3) * 10 * count + 4096);
+	matrix_arena_use(arena);
+
+	double start = threadpool_seconds();
+
+	Matrix *A1;
+	if (sparse != NULL)
+	{
+		A1 = matrix_new(10, count);
+		matrix_sparse_dense_into(A1, W1, sparse, NULL, b1, MATRIX_ACTIVATION_RELU);
+	}
+	else if (pruned != NULL)
+	{
+		A1 = matrix_pruned_dense(pruned, pixels, b1, MATRIX_ACTIVATION_RELU);
+	}
+	else
+	{
+		A1 = matrix_dense(W1, pixels, b1, MATRIX_ACTIVATION_RELU);
+	}
+	Matrix *Z2 = matrix_dense(W2, A1, b2, MATRIX_ACTIVATION_NONE);
+	Matrix *A2 = matrix_softmax(Z2);
+
+	double elapsed = threadpool_seconds() - start;
+	double dense_elapsed = 0.0;
+
+	if (sparse != NULL || pruned != NULL)
+	{
+		start = threadpool_seconds();
+
+		Matrix *dense_A1 = matrix_dense(W1, pixels, b1, MATRIX_ACTIVATION_RELU);
+		Matrix *dense_Z2 = matrix_dense(W2, dense_A1, b2, MATRIX_ACTIVATION_NONE);
+		matrix_softmax_into(dense_Z2, dense_Z2);
+
+		dense_elapsed = threadpool_seconds() - start;
+	}
+
+	matrix_arena_use(NULL);
+
+	double accuracy = mark(A2, labels->data, count);
+
+	printf("Accuracy: %.2lf%%.\n", 100.0 * accuracy);
+	printf("Precision: %s, %s backend, %.0lf images/s.\n", (W1->precision == MATRIX_F32) ? "f32" : "f64", matrix_backend(), count / elapsed);
+	if (sparse != NULL)
+	{
+		printf("Sparse input: %.0lf images/s against %.0lf images/s dense (%.2lfx).\n", count / elapsed, count / dense_elapsed, dense_elapsed / elapsed);
+	}
+	if (pruned != NULL)
+	{
+		printf("Pruned weights (%.1lf%% kept): %.0lf images/s against %.0lf images/s dense (%.2lfx).\n", 100.0 * matrix_pruned_density(pruned),
+			count / elapsed, count / dense_elapsed, dense_elapsed / elapsed);
+	}
+	print_device_stats();
+
+	if (quantized != NULL)
+	{
+		unsigned char *predictions = (unsigned char*)malloc(count);
+
+		start = threadpool_seconds();
+		quantized_classify(quantized, images->data, count, predictions);
+		double int8_elapsed = threadpool_seconds() - start;
+
+		unsigned int correct = 0;
+		for (unsigned int image = 0; image < count; image++)
+		{
+			correct += (predictions[image] == labels->data[image]);
+		}
+		double int8_accuracy = (double)correct / count;
+
+		printf("Int8 accuracy: %.2lf%% (%+.2lf%%).\n", 100.0 * int8_accuracy, 100.0 * (int8_accuracy - accuracy));
+		printf("Int8 kernel: %s, %.0lf images/s (%.2lfx).\n", quantized_kernel(), count / int8_elapsed, elapsed / int8_elapsed);
+
+		free(predictions);
+		quantized_free(quantized);
+	}
+
+	idx_close(images);
+	idx_close(labels);
+
+	matrix_arena_free(arena);
+	matrix_free(pixels);
+	if (sparse != NULL)
+	{
+		matrix_sparse_free(sparse);
+	}
+	if (pruned != NULL)
+	{
+		matrix_pruned_free(pruned);
+	}
+	matrix_free(W1);
+	matrix_free(W2);
+	matrix_free(b1);
+	matrix_free(b2);
+	model_close(brainsave);
+}
+
+// image
+// =====
+//
+// Attempts to determine the number contained in a bitmap.
+//
+// Parameters:
+//   path - The path to an 8, 24 or 32 bits-per-pixel bitmap, black on white. It is scaled to 28x28.
+//   int8 - Whether to classify with the quantized model.
+void image(char *path, bool int8)
+{
+	// The quantized model is made from the whole first layer, so a pruned one is written out in full for it.
+	Matrix *W1, *W2, *b1, *b2;
+	MatrixPruned *pruned = NULL;
+	ModelFile *brainsave = read_brainsave(&W1, &W2, &b1, &b2, int8 ? NULL : &pruned);
+	if (brainsave == NULL)
+	{
+		printf("No brainsave file found. Run train first.\n");
+		exit(5);
+	}
+
+	unsigned char raw_pixels[784];
+	ImageError error = read_image(path, raw_pixels);
+	if (error != IMAGE_OK)
+	{
+		printf("Could not read '%s': %s.\n", path, image_error(error));
+		exit(5);
+	}
+
+	if (int8)
+	{
+		// The quantized model takes ink as 255, like the MNIST data.
+		for (unsigned int i = 0; i < 784; i++)
+		{
+			raw_pixels[i] = 255 - raw_pixels[i];
+		}
+
+		QuantizedModel *quantized = read_quantized(brainsave, W1, W2, b1, b2);
+		unsigned char output;
+		quantized_classify(quantized, raw_pixels, 1, &output);
+
+		printf("Looks like a %d to me.\n", output);
+
+		quantized_free(quantized);
+		matrix_free(W1);
+		matrix_free(W2);
+		matrix_free(b1);
+		matrix_free(b2);
+		model_close(brainsave);
+		return;
+	}
+
+	Matrix* pixels = matrix_new(784, 1);
+
+	for (unsigned int i = 0; i < 784; i++)
+	{
+		matrix_set(pixels, i, 0, (255 - raw_pixels[i]) / 255.);
+	}
+
+	// The intermediates of the forward pass come from an arena and are released together.
+	MatrixArena *arena = matrix_arena_new(4096);
+	matrix_arena_use(arena);
+
+	Matrix *A1 = (pruned != NULL) ? matrix_pruned_dense(pruned, pixels, b1, MATRIX_ACTIVATION_RELU) : matrix_dense(W1, pixels, b1, MATRIX_ACTIVATION_RELU);
+	Matrix *Z2 = matrix_dense(W2, A1, b2, MATRIX_ACTIVATION_NONE);
+	Matrix *A2 = matrix_softmax(Z2);
+
+	matrix_arena_use(NULL);
+
+	printf("Looks like a %d to me.\n", predict(A2, 0));
+
+	matrix_arena_free(arena);
+	matrix_free(pixels);
+
+	if (pruned != NULL)
+	{
+		matrix_pruned_free(pruned);
+	}
+	else
+	{
+		matrix_free(W1);
+	}
+	matrix_free(W2);
+	matrix_free(b1);
+	matrix_free(b2);
+	model_close(brainsave);
+}
+
+// PathList
+// ========
+//
+// The images classify() has been asked for, in the order they are given.
+typedef struct
+{
+	char **paths;
+	unsigned int count, capacity;
+} PathList;
+
+// path_list_add
+// =============
+//
+// Adds a copy of a path to a list.
+//
+// Parameters:
+//   list - The list.
+//   path - The path.
+static void path_list_add(PathList *list, const char *path)
+{
+	if (list->count == list->capacity)
+	{
+		list->capacity = (list->capacity > 0) ? 2 * list->capacity : 64;
+		list->paths = realloc(list->paths, sizeof(char*) * list->capacity);
+	}
+
+	char *copy = malloc(strlen(path) + 1);
+	if (list->paths == NULL || copy == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	strcpy(copy, path);
+	list->paths[list->count++] = copy;
+}
+
+// compare_paths
+// =============
+//
+// Orders paths alphabetically, for qsort().
+//
+// Parameters:
+//   a - The first path.
+//   b - The second path.
+//
+// Return:
+//   Less than, equal to or greater than 0 as a sorts before, with or after b.
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+// path_list_add_directory
+// =======================
+//
+// Adds every bitmap in a directory to a list, in alphabetical order. Subdirectories are not searched.
+//
+// Parameters:
+//   list - The list.
+//   path - The directory.
+static void path_list_add_directory(PathList *list, const char *path)
+{
+	DIR *directory = opendir(path);
+	if (directory == NULL)
 	{
-		printf("numeros requires on of the following:\n  - \"test\"\n  - \"train\"\n  - a filename.\n");
-		return 0;
+		printf("Could not open the directory '%s'.\n", path);
+		exit(5);
 	}
 
-	matrix_init();
+	unsigned int first = list->count;
+	size_t length = strlen(path);
+	bool separated = length > 0 && path[length - 1] == '/';
 
-	if (strequ(argv[1], "train"))
+	struct dirent *entry;
+	while ((entry = readdir(directory)) != NULL)
 	{
-		train();
+		size_t name_length = strlen(entry->d_name);
+		if (name_length < 4 || strcasecmp(entry->d_name + name_length - 4, ".bmp") != 0)
+		{
+			continue;
+		}
+
+		char *joined = malloc(length + name_length + 2);
+		if (joined == NULL)
+		{
+			printf("Your computer has run out of memory :(\n");
+			exit(3);
+		}
+
+		sprintf(joined, separated ? "%s%s" : "%s/%s", path, entry->d_name);
+		path_list_add(list, joined);
+		free(joined);
 	}
-	else if (strequ(argv[1], "test"))
+
+	closedir(directory);
+
+	qsort(list->paths + first, list->count - first, sizeof(char*), compare_paths);
+}
+
+// path_list_add_file
+// ==================
+//
+// Adds the paths listed in a file, one per line, to a list. Blank lines are skipped.
+//
+// Parameters:
+//   list - The list.
+//   path - The file of paths.
+static void path_list_add_file(PathList *list, const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
 	{
-		test();
+		printf("Could not open the list of images '%s'.\n", path);
+		exit(5);
 	}
-	else
+
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+
+	while ((length = getline(&line, &capacity, file)) != -1)
 	{
-		image(argv[1]);
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+		{
+			line[--length] = '\0';
+		}
+
+		if (length > 0)
+		{
+			path_list_add(list, line);
+		}
 	}
 
-	return 0;
+	free(line);
+	fclose(file);
 }
 
-// train
-// =====
+// DecodeJob
+// =========
 //
-// Trains the model using the MNIST database.
-void train(void)
+// The images being decoded by decode_image().
+typedef struct
+{
+	char **paths;
+	unsigned char *pixels; // 784 bytes per image, with ink as 255 like the MNIST data.
+	ImageError *errors;    // Why each image could not be read, or IMAGE_OK.
+} DecodeJob;
+
+// decode_image
+// ============
+//
+// Decodes one image of a DecodeJob. Run on the thread pool. An image that cannot be read is left blank.
+//
+// Parameters:
+//   context - The DecodeJob.
+//      task - The index of the image.
+//    worker - Unused.
+static void decode_image(void *context, unsigned int task, unsigned int worker)
 {
-	FILE *image_file = fopen("data/train-images.idx3-ubyte", "rb");
-	if (image_file == NULL)
+	DecodeJob *job = context;
+
+	unsigned char *pixels = job->pixels + (size_t)task * 784;
+
+	job->errors[task] = read_image(job->paths[task], pixels);
+	if (job->errors[task] != IMAGE_OK)
 	{
-		printf("Could not find training images at 'data/train-images.idx3-ubyte'.\n");
-		exit(2);
+		memset(pixels, 0, 784);
+		return;
 	}
 
-	FILE *label_file = fopen("data/train-labels.idx1-ubyte", "rb");
-	if (label_file == NULL)
+	for (unsigned int i = 0; i < 784; i++)
 	{
-		printf("Could not find training lables at 'data/train-labels.idx1-ubyte'.\n");
-		fclose(image_file);
-		exit(2);
+		pixels[i] = 255 - pixels[i];
 	}
+}
 
-	unsigned char *buffer = (unsigned char*)malloc(50000000);
-	if (buffer == NULL)
+// print_csv_string
+// ================
+//
+// Prints a CSV field, quoted if it needs to be.
+//
+// Parameters:
+//   text - The field.
+static void print_csv_string(const char *text)
+{
+	if (strpbrk(text, ",\"\r\n") == NULL)
 	{
-		printf("Your computer has run out of memory :(\n");
-		fclose(image_file);
-		fclose(label_file);
-		exit(2);
+		fputs(text, stdout);
+		return;
 	}
 
-	fread(buffer, 1, 16, image_file);
-	fread(buffer, 1, 8, label_file);
+	putchar('"');
+	for (const char *c = text; *c != '\0'; c++)
+	{
+		if (*c == '"')
+		{
+			putchar('"');
+		}
+		putchar(*c);
+	}
+	putchar('"');
+}
 
-	Matrix *pixels = matrix_new(784, BATCH_SIZE);
-	unsigned char *labels = (unsigned char*)malloc(BATCH_SIZE);
+// print_json_string
+// =================
+//
+// Prints a JSON string.
+//
+// Parameters:
+//   text - The contents of the string.
+static void print_json_string(const char *text)
+{
+	putchar('"');
+	for (const unsigned char *c = (const unsigned char*)text; *c != '\0'; c++)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			printf("\\%c", *c);
+		}
+		else if (*c < 0x20)
+		{
+			printf("\\u%04x", *c);
+		}
+		else
+		{
+			putchar(*c);
+		}
+	}
+	putchar('"');
+}
 
-	fread(buffer, 784, BATCH_SIZE, image_file);
-	fread(labels, 1, BATCH_SIZE, label_file);
+// classify
+// ========
+//
+// Classifies many bitmaps at once. The bitmaps are decoded in parallel on the thread pool into one matrix, which is
+// classified by a single forward pass, and the results are printed as CSV or JSON.
+//
+// Parameters:
+//   arguments - The bitmaps: paths of images, directories of images, or '@' followed by the path of a file listing
+//               images one per line.
+//       count - The number of arguments.
+//        json - Whether to print JSON instead of CSV.
+//        int8 - Whether to classify with the quantized model.
+void classify(char **arguments, unsigned int count, bool json, bool int8)
+{
+	PathList list = { NULL, 0, 0 };
 
-	for (unsigned int image = 0; image < BATCH_SIZE; image++)
+	for (unsigned int i = 0; i < count; i++)
 	{
-		for (unsigned int pixel = 0; pixel < 784; pixel++)
+		struct stat metadata;
+
+		if (arguments[i][0] == '@')
+		{
+			path_list_add_file(&list, arguments[i] + 1);
+		}
+		else if (stat(arguments[i], &metadata) == 0 && S_ISDIR(metadata.st_mode))
+		{
+			path_list_add_directory(&list, arguments[i]);
+		}
+		else
 		{
-			matrix_set(pixels, pixel, image, buffer[image*784 + pixel] / 255.0);
+			path_list_add(&list, arguments[i]);
 		}
 	}
 
-	fclose(image_file);
-	fclose(label_file);
+	if (list.count == 0)
+	{
+		printf("No images to classify.\n");
+		free(list.paths);
+		return;
+	}
 
-	Matrix *W1 = matrix_new(10, 784);
-	Matrix *b1 = matrix_new(10, 1);
-	Matrix *W2 = matrix_new(10, 10);
-	Matrix *b2 = matrix_new(10, 1);
-	Matrix *A1, *A2, *Z1, *Z2;
-	Matrix *nW1, *nb1, *nW2, *nb2;
+	// The quantized model is made from the whole first layer, so a pruned one is written out in full for it.
+	Matrix *W1, *W2, *b1, *b2;
+	MatrixPruned *pruned = NULL;
+	ModelFile *brainsave = read_brainsave(&W1, &W2, &b1, &b2, int8 ? NULL : &pruned);
+	if (brainsave == NULL)
+	{
+		printf("No brainsave file found. Run train first.\n");
+		exit(5);
+	}
 
-	Matrix *answers = matrix_new(10, BATCH_SIZE);
-	Matrix *dZ1, *dZ2, *dW1, *dW2, *db1, *db2;
-	Matrix *tmp, *tmp2, *tmp3;
+	QuantizedModel *quantized = int8 ? read_quantized(brainsave, W1, W2, b1, b2) : NULL;
 
-	matrix_rand(W1);
-	matrix_rand(b1);
-	matrix_rand(W2);
-	matrix_rand(b2);
+	// Very long lists are classified a chunk at a time, so memory stays bounded.
+	unsigned int chunk = (list.count < CLASSIFY_CHUNK) ? list.count : CLASSIFY_CHUNK;
+	unsigned char *bytes = malloc((size_t)784 * chunk);
+	unsigned char *digits = malloc(chunk);
+	ImageError *errors = malloc(sizeof(ImageError) * chunk);
+	if (bytes == NULL || digits == NULL || errors == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
 
-	double learning_rate = 0.1;
+	Matrix *pixels = int8 ? NULL : matrix_new(784, chunk);
+	MatrixArena *arena = matrix_arena_new(sizeof(double) * 3 * 10 * chunk + 4096);
 
-	for (unsigned int i = 1; i <= ITERATIONS; i++)
+	if (!int8)
 	{
-#if USE_CUDA
-		tmp = matrix_multiply(W1, pixels, CUBLAS_OP_N, CUBLAS_OP_N);
-#else
-		tmp = matrix_multiply(W1, pixels);
-#endif
-		Z1 = matrix_add_to_rows(tmp, b1);
-		matrix_free(tmp);
-		A1 = matrix_ReLU(Z1);
-#if USE_CUDA
-		tmp = matrix_multiply(W2, A1, CUBLAS_OP_N, CUBLAS_OP_N);
-#else
-		tmp = matrix_multiply(W2, A1);
-#endif
-		Z2 = matrix_add_to_rows(tmp, b2);
-		matrix_free(tmp);
-		A2 = matrix_softmax(Z2);
+		if (pruned == NULL)
+		{
+			matrix_keep_on_device(W1);
+		}
+		matrix_keep_on_device(W2);
+	}
+
+	if (json)
+	{
+		printf("[");
+	}
+	else
+	{
+		printf(int8 ? "path,digit,error\n" : "path,digit,probability,error\n");
+	}
+
+	double decoding = 0, classifying = 0;
+	unsigned int failures = 0;
+
+	for (unsigned int first = 0; first < list.count; first += chunk)
+	{
+		unsigned int images = (list.count - first < chunk) ? list.count - first : chunk;
+
+		double start = threadpool_seconds();
 
-		matrix_clear(answers);
-		for (unsigned int image = 0; image < BATCH_SIZE; image++)
+		DecodeJob job = { list.paths + first, bytes, errors };
+		threadpool_run(images, decode_image, &job);
+
+		double decoded = threadpool_seconds();
+		decoding += decoded - start;
+
+		Matrix *A2 = NULL;
+
+		if (int8)
 		{
-			matrix_set(answers, labels[image], image, 1.0);
+			quantized_classify(quantized, bytes, images, digits);
 		}
+		else
+		{
+			Matrix view = matrix_columns(pixels, 0, images);
+			matrix_gather_bytes_into(&view, bytes, NULL, 1 / 255.0);
 
-		dZ2 = matrix_subtract(A2, answers, 1.0);
+			matrix_arena_reset(arena);
+			matrix_arena_use(arena);
 
-#if USE_CUDA
-		dW2 = matrix_multiply(dZ2, A1, CUBLAS_OP_N, CUBLAS_OP_T);
-#else
-		tmp = matrix_transpose(A1);
-		dW2 = matrix_multiply(dZ2, tmp);
-		matrix_free(tmp);
-#endif
-		db2 = matrix_sum_rows(dZ2);
-#if USE_CUDA
-		tmp2 = matrix_multiply(W2, dZ2, CUBLAS_OP_T, CUBLAS_OP_N);
-#else
-		tmp = matrix_transpose(W2);
-		tmp2 = matrix_multiply(tmp, dZ2);
-		matrix_free(tmp);
-#endif
-		tmp3 = matrix_dReLU(Z1);
-		dZ1 = matrix_elementwise_multiply(tmp2, tmp3);
-		matrix_free(tmp2);
-		matrix_free(tmp3);
-#if USE_CUDA
-		tmp2 = matrix_multiply(pixels, dZ1, CUBLAS_OP_N, CUBLAS_OP_T);
-#else
-		tmp = matrix_transpose(dZ1);
-		tmp2 = matrix_multiply(pixels, tmp);
-		matrix_free(tmp);
-#endif
-		dW1 = matrix_transpose(tmp2);
-		matrix_free(tmp2);
-		db1 = matrix_sum_rows(dZ1);
+			Matrix *A1 = (pruned != NULL) ? matrix_pruned_dense(pruned, &view, b1, MATRIX_ACTIVATION_RELU) : matrix_dense(W1, &view, b1, MATRIX_ACTIVATION_RELU);
+			Matrix *Z2 = matrix_dense(W2, A1, b2, MATRIX_ACTIVATION_NONE);
+			A2 = matrix_softmax(Z2);
 
-		nW1 = matrix_subtract(W1, dW1, learning_rate / BATCH_SIZE);
-		nb1 = matrix_subtract(b1, db1, learning_rate / BATCH_SIZE);
-		nW2 = matrix_subtract(W2, dW2, learning_rate / BATCH_SIZE);
-		nb2 = matrix_subtract(b2, db2, learning_rate / BATCH_SIZE);
+			matrix_arena_use(NULL);
 
-		double mk = 100.0 * mark(A2, labels, BATCH_SIZE);
+			for (unsigned int col = 0; col < images; col++)
+			{
+				digits[col] = predict(A2, col);
+			}
+		}
 
-		matrix_free(W1);
-		matrix_free(b1);
-		matrix_free(W2);
-		matrix_free(b2);
+		classifying += threadpool_seconds() - decoded;
 
-		matrix_free(A1);
-		matrix_free(A2);
-		matrix_free(Z1);
-		matrix_free(Z2);
-		matrix_free(dW1);
-		matrix_free(dW2);
-		matrix_free(db1);
-		matrix_free(db2);
-		matrix_free(dZ1);
-		matrix_free(dZ2);
-
-		W1 = nW1;
-		W2 = nW2;
-		b1 = nb1;
-		b2 = nb2;
-
-		printf("Training...%.2lf%% Accuracy=%.1lf%%\r", 100.0 * i / ITERATIONS, mk);
-		fflush(stdout);
-	}
-	printf("\n");
+		for (unsigned int image = 0; image < images; image++)
+		{
+			const char *path = list.paths[first + image];
 
-	FILE *brainsave = fopen("brainsave", "wb");
+			if (errors[image] != IMAGE_OK)
+			{
+				failures++;
 
-	fwrite(W1->data, sizeof(double), 7840, brainsave);
-	fwrite(W2->data, sizeof(double), 100, brainsave);
-	fwrite(b1->data, sizeof(double), 10, brainsave);
-	fwrite(b2->data, sizeof(double), 10, brainsave);
+				if (json)
+				{
+					printf("%s\n  {\"path\": ", (first + image > 0) ? "," : "");
+					print_json_string(path);
+					printf(", \"error\": ");
+					print_json_string(image_error(errors[image]));
+					printf("}");
+				}
+				else
+				{
+					print_csv_string(path);
+					printf(int8 ? ",," : ",,,");
+					print_csv_string(image_error(errors[image]));
+					printf("\n");
+				}
 
-	fclose(brainsave);
+				continue;
+			}
 
-	free(buffer);
-	free(labels);
-	matrix_free(pixels);
-	matrix_free(answers);
-	matrix_free(W1);
+			if (json)
+			{
+				printf("%s\n  {\"path\": ", (first + image > 0) ? "," : "");
+				print_json_string(path);
+				printf(", \"digit\": %u", digits[image]);
+				if (A2 != NULL)
+				{
+					printf(", \"probability\": %.4lf", matrix_get(A2, digits[image], image));
+				}
+				printf("}");
+			}
+			else
+			{
+				print_csv_string(path);
+				printf(",%u", digits[image]);
+				if (A2 != NULL)
+				{
+					printf(",%.4lf", matrix_get(A2, digits[image], image));
+				}
+				printf(",\n");
+			}
+		}
+	}
+
+	if (json)
+	{
+		printf("\n]\n");
+	}
+
+	// Kept off stdout, which holds the results.
+	fprintf(stderr, "Classified %u images in %.2lfs decoding and %.2lfs classifying, %.0lf images/s.\n",
+		list.count, decoding, classifying, list.count / (decoding + classifying));
+	if (failures > 0)
+	{
+		fprintf(stderr, "%u of the images could not be read.\n", failures);
+	}
+
+	if (quantized != NULL)
+	{
+		quantized_free(quantized);
+	}
+	if (pixels != NULL)
+	{
+		matrix_free(pixels);
+	}
+	matrix_arena_free(arena);
+	free(bytes);
+	free(digits);
+	free(errors);
+	if (pruned != NULL)
+	{
+		matrix_pruned_free(pruned);
+	}
+	else
+	{
+		matrix_free(W1);
+	}
 	matrix_free(W2);
 	matrix_free(b1);
 	matrix_free(b2);
+	model_close(brainsave);
+
+	for (unsigned int i = 0; i < list.count; i++)
+	{
+		free(list.paths[i]);
+	}
+	free(list.paths);
 }
 
-// test
-// ====
+// ServeModel
+// ==========
 //
-// Uses the 'brainsave' file created by train() to test the model's accuracy.
-void test(void)
+// The model serve() classifies with, and the buffers it reuses for every batch.
+typedef struct
+{
+	Matrix *W1, *W2, *b1, *b2;
+	MatrixPruned *pruned;      // Used instead of W1 if not NULL.
+	QuantizedModel *quantized; // Used instead of the matrices if not NULL.
+	Matrix *pixels;            // (784, max batch)
+	MatrixArena *arena;        // The intermediates of a batch.
+} ServeModel;
+
+// serve_classify
+// ==============
+//
+// Classifies a batch for serve(). See ServerClassify.
+//
+// Parameters:
+//   context - The ServeModel.
+//    images - The images, 784 bytes each.
+//     count - The number of images.
+//    digits - Set to the digit seen in each image.
+static void serve_classify(void *context, const unsigned char *images, unsigned int count, unsigned char *digits)
 {
-	FILE *test_images = fopen("data/t10k-images.idx3-ubyte", "rb");
-	if (test_images == NULL)
+	ServeModel *model = context;
+
+	if (model->quantized != NULL)
 	{
-		printf("Could not find test images at 'data/t10k-images.idx3-ubyte'.\n");
-		exit(4);
+		quantized_classify(model->quantized, images, count, digits);
+		return;
 	}
 
-	FILE *test_labels = fopen("data/t10k-labels.idx1-ubyte", "rb");
-	if (test_labels == NULL)
+	Matrix pixels = matrix_columns(model->pixels, 0, count);
+	matrix_gather_bytes_into(&pixels, images, NULL, 1 / 255.0);
+
+	matrix_arena_reset(model->arena);
+	matrix_arena_use(model->arena);
+
+	// Only the logits are needed. See predict().
+	Matrix *A1 = (model->pruned != NULL) ? matrix_pruned_dense(model->pruned, &pixels, model->b1, MATRIX_ACTIVATION_RELU)
+		: matrix_dense(model->W1, &pixels, model->b1, MATRIX_ACTIVATION_RELU);
+	Matrix *Z2 = matrix_dense(model->W2, A1, model->b2, MATRIX_ACTIVATION_NONE);
+
+	matrix_arena_use(NULL);
+
+	for (unsigned int col = 0; col < count; col++)
 	{
-		printf("Could not find test labels at 'data/t10k-labels.idx1-ubyte'.\n");
-		fclose(test_images);
-		exit(4);
+		digits[col] = predict(Z2, col);
 	}
+}
+
+// serve
+// =====
+//
+// Loads the 'brainsave' file created by train() once, then classifies images sent over a Unix domain socket in
+// batches until interrupted. See server_run().
+//
+// Parameters:
+//   options - Where to listen and how to batch.
+//      int8 - Whether to classify with the quantized model.
+void serve(ServerOptions options, bool int8)
+{
+	ServeModel model = { .pruned = NULL };
 
-	FILE *brainsave = fopen("brainsave", "rb");
+	// The quantized model is made from the whole first layer, so a pruned one is written out in full for it.
+	ModelFile *brainsave = read_brainsave(&model.W1, &model.W2, &model.b1, &model.b2, int8 ? NULL : &model.pruned);
 	if (brainsave == NULL)
 	{
 		printf("Could not find a brainsave file. Run train first.\n");
-		fclose(test_images);
-		fclose(test_labels);
 		exit(4);
 	}
 
-	unsigned char *raw_test_data = (unsigned char*)malloc(TEST_SIZE*784);
-	unsigned char *labels = (unsigned char*)malloc(TEST_SIZE);
+	model.quantized = int8 ? read_quantized(brainsave, model.W1, model.W2, model.b1, model.b2) : NULL;
+	model.pixels = matrix_new(784, options.max_batch);
+	model.arena = matrix_arena_new(sizeof(double) * 2 * 10 * options.max_batch + 4096);
 
-	// Headers.
-	fread(raw_test_data, 1, 16, test_images);
-	fread(labels, 1, 8, test_labels);
+	if (model.pruned == NULL)
+	{
+		matrix_keep_on_device(model.W1);
+	}
+	matrix_keep_on_device(model.W2);
 
-	fread(raw_test_data, 784, TEST_SIZE, test_images);
-	fread(labels, 1, TEST_SIZE, test_labels);
+	printf("Precision: %s, %s.\n", int8 ? "int8" : (model.W2->precision == MATRIX_F32) ? "f32" : "f64",
+		int8 ? quantized_kernel() : matrix_backend());
 
-	double *W1_buffer = (double*)malloc(sizeof(double)*7840);
-	double *W2_buffer = (double*)malloc(sizeof(double)*100);
-	double *b1_buffer = (double*)malloc(sizeof(double)*10);
-	double *b2_buffer = (double*)malloc(sizeof(double)*10);
+	server_run(options, serve_classify, &model);
 
-	fread(W1_buffer, sizeof(double), 7840, brainsave);
-	fread(W2_buffer, sizeof(double), 100, brainsave);
-	fread(b1_buffer, sizeof(double), 10, brainsave);
-	fread(b2_buffer, sizeof(double), 10, brainsave);
+	if (model.quantized != NULL)
+	{
+		quantized_free(model.quantized);
+	}
+	matrix_arena_free(model.arena);
+	matrix_free(model.pixels);
+	if (model.pruned != NULL)
+	{
+		matrix_pruned_free(model.pruned);
+	}
+	else
+	{
+		matrix_free(model.W1);
+	}
+	matrix_free(model.W2);
+	matrix_free(model.b1);
+	matrix_free(model.b2);
+	model_close(brainsave);
+}
 
-	fclose(brainsave);
-	fclose(test_images);
-	fclose(test_labels);
+// prune_measure
+// =============
+//
+// Classifies a set of images with a first layer that is either dense or pruned, repeating the forward pass for at
+// least PRUNE_CURVE_SECONDS to time it.
+//
+// Parameters:
+//         W1 - The first layer's weights, used if pruned is NULL.
+//     pruned - The kept weights of the first layer, or NULL.
+//         W2 - The second layer's weights.
+//         b1 - The first layer's biases.
+//         b2 - The second layer's biases.
+//     pixels - The images, one per column.
+//     labels - The label of each image.
+//   accuracy - Set to the fraction of the images classified correctly.
+//
+// Return:
+//   The images classified per second.
+static double prune_measure(Matrix *W1, MatrixPruned *pruned, Matrix *W2, Matrix *b1, Matrix *b2, Matrix *pixels, const unsigned char *labels, double *accuracy)
+{
+	Matrix *A1 = matrix_new(10, pixels->cols);
+	Matrix *Z2 = matrix_new(10, pixels->cols);
 
-	Matrix *W1 = matrix_new_from_data(10, 784, W1_buffer);
-	Matrix *W2 = matrix_new_from_data(10, 10, W2_buffer);
-	Matrix *b1 = matrix_new_from_data(10, 1, b1_buffer);
-	Matrix *b2 = matrix_new_from_data(10, 1, b2_buffer);
+	unsigned int runs = 0;
+	double start = threadpool_seconds(), elapsed;
 
-	Matrix *pixels = matrix_new(784, TEST_SIZE);
-	for (unsigned int image = 0; image < TEST_SIZE; image++)
+	// Only the logits are needed. See predict().
+	do
 	{
-		for (unsigned int pixel = 0; pixel < 784; pixel++)
+		if (pruned != NULL)
 		{
-			matrix_set(pixels, pixel, image, (raw_test_data[image*784 + pixel]) / 255.);
+			matrix_pruned_dense_into(A1, pruned, pixels, b1, MATRIX_ACTIVATION_RELU);
 		}
-	}
-	free(raw_test_data);
-
-	Matrix *A1, *A2, *Z1, *Z2, *tmp;
+		else
+		{
+			matrix_dense_into(A1, W1, pixels, b1, MATRIX_ACTIVATION_RELU);
+		}
+		matrix_dense_into(Z2, W2, A1, b2, MATRIX_ACTIVATION_NONE);
 
-#if USE_CUDA
-	tmp = matrix_multiply(W1, pixels, CUBLAS_OP_N, CUBLAS_OP_N);
-#else
-	tmp = matrix_multiply(W1, pixels);
-#endif
-	Z1 = matrix_add_to_rows(tmp, b1);
-	matrix_free(tmp);
-	A1 = matrix_ReLU(Z1);
-#if USE_CUDA
-	tmp = matrix_multiply(W2, A1, CUBLAS_OP_N, CUBLAS_OP_N);
-#else
-	tmp = matrix_multiply(W2, A1);
-#endif
-	Z2 = matrix_add_to_rows(tmp, b2);
-	matrix_free(tmp);
-	A2 = matrix_softmax(Z2);
+		runs++;
+		elapsed = threadpool_seconds() - start;
+	}
+	while (elapsed < PRUNE_CURVE_SECONDS);
 
-	printf("Accuracy: %.2lf%%.\n", 100.0 * mark(A2, labels, TEST_SIZE));
-	free(labels);
+	*accuracy = mark(Z2, labels, pixels->cols);
 
 	matrix_free(A1);
-	matrix_free(A2);
-	matrix_free(Z1);
 	matrix_free(Z2);
-	matrix_free(pixels);
-	matrix_free(W1);
-	matrix_free(W2);
-	matrix_free(b1);
-	matrix_free(b2);
+
+	return (double)runs * pixels->cols / elapsed;
 }
 
-// image
+// prune
 // =====
 //
-// Attempts to determine the number contained in a bitmap.
+// Prunes the smallest weights of the first layer of the 'brainsave' file created by train(), and saves the model
+// again with the kept weights, which test(), image(), classify() and serve() then use in place of the dense ones.
+// If the test set is present, first prints the accuracy and speed of the model pruned to a range of sparsities.
 //
 // Parameters:
-//   path - The path to a 28x28, 24bpp greyscale image.
-void image(char *path)
+//   sparsity - The fraction of the first layer's weights to prune, from 0 up to but not including 1.
+void prune(double sparsity)
 {
-	FILE* brainsave = fopen("brainsave", "rb");
+	// A model pruned before has its first layer written out in full, to be pruned further.
+	Matrix *W1, *W2, *b1, *b2;
+	ModelFile *brainsave = read_brainsave(&W1, &W2, &b1, &b2, NULL);
 	if (brainsave == NULL)
 	{
-		printf("No brainsave file found. Run train first.\n");
-		exit(5);
+		printf("Could not find a brainsave file. Run train first.\n");
+		exit(4);
 	}
 
-	unsigned char* raw_pixels = read_image(path);
-	Matrix* pixels = matrix_new(784, 1);
+	// The saved weights are mapped read only, so they are pruned into a copy.
+	Matrix *kept = matrix_new(W1->rows, W1->cols);
 
-	for (unsigned int i = 0; i < 784; i++)
+	IdxFile *images, *labels;
+	if (open_dataset("test", "data/t10k-images.idx3-ubyte", "data/t10k-labels.idx1-ubyte", &images, &labels, 0))
 	{
-		matrix_set(pixels, i, 0, (255 - raw_pixels[i]) / 255.);
-	}
-	free(raw_pixels);
+		Matrix *pixels = matrix_new(784, images->count);
+		matrix_gather_bytes_into(pixels, images->data, NULL, 1 / 255.0);
 
-	double *W1_buffer = (double*)malloc(sizeof(double) * 7840);
-	double *W2_buffer = (double*)malloc(sizeof(double) * 100);
-	double *b1_buffer = (double*)malloc(sizeof(double) * 10);
-	double *b2_buffer = (double*)malloc(sizeof(double) * 10);
+		// The sparsity asked for is measured along with the curve, in order.
+		double curve[] = PRUNE_CURVE;
+		unsigned int points = sizeof(curve) / sizeof(curve[0]);
+		double sparsities[sizeof(curve) / sizeof(curve[0]) + 1];
+		unsigned int count = 0;
+		bool added = false;
+
+		for (unsigned int i = 0; i < points; i++)
+		{
+			if (!added && sparsity <= curve[i])
+			{
+				if (sparsity < curve[i])
+				{
+					sparsities[count++] = sparsity;
+				}
+				added = true;
+			}
 
-	fread(W1_buffer, sizeof(double), 7840, brainsave);
-	fread(W2_buffer, sizeof(double), 100, brainsave);
-	fread(b1_buffer, sizeof(double), 10, brainsave);
-	fread(b2_buffer, sizeof(double), 10, brainsave);
+			sparsities[count++] = curve[i];
+		}
 
-	Matrix *W1 = matrix_new_from_data(10, 784, W1_buffer);
-	Matrix *W2 = matrix_new_from_data(10, 10, W2_buffer);
-	Matrix *b1 = matrix_new_from_data(10, 1, b1_buffer);
-	Matrix *b2 = matrix_new_from_data(10, 1, b2_buffer);
+		if (!added)
+		{
+			sparsities[count++] = sparsity;
+		}
 
-	Matrix *A1, *A2, *Z1, *Z2, *tmp;
+		double dense_accuracy;
+		double dense_rate = prune_measure(W1, NULL, W2, b1, b2, pixels, labels->data, &dense_accuracy);
 
-#if USE_CUDA
-	tmp = matrix_multiply(W1, pixels, CUBLAS_OP_N, CUBLAS_OP_N);
-#else
-	tmp = matrix_multiply(W1, pixels);
-#endif
-	Z1 = matrix_add_to_rows(tmp, b1);
-	matrix_free(tmp);
-	A1 = matrix_ReLU(Z1);
-#if USE_CUDA
-	tmp = matrix_multiply(W2, A1, CUBLAS_OP_N, CUBLAS_OP_N);
-#else
-	tmp = matrix_multiply(W2, A1);
-#endif
-	Z2 = matrix_add_to_rows(tmp, b2);
-	matrix_free(tmp);
-	A2 = matrix_softmax(Z2);
+		printf("Accuracy and speed of the %u test images with the first layer pruned, %s, %s backend:\n", images->count,
+			(W1->precision == MATRIX_F32) ? "f32" : "f64", matrix_backend());
+		printf("  %-9s %7s %9s %12s %8s\n", "sparsity", "kept", "accuracy", "images/s", "speedup");
+		printf("  %-9s %6.1lf%% %8.2lf%% %12.0lf %7.2lfx\n", "dense", 100.0, 100.0 * dense_accuracy, dense_rate, 1.0);
 
-	int output = 0;
-	double max = 0.0;
-	for (int i = 0; i < 10; i++)
-	{
-		double got = matrix_get(A2, i, 0);
-		if (got > max)
+		for (unsigned int i = 0; i < count; i++)
 		{
-			max = got;
-			output = i;
+			MatrixPruned *pruned = matrix_prune(kept, W1, sparsities[i]);
+
+			double accuracy;
+			double rate = prune_measure(kept, pruned, W2, b1, b2, pixels, labels->data, &accuracy);
+
+			printf("  %-8.2lf%c %6.1lf%% %8.2lf%% %12.0lf %7.2lfx\n", sparsities[i], (sparsities[i] == sparsity) ? '*' : ' ',
+				100.0 * matrix_pruned_density(pruned), 100.0 * accuracy, rate, rate / dense_rate);
+
+			matrix_pruned_free(pruned);
 		}
+
+		matrix_free(pixels);
+		idx_close(images);
+		idx_close(labels);
+	}
+	else
+	{
+		printf("There is no test set, so the accuracy of the pruned model is not measured.\n");
 	}
 
-	printf("Looks like a %d to me.\n", output);
+	MatrixPruned *pruned = matrix_prune(kept, W1, sparsity);
 
-	matrix_free(A1);
-	matrix_free(A2);
-	matrix_free(Z1);
-	matrix_free(Z2);
+	// Weights pruned before are still zero, so the model may keep fewer than asked.
+	printf("Pruned the first layer to %.1lf%% of its weights, keeping %u of %u.\n", 100.0 * matrix_pruned_density(pruned),
+		pruned->starts[pruned->rows], pruned->rows * pruned->cols);
+
+	// The file is replaced by a rename, so the mapping stays valid while it is written.
+	write_brainsave(kept, W2, b1, b2, pruned);
 
+	matrix_pruned_free(pruned);
+	matrix_free(kept);
 	matrix_free(W1);
 	matrix_free(W2);
 	matrix_free(b1);
 	matrix_free(b2);
-
-	fclose(brainsave);
+	model_close(brainsave);
 }
 
 // mark
@@ -399,26 +2224,19 @@ void image(char *path)
 // Parameters:
 //    output - The matrix output of either test() or train().
 //   answers - An array of answers, where each byte is the next image's number.
+//      size - The number of images.
 //
 // Return:
 //   A ratio between 0 and 1 representing correct answers over total images.
-double mark(Matrix *output, unsigned char *answers, unsigned int size)
+double mark(Matrix *output, const unsigned char *answers, unsigned int size)
 {
+	PROFILE_SCOPE("mark");
+
 	unsigned int correct = 0;
 
-	for (int image = 0; image < size; image++)
+	for (unsigned int image = 0; image < size; image++)
 	{
-		int response = 0;
-
-		for (int i = 0; i < 10; i++)
-		{
-			if (matrix_get(output, i, image) > matrix_get(output, response, image))
-			{
-				response = i;
-			}
-		}
-
-		if (response == answers[image])
+		if (predict(output, image) == answers[image])
 		{
 			correct++;
 		}
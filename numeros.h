@@ -1,30 +1,110 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "images.h"
 #include "linalg.h"
+#include "quantized.h"
+#include "idx.h"
+#include "loader.h"
+#include "model.h"
+#include "server.h"
 
-#if USE_CUDA
-#include <cublas_v2.h>
-#endif
+// The defaults for mini-batch training. A batch of 64 images is 200KB of
+// single or 400KB of double precision pixels, which stays in L2.
+#define MINIBATCH_SIZE 64
+#define EPOCHS 10
+#define LEARNING_RATE 0.1
 
+// The number of batches the loader prepares ahead of training, and the size of
+// the chunks it streams the training images in. A set that fits in one chunk is
+// shuffled as a whole.
+#define PREFETCH_DEPTH 2
+#define STREAM_CHUNK_BYTES (64 << 20)
+
+// The original full-batch scheme, kept for comparison with --full-batch.
 #define BATCH_SIZE 10000
-#define TEST_SIZE 10000
 #define ITERATIONS 500
 
+// The defaults for serve. A request waits at most 2ms for others to join its
+// batch, which is enough to gather a few hundred at thousands per second.
+#define SERVE_SOCKET "numeros.sock"
+#define SERVE_MAX_BATCH 256
+#define SERVE_WINDOW 0.002
+#define SERVE_REPORT_INTERVAL 10.0
+
+// The most images classify decodes and classifies at once. 16384 images are
+// 12MB of pixel bytes and 50MB of single precision inputs.
+#define CLASSIFY_CHUNK 16384
+
+// The largest fraction of set pixels at which the first layer reads the images
+// sparse. Below about a third the sparse products beat the dense ones on the
+// sizes train() uses, and MNIST has about a fifth of its pixels set.
+#define SPARSE_MAX_DENSITY 0.3
+
+// How long train() times the first layer for, each way, to report the speedup
+// of reading the images sparse.
+#define INPUT_COMPARE_SECONDS 0.1
+
+// The sparsities prune() measures the accuracy and speed of the test set at,
+// along with the one asked for, and how long it times the forward pass at each.
+#define PRUNE_CURVE { 0.0, 0.5, 0.75, 0.9, 0.95, 0.98, 0.99 }
+#define PRUNE_CURVE_SECONDS 0.2
+
 #define strequ !strcmp
 
+// InputMode
+// =========
+//
+// How the first layer reads a set of images: dense, as a matrix of pixels, or sparse, from a MatrixSparse of the
+// whole set that skips the pixels that are not set.
+typedef enum
+{
+	INPUT_AUTO,   // Sparse if at most SPARSE_MAX_DENSITY of the pixels are set, otherwise dense.
+	INPUT_DENSE,
+	INPUT_SPARSE
+} InputMode;
+
+// TrainOptions
+// ============
+//
+// How train() trains the model.
+typedef struct
+{
+	MatrixPrecision precision; // The precision to train and save the model in.
+	unsigned int images;       // The number of training images to use from the start of the set, or 0 for all of them.
+	unsigned int batch_size;   // The number of images averaged over for each step.
+	unsigned int epochs;       // The number of passes over the images.
+	double learning_rate;
+	bool shuffle;              // Visits the images in a new random order each epoch.
+	double target;             // A test accuracy between 0 and 1 to report the time taken to reach, or 0.
+	const char *trace;         // The path to write a Chrome trace of training to, or NULL. Needs USE_PROFILE.
+	InputMode input;           // How the first layer reads the images.
+} TrainOptions;
+
 	// train
 	// =====
 	//
 	// Trains the model using the MNIST database.
-	void train(void);
+	//
+	// Parameters:
+	//   options - How to train. See TrainOptions.
+	void train(TrainOptions options);
 
 	// test
 	// ====
 	//
 	// Uses the 'brainsave' file created by train() to test the model's accuracy.
-	void test(void);
+	//
+	// Parameters:
+	//    int8 - Whether to also quantize the model and compare the int8 path against the floating point path.
+	//   input - How the first layer reads the images.
+	void test(bool int8, InputMode input);
 
 	// image
 	// =====
@@ -32,8 +112,45 @@
 	// Attempts to determine the number contained in a bitmap.
 	//
 	// Parameters:
-	//   path - The path to a 28x28, 24bpp greyscale image.
-	void image(char *path);
+	//   path - The path to an 8, 24 or 32 bits-per-pixel bitmap, black on white. It is scaled to 28x28.
+	//   int8 - Whether to classify with the quantized model.
+	void image(char *path, bool int8);
+
+	// classify
+	// ========
+	//
+	// Classifies many bitmaps at once. The bitmaps are decoded in parallel on the thread pool into one matrix, which
+	// is classified by a single forward pass, and the results are printed as CSV or JSON.
+	//
+	// Parameters:
+	//   arguments - The bitmaps: paths of images, directories of images, or '@' followed by the path of a file
+	//               listing images one per line.
+	//       count - The number of arguments.
+	//        json - Whether to print JSON instead of CSV.
+	//        int8 - Whether to classify with the quantized model.
+	void classify(char **arguments, unsigned int count, bool json, bool int8);
+
+	// prune
+	// =====
+	//
+	// Prunes the smallest weights of the first layer of the 'brainsave' file created by train(), and saves the model
+	// again with the kept weights, which test(), image(), classify() and serve() then use in place of the dense ones.
+	// If the test set is present, first prints the accuracy and speed of the model pruned to a range of sparsities.
+	//
+	// Parameters:
+	//   sparsity - The fraction of the first layer's weights to prune, from 0 up to but not including 1.
+	void prune(double sparsity);
+
+	// serve
+	// =====
+	//
+	// Loads the 'brainsave' file created by train() once, then classifies images sent over a Unix domain socket in
+	// batches until interrupted. See server_run().
+	//
+	// Parameters:
+	//   options - Where to listen and how to batch.
+	//      int8 - Whether to classify with the quantized model.
+	void serve(ServerOptions options, bool int8);
 
 	// mark
 	// ====
@@ -43,7 +160,8 @@
 	// Parameters:
 	//    output - The matrix output of either test() or train().
 	//   answers - An array of answers, where each byte is the next image's number.
+	//      size - The number of images.
 	//
 	// Return:
 	//   A ratio between 0 and 1 representing correct answers over total images.
-	double mark(Matrix *output, unsigned char *answers);
+	double mark(Matrix *output, const unsigned char *answers, unsigned int size);
@@ -0,0 +1,435 @@
+#include "profile.h"
+
+#if USE_PROFILE
+
+// ProfileStat
+// ===========
+//
+// The totals of one scope name on one thread since the last report.
+typedef struct
+{
+	const char *name;
+	uint64_t calls;
+	uint64_t total; // Nanoseconds inside the scope.
+	uint64_t self;  // Nanoseconds inside the scope but not inside a scope nested in it.
+} ProfileStat;
+
+// ProfileEvent
+// ============
+//
+// One closed scope, for the trace.
+typedef struct
+{
+	const char *name;
+	uint64_t start, duration;
+} ProfileEvent;
+
+// ProfileThread
+// =============
+//
+// What one thread has timed. Each thread only writes its own.
+typedef struct ProfileThread
+{
+	struct ProfileThread *next;
+	unsigned int id;
+
+	// The totals are locked so that they can be reported while the thread runs,
+	// as the loader thread does. The lock is only ever contended by a report.
+	pthread_mutex_t lock;
+	ProfileStat stats[PROFILE_MAX_NAMES];
+	unsigned int stat_count;
+
+	// The time spent in scopes nested inside each open scope.
+	uint64_t nested[PROFILE_MAX_DEPTH];
+	unsigned int depth;
+
+	ProfileEvent *events;
+	size_t event_count, event_capacity, dropped;
+} ProfileThread;
+
+static _Thread_local ProfileThread *local;
+static ProfileThread *threads;
+static unsigned int thread_count;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *trace_path;
+static uint64_t origin, last_report;
+
+// now
+// ===
+//
+// Returns the time on the monotonic clock, which is cheaper to read than the wall clock and never steps backwards.
+//
+// Return:
+//   The time in nanoseconds.
+static uint64_t now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// profile_thread
+// ==============
+//
+// Returns the calling thread's record, creating it the first time the thread opens a scope.
+//
+// Return:
+//   The record.
+static ProfileThread *profile_thread(void)
+{
+	if (local != NULL)
+	{
+		return local;
+	}
+
+	ProfileThread *thread = calloc(1, sizeof(ProfileThread));
+	if (thread == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	pthread_mutex_init(&thread->lock, NULL);
+	pthread_mutex_lock(&threads_lock);
+
+	if (origin == 0)
+	{
+		origin = now();
+		last_report = origin;
+	}
+
+	// Threads are listed in the order they first opened a scope, so the main
+	// thread, which starts training, comes first.
+	thread->id = thread_count++;
+	ProfileThread **last = &threads;
+	while (*last != NULL)
+	{
+		last = &(*last)->next;
+	}
+	*last = thread;
+
+	pthread_mutex_unlock(&threads_lock);
+
+	local = thread;
+	return thread;
+}
+
+// stat_find
+// =========
+//
+// Finds the totals of a scope name on a thread, adding them if this is the first scope of that name.
+//
+// Parameters:
+//   thread - The thread.
+//     name - The name of the scope.
+//
+// Return:
+//   The totals, or NULL if the thread already has PROFILE_MAX_NAMES names.
+static ProfileStat *stat_find(ProfileThread *thread, const char *name)
+{
+	for (unsigned int i = 0; i < thread->stat_count; i++)
+	{
+		if (thread->stats[i].name == name)
+		{
+			return &thread->stats[i];
+		}
+	}
+
+	if (thread->stat_count == PROFILE_MAX_NAMES)
+	{
+		return NULL;
+	}
+
+	ProfileStat *stat = &thread->stats[thread->stat_count++];
+	*stat = (ProfileStat){ name, 0, 0, 0 };
+
+	return stat;
+}
+
+// profile_begin
+// =============
+//
+// Opens a timed scope on the calling thread. Use PROFILE_SCOPE rather than calling this directly.
+//
+// Parameters:
+//   name - The name of the scope.
+//
+// Return:
+//   The scope, to pass to profile_end().
+ProfileScope profile_begin(const char *name)
+{
+	ProfileThread *thread = profile_thread();
+
+	if (thread->depth < PROFILE_MAX_DEPTH)
+	{
+		thread->nested[thread->depth] = 0;
+	}
+	thread->depth++;
+
+	return (ProfileScope){ name, now() };
+}
+
+// profile_end
+// ===========
+//
+// Closes the innermost timed scope of the calling thread, adding its time to the totals of its name, and
+// recording it as a trace event if tracing.
+//
+// Parameters:
+//   this - The scope, as returned by profile_begin().
+void profile_end(ProfileScope *this)
+{
+	uint64_t duration = now() - this->start;
+	ProfileThread *thread = local;
+
+	thread->depth--;
+	uint64_t nested = (thread->depth < PROFILE_MAX_DEPTH) ? thread->nested[thread->depth] : 0;
+	if (thread->depth > 0 && thread->depth - 1 < PROFILE_MAX_DEPTH)
+	{
+		thread->nested[thread->depth - 1] += duration;
+	}
+
+	pthread_mutex_lock(&thread->lock);
+
+	ProfileStat *stat = stat_find(thread, this->name);
+	if (stat != NULL)
+	{
+		stat->calls++;
+		stat->total += duration;
+		stat->self += (nested < duration) ? duration - nested : 0;
+	}
+
+	pthread_mutex_unlock(&thread->lock);
+
+	if (trace_path == NULL)
+	{
+		return;
+	}
+
+	if (thread->event_count == thread->event_capacity)
+	{
+		size_t capacity = (thread->event_capacity == 0) ? 4096 : thread->event_capacity * 2;
+		ProfileEvent *events = (capacity <= PROFILE_MAX_EVENTS) ? realloc(thread->events, sizeof(ProfileEvent) * capacity) : NULL;
+
+		if (events == NULL)
+		{
+			thread->dropped++;
+			return;
+		}
+
+		thread->events = events;
+		thread->event_capacity = capacity;
+	}
+
+	thread->events[thread->event_count++] = (ProfileEvent){ this->name, this->start, duration };
+}
+
+// profile_trace
+// =============
+//
+// Starts recording every scope as an event, to be written by profile_finish(). Call before any thread opens a
+// scope that should be recorded.
+//
+// Parameters:
+//   path - The path to write the Chrome trace-event JSON file to, or NULL to not record a trace.
+void profile_trace(const char *path)
+{
+	trace_path = path;
+}
+
+// compare_stats
+// =============
+//
+// Orders totals by their self time, longest first, for qsort().
+//
+// Parameters:
+//   a - The first totals.
+//   b - The second totals.
+//
+// Return:
+//   Less than, equal to or greater than 0 as a comes before, with or after b.
+static int compare_stats(const void *a, const void *b)
+{
+	uint64_t x = ((const ProfileStat*)a)->self;
+	uint64_t y = ((const ProfileStat*)b)->self;
+
+	return (x < y) - (x > y);
+}
+
+// profile_report
+// ==============
+//
+// Prints a table of the calls and time of each scope name, summed over every thread, since the last report,
+// and resets the totals.
+//
+// Parameters:
+//   format - A printf() format for what the table covers, such as "Epoch %u", followed by its arguments.
+void profile_report(const char *format, ...)
+{
+	ProfileStat merged[PROFILE_MAX_NAMES];
+	unsigned int count = 0;
+	uint64_t self = 0;
+
+	pthread_mutex_lock(&threads_lock);
+
+	// Scopes are merged by name rather than by pointer, as the same literal may
+	// have a different address in each file.
+	for (ProfileThread *thread = threads; thread != NULL; thread = thread->next)
+	{
+		pthread_mutex_lock(&thread->lock);
+
+		for (unsigned int i = 0; i < thread->stat_count; i++)
+		{
+			ProfileStat *stat = &thread->stats[i];
+			unsigned int j = 0;
+
+			while (j < count && strcmp(merged[j].name, stat->name) != 0)
+			{
+				j++;
+			}
+
+			if (j == count)
+			{
+				if (count == PROFILE_MAX_NAMES)
+				{
+					continue;
+				}
+
+				merged[count++] = (ProfileStat){ stat->name, 0, 0, 0 };
+			}
+
+			merged[j].calls += stat->calls;
+			merged[j].total += stat->total;
+			merged[j].self += stat->self;
+			self += stat->self;
+		}
+
+		thread->stat_count = 0;
+		pthread_mutex_unlock(&thread->lock);
+	}
+
+	unsigned int thread_total = thread_count;
+	pthread_mutex_unlock(&threads_lock);
+
+	uint64_t time = now();
+	double elapsed = (time - last_report) / 1e9;
+	last_report = time;
+
+	qsort(merged, count, sizeof(ProfileStat), compare_stats);
+
+	// Scopes on different threads overlap, so the times add up to more than the
+	// elapsed time when training on more than one thread.
+	va_list arguments;
+	va_start(arguments, format);
+	printf("\n");
+	vprintf(format, arguments);
+	va_end(arguments);
+
+	printf(": %.3lfs on %u threads.\n", elapsed, thread_total);
+	printf("  %-28s %10s %10s %10s %7s %10s\n", "scope", "calls", "total s", "self s", "self", "mean us");
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		printf("  %-28s %10llu %10.4lf %10.4lf %6.1lf%% %10.2lf\n", merged[i].name, (unsigned long long)merged[i].calls,
+			merged[i].total / 1e9, merged[i].self / 1e9, (self > 0) ? 100.0 * merged[i].self / self : 0.0,
+			merged[i].total / 1e3 / merged[i].calls);
+	}
+
+	fflush(stdout);
+}
+
+// print_json_name
+// ===============
+//
+// Prints a scope name as a JSON string.
+//
+// Parameters:
+//   file - Where to print it.
+//   name - The name.
+static void print_json_name(FILE *file, const char *name)
+{
+	fputc('"', file);
+
+	for (const char *c = name; *c != '\0'; c++)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			fputc('\\', file);
+		}
+
+		fputc(*c, file);
+	}
+
+	fputc('"', file);
+}
+
+// profile_finish
+// ==============
+//
+// Writes the trace started by profile_trace(), if any, and stops recording. Must not be called while other
+// threads are inside scopes.
+void profile_finish(void)
+{
+	if (trace_path == NULL)
+	{
+		return;
+	}
+
+	const char *path = trace_path;
+	trace_path = NULL;
+
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+	{
+		printf("Could not write the trace to '%s'.\n", path);
+		return;
+	}
+
+	// Complete ("X") events, in microseconds since the first scope, one track
+	// per thread.
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+	size_t written = 0, dropped = 0;
+
+	pthread_mutex_lock(&threads_lock);
+
+	for (ProfileThread *thread = threads; thread != NULL; thread = thread->next)
+	{
+		fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s %u\"}}",
+			(written > 0) ? ",\n" : "", thread->id, (thread->id == 0) ? "main" : "thread", thread->id);
+		written++;
+
+		for (size_t i = 0; i < thread->event_count; i++)
+		{
+			ProfileEvent *event = &thread->events[i];
+
+			fprintf(file, ",\n{\"name\": ");
+			print_json_name(file, event->name);
+			fprintf(file, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3lf, \"dur\": %.3lf}", thread->id,
+				(event->start - origin) / 1e3, event->duration / 1e3);
+		}
+
+		written += thread->event_count;
+		dropped += thread->dropped;
+
+		free(thread->events);
+		thread->events = NULL;
+		thread->event_count = thread->event_capacity = thread->dropped = 0;
+	}
+
+	pthread_mutex_unlock(&threads_lock);
+
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	printf("Wrote the trace to '%s'", path);
+	if (dropped > 0)
+	{
+		printf(", dropping %zu events past the %u per thread limit", dropped, PROFILE_MAX_EVENTS);
+	}
+	printf(".\n");
+}
+
+#endif // USE_PROFILE
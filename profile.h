@@ -0,0 +1,104 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// The most distinct scope names each thread keeps totals for, the deepest
+// scopes may nest, and the most trace events each thread records before it
+// starts dropping them, 96MB per thread.
+#define PROFILE_MAX_NAMES 64
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_MAX_EVENTS (1 << 22)
+
+#if USE_PROFILE
+
+// ProfileScope
+// ============
+//
+// A timed scope, opened by profile_begin() and closed by profile_end().
+typedef struct
+{
+	const char *name;
+	uint64_t start; // Nanoseconds on the monotonic clock.
+} ProfileScope;
+
+// PROFILE_SCOPE
+// =============
+//
+// Times the rest of the enclosing block under a name, which must be a string literal or otherwise outlive the
+// program. The scope is closed however the block is left, including by return. Needs GCC or Clang.
+#define PROFILE_JOIN(a, b) a##b
+#define PROFILE_LOCAL(line) PROFILE_JOIN(profile_scope_, line)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_LOCAL(__LINE__) __attribute__((cleanup(profile_end))) = profile_begin(name)
+
+#define PROFILE_TRACE(path) profile_trace(path)
+#define PROFILE_REPORT(...) profile_report(__VA_ARGS__)
+#define PROFILE_FINISH() profile_finish()
+
+	// profile_begin
+	// =============
+	//
+	// Opens a timed scope on the calling thread. Use PROFILE_SCOPE rather than calling this directly.
+	//
+	// Parameters:
+	//   name - The name of the scope.
+	//
+	// Return:
+	//   The scope, to pass to profile_end().
+	ProfileScope profile_begin(const char *name);
+
+	// profile_end
+	// ===========
+	//
+	// Closes the innermost timed scope of the calling thread, adding its time to the totals of its name, and
+	// recording it as a trace event if tracing.
+	//
+	// Parameters:
+	//   scope - The scope, as returned by profile_begin().
+	void profile_end(ProfileScope *scope);
+
+	// profile_trace
+	// =============
+	//
+	// Starts recording every scope as an event, to be written by profile_finish(). Call before any thread opens a
+	// scope that should be recorded.
+	//
+	// Parameters:
+	//   path - The path to write the Chrome trace-event JSON file to, or NULL to not record a trace.
+	void profile_trace(const char *path);
+
+	// profile_report
+	// ==============
+	//
+	// Prints a table of the calls and time of each scope name, summed over every thread, since the last report,
+	// and resets the totals.
+	//
+	// Parameters:
+	//   format - A printf() format for what the table covers, such as "Epoch %u", followed by its arguments.
+	void profile_report(const char *format, ...);
+
+	// profile_finish
+	// ==============
+	//
+	// Writes the trace started by profile_trace(), if any, and stops recording. Must not be called while other
+	// threads are inside scopes.
+	void profile_finish(void);
+
+#else
+
+// Without USE_PROFILE the timers compile to nothing.
+#define PROFILE_SCOPE(name)
+#define PROFILE_TRACE(path)
+#define PROFILE_REPORT(...)
+#define PROFILE_FINISH()
+
+#endif // USE_PROFILE
+
+#endif // PROFILE_H
@@ -0,0 +1,299 @@
+#include "quantized.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Pixels are shifted down to 7 bits before multiplying, so one step of a pixel
+// is worth 2/255 of full ink.
+#define PIXEL_SCALE (2.0f / 255.0f)
+
+// dot
+// ===
+//
+// Computes the dot product of a run of 7 bit pixels with a row of int8 weights.
+//
+// Parameters:
+//    pixels - The raw pixel bytes. Each is shifted right by one before use.
+//   weights - The weights.
+//         n - The number of pixels.
+//
+// Return:
+//   The exact integer dot product.
+static int32_t dot(const unsigned char *pixels, const int8_t *weights, unsigned int n)
+{
+	unsigned int i = 0;
+	int32_t sum = 0;
+
+#if defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256();
+	__m256i low_bits = _mm256_set1_epi8(0x7F);
+#if !(defined(__AVX512VNNI__) && defined(__AVX512VL__)) && !defined(__AVXVNNI__)
+	__m256i ones = _mm256_set1_epi16(1);
+#endif
+
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i p = _mm256_loadu_si256((const __m256i*)(pixels + i));
+		__m256i w = _mm256_loadu_si256((const __m256i*)(weights + i));
+
+		// There is no 8 bit shift, so shift 16 bit lanes and clear the bit carried in from the neighbouring byte.
+		p = _mm256_and_si256(_mm256_srli_epi16(p, 1), low_bits);
+
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+		acc = _mm256_dpbusd_epi32(acc, p, w);
+#elif defined(__AVXVNNI__)
+		acc = _mm256_dpbusd_avx_epi32(acc, p, w);
+#else
+		// Pairs of 127 * 127 products fit in 16 bits, so maddubs cannot saturate.
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(p, w), ones));
+#endif
+	}
+
+	__m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+	sum = _mm_cvtsi128_si32(half);
+#endif
+
+	for (; i < n; i++)
+	{
+		sum += (pixels[i] >> 1) * weights[i];
+	}
+
+	return sum;
+}
+
+// quantized_kernel
+// ================
+//
+// Returns the name of the dot product kernel quantized_classify() was compiled with.
+//
+// Return:
+//   "avx512-vnni", "avx-vnni", "avx2" or "scalar".
+const char *quantized_kernel(void)
+{
+#if defined(__AVX2__) && defined(__AVX512VNNI__) && defined(__AVX512VL__)
+	return "avx512-vnni";
+#elif defined(__AVX2__) && defined(__AVXVNNI__)
+	return "avx-vnni";
+#elif defined(__AVX2__)
+	return "avx2";
+#else
+	return "scalar";
+#endif
+}
+
+// copy_second_layer
+// =================
+//
+// Copies the layers that stay in single precision into a quantized model: the first layer's biases and the second
+// layer.
+//
+// Parameters:
+//   model - The model, with its sizes set.
+//      W2 - The second layer's weights.
+//      b1 - The first layer's biases.
+//      b2 - The second layer's biases.
+static void copy_second_layer(QuantizedModel *model, Matrix *W2, Matrix *b1, Matrix *b2)
+{
+	model->b1 = malloc(sizeof(float) * model->hidden);
+	model->W2 = malloc(sizeof(float) * model->outputs * model->hidden);
+	model->b2 = malloc(sizeof(float) * model->outputs);
+
+	if (model->b1 == NULL || model->W2 == NULL || model->b2 == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	for (unsigned int row = 0; row < model->hidden; row++)
+	{
+		model->b1[row] = matrix_get(b1, row, 0);
+	}
+
+	for (unsigned int output = 0; output < model->outputs; output++)
+	{
+		for (unsigned int hidden = 0; hidden < model->hidden; hidden++)
+		{
+			model->W2[hidden * model->outputs + output] = matrix_get(W2, output, hidden);
+		}
+
+		model->b2[output] = matrix_get(b2, output, 0);
+	}
+}
+
+// quantized_new
+// =============
+//
+// Quantizes a trained model. Each row of W1 is scaled so that its largest magnitude becomes 127.
+//
+// Parameters:
+//   W1 - The first layer's weights.
+//   W2 - The second layer's weights.
+//   b1 - The first layer's biases.
+//   b2 - The second layer's biases.
+//
+// Return:
+//   The quantized model. Call quantized_free() when no longer needed.
+QuantizedModel *quantized_new(Matrix *W1, Matrix *W2, Matrix *b1, Matrix *b2)
+{
+	QuantizedModel *model = malloc(sizeof(QuantizedModel));
+	if (model == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	model->inputs = W1->cols;
+	model->hidden = W1->rows;
+	model->outputs = W2->rows;
+	model->stride = (W1->cols + 31) & ~31u;
+	model->borrowed = false;
+
+	int8_t *weights = calloc((size_t)model->hidden * model->stride, sizeof(int8_t));
+	float *scales = malloc(sizeof(float) * model->hidden);
+
+	if (weights == NULL || scales == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	for (unsigned int row = 0; row < model->hidden; row++)
+	{
+		double largest = 0.0;
+		for (unsigned int col = 0; col < model->inputs; col++)
+		{
+			largest = fmax(largest, fabs(matrix_get(W1, row, col)));
+		}
+
+		double scale = (largest > 0.0) ? largest / 127.0 : 1.0;
+		scales[row] = scale;
+
+		for (unsigned int col = 0; col < model->inputs; col++)
+		{
+			long q = lround(matrix_get(W1, row, col) / scale);
+			weights[(size_t)row * model->stride + col] = (q > 127) ? 127 : (q < -127) ? -127 : q;
+		}
+	}
+
+	model->W1 = weights;
+	model->W1_scales = scales;
+	copy_second_layer(model, W2, b1, b2);
+
+	return model;
+}
+
+// quantized_wrap
+// ==============
+//
+// Builds a quantized model around a first layer that has already been quantized, such as one mapped from a model
+// file, without copying it.
+//
+// Parameters:
+//      inputs - The number of inputs.
+//      stride - The length of each row of W1, a multiple of 32 at least inputs long.
+//          W1 - The quantized first layer, laid out as in QuantizedModel. Must outlive the model.
+//   W1_scales - The scale of each row of W1. Must outlive the model.
+//          W2 - The second layer's weights.
+//          b1 - The first layer's biases.
+//          b2 - The second layer's biases.
+//
+// Return:
+//   The quantized model. Call quantized_free() when no longer needed.
+QuantizedModel *quantized_wrap(unsigned int inputs, unsigned int stride, const int8_t *W1, const float *W1_scales, Matrix *W2, Matrix *b1, Matrix *b2)
+{
+	QuantizedModel *model = malloc(sizeof(QuantizedModel));
+	if (model == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	model->inputs = inputs;
+	model->hidden = b1->rows;
+	model->outputs = W2->rows;
+	model->stride = stride;
+	model->borrowed = true;
+	model->W1 = W1;
+	model->W1_scales = W1_scales;
+	copy_second_layer(model, W2, b1, b2);
+
+	return model;
+}
+
+// quantized_free
+// ==============
+//
+// Releases a quantized model.
+//
+// Parameters:
+//   model - The model.
+void quantized_free(QuantizedModel *model)
+{
+	if (!model->borrowed)
+	{
+		free((void*)model->W1);
+		free((void*)model->W1_scales);
+	}
+
+	free(model->b1);
+	free(model->W2);
+	free(model->b2);
+	free(model);
+}
+
+// quantized_classify
+// ==================
+//
+// Classifies images given as raw pixel bytes, where 0 is background and 255 is ink.
+//
+// Parameters:
+//         model - The quantized model.
+//        pixels - The images, one after the other, each model->inputs bytes long.
+//         count - The number of images.
+//   predictions - Set to the predicted class of each image.
+void quantized_classify(QuantizedModel *model, const unsigned char *pixels, unsigned int count, unsigned char *predictions)
+{
+	float *hidden = malloc(sizeof(float) * model->hidden);
+	if (hidden == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	for (unsigned int image = 0; image < count; image++)
+	{
+		const unsigned char *input = pixels + (size_t)image * model->inputs;
+
+		for (unsigned int row = 0; row < model->hidden; row++)
+		{
+			int32_t sum = dot(input, model->W1 + (size_t)row * model->stride, model->inputs);
+			float z = sum * model->W1_scales[row] * PIXEL_SCALE + model->b1[row];
+			hidden[row] = (z > 0) ? z : 0;
+		}
+
+		unsigned int response = 0;
+		float best = 0;
+
+		for (unsigned int output = 0; output < model->outputs; output++)
+		{
+			float z = model->b2[output];
+			for (unsigned int row = 0; row < model->hidden; row++)
+			{
+				z += model->W2[row * model->outputs + output] * hidden[row];
+			}
+
+			if (output == 0 || z > best)
+			{
+				best = z;
+				response = output;
+			}
+		}
+
+		predictions[image] = response;
+	}
+
+	free(hidden);
+}
@@ -0,0 +1,94 @@
+#ifndef QUANTIZED_H
+#define QUANTIZED_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "linalg.h"
+
+// QuantizedModel
+// ==============
+//
+// A trained model prepared for 8 bit integer inference. The first layer's weights are stored as one int8 row per
+// hidden unit with its own scale, so that they can be multiplied directly against raw uint8 pixel bytes. The small
+// second layer stays in single precision.
+typedef struct
+{
+	unsigned int inputs, hidden, outputs;
+	unsigned int stride;   // The length of each weight row, padded to a multiple of 32 bytes.
+	const int8_t *W1;      // (hidden, stride), row major.
+	const float *W1_scales; // One scale per row of W1.
+	bool borrowed;         // Whether W1 and W1_scales belong to someone else. See quantized_wrap().
+	float *b1;             // (hidden)
+	float *W2;             // (outputs, hidden), column major.
+	float *b2;             // (outputs)
+} QuantizedModel;
+
+	// quantized_new
+	// =============
+	//
+	// Quantizes a trained model. Each row of W1 is scaled so that its largest magnitude becomes 127.
+	//
+	// Parameters:
+	//   W1 - The first layer's weights.
+	//   W2 - The second layer's weights.
+	//   b1 - The first layer's biases.
+	//   b2 - The second layer's biases.
+	//
+	// Return:
+	//   The quantized model. Call quantized_free() when no longer needed.
+	QuantizedModel *quantized_new(Matrix *W1, Matrix *W2, Matrix *b1, Matrix *b2);
+
+	// quantized_wrap
+	// ==============
+	//
+	// Builds a quantized model around a first layer that has already been quantized, such as one mapped from a model
+	// file, without copying it.
+	//
+	// Parameters:
+	//      inputs - The number of inputs.
+	//      stride - The length of each row of W1, a multiple of 32 at least inputs long.
+	//          W1 - The quantized first layer, laid out as in QuantizedModel. Must outlive the model.
+	//   W1_scales - The scale of each row of W1. Must outlive the model.
+	//          W2 - The second layer's weights.
+	//          b1 - The first layer's biases.
+	//          b2 - The second layer's biases.
+	//
+	// Return:
+	//   The quantized model. Call quantized_free() when no longer needed.
+	QuantizedModel *quantized_wrap(unsigned int inputs, unsigned int stride, const int8_t *W1, const float *W1_scales, Matrix *W2, Matrix *b1, Matrix *b2);
+
+	// quantized_free
+	// ==============
+	//
+	// Releases a quantized model.
+	//
+	// Parameters:
+	//   model - The model.
+	void quantized_free(QuantizedModel *model);
+
+	// quantized_classify
+	// ==================
+	//
+	// Classifies images given as raw pixel bytes, where 0 is background and 255 is ink. Pixels are reduced to 7 bits
+	// so that the AVX2 multiply-add path cannot saturate, and every code path gives identical results.
+	//
+	// Parameters:
+	//         model - The quantized model.
+	//        pixels - The images, one after the other, each model->inputs bytes long.
+	//         count - The number of images.
+	//   predictions - Set to the predicted class of each image.
+	void quantized_classify(QuantizedModel *model, const unsigned char *pixels, unsigned int count, unsigned char *predictions);
+
+	// quantized_kernel
+	// ================
+	//
+	// Returns the name of the dot product kernel quantized_classify() was compiled with.
+	//
+	// Return:
+	//   "avx512-vnni", "avx-vnni", "avx2" or "scalar".
+	const char *quantized_kernel(void);
+
+#endif // QUANTIZED_H
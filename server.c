@@ -0,0 +1,616 @@
+#include "server.h"
+
+// Latencies are counted in buckets a sixteenth of an octave of microseconds
+// wide, so that a percentile is within about 4% of the truth without keeping
+// every latency, up to an hour.
+#define LATENCY_STEPS 16
+#define LATENCY_BUCKETS (1 + LATENCY_STEPS * 32)
+
+// Connection
+// ==========
+//
+// A connected client.
+typedef struct
+{
+	int fd;
+	unsigned char request[SERVER_REQUEST_SIZE]; // The request being read.
+	unsigned int filled;                        // The number of bytes of request read so far.
+	unsigned char *output;                      // Digits waiting to be written to the client.
+	size_t output_size, output_capacity;
+	unsigned int pending;                       // The number of the client's requests in the batch.
+	bool reading;                               // Whether the client may still write requests.
+	bool broken;                                // Whether writing to the client has failed.
+} Connection;
+
+// ServerStats
+// ===========
+//
+// What has been served since start.
+typedef struct
+{
+	double start;
+	unsigned long long requests, batches;
+	unsigned long long latencies[LATENCY_BUCKETS];
+} ServerStats;
+
+// Server
+// ======
+//
+// The state of server_run(). The batch holds count requests, in the order they
+// were read.
+typedef struct
+{
+	ServerOptions options;
+	ServerClassify classify;
+	void *context;
+
+	int listener;
+	Connection **connections;
+	unsigned int connection_count, connection_capacity;
+
+	unsigned char *images;    // (max_batch, SERVER_REQUEST_SIZE)
+	unsigned char *digits;    // (max_batch)
+	Connection **owners;      // The connection each request came from.
+	double *arrivals;         // When each request was read.
+	unsigned int count;
+
+	ServerStats interval;     // Since the last report.
+	ServerStats total;        // Since the server started.
+} Server;
+
+// Set by the SIGINT and SIGTERM handler.
+static volatile sig_atomic_t stopping;
+
+// stop
+// ====
+//
+// Asks server_run() to stop.
+//
+// Parameters:
+//   signal - The signal received.
+static void stop(int signal)
+{
+	stopping = 1;
+}
+
+// allocate
+// ========
+//
+// Allocates memory, exiting if there is none.
+//
+// Parameters:
+//   size - The number of bytes.
+//
+// Return:
+//   The memory.
+static void *allocate(size_t size)
+{
+	void *memory = malloc(size);
+	if (memory == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	return memory;
+}
+
+// stats_reset
+// ===========
+//
+// Empties some stats.
+//
+// Parameters:
+//   stats - The stats.
+//     now - The time to count from.
+static void stats_reset(ServerStats *stats, double now)
+{
+	memset(stats, 0, sizeof(ServerStats));
+	stats->start = now;
+}
+
+// stats_record
+// ============
+//
+// Counts the latency of a request.
+//
+// Parameters:
+//     stats - The stats.
+//   latency - The seconds from the request being read to its answer being ready.
+static void stats_record(ServerStats *stats, double latency)
+{
+	double microseconds = latency * 1e6;
+	unsigned int bucket = 0;
+
+	if (microseconds >= 1)
+	{
+		double step = floor(log2(microseconds) * LATENCY_STEPS);
+		bucket = (step < LATENCY_BUCKETS - 2) ? 1 + (unsigned int)step : LATENCY_BUCKETS - 1;
+	}
+
+	stats->latencies[bucket]++;
+	stats->requests++;
+}
+
+// stats_percentile
+// ================
+//
+// Returns a percentile of the latencies counted.
+//
+// Parameters:
+//      stats - The stats.
+//   fraction - The percentile, between 0 and 1.
+//
+// Return:
+//   The upper bound of the bucket the percentile falls in, in seconds.
+static double stats_percentile(ServerStats *stats, double fraction)
+{
+	unsigned long long rank = ceil(fraction * stats->requests);
+	unsigned long long seen = 0;
+
+	for (unsigned int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		seen += stats->latencies[bucket];
+
+		if (seen >= rank && seen > 0)
+		{
+			return exp2((double)bucket / LATENCY_STEPS) / 1e6;
+		}
+	}
+
+	return 0;
+}
+
+// stats_print
+// ===========
+//
+// Prints the throughput and latency of some stats.
+//
+// Parameters:
+//   stats - The stats.
+//   label - What the line starts with.
+//     now - The time the stats end.
+static void stats_print(ServerStats *stats, const char *label, double now)
+{
+	double elapsed = now - stats->start;
+
+	printf("%s %llu requests in %llu batches (%.1lf per batch), %.0lf requests/s. Latency: p50 %.3lfms, p99 %.3lfms.\n",
+		label, stats->requests, stats->batches, (stats->batches > 0) ? (double)stats->requests / stats->batches : 0.0,
+		(elapsed > 0) ? stats->requests / elapsed : 0.0, 1e3 * stats_percentile(stats, 0.5), 1e3 * stats_percentile(stats, 0.99));
+	fflush(stdout);
+}
+
+// open_listener
+// =============
+//
+// Creates the socket the server listens on. A socket left behind by a server that has gone is replaced, but not one
+// that is still being served.
+//
+// Parameters:
+//   path - The path of the socket.
+//
+// Return:
+//   The non-blocking listening socket.
+static int open_listener(const char *path)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		printf("The socket path '%s' is too long.\n", path);
+		exit(8);
+	}
+	strcpy(address.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == -1)
+	{
+		printf("Could not create a socket: %s.\n", strerror(errno));
+		exit(8);
+	}
+
+	if (connect(listener, (struct sockaddr*)&address, sizeof(address)) == 0)
+	{
+		printf("'%s' is already being served.\n", path);
+		exit(8);
+	}
+
+	// A socket whose connect() failed cannot be reused portably.
+	close(listener);
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	struct stat metadata;
+	if (stat(path, &metadata) == 0 && S_ISSOCK(metadata.st_mode))
+	{
+		unlink(path);
+	}
+
+	if (listener == -1 || bind(listener, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(listener, SOMAXCONN) == -1)
+	{
+		printf("Could not listen on '%s': %s.\n", path, strerror(errno));
+		exit(8);
+	}
+
+	fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+	return listener;
+}
+
+// accept_connections
+// ==================
+//
+// Accepts every client waiting to connect.
+//
+// Parameters:
+//   server - The server.
+static void accept_connections(Server *server)
+{
+	while (true)
+	{
+		int fd = accept(server->listener, NULL, NULL);
+		if (fd == -1)
+		{
+			return;
+		}
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		if (server->connection_count == server->connection_capacity)
+		{
+			server->connection_capacity = (server->connection_capacity > 0) ? 2 * server->connection_capacity : 16;
+			server->connections = realloc(server->connections, sizeof(Connection*) * server->connection_capacity);
+			if (server->connections == NULL)
+			{
+				printf("Your computer has run out of memory :(\n");
+				exit(3);
+			}
+		}
+
+		Connection *connection = allocate(sizeof(Connection));
+		memset(connection, 0, sizeof(Connection));
+		connection->fd = fd;
+		connection->reading = true;
+
+		server->connections[server->connection_count++] = connection;
+	}
+}
+
+// run_batch
+// =========
+//
+// Classifies the requests in the batch and queues the answers to be written.
+//
+// Parameters:
+//   server - The server.
+static void run_batch(Server *server)
+{
+	server->classify(server->context, server->images, server->count, server->digits);
+
+	double now = threadpool_seconds();
+
+	for (unsigned int i = 0; i < server->count; i++)
+	{
+		Connection *connection = server->owners[i];
+		connection->pending--;
+
+		if (!connection->broken)
+		{
+			if (connection->output_size == connection->output_capacity)
+			{
+				connection->output_capacity = (connection->output_capacity > 0) ? 2 * connection->output_capacity : 256;
+				connection->output = realloc(connection->output, connection->output_capacity);
+				if (connection->output == NULL)
+				{
+					printf("Your computer has run out of memory :(\n");
+					exit(3);
+				}
+			}
+
+			connection->output[connection->output_size++] = server->digits[i];
+		}
+
+		stats_record(&server->interval, now - server->arrivals[i]);
+		stats_record(&server->total, now - server->arrivals[i]);
+	}
+
+	server->interval.batches++;
+	server->total.batches++;
+	server->count = 0;
+}
+
+// read_connection
+// ===============
+//
+// Reads what a client has written, adding each whole request to the batch. A full batch is classified straight away.
+//
+// Parameters:
+//       server - The server.
+//   connection - The client.
+static void read_connection(Server *server, Connection *connection)
+{
+	unsigned char buffer[16 * SERVER_REQUEST_SIZE];
+
+	ssize_t got = read(connection->fd, buffer, sizeof(buffer));
+	if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	{
+		return;
+	}
+
+	if (got <= 0)
+	{
+		// The client has finished writing, but may still be reading its answers.
+		connection->reading = false;
+		return;
+	}
+
+	double now = threadpool_seconds();
+
+	for (ssize_t used = 0; used < got;)
+	{
+		size_t take = SERVER_REQUEST_SIZE - connection->filled;
+		if (take > (size_t)(got - used))
+		{
+			take = got - used;
+		}
+
+		memcpy(connection->request + connection->filled, buffer + used, take);
+		connection->filled += take;
+		used += take;
+
+		if (connection->filled < SERVER_REQUEST_SIZE)
+		{
+			break;
+		}
+
+		memcpy(server->images + (size_t)server->count * SERVER_REQUEST_SIZE, connection->request, SERVER_REQUEST_SIZE);
+		server->owners[server->count] = connection;
+		server->arrivals[server->count] = now;
+		server->count++;
+		connection->pending++;
+		connection->filled = 0;
+
+		if (server->count == server->options.max_batch)
+		{
+			run_batch(server);
+		}
+	}
+}
+
+// write_connection
+// ================
+//
+// Writes as many of a client's answers as it will take without blocking.
+//
+// Parameters:
+//   connection - The client.
+static void write_connection(Connection *connection)
+{
+	ssize_t written = write(connection->fd, connection->output, connection->output_size);
+
+	if (written > 0)
+	{
+		memmove(connection->output, connection->output + written, connection->output_size - written);
+		connection->output_size -= written;
+	}
+	else if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	{
+		// The client has gone. Its requests in the batch are still answered, into nowhere.
+		connection->broken = true;
+		connection->reading = false;
+		connection->output_size = 0;
+	}
+}
+
+// close_finished
+// ==============
+//
+// Closes the connections of clients that have stopped writing and have been given every answer.
+//
+// Parameters:
+//   server - The server.
+static void close_finished(Server *server)
+{
+	unsigned int kept = 0;
+
+	for (unsigned int i = 0; i < server->connection_count; i++)
+	{
+		Connection *connection = server->connections[i];
+
+		if (!connection->reading && connection->pending == 0 && connection->output_size == 0)
+		{
+			close(connection->fd);
+			free(connection->output);
+			free(connection);
+		}
+		else
+		{
+			server->connections[kept++] = connection;
+		}
+	}
+
+	server->connection_count = kept;
+}
+
+// server_run
+// ==========
+//
+// Serves classification requests over a Unix domain socket until interrupted by SIGINT or SIGTERM. A client connects,
+// writes any number of SERVER_REQUEST_SIZE byte images, and reads back one byte per image, the digit seen in it, in
+// the order the images were written. Requests from every connection are gathered into one batch, which is classified
+// once it holds max_batch requests or its oldest request has waited for window seconds. The latency and throughput
+// are reported as it runs and once more when it stops.
+//
+// Parameters:
+//    options - Where to listen and how to batch. See ServerOptions.
+//   classify - Classifies each batch.
+//    context - Passed to classify.
+void server_run(ServerOptions options, ServerClassify classify, void *context)
+{
+	Server server;
+	memset(&server, 0, sizeof(Server));
+	server.options = options;
+	server.classify = classify;
+	server.context = context;
+	server.listener = open_listener(options.path);
+	server.images = allocate((size_t)options.max_batch * SERVER_REQUEST_SIZE);
+	server.digits = allocate(options.max_batch);
+	server.owners = allocate(sizeof(Connection*) * options.max_batch);
+	server.arrivals = allocate(sizeof(double) * options.max_batch);
+
+	struct pollfd *fds = NULL;
+	unsigned int fds_capacity = 0;
+
+	struct sigaction action, old_interrupt, old_terminate, old_pipe;
+	memset(&action, 0, sizeof(action));
+	sigemptyset(&action.sa_mask);
+	action.sa_handler = stop;
+	stopping = 0;
+	sigaction(SIGINT, &action, &old_interrupt);
+	sigaction(SIGTERM, &action, &old_terminate);
+
+	// A client that hangs up shows up as a failed write instead.
+	action.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &action, &old_pipe);
+
+	double now = threadpool_seconds();
+	stats_reset(&server.interval, now);
+	stats_reset(&server.total, now);
+
+	printf("Serving on '%s', in batches of up to %u requests gathered for up to %.3lfms. Press Ctrl+C to stop.\n",
+		options.path, options.max_batch, 1e3 * options.window);
+	fflush(stdout);
+
+	while (!stopping)
+	{
+		// Wake for the batch's deadline and the next report, and at least once a
+		// second, so that a signal landing just before poll() is not missed.
+		double wait = 1.0;
+		if (server.interval.requests > 0)
+		{
+			wait = fmin(wait, server.interval.start + options.report_interval - now);
+		}
+		if (server.count > 0)
+		{
+			wait = fmin(wait, server.arrivals[0] + options.window - now);
+		}
+
+		if (server.connection_count + 1 > fds_capacity)
+		{
+			fds_capacity = 2 * (server.connection_count + 1);
+			fds = realloc(fds, sizeof(struct pollfd) * fds_capacity);
+			if (fds == NULL)
+			{
+				printf("Your computer has run out of memory :(\n");
+				exit(3);
+			}
+		}
+
+		fds[0].fd = server.listener;
+		fds[0].events = POLLIN;
+
+		for (unsigned int i = 0; i < server.connection_count; i++)
+		{
+			Connection *connection = server.connections[i];
+			short events = (connection->reading ? POLLIN : 0) | (connection->output_size > 0 ? POLLOUT : 0);
+
+			fds[i + 1].fd = (events != 0) ? connection->fd : -1;
+			fds[i + 1].events = events;
+		}
+
+		unsigned int polled = server.connection_count;
+		int ready = poll(fds, polled + 1, (wait > 0) ? (int)ceil(wait * 1e3) : 0);
+
+		if (ready == -1 && errno != EINTR)
+		{
+			printf("Could not wait for requests: %s.\n", strerror(errno));
+			exit(8);
+		}
+
+		if (ready > 0)
+		{
+			for (unsigned int i = 0; i < polled; i++)
+			{
+				if (server.connections[i]->reading && (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				{
+					read_connection(&server, server.connections[i]);
+				}
+			}
+
+			// Accepted after reading, as this can move the connections.
+			if (fds[0].revents & POLLIN)
+			{
+				accept_connections(&server);
+			}
+		}
+
+		now = threadpool_seconds();
+
+		if (server.count > 0 && now >= server.arrivals[0] + options.window)
+		{
+			run_batch(&server);
+			now = threadpool_seconds();
+		}
+
+		for (unsigned int i = 0; i < server.connection_count; i++)
+		{
+			if (server.connections[i]->output_size > 0)
+			{
+				write_connection(server.connections[i]);
+			}
+		}
+
+		close_finished(&server);
+
+		// An idle interval starts again, so that its throughput only counts time
+		// spent serving.
+		if (server.interval.requests == 0 && server.count == 0)
+		{
+			server.interval.start = now;
+		}
+		else if (server.interval.requests > 0 && now >= server.interval.start + options.report_interval)
+		{
+			stats_print(&server.interval, "Served", now);
+			stats_reset(&server.interval, now);
+		}
+	}
+
+	// Requests already read are still answered, as far as the clients will take
+	// them without blocking.
+	if (server.count > 0)
+	{
+		run_batch(&server);
+	}
+
+	for (unsigned int i = 0; i < server.connection_count; i++)
+	{
+		Connection *connection = server.connections[i];
+
+		if (connection->output_size > 0)
+		{
+			write_connection(connection);
+		}
+
+		close(connection->fd);
+		free(connection->output);
+		free(connection);
+	}
+
+	close(server.listener);
+	unlink(options.path);
+
+	sigaction(SIGINT, &old_interrupt, NULL);
+	sigaction(SIGTERM, &old_terminate, NULL);
+	sigaction(SIGPIPE, &old_pipe, NULL);
+
+	printf("\n");
+	stats_print(&server.total, "In total, served", threadpool_seconds());
+
+	free(fds);
+	free(server.connections);
+	free(server.images);
+	free(server.digits);
+	free(server.owners);
+	free(server.arrivals);
+}
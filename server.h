@@ -0,0 +1,63 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "threadpool.h"
+
+// The size of a request: one 28x28 greyscale image, row by row, with 0 as the background and 255 as ink, like the
+// MNIST data.
+#define SERVER_REQUEST_SIZE 784
+
+// ServerClassify
+// ==============
+//
+// Classifies a batch of images for server_run().
+//
+// Parameters:
+//   context - The context given to server_run().
+//    images - The images, SERVER_REQUEST_SIZE bytes each.
+//     count - The number of images, from 1 up to the maximum batch size.
+//    digits - Set to the digit seen in each image.
+typedef void (*ServerClassify)(void *context, const unsigned char *images, unsigned int count, unsigned char *digits);
+
+// ServerOptions
+// =============
+//
+// How server_run() batches requests.
+typedef struct
+{
+	const char *path;       // The path of the Unix domain socket to listen on.
+	unsigned int max_batch; // The most requests classified together.
+	double window;          // Seconds a request may wait for others to join its batch.
+	double report_interval; // Seconds between reports of the latency and throughput while requests are arriving.
+} ServerOptions;
+
+	// server_run
+	// ==========
+	//
+	// Serves classification requests over a Unix domain socket until interrupted by SIGINT or SIGTERM. A client
+	// connects, writes any number of SERVER_REQUEST_SIZE byte images, and reads back one byte per image, the digit
+	// seen in it, in the order the images were written. Requests from every connection are gathered into one batch,
+	// which is classified once it holds max_batch requests or its oldest request has waited for window seconds. The
+	// latency and throughput are reported as it runs and once more when it stops.
+	//
+	// Parameters:
+	//    options - Where to listen and how to batch. See ServerOptions.
+	//   classify - Classifies each batch.
+	//    context - Passed to classify.
+	void server_run(ServerOptions options, ServerClassify classify, void *context);
+
+#endif // SERVER_H
@@ -0,0 +1,345 @@
+#include "threadpool.h"
+
+// Deque
+// =====
+//
+// The tasks waiting to be run by one thread. Tasks are always handed out as one
+// contiguous run of indices, so a deque is just a range, with its first task in
+// the low 32 bits and one past its last task in the high 32 bits. Keeping both
+// ends in one word lets the owner and thieves claim tasks with a single compare
+// and swap. Each deque has its own cache line so that owners do not contend.
+typedef struct
+{
+	_Alignas(64) _Atomic uint64_t range;
+} Deque;
+
+#define RANGE(begin, end) (((uint64_t)(end) << 32) | (uint64_t)(begin))
+#define RANGE_BEGIN(range) ((uint32_t)(range))
+#define RANGE_END(range) ((uint32_t)((range) >> 32))
+
+static unsigned int thread_count = 1;
+static pthread_t *workers;
+static Deque *deques;
+
+// Workers sleep on wake until generation changes, and the caller of
+// threadpool_run() sleeps on finished until every worker has left the job.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static unsigned long generation;
+static unsigned long started_generation;
+static unsigned int busy;
+static bool stopping;
+
+static ThreadPoolFunction job_function;
+static void *job_context;
+
+// The index of each thread, and whether it is running a task.
+static _Thread_local unsigned int current_worker;
+static _Thread_local bool in_task;
+
+// pop
+// ===
+//
+// Takes the task at the front of a deque.
+//
+// Parameters:
+//   deque - The deque.
+//    task - Set to the task taken.
+//
+// Return:
+//   false if the deque was empty.
+static bool pop(Deque *deque, unsigned int *task)
+{
+	uint64_t range = atomic_load(&deque->range);
+
+	while (RANGE_BEGIN(range) < RANGE_END(range))
+	{
+		if (atomic_compare_exchange_weak(&deque->range, &range, RANGE(RANGE_BEGIN(range) + 1, RANGE_END(range))))
+		{
+			*task = RANGE_BEGIN(range);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// steal
+// =====
+//
+// Moves the back half of the first non-empty deque found into an empty deque.
+//
+// Parameters:
+//   worker - The thread whose deque is empty.
+//
+// Return:
+//   false if every other deque was empty.
+static bool steal(unsigned int worker)
+{
+	for (unsigned int i = 1; i < thread_count; i++)
+	{
+		Deque *victim = &deques[(worker + i) % thread_count];
+		uint64_t range = atomic_load(&victim->range);
+
+		while (RANGE_BEGIN(range) < RANGE_END(range))
+		{
+			uint32_t begin = RANGE_BEGIN(range);
+			uint32_t end = RANGE_END(range);
+			uint32_t split = end - (end - begin + 1) / 2;
+
+			if (atomic_compare_exchange_weak(&victim->range, &range, RANGE(begin, split)))
+			{
+				atomic_store(&deques[worker].range, RANGE(split, end));
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+// work
+// ====
+//
+// Runs tasks from a thread's own deque, then from other threads' deques, until
+// there are none left to take.
+//
+// Parameters:
+//   worker - The thread.
+static void work(unsigned int worker)
+{
+	unsigned int task;
+
+	in_task = true;
+
+	do
+	{
+		while (pop(&deques[worker], &task))
+		{
+			job_function(job_context, task, worker);
+		}
+	} while (steal(worker));
+
+	in_task = false;
+}
+
+// worker_main
+// ===========
+//
+// The body of each worker thread.
+//
+// Parameters:
+//   argument - The index of the worker.
+//
+// Return:
+//   NULL.
+static void *worker_main(void *argument)
+{
+	unsigned int worker = (unsigned int)(uintptr_t)argument;
+	current_worker = worker;
+
+	pthread_mutex_lock(&lock);
+	unsigned long seen = started_generation;
+
+	for (;;)
+	{
+		while (generation == seen && !stopping)
+		{
+			pthread_cond_wait(&wake, &lock);
+		}
+
+		if (stopping)
+		{
+			break;
+		}
+
+		seen = generation;
+		pthread_mutex_unlock(&lock);
+
+		work(worker);
+
+		pthread_mutex_lock(&lock);
+		if (--busy == 0)
+		{
+			pthread_cond_signal(&finished);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+// threadpool_start
+// ================
+//
+// Starts the worker threads. The calling thread counts as one of them, so one thread starts no workers at all.
+//
+// Parameters:
+//   threads - The number of threads, or 0 to use the NUMEROS_THREADS environment variable, falling back to the
+//             number of online processors.
+void threadpool_start(unsigned int threads)
+{
+	if (threads == 0)
+	{
+		const char *variable = getenv("NUMEROS_THREADS");
+		long requested = (variable != NULL) ? strtol(variable, NULL, 10) : 0;
+		threads = (requested > 0) ? requested : 0;
+	}
+
+	if (threads == 0)
+	{
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (online > 0) ? online : 1;
+	}
+
+	deques = aligned_alloc(64, sizeof(Deque) * threads);
+	workers = malloc(sizeof(pthread_t) * threads);
+
+	if (deques == NULL || workers == NULL)
+	{
+		printf("Your computer has run out of memory :(\n");
+		exit(3);
+	}
+
+	for (unsigned int worker = 0; worker < threads; worker++)
+	{
+		atomic_init(&deques[worker].range, 0);
+	}
+
+	// A worker may not get to run until after the first job has been posted,
+	// so it compares against the generation at start rather than whatever the
+	// generation is once it runs.
+	pthread_mutex_lock(&lock);
+	stopping = false;
+	busy = 0;
+	started_generation = generation;
+	thread_count = threads;
+
+	for (unsigned int worker = 1; worker < threads; worker++)
+	{
+		if (pthread_create(&workers[worker], NULL, worker_main, (void*)(uintptr_t)worker) != 0)
+		{
+			printf("Could not start thread %u of %u.\n", worker + 1, threads);
+			exit(3);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+// threadpool_stop
+// ===============
+//
+// Stops and joins the worker threads. threadpool_run() then runs every task on the calling thread.
+void threadpool_stop(void)
+{
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	for (unsigned int worker = 1; worker < thread_count; worker++)
+	{
+		pthread_join(workers[worker], NULL);
+	}
+
+	free(workers);
+	free(deques);
+	workers = NULL;
+	deques = NULL;
+	thread_count = 1;
+}
+
+// threadpool_threads
+// ==================
+//
+// Returns the number of threads a threadpool_run() from the calling thread spreads tasks over, including the
+// calling thread. This is 1 from inside a task.
+unsigned int threadpool_threads(void)
+{
+	return (in_task) ? 1 : thread_count;
+}
+
+// threadpool_worker
+// =================
+//
+// Returns the index of the calling thread, which is 0 for the thread that started the pool.
+unsigned int threadpool_worker(void)
+{
+	return current_worker;
+}
+
+// threadpool_run
+// ==============
+//
+// Runs a number of independent tasks on the pool and waits for them all to finish. The tasks are dealt out in
+// contiguous runs to one deque per thread. Each thread takes tasks from the front of its own deque, and once it is
+// empty steals the back half of another thread's deque, so uneven tasks still keep every thread busy. Called from
+// inside a task, or with a single task, it runs every task on the calling thread, as a task.
+//
+// Parameters:
+//      tasks - The number of tasks.
+//   function - The function to run for each task.
+//    context - Passed to every call of function.
+void threadpool_run(unsigned int tasks, ThreadPoolFunction function, void *context)
+{
+	if (thread_count == 1 || tasks <= 1 || in_task)
+	{
+		// Tasks run here are tasks all the same, so whatever they run in turn
+		// stays on this thread.
+		bool outer = in_task;
+		in_task = true;
+
+		for (unsigned int task = 0; task < tasks; task++)
+		{
+			function(context, task, current_worker);
+		}
+
+		in_task = outer;
+		return;
+	}
+
+	job_function = function;
+	job_context = context;
+
+	for (unsigned int worker = 0; worker < thread_count; worker++)
+	{
+		uint64_t begin = (uint64_t)tasks * worker / thread_count;
+		uint64_t end = (uint64_t)tasks * (worker + 1) / thread_count;
+		atomic_store(&deques[worker].range, RANGE(begin, end));
+	}
+
+	pthread_mutex_lock(&lock);
+	busy = thread_count - 1;
+	generation++;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	// The calling thread is worker 0.
+	work(0);
+
+	pthread_mutex_lock(&lock);
+	while (busy > 0)
+	{
+		pthread_cond_wait(&finished, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+// threadpool_seconds
+// ==================
+//
+// Returns the time on the monotonic clock, which never steps backwards when the wall clock is set. Every duration
+// numeros measures is timed with it.
+//
+// Return:
+//   The time in seconds since an arbitrary point.
+double threadpool_seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
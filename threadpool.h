@@ -0,0 +1,78 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+// ThreadPoolFunction
+// ==================
+//
+// A function run by threadpool_run() once per task.
+//
+// Parameters:
+//   context - The context given to threadpool_run().
+//      task - The index of the task, from 0 up to the number of tasks.
+//    worker - The index of the thread running the task, from 0 up to threadpool_threads(). Tasks that run at the
+//             same time always have different workers, so it can index per thread scratch memory.
+typedef void (*ThreadPoolFunction)(void *context, unsigned int task, unsigned int worker);
+
+	// threadpool_start
+	// ================
+	//
+	// Starts the worker threads. The calling thread counts as one of them, so one thread starts no workers at all.
+	//
+	// Parameters:
+	//   threads - The number of threads, or 0 to use the NUMEROS_THREADS environment variable, falling back to the
+	//             number of online processors.
+	void threadpool_start(unsigned int threads);
+
+	// threadpool_stop
+	// ===============
+	//
+	// Stops and joins the worker threads. threadpool_run() then runs every task on the calling thread.
+	void threadpool_stop(void);
+
+	// threadpool_threads
+	// ==================
+	//
+	// Returns the number of threads a threadpool_run() from the calling thread spreads tasks over, including the
+	// calling thread. This is 1 from inside a task.
+	unsigned int threadpool_threads(void);
+
+	// threadpool_worker
+	// =================
+	//
+	// Returns the index of the calling thread, which is 0 for the thread that started the pool.
+	unsigned int threadpool_worker(void);
+
+	// threadpool_run
+	// ==============
+	//
+	// Runs a number of independent tasks on the pool and waits for them all to finish. The tasks are dealt out in
+	// contiguous runs to one deque per thread. Each thread takes tasks from the front of its own deque, and once it is
+	// empty steals the back half of another thread's deque, so uneven tasks still keep every thread busy. Called from
+	// inside a task, or with a single task, it runs every task on the calling thread, as a task.
+	//
+	// Parameters:
+	//      tasks - The number of tasks.
+	//   function - The function to run for each task.
+	//    context - Passed to every call of function.
+	void threadpool_run(unsigned int tasks, ThreadPoolFunction function, void *context);
+
+	// threadpool_seconds
+	// ==================
+	//
+	// Returns the time on the monotonic clock, which never steps backwards when the wall clock is set. Every duration
+	// numeros measures is timed with it.
+	//
+	// Return:
+	//   The time in seconds since an arbitrary point.
+	double threadpool_seconds(void);
+
+#endif // THREADPOOL_H